@@ -74,6 +74,70 @@ qr.update <- function(Xn,yn,R=NULL,f=rep(0,0),y.norm2=0,use.chol=FALSE,nt=1)
 }
 
 
+cX.setup <- function(G,mf) {
+## Finds the "cr" smooths of G whose model matrix columns can be held in compact 
+## form (see cr.basis) when X'WX is accumulated blockwise (use.chol=TRUE). If there 
+## are any, returns G with them removed (to produce the remaining, dense, columns by 
+## predict), their indices, k, and the column indices of the dense part, dind, and of 
+## each compact term, cind. Otherwise returns NULL.
+  if (!is.null(G$Xcentre)||length(G$smooth)==0) return(NULL)
+  mf1 <- mf[1:min(2,nrow(mf)),,drop=FALSE]
+  k <- which(sapply(G$smooth,function(s) !is.null(cr.basis(s,mf1))))
+  if (length(k)==0) return(NULL)
+  cind <- lapply(G$smooth[k],function(s) s$first.para:s$last.para)
+  Gd <- G;Gd$smooth <- G$smooth[-k]
+  list(Gd=Gd,k=k,cind=cind,dind=(1:ncol(G$X))[-unlist(cind)])
+} ## cX.setup
+
+cX.predict <- function(cs,G,data) {
+## model matrix for 'data' as dense columns, X, and compact bases for the 
+## smooths selected by cX.setup, cb.
+  X <- predict(cs$Gd,newdata=data,type="lpmatrix",newdata.guaranteed=TRUE,
+               block.size=nrow(data))[,cs$dind,drop=FALSE]
+  rownames(X) <- NULL
+  list(X=X,cb=lapply(G$smooth[cs$k],cr.basis,data=data))
+} ## cX.predict
+
+cX.mult <- function(cs,cX,b) {
+## model matrix (from cX.predict) times b
+  f <- drop(cX$X%*%b[cs$dind])
+  for (j in 1:length(cX$cb)) f <- f + cr.Xb(cX$cb[[j]],b[cs$cind[[j]]])
+  f
+} ## cX.mult
+
+cX.update <- function(cs,cX,w,z,ind=NULL,R=NULL,f=rep(0,0),y.norm2=0) {
+## equivalent to qr.update(sqrt(w)*X[ind,],sqrt(w)*z,R,f,y.norm2,use.chol=TRUE) 
+## for X from cX.predict, but forms the blocks of X'WX involving the cr terms from 
+## their compact bases, in O(n) operations per term pair (O(n p) with the dense part).
+  if (!is.null(ind)) {
+    cX$X <- cX$X[ind,,drop=FALSE]
+    cX$cb <- lapply(cX$cb,cr.basis.rows,ind=ind)
+  }
+  d <- cs$dind
+  p <- length(d) + length(unlist(cs$cind))
+  XX <- matrix(0,p,p);Xz <- rep(0,p)
+  if (length(d)) {
+    XX[d,d] <- crossprod(sqrt(w)*cX$X)
+    Xz[d] <- drop(t(cX$X)%*%(w*z))
+  }
+  for (j in 1:length(cX$cb)) {
+    cj <- cs$cind[[j]]
+    if (length(d)) { 
+      XX[cj,d] <- cr.XWXd(cX$cb[[j]],cX$X,w)
+      XX[d,cj] <- t(XX[cj,d])
+    }
+    for (i in 1:j) { 
+      ci <- cs$cind[[i]]
+      XX[cj,ci] <- cr.XWX(cX$cb[[j]],cX$cb[[i]],w)
+      XX[ci,cj] <- t(XX[cj,ci])
+    }
+    Xz[cj] <- cr.XWy(cX$cb[[j]],z,w)
+  }
+  y.norm2 <- y.norm2 + sum(w*z*z)
+  if (!is.null(R)) { XX <- R + XX; Xz <- f + Xz }
+  list(R=XX,f=Xz,y.norm2=y.norm2)
+} ## cX.update
+
 qr.up <- function(arg) {
 ## routine for parallel computation of the QR factorization of 
 ## a large gam model matrix, suitable for calling with parLapply.
@@ -289,6 +353,9 @@ bgam.fit <- function (G, mf, chunk.size, gp ,scale ,gamma,method, coef=NULL,etas
     conv <- FALSE
 
     if (method=="fREML") Sl <- Sl.setup(G) ## setup block diagonal penalty object
+
+    ## "cr" terms can be handled in compact form when accumulating X'WX...
+    cs <- if (use.chol&&n.threads==1) cX.setup(G,mf) else NULL
    
     for (iter in 1L:control$maxit) { ## main fitting loop
        ## accumulate the QR decomposition of the weighted model matrix
@@ -298,9 +365,14 @@ bgam.fit <- function (G, mf, chunk.size, gp ,scale ,gamma,method, coef=NULL,etas
        if (n.threads == 1) { ## use original serial update code     
          for (b in 1:n.block) {
            ind <- start[b]:stop[b]
-           X <- predict(G,newdata=mf[ind,],type="lpmatrix",newdata.guaranteed=TRUE,block.size=length(ind))
-           rownames(X) <- NULL
-           if (is.null(coef)) eta1 <- eta[ind] else eta1 <- drop(X%*%coef) + offset[ind]
+           if (is.null(cs)) {
+             X <- predict(G,newdata=mf[ind,],type="lpmatrix",newdata.guaranteed=TRUE,block.size=length(ind))
+             rownames(X) <- NULL
+             if (is.null(coef)) eta1 <- eta[ind] else eta1 <- drop(X%*%coef) + offset[ind]
+           } else { ## model matrix with compact cr terms
+             X <- cX.predict(cs,G,mf[ind,])
+             if (is.null(coef)) eta1 <- eta[ind] else eta1 <- cX.mult(cs,X,coef) + offset[ind]
+           }
            mu <- linkinv(eta1) 
            y <- G$y[ind] ## G$model[[gp$response]] ## - G$offset[ind]
            weights <- G$w[ind]
@@ -310,10 +382,15 @@ bgam.fit <- function (G, mf, chunk.size, gp ,scale ,gamma,method, coef=NULL,etas
            w <- (weights[good] * mu.eta.val[good]^2)/variance(mu)[good]
            dev <- dev + sum(dev.resids(y,mu,weights))
            wt <- c(wt,w)
-           w <- sqrt(w)
-           ## note that QR may be parallel using npt>1, even under serial accumulation...
-           if (b == 1) qrx <- qr.update(w*X[good,],w*z,use.chol=use.chol,nt=npt) 
-           else qrx <- qr.update(w*X[good,],w*z,qrx$R,qrx$f,qrx$y.norm2,use.chol=use.chol,nt=npt)
+           if (!is.null(cs)) { 
+             if (b == 1) qrx <- cX.update(cs,X,w,z,good) 
+             else qrx <- cX.update(cs,X,w,z,good,qrx$R,qrx$f,qrx$y.norm2)
+           } else {
+             w <- sqrt(w)
+             ## note that QR may be parallel using npt>1, even under serial accumulation...
+             if (b == 1) qrx <- qr.update(w*X[good,],w*z,use.chol=use.chol,nt=npt) 
+             else qrx <- qr.update(w*X[good,],w*z,qrx$R,qrx$f,qrx$y.norm2,use.chol=use.chol,nt=npt)
+           }
            rm(X);if(gc.level>1) gc() ## X can be large: remove and reclaim
         }
         if (use.chol) { ## post proc to get R and f...
@@ -874,6 +951,8 @@ bam.fit <- function(G,mf,chunk.size,gp,scale,gamma,method,rho=0,
     
      if (n.threads==1) { ## use original single thread method...
        qrx <- list(R=NULL,f=array(0,0),y.norm2=0) ## initial empty qr object
+       ## "cr" terms can be handled in compact form when accumulating X'WX...
+       cs <- if (use.chol&&rho==0) cX.setup(G,mf) else NULL
        for (i in 1:n.block) {
          ind <- start[i]:end[i] 
          if (rho!=0) {
@@ -892,6 +971,11 @@ bam.fit <- function(G,mf,chunk.size,gp,scale,gamma,method,rho=0,
            }
          } 
          #G$model <- mf[ind,]
+         if (!is.null(cs)) { ## X'WX blocks for cr terms from compact bases
+           qrx <- cX.update(cs,cX.predict(cs,G,mf[ind,]),G$w[ind],mf[ind,gp$response]-G$offset[ind],
+                            R=qrx$R,f=qrx$f,y.norm2=qrx$y.norm2)
+           next
+         }
          w <- sqrt(G$w[ind])
          X <- w*predict(G,newdata=mf[ind,],type="lpmatrix",newdata.guaranteed=TRUE,block.size=length(ind))
          y <- w*(mf[ind,gp$response]-G$offset[ind])  ## w*(G$model[[gp$response]] - G$offset[ind])
@@ -1239,6 +1323,9 @@ bam <- function(formula,family=gaussian(),data=list(),weights=NULL,subset=NULL,n
   
   colnamesX <- colnames(G$X)  
 
+  .C(C_stableS_cache_clear) ## fit starts and ends with empty get_stableS cache
+  on.exit(.C(C_stableS_cache_clear))
+
   if (sparse) { ## Form a sparse model matrix...
     if (sum(G$X==0)/prod(dim(G$X))<.5) warning("model matrix too dense for any possible benefit from sparse")
     if (nrow(mf)<=chunk.size) G$X <- as(G$X,"dgCMatrix") else 
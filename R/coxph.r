@@ -33,28 +33,42 @@ cox.ph <- function (link = "identity") {
   
     preinitialize <- expression({
     ## code to evaluate in estimate.gam...
-      ## sort y (time) into decending order, and
+      ## sort y (time) into decending order (within strata), and
       ## re-order weights and rows of X accordingly
       G$family$data <- list()
-      y.order <- order(G$y,decreasing=TRUE)
+      y.start <- y.strata <- NULL
+      if (is.matrix(G$y)) { ## stratified and/or (start, stop] data
+        if (ncol(G$y)==2) y.strata <- G$y[,2] else {
+          y.start <- G$y[,1];y.strata <- G$y[,3] 
+        }
+        G$y <- G$y[,ncol(G$y)-1] 
+        y.order <- order(as.integer(factor(y.strata)),-G$y)
+        y.start <- y.start[y.order];y.strata <- y.strata[y.order]
+      } else y.order <- order(G$y,decreasing=TRUE)
       G$family$data$y.order <- y.order
       G$y <- G$y[y.order]
       G$X <- G$X[y.order,,drop=FALSE]
       G$w <- G$w[y.order]
+      ## risk set indexing for the C code...
+      G$family$data <- c(G$family$data,cox.risk.sets(G$y,y.start,y.strata))
     })
     
     postproc <- expression({
     ## code to evaluate in estimate.gam, to do with data ordering and 
     ## baseline hazard estimation...
       ## first get the estimated hazard and prediction information...
-      object$family$data <- G$family$hazard(G$y,G$X,object$coefficients,G$w)
-      rumblefish <- G$family$hazard(G$y,matrix(0,nrow(G$X),0),object$coefficients,G$w)
-      s0.base <- exp(-rumblefish$h[rumblefish$r]) ## no model baseline survival 
+      object$family$data <- G$family$hazard(G$y,G$X,object$coefficients,G$w,control$nthreads,G$family$data)
+      object$family$nthreads <- control$nthreads ## for prediction
+      rumblefish <- G$family$hazard(G$y,matrix(0,nrow(G$X),0),object$coefficients,G$w,control$nthreads,G$family$data)
+      ## cumulative hazard over each row's time at risk...
+      h0 <- rumblefish$h[rumblefish$r] - rumblefish$hs
+      h1 <- object$family$data$h[object$family$data$r] - object$family$data$hs
+      s0.base <- exp(-h0) ## no model baseline survival 
       s0.base[s0.base >= 1] <- 1 - 2*.Machine$double.eps ## avoid NA later
       ## now put the survivor function in object$fitted
-      object$fitted.values <- exp(-object$family$data$h[object$family$data$r]*exp(object$linear.predictors))
+      object$fitted.values <- exp(-h1*exp(object$linear.predictors))
       ## compute the null deviance...
-      s.base <- exp(-object$family$data$h[object$family$data$r]) ## baseline survival
+      s.base <- exp(-h1) ## baseline survival
       s.base[s.base >= 1] <- 1 - 2*.Machine$double.eps ## avoid NA later
       object$null.deviance <- ## sum of squares of null deviance residuals
       2*sum(abs((object$prior.weights + log(s0.base) + object$prior.weights*(log(-log(s0.base)))))) 
@@ -70,16 +84,24 @@ cox.ph <- function (link = "identity") {
         if (is.null(start)) start <- rep(0,ncol(x))
     })
 
-    hazard <- function(y, X,beta,wt) {
+    hazard <- function(y, X,beta,wt,nthreads=1,rs=NULL) {
     ## get the baseline hazard function information, given times in descending order in y
     ## model matrix (same ordering) in X, coefs in beta and censoring in wt (1 = death, 0
-    ## = censoring)
-      tr <- unique(y);r <- match(y,tr);nt <- length(tr)
+    ## = censoring). nthreads is the number of threads to use. rs is the risk set and 
+    ## strata information from cox.risk.sets (default right censored, unstratified).
+      if (is.null(rs$r)) rs <- cox.risk.sets(y)
+      tr <- rs$tr;r <- rs$r;nt <- length(tr)
       oo <- .C("coxpp",as.double(X%*%beta),A=as.double(X),as.integer(r),d=as.integer(wt),
+               as.integer(rs$e),as.integer(rs$so),as.integer(rs$st),
                h=as.double(rep(0,nt)),q=as.double(rep(0,nt)),km=as.double(rep(0,nt)),n=as.integer(nrow(X)),p=as.integer(ncol(X)),
-               nt=as.integer(nt),PACKAGE="mgcv")
+               nt=as.integer(nt),as.integer(nthreads),PACKAGE="mgcv")
       p <- ncol(X)
-      list(tr=tr,h=oo$h,q=oo$q,a=matrix(oo$A[p*nt],p,nt),nt=nt,r=r,km=oo$km)
+      ## cumulative hazard at each row's entry to the risk set (0 if none)...
+      hs <- rep(0,length(y))
+      ii <- rs$e <= nt; ii[ii] <- rs$st[match(rs$e[ii],r)] == rs$st[ii]
+      hs[ii] <- oo$h[rs$e[ii]]
+      list(tr=tr,h=oo$h,q=oo$q,a=matrix(oo$A[1:(p*nt)],p,nt),nt=nt,r=r,km=oo$km,hs=hs,
+           n.strata=max(rs$st),counting=isTRUE(rs$counting))
     }
 
     residuals <- function(object,type=c("deviance","martingale")) {
@@ -96,18 +118,23 @@ cox.ph <- function (link = "identity") {
 
     predict <- function(family,se=FALSE,eta=NULL,y=NULL,
                X=NULL,beta=NULL,off=NULL,Vb=NULL) {
-      ## prediction function.
+      ## prediction function. If y is a matrix then the survivor function 
+      ## is predicted at each of the times in row i of y, for row i of X. 
       if (sum(is.na(y))>0) stop("NA times supplied for cox.ph prediction")
-      ii <- order(y,decreasing=TRUE) ## C code expects non-increasing
-      n <- nrow(X)
-      oo <- .C("coxpred",as.double(X[ii,]),t=as.double(y[ii]),as.double(beta),as.double(Vb),
+      if (!is.null(family$data$n.strata)&&family$data$n.strata>1) 
+        stop("survival prediction is not available for stratified cox.ph models")
+      if (isTRUE(family$data$counting)) ## predict.gam supplies the first response column, start 
+        stop("survival prediction is not available for cox.ph models with a cbind(start,stop,stratum) response")
+      n <- nrow(X); m <- if (is.matrix(y)) ncol(y) else 1
+      nt <- if (is.null(family$nthreads)) 1 else family$nthreads
+      oo <- .C("coxpred",as.double(X),t=as.double(y),as.double(beta),as.double(Vb),
                 a=as.double(family$data$a),h=as.double(family$data$h),q=as.double(family$data$q),
                 tr = as.double(family$data$tr),
                 n=as.integer(n),p=as.integer(ncol(X)),nt = as.integer(family$data$nt),
-                s=as.double(rep(0,n)),se=as.double(rep(0,n)),PACKAGE="mgcv")
-      s <- sef <- oo$s
-      s[ii] <- oo$s
-      sef[ii] <- oo$se    
+                s=as.double(rep(0,n*m)),se=as.double(rep(0,n*m)),as.integer(m),as.integer(nt),
+                PACKAGE="mgcv")
+      s <- oo$s; sef <- oo$se
+      if (m>1) { s <- matrix(s,n,m); sef <- matrix(sef,n,m) }
       if (se) return(list(fit=s,se.fit=sef)) else return(list(fit=s))
     }
 
@@ -126,8 +153,14 @@ cox.ph <- function (link = "identity") {
     ## D is the diagonal pre-conditioning matrix used to obtain Hp
     ##   if Hr is the raw Hp then Hp = D*t(D*Hr)
       ##tr <- sort(unique(y),decreasing=TRUE)
-      tr <- unique(y)
-      r <- match(y,tr)
+      if (is.null(family$data$so)) { ## right censored, unstratified
+        tr <- unique(y)
+        r <- match(y,tr)
+        e <- rep(length(tr)+1,length(y));so <- 1:length(y);st <- rep(1,length(y))
+      } else { ## risk set and strata information from preinitialize 
+        tr <- family$data$tr;r <- family$data$r
+        e <- family$data$e;so <- family$data$so;st <- family$data$st
+      } 
       p <- ncol(X)
       deriv <- deriv - 1
       mu <- X%*%coef
@@ -152,10 +185,11 @@ cox.ph <- function (link = "identity") {
       ## note that the following call can not use .C(C_coxlpl,...) since the ll
       ## function is not in the mgcv namespace.
       oo <- .C("coxlpl",as.double(mu),as.double(X),as.integer(r),as.integer(wt),
-            as.double(tr),n=as.integer(length(y)),p=as.integer(p),nt=as.integer(length(tr)),
+            as.integer(e),as.integer(so),as.integer(st),as.double(tr),n=as.integer(length(y)),p=as.integer(p),nt=as.integer(length(tr)),
             lp=as.double(0),g=as.double(g),H=as.double(H),
             d1b=as.double(d1b),d1H=as.double(d1H),d2b=as.double(d2b),d2H=as.double(d2H),
-            n.sp=as.integer(M),deriv=as.integer(deriv),PACKAGE="mgcv");
+            n.sp=as.integer(M),deriv=as.integer(deriv),
+            as.integer(if (is.null(family$nthreads)) 1 else family$nthreads),PACKAGE="mgcv");
       if (deriv==1) d1H <- matrix(oo$d1H,p,M) else
       if (deriv>1) {
         ind <- 1:(p^2)
@@ -193,3 +227,28 @@ cox.ph <- function (link = "identity") {
         class = c("general.family","extended.family","family"))
 } ## cox.ph
 
+cox.risk.sets <- function(y,start=NULL,strata=NULL) {
+## Risk set indexing for the cox.ph C code. y are the event times, in 
+## decreasing order within contiguous blocks of rows for each stratum. 
+## start are the risk set entry times for (start, stop] data. Returns 
+## the unique times tr (unique within strata), the index r of each row's 
+## time in tr, the index e of the first time at which each row is no 
+## longer in the risk set (length(tr)+1 if never), the ordering so 
+## of e, the integer stratum of each row, st, and whether start times were 
+## supplied, counting.
+  n <- length(y)
+  st <- if (is.null(strata)) rep(1L,n) else as.integer(factor(strata,levels=unique(strata)))
+  new.t <- c(TRUE,y[-1]!=y[-n]|st[-1]!=st[-n])
+  tr <- y[new.t];r <- cumsum(new.t);nt <- length(tr)
+  if (is.null(start)) e <- rep(nt+1L,n) else {
+    if (any(start>=y)) stop("start times must be less than event times")
+    e <- rep(0L,n)
+    ti <- split(1:nt,st[new.t]);ri <- split(1:n,st) ## times and rows of each stratum
+    for (k in 1:length(ti)) { ## index of first time <= start, within stratum  
+      ii <- ti[[k]];jj <- ri[[k]]
+      e[jj] <- min(ii) + length(ii) - findInterval(start[jj],rev(tr[ii]))
+    }
+  }
+  list(tr=tr,r=r,e=as.integer(e),so=order(e),st=st,counting=!is.null(start))
+} ## cox.risk.sets
+
@@ -728,7 +728,7 @@ nb <- function (theta = NULL, link = "log") {
 ## Tweedie....
 
 
-tw <- function (theta = NULL, link = "log",a=1.01,b=1.99) { 
+tw <- function (theta = NULL, link = "log",a=1.01,b=1.99,nthreads=1) { 
 ## Extended family object for Tweedie, to allow direct estimation of p
 ## as part of REML optimization. 
 ## p = (a+b*exp(theta))/(1+exp(theta)), i.e. a < p < b
@@ -764,6 +764,7 @@ tw <- function (theta = NULL, link = "log",a=1.01,b=1.99) {
   env <- new.env(parent = .GlobalEnv)
   assign(".Theta", iniTheta, envir = env) 
   assign(".a",a, envir = env);assign(".b",b, envir = env)
+  assign(".nthreads",nthreads, envir = env) ## for Tweedie density evaluation
   getTheta <- function(trans=FALSE) { 
   ## trans transforms to the original scale...
     th <- get(".Theta")
@@ -851,14 +852,14 @@ tw <- function (theta = NULL, link = "log",a=1.01,b=1.99) {
         a <- get(".a");b <- get(".b")
         p <- if (theta>0) (b+a*exp(-theta))/(1+exp(-theta)) else (b*exp(theta)+a)/(exp(theta)+1)
         scale <- dev/sum(wt)
-        -2 * sum(ldTweedie(y, mu, p = p, phi = scale)[, 1] * 
+        -2 * sum(ldTweedie(y, mu, p = p, phi = scale,nthreads=get(".nthreads"))[, 1] * 
             wt) + 2
     }
 
     ls <- function(y, w, n, theta, scale) {
         ## evaluate saturated log likelihood + derivs w.r.t. working params and log(scale)
         a <- get(".a");b <- get(".b")
-        LS <- colSums(w * ldTweedie(y, y, rho=log(scale), theta=theta,a=a,b=b))
+        LS <- colSums(w * ldTweedie(y, y, rho=log(scale), theta=theta,a=a,b=b,nthreads=get(".nthreads")))
         lsth1 <- c(LS[4],LS[2])
         lsth2 <- matrix(c(LS[5],LS[6],LS[6],LS[3]),2,2)
         list(ls=LS[1],lsth1=lsth1,lsth2=lsth2)
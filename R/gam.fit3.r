@@ -105,6 +105,19 @@ gam.scale <- function(wp,wd,dof,extra=0) {
 }
 
 
+pirls.code <- function(family)
+## returns the link and variance function codes used by the compiled P-IRLS
+## loop (see pirls.c), or NULL if the family is not one it handles. 
+{ fam <- match(family$family,c("gaussian","poisson","binomial","Gamma","inverse.gaussian",
+                             "quasipoisson","quasibinomial")) - 1
+  if (is.na(fam)) return(NULL)
+  if (fam>4) fam <- fam - 4 ## quasi families have same variance and deviance
+  link <- match(family$link,c("identity","log","logit","probit","cloglog","inverse",
+                              "sqrt","1/mu^2")) - 1
+  if (length(link)!=1||is.na(link)) return(NULL)
+  c(link,fam)
+} ## pirls.code
+
 gam.fit3 <- function (x, y, sp, Eb,UrS=list(),
             weights = rep(1, nobs), start = NULL, etastart = NULL, 
             mustart = NULL, offset = rep(0, nobs),U1=diag(ncol(x)), Mp=-1, family = gaussian(), 
@@ -166,6 +179,7 @@ gam.fit3 <- function (x, y, sp, Eb,UrS=list(),
     }
     if (!deriv%in%c(0,1,2)) stop("unsupported order of differentiation requested of gam.fit3")
     x <- as.matrix(x)  
+    if (!is.double(x)) storage.mode(x) <- "double" ## compiled code accesses x in place
     nSp <- length(sp)  
     if (nSp==0) deriv.sp <- 0 else deriv.sp <- deriv 
 
@@ -330,6 +344,20 @@ gam.fit3 <- function (x, y, sp, Eb,UrS=list(),
           mu <- linkinv(eta)
         }
 
+        pirls <- if (control$trace) NULL else pirls.code(family)
+        if (!is.null(pirls)) { ## standard family: P-IRLS in compiled code, with x accessed in place
+          oo <- .Call(C_mgcv_pirls,x,as.double(y),as.double(weights),as.double(offset),
+                      as.double(eta),as.double(null.coef),as.double(St),as.double(Sr),as.double(Eb),
+                      as.integer(c(pirls,fisher,strictly.additive,control$maxit,
+                                   control$nthreads,rows.E)),
+                      as.double(c(control$epsilon,rank.tol)))
+          coef <- oo$coef;start <- oo$start;eta <- oo$eta;etaold <- oo$etaold;mu <- oo$mu
+          iter <- oo$iter;conv <- oo$conv;boundary <- oo$boundary
+          if (oo$warn%%2) warning(gettextf("No observations informative at iteration %d", iter))
+          if ((oo$warn%/%2)%%2) warning(gettextf("Non-finite coefficients at iteration %d", iter))
+          if ((oo$warn%/%4)%%2) warning("Step size truncated due to divergence",call. = FALSE)
+          if ((oo$warn%/%8)%%2) warning("Step size truncated: out of bounds",call. = FALSE)
+        } else
         for (iter in 1:control$maxit) { ## start of main fitting iteration
             good <- weights > 0
             var.val <- variance(mu)
@@ -367,20 +395,19 @@ gam.fit3 <- function (x, y, sp, Eb,UrS=list(),
            
             if (sum(good)<ncol(x)) stop("Not enough informative observations.")
             if (control$trace) t1 <- proc.time()
-            oo <- .C(C_pls_fit1,y=as.double(z),X=as.double(x[good,]),w=as.double(w),
-                     E=as.double(Sr),Es=as.double(Eb),n=as.integer(sum(good)),
-                     q=as.integer(ncol(x)),rE=as.integer(rows.E),eta=as.double(z),
-                     penalty=as.double(1),rank.tol=as.double(rank.tol),nt=as.integer(control$nthreads))
+            ## .Call interface avoids copying x[good,] 
+            oo <- .Call(C_mgcv_Rpls_fit1,as.double(z),x,if (all(good)) NULL else good,as.double(w),
+                     as.double(Sr),as.double(Eb),as.integer(rows.E),as.double(rank.tol),
+                     as.integer(control$nthreads))
             if (control$trace) tc <- tc + sum((proc.time()-t1)[c(1,4)])
 
             if (!fisher&&oo$n<0) { ## likelihood indefinite - switch to Fisher for this step
               z <- (eta - offset)[good] + (yg - mug)/mevg
               w <- (weg * mevg^2)/var.mug
               if (control$trace) t1 <- proc.time()
-              oo <- .C(C_pls_fit1,y=as.double(z),X=as.double(x[good,]),w=as.double(w),
-                       E=as.double(Sr),Es=as.double(Eb),n=as.integer(sum(good)),
-                       q=as.integer(ncol(x)),rE=as.integer(rows.E),eta=as.double(z),
-                       penalty=as.double(1),rank.tol=as.double(rank.tol),nt=as.integer(control$nthreads))
+              oo <- .Call(C_mgcv_Rpls_fit1,as.double(z),x,if (all(good)) NULL else good,as.double(w),
+                       as.double(Sr),as.double(Eb),as.integer(rows.E),as.double(rank.tol),
+                       as.integer(control$nthreads))
               if (control$trace) tc <- tc + sum((proc.time()-t1)[c(1,4)])
             }
 
@@ -584,21 +611,15 @@ gam.fit3 <- function (x, y, sp, Eb,UrS=list(),
 
        if (REML==0) rSncol <- unlist(lapply(rS,ncol)) else rSncol <- unlist(lapply(UrS,ncol))
        if (control$trace) t1 <- proc.time()
-       oo <- .C(C_gdi1,X=as.double(x[good,]),E=as.double(Sr),Eb = as.double(Eb), 
-                rS = as.double(unlist(rS)),U1=as.double(U1),sp=as.double(exp(sp)),
-                z=as.double(z),w=as.double(w),wf=as.double(wf),alpha=as.double(alpha),
-                mu=as.double(mug),eta=as.double(etag),y=as.double(yg),
-                p.weights=as.double(weg),g1=as.double(g1),g2=as.double(g2),
-                g3=as.double(g3),g4=as.double(g4),V0=as.double(V),V1=as.double(V1),
-                V2=as.double(V2),V3=as.double(V3),beta=as.double(coef),b1=as.double(rep(0,nSp*ncol(x))),
-                D1=as.double(D1),D2=as.double(D2),P=as.double(dum),P1=as.double(P1),P2=as.double(P2),
-                trA=as.double(dum),trA1=as.double(trA1),trA2=as.double(trA2),
-                rV=as.double(rV),rank.tol=as.double(rank.tol),
-                conv.tol=as.double(control$epsilon),rank.est=as.integer(1),n=as.integer(length(z)),
-                p=as.integer(ncol(x)),M=as.integer(nSp),Mp=as.integer(Mp),Enrow = as.integer(rows.E),
-                rSncol=as.integer(rSncol),deriv=as.integer(deriv.sp),
-                REML = as.integer(REML),fisher=as.integer(fisher),
-                fixed.penalty = as.integer(rp$fixed.penalty),nthreads=as.integer(control$nthreads))      
+       ## .Call interface: x and the n-vectors are not copied (rows x[good,] are copied 
+       ## straight into the returned K matrix, oo$X)
+       oo <- .Call(C_mgcv_Rgdi1,x,good,as.double(Sr),as.double(Eb),as.double(unlist(rS)),
+                as.double(U1),as.double(exp(sp)),as.double(z),as.double(w),as.double(wf),
+                as.double(alpha),as.double(mug),as.double(etag),as.double(yg),as.double(weg),
+                as.double(g1),as.double(g2),as.double(g3),as.double(g4),as.double(V),
+                as.double(V1),as.double(V2),as.double(V3),as.double(coef),as.integer(rSncol),
+                as.integer(c(nSp,Mp,rows.E,deriv.sp,REML,fisher,rp$fixed.penalty,control$nthreads)),
+                as.double(c(rank.tol,control$epsilon)))      
          if (control$trace) { 
            tg <- sum((proc.time()-t1)[c(1,4)])
            cat("done!\n")
@@ -2437,9 +2458,12 @@ mini.roots <- function(S,off,np,rank=NULL)
 }
 
 
-ldTweedie <- function(y,mu=y,p=1.5,phi=1,rho=NA,theta=NA,a=1.001,b=1.999) {
+ldTweedie <- function(y,mu=y,p=1.5,phi=1,rho=NA,theta=NA,a=1.001,b=1.999,nthreads=1,tol=0) {
 ## evaluates log Tweedie density for 1<=p<=2, using series summation of
 ## Dunn & Smyth (2005) Statistics and Computing 15:267-280.
+## nthreads is the number of threads to use for the series summation.
+## tol > 0 allows the series results to be interpolated from a table over
+## log(y), with relative error < tol (only used when cheaper).
 
   if (!is.na(rho)&&!is.na(theta)) { ## use rho and theta and get derivs w.r.t. these
     if (length(rho)>1||length(theta)>1) stop("only scalar `rho' and `theta' allowed.")
@@ -2511,7 +2535,8 @@ ldTweedie <- function(y,mu=y,p=1.5,phi=1,rho=NA,theta=NA,a=1.001,b=1.999) {
   w <- w1 <- w2 <- y*0
   oo <- .C(C_tweedious,w=as.double(w),w1=as.double(w1),w2=as.double(w2),w1p=as.double(y*0),w2p=as.double(y*0),
            w2pp=as.double(y*0),y=as.double(y),eps=as.double(.Machine$double.eps^2),n=as.integer(length(y)),
-           th=as.double(theta),rho=as.double(rho),a=as.double(a),b=as.double(b))
+           th=as.double(theta),rho=as.double(rho),a=as.double(a),b=as.double(b),nt=as.integer(nthreads),
+           tol=as.double(tol))
   
   if (!work.param) { ## transform working param derivatives to p/phi derivs...
     oo$w2 <- oo$w2/phi^2 - oo$w1/phi^2
@@ -2567,8 +2592,8 @@ if (FALSE) { ## DEBUG disconnetion of density terms
 
 
 
-Tweedie <- function(p=1,link=power(0)) {
-## a restricted Tweedie family
+Tweedie <- function(p=1,link=power(0),nthreads=1) {
+## a restricted Tweedie family. nthreads is used for density evaluation.
   if (p<=1||p>2) stop("Only 1<p<=2 supported")
   
   linktemp <- substitute(link)
@@ -2614,13 +2639,13 @@ Tweedie <- function(p=1,link=power(0)) {
     })
     ls <-  function(y,w,n,scale) {
       power <- p
-      colSums(w*ldTweedie(y,y,p=power,phi=scale))
+      colSums(w*ldTweedie(y,y,p=power,phi=scale,nthreads=nthreads,tol=1e-10))
     }
 
     aic <- function(y, n, mu, wt, dev) {
       power <- p
       scale <- dev/sum(wt)
-      -2*sum(ldTweedie(y,mu,p=power,phi=scale)[,1]*wt) + 2
+      -2*sum(ldTweedie(y,mu,p=power,phi=scale,nthreads=nthreads,tol=1e-10)[,1]*wt) + 2
     }
 
     if (p==2) {
@@ -222,6 +222,7 @@ gam.fit4 <- function(x, y, sp, Eb,UrS=list(),
   }
   
   x <- as.matrix(x)  
+  if (!is.double(x)) storage.mode(x) <- "double" ## compiled code accesses x in place
   nSp <- length(sp) 
   rank.tol <- .Machine$double.eps*100 ## tolerance to use for rank deficiency
   q <- ncol(x)
@@ -325,12 +326,9 @@ gam.fit4 <- function(x, y, sp, Eb,UrS=list(),
       }
       z <- (eta-offset)[good] - dd$Deta.Deta2[good] ## - .5 * dd$Deta[good] / w
       
-      oo <- .C(C_pls_fit1,   ##C_pls_fit1, reinstate for use in mgcv
-               y=as.double(z),X=as.double(x[good,]),w=as.double(w),
-                     E=as.double(Sr),Es=as.double(Eb),n=as.integer(sum(good)),
-                     q=as.integer(ncol(x)),rE=as.integer(rows.E),eta=as.double(z),
-                     penalty=as.double(1),rank.tol=as.double(rank.tol),
-                     nt=as.integer(control$nthreads))
+      oo <- .Call(C_mgcv_Rpls_fit1,as.double(z),x,if (all(good)) NULL else good,as.double(w),
+                  as.double(Sr),as.double(Eb),as.integer(rows.E),as.double(rank.tol),
+                  as.integer(control$nthreads))
       if (oo$n<0) { ## then problem is indefinite - switch to +ve weights for this step
         if (control$trace) cat("**using positive weights\n")
         # problem is that Fisher can be very poor for zeroes  
@@ -344,12 +342,9 @@ gam.fit4 <- function(x, y, sp, Eb,UrS=list(),
         good <- is.finite(dd$Deta)
         z <- (eta-offset)[good] - .5 * dd$Deta[good] / w[good]
        
-        oo <- .C(C_pls_fit1, ##C_pls_fit1,
-                  y=as.double(z),X=as.double(x[good,]),w=as.double(w),
-                     E=as.double(Sr),Es=as.double(Eb),n=as.integer(sum(good)),
-                     q=as.integer(ncol(x)),rE=as.integer(rows.E),eta=as.double(z),
-                     penalty=as.double(1),rank.tol=as.double(rank.tol),
-                     nt=as.integer(control$nthreads))
+        oo <- .Call(C_mgcv_Rpls_fit1,as.double(z),x,if (all(good)) NULL else good,as.double(w),
+                    as.double(Sr),as.double(Eb),as.integer(rows.E),as.double(rank.tol),
+                    as.integer(control$nthreads))
       }
       start <- oo$y[1:ncol(x)] ## current coefficient estimates
       penalty <- oo$penalty ## size of penalty
@@ -523,24 +518,15 @@ gam.fit4 <- function(x, y, sp, Eb,UrS=list(),
    mwb <- max(abs(w))*.Machine$double.eps
    mwa <- min(abs(w[w!=0]))*.0001; if (mwa==0) mwa <- mwb
    w[w==0] <- min(mwa,mwb);
-   oo <- .C(C_gdi2,
-            X=as.double(x[good,]),E=as.double(Sr),Es=as.double(Eb),rS=as.double(unlist(rS)),
-            U1 = as.double(U1),sp=as.double(exp(sp)),theta=as.double(theta),
-            z=as.double(z),w=as.double(w),wf=as.double(wf),Dth=as.double(dd$Dth),Det=as.double(dd$Deta),
-            Det2=as.double(dd$Deta2),Dth2=as.double(dd$Dth2),Det.th=as.double(dd$Detath),
-            Det2.th=as.double(dd$Deta2th),Det3=as.double(dd$Deta3),Det.th2 = as.double(dd$Detath2),
-            Det4 = as.double(dd$Deta4),Det3.th=as.double(dd$Deta3th), Deta2.th2=as.double(dd$Deta2th2),
-            beta=as.double(coef),b1=as.double(rep(0,ntot*ncol(x))),
-            D1=as.double(rep(0,ntot)),D2=as.double(rep(0,ntot^2)),
-            P=as.double(0),P1=as.double(rep(0,ntot)),P2 = as.double(rep(0,ntot^2)),
-            ldet=as.double(1-2*(scoreType=="ML")),ldet1 = as.double(rep(0,ntot)), 
-            ldet2 = as.double(rep(0,ntot^2)),
-            rV=as.double(rep(0,ncol(x)^2)),
-            rank.tol=as.double(.Machine$double.eps^.75),rank.est=as.integer(0),
-	    n=as.integer(sum(good)),q=as.integer(ncol(x)),M=as.integer(nSp),
-            n.theta=as.integer(length(theta)), Mp=as.integer(Mp),Enrow=as.integer(rows.E),
-            rSncol=as.integer(rSncol),deriv=as.integer(deriv),
-	    fixed.penalty = as.integer(rp$fixed.penalty),nt=as.integer(control$nthreads))
+   ## .Call interface: x and the derivative vectors are not copied 
+   oo <- .Call(C_mgcv_Rgdi2,x,good,as.double(Sr),as.double(Eb),as.double(unlist(rS)),
+            as.double(U1),as.double(exp(sp)),as.double(theta),as.double(z),as.double(w),
+            as.double(wf),as.double(dd$Dth),as.double(dd$Deta),as.double(dd$Deta2),
+            as.double(dd$Dth2),as.double(dd$Detath),as.double(dd$Deta2th),as.double(dd$Deta3),
+            as.double(dd$Detath2),as.double(dd$Deta4),as.double(dd$Deta3th),as.double(dd$Deta2th2),
+            as.double(coef),as.double(1-2*(scoreType=="ML")),as.integer(rSncol),
+            as.integer(c(nSp,Mp,rows.E,deriv,rp$fixed.penalty,control$nthreads)),
+            as.double(.Machine$double.eps^.75))
 
    rV <- matrix(oo$rV,ncol(x),ncol(x)) ## rV%*%t(rV)*scale gives covariance matrix 
    rV <- T %*% rV   
@@ -688,6 +674,8 @@ gam.fit5 <- function(x,y,lsp,Sl,weights=NULL,offset=NULL,deriv=2,family,
   if (!is.null(start0)) start <- start0 
   coef <- as.numeric(start)
 
+  ## let the family's ll code know how many threads it can use
+  if (is.null(family$nthreads)) family$nthreads <- control$nthreads
 
   if (is.null(weights)) weights <- rep.int(1, nobs)
   if (is.null(offset)) offset <- rep.int(0, nobs)
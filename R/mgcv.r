@@ -85,11 +85,20 @@ pcls <- function(M)
 # M$S  - List of (minimal) penalty matrices
 # M$off - used for unpacking M$S
 # M$sp - array of theta_i's 
+# M$active - optional: rows of M$Ain from which to warm start the active set
+#       search (e.g. attr(p,"active") from a previous call). If supplied (possibly 
+#       as integer(0)) the active set at the solution is returned as attribute 
+#       "active" of the result.
 # Ain, bin and p are not in the object needed to call mgcv....
 #
 { nar<-c(length(M$y),length(M$p),dim(M$Ain)[1],dim(M$C)[1],0)
   H<-0
   ## sanity checking ...
+  if (!is.null(M$active)) { 
+    if (!is.numeric(M$active)||any(!is.finite(M$active))||any(M$active!=round(M$active))||
+        any(M$active<1|M$active>nrow(M$Ain))) stop("M$active must contain only row indices of M$Ain")
+    M$active <- as.integer(M$active)
+  }
   if (nrow(M$X)!=nar[1]) stop("nrow(M$X) != length(M$y)") 
   if (ncol(M$X)!=nar[2]) stop("ncol(M$X) != length(M$p)")
   if (length(M$w)!=nar[1]) stop("length(M$w) != length(M$y)")
@@ -97,13 +106,20 @@ pcls <- function(M)
   if (nrow(M$Ain)>0) {
     if (ncol(M$Ain)!=nar[2]) stop("nrow(M$Ain) != length(M$p)") 
     res <- as.numeric(M$Ain%*%M$p) - as.numeric(M$bin)
+    if (length(M$active)) { ## warm start constraints lie on their constraint, to rounding 
+      ii <- M$active
+      res[ii][abs(res[ii]) < .Machine$double.eps^.5*(abs(M$bin[ii])+1)] <- 0
+    }
     if (sum(res<0)>0) stop("initial parameters not feasible")
     res <- abs(res)
-    if (sum(res<.Machine$double.eps^.5)>0) 
-      warning("initial point very close to some inequality constraints")
-    res <- mean(res)
-    if (res<.Machine$double.eps^.5) 
-      warning("initial parameters very close to inequality constraints")
+    if (length(M$active)) res <- res[-M$active] ## exact equality expected for these
+    if (length(res)) {
+      if (sum(res<.Machine$double.eps^.5)>0) 
+        warning("initial point very close to some inequality constraints")
+      res <- mean(res)
+      if (res<.Machine$double.eps^.5) 
+        warning("initial parameters very close to inequality constraints")
+    }
   }
   
   if (nrow(M$C)>0) if (ncol(M$C)!=nar[2]) stop("ncol(M$C) != length(M$p)")  
@@ -128,6 +144,9 @@ pcls <- function(M)
       M$X <- t(qr.qty(qra,t(M$X))[(j+1):k,])
       M$Ain <- t(qr.qty(qra,t(M$Ain))[(j+1):k,])
       M$C <- matrix(0,0,0)
+      ## a warm start p (e.g. from a previous call) is transformed to the reduced 
+      ## parameterization, otherwise start from zero...
+      if (length(M$active)) M$p <- qr.qty(qra,as.numeric(M$p))[(j+1):k] else 
       M$p <- rep(0,ncol(M$X)) 
       nar[2] <- length(M$p)
       nar[4] <- 0
@@ -135,11 +154,21 @@ pcls <- function(M)
       if  (ncol(M$X)>nrow(M$X)) stop("Model matrix not full column rank")
     }
   }
+  ## working set for warm start (0 based for C) ...
+  active <- rep(0,nar[2]+1)
+  if (length(M$active)&&nar[3]>0) { 
+    ii <- unique(M$active);if (length(ii)>nar[2]) ii <- ii[1:nar[2]]
+    active[1:(length(ii)+1)] <- c(length(ii),ii-1)
+  }
   o<-.C(C_RPCLS,as.double(M$X),as.double(M$p),as.double(M$y),as.double(M$w),as.double(M$Ain),as.double(M$bin)
         ,as.double(M$C),as.double(H),as.double(Sa),as.integer(M$off),as.integer(df),as.double(M$sp),
-        as.integer(length(M$off)),as.integer(nar))
+        as.integer(length(M$off)),as.integer(nar),active=as.integer(active))
   p <- array(o[[2]],length(M$p))
   if (qra.exist) p <- qr.qy(qra,c(rep(0,j),p))
+  if (!is.null(M$active)) { ## return the active set, for warm starting the next call
+    na <- o$active[1]
+    attr(p,"active") <- if (na>0) o$active[1:na+1]+1 else integer(0)
+  }
   p
 } ## pcls
 
@@ -1468,6 +1497,11 @@ get.null.coef <- function(G,start=NULL,etastart=NULL,mustart=NULL,...) {
 estimate.gam <- function (G,method,optimizer,control,in.out,scale,gamma,...) {
 ## Do gam estimation and smoothness selection...
   
+  ## each fit starts and ends with an empty get_stableS cache, so that
+  ## results do not depend on earlier fits...
+  .C(C_stableS_cache_clear)
+  on.exit(.C(C_stableS_cache_clear))
+  
   if (inherits(G$family,"extended.family")) { ## then there are some restrictions...
     if (!(method%in%c("REML","ML"))) method <- "REML"
     if (optimizer[1]=="perf") optimizer <- c("outer","newton") 
@@ -4124,12 +4158,13 @@ magic <- function(y,X,sp,S,off,L=NULL,lsp0=NULL,rank=NULL,H=NULL,C=NULL,w=NULL,g
   b<-array(0,icontrol[3])
   # argument names in call refer to returned values.
   if (nthreads<1) nthreads <- 1 ## can't set up storage without knowing nthreads
-  if (nthreads>1) extra.x <- q^2 * nthreads else extra.x <- 0 
-  um<-.C(C_magic,as.double(y),X=as.double(c(X,rep(0,extra.x))),sp=as.double(sp),as.double(def.sp),
-          as.double(Si),as.double(H),as.double(L),
-          lsp0=as.double(lsp0),score=as.double(gamma),scale=as.double(scale),info=as.integer(icontrol),as.integer(cS),
-          as.double(control$rank.tol),rms.grad=as.double(control$tol),b=as.double(b),rV=double(q*q),
-          as.double(extra.rss),as.integer(n.score),as.integer(nthreads))
+  if (!is.double(X)) storage.mode(X) <- "double"
+  ## .Call interface: X is copied once in C, with the extra q^2*nthreads workspace,
+  ## rather than being padded here and then duplicated by .C 
+  um<-.Call(C_mgcv_Rmagic,as.double(y),X,as.double(sp),as.double(def.sp),
+          as.double(Si),as.double(H),as.double(L),as.double(lsp0),as.double(gamma),
+          as.double(scale),as.integer(icontrol),as.integer(cS),as.double(control$rank.tol),
+          as.double(control$tol),as.double(extra.rss),as.integer(n.score),as.integer(nthreads))
   res<-list(b=um$b,scale=um$scale,score=um$score,sp=um$sp,sp.full=as.numeric(exp(L%*%log(um$sp))))
   res$R <- matrix(um$X[1:q^2],q,q)
   res$rV<-matrix(um$rV[1:(um$info[1]*q)],q,um$info[1])
@@ -3,12 +3,12 @@
 ## for testing purposes
 
 
-mvn.ll <- function(y,X,beta,dbeta=NULL) {
+mvn.ll <- function(y,X,beta,dbeta=NULL,ytr=FALSE) {
 ## to facilitate testing of MVN routine mvn_ll.
 ## X is a sequence of m model matrices bound columnwise, with m dim attribute lpi
 ##   indicating where the next starts in all cases.
 ## beta is parameter vector - last m*(m+1)/2 elements are chol factor of precision params.
-## y is m by n data matrix.
+## y is m by n data matrix (n by m if ytr=TRUE).
   lpi <- attr(X,"lpi")-1;m <- length(lpi)
   nb <- length(beta)
   if (is.null(dbeta)) {
@@ -20,7 +20,7 @@ mvn.ll <- function(y,X,beta,dbeta=NULL) {
   oo <- .C(C_mvn_ll,y=as.double(y),X=as.double(X),XX=as.double(crossprod(X)),beta=as.double(beta),n=as.integer(nrow(X)),
                   lpi=as.integer(lpi),m=as.integer(m),ll=as.double(0),lb=as.double(beta*0),
                   lbb=as.double(rep(0,nb*nb)), dbeta = as.double(dbeta), dH = as.double(dH), 
-                  deriv = as.integer(nsp>0),nsp = as.integer(nsp),nt=as.integer(1))
+                  deriv = as.integer(nsp>0),nsp = as.integer(nsp),nt=as.integer(1),ytr=as.integer(ytr))
   if (nsp==0) dH <- NULL else {
     dH <- list();ind <- 1:(nb*nb)
     for (i in 1:nsp) { 
@@ -110,11 +110,13 @@ mvn <- function(d=2) {
       }
       #cat("\nderiv=",deriv,"  lpstart=",lpstart," dim(y) = ",dim(y),
       #    "\ndim(XX)=",dim(attr(X,"XX"))," m=",m," nsp=",nsp,"\n")
-      oo <- .C("mvn_ll",y=as.double(t(y)),X=as.double(X),XX=as.double(attr(X,"XX")),
+      ## y is passed n by m (ytr=1), so that each response is contiguous in the C code
+      oo <- .C("mvn_ll",y=as.double(y),X=as.double(X),XX=as.double(attr(X,"XX")),
                beta=as.double(coef),n=as.integer(nrow(X)),
                lpi=as.integer(lpstart-1),m=as.integer(m),ll=as.double(0),lb=as.double(coef*0),
                lbb=as.double(rep(0,nb*nb)), dbeta = as.double(d1b), dH = as.double(dH), 
-               deriv = as.integer(nsp>0),nsp = as.integer(nsp),nt=as.integer(1),PACKAGE="mgcv")
+               deriv = as.integer(nsp>0),nsp = as.integer(nsp),
+               nt=as.integer(if (is.null(family$nthreads)) 1 else family$nthreads),ytr=as.integer(1),PACKAGE="mgcv")
       if (nsp==0) d1H <- NULL else if (deriv==2) {
         d1H <- matrix(0,nb,nsp)
         for (i in 1:nsp) { 
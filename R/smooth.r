@@ -1038,6 +1038,8 @@ smooth.construct.tp.smooth.spec <- function(object,data,knots)
   else xtra$max.knots <- object$xt$max.knots 
   if (is.null(object$xt$seed)) xtra$seed <- 1 
   else xtra$seed <- object$xt$seed 
+  ## randomized eigen-decomposition uses all unique data as knots...
+  xtra$rand.eig <- if (is.null(object$xt$rand.eig)) FALSE else object$xt$rand.eig 
   ## now collect predictors
   x<-array(0,0)
   shift<-array(0,object$dim)
@@ -1066,7 +1068,7 @@ smooth.construct.tp.smooth.spec <- function(object,data,knots)
   if (nk>n) { nk <- 0
   warning("more knots than data in a tp term: knots ignored.")}
   ## deal with possibility of large data set
-  if (nk==0 && n>xtra$max.knots) { ## then there *may* be too many data  
+  if (nk==0 && n>xtra$max.knots && !xtra$rand.eig) { ## then there *may* be too many data  
     xu <- uniquecombs(matrix(x,n,object$dim)) ## find the unique `locations'
     nu <- nrow(xu)  ## number of unique locations
     if (nu>xtra$max.knots) { ## then there is really a problem 
@@ -1114,7 +1116,8 @@ smooth.construct.tp.smooth.spec <- function(object,data,knots)
   nXu<-0  
   oo<-.C(C_construct_tprs,as.double(x),as.integer(object$dim),as.integer(n),as.double(knt),as.integer(nk),
                as.integer(object$p.order[1]),as.integer(object$bs.dim),X=as.double(X),S=as.double(S),
-               UZ=as.double(UZ),Xu=as.double(Xu),n.Xu=as.integer(nXu),C=as.double(C))
+               UZ=as.double(UZ),Xu=as.double(Xu),n.Xu=as.integer(nXu),C=as.double(C),
+               rand.eig=as.integer(xtra$rand.eig),nt=as.integer(basis.nthreads(object)))
   object$X<-matrix(oo$X,n,k)                   # model matrix
 
   object$S<-list()
@@ -1197,7 +1200,8 @@ Predict.matrix.tprs.smooth <- function(object,data)
   X<-matrix(0,n,object$bs.dim)
   oo<-.C(C_predict_tprs,as.double(x),as.integer(object$dim),as.integer(n),as.integer(object$p.order[1]),
       as.integer(object$bs.dim),as.integer(M),as.double(object$Xu),
-      as.integer(nrow(object$Xu)),as.double(object$UZ),as.double(by),as.integer(by.exists),X=as.double(X))
+      as.integer(nrow(object$Xu)),as.double(object$UZ),as.double(by),as.integer(by.exists),X=as.double(X),
+      nt=as.integer(basis.nthreads(object)))
   X<-matrix(oo$X,n,object$bs.dim)
   if (object$drop.null>0) {
     if (FALSE) { ## nat param
@@ -1222,6 +1226,12 @@ Predict.matrix.ts.smooth <- function(object,data)
 #############################################
 
 
+basis.nthreads <- function(object) {
+## number of threads for basis evaluation: can be set via xt=list(nthreads=...)
+## in the s term, for bases that support it.
+  if (is.list(object$xt)&&!is.null(object$xt$nthreads)) object$xt$nthreads else 1
+} ## basis.nthreads
+
 smooth.construct.cr.smooth.spec <- function(object,data,knots) {
 # this routine is the constructor for cubic regression spline basis objects
 # It takes a cubic regression spline specification object and returns the 
@@ -1260,7 +1270,7 @@ smooth.construct.cr.smooth.spec <- function(object,data,knots) {
 
   oo <- .C(C_crspl,x=as.double(x),n=as.integer(nx),xk=as.double(k),
            nk=as.integer(nk),X=as.double(X),S=as.double(S),
-           F=as.double(F),Fsupplied=as.integer(F.supplied))
+           F=as.double(F),Fsupplied=as.integer(F.supplied),nt=as.integer(basis.nthreads(object)))
 
   object$X <- matrix(oo$X,nx,nk)
 
@@ -1321,13 +1331,89 @@ Predict.matrix.cr.smooth <- function(object,data) {
 
   oo <- .C(C_crspl,x=as.double(x),n=as.integer(nx),xk=as.double(object$xp),
            nk=as.integer(nk),X=as.double(X),S=as.double(S),
-           F=as.double(object$F),Fsupplied=as.integer(F.supplied))
+           F=as.double(object$F),Fsupplied=as.integer(F.supplied),nt=as.integer(basis.nthreads(object)))
   
   X <- matrix(oo$X,nx,nk) # the prediction matrix
 
   X
 } ## Predict.matrix.cr.smooth
 
+cr.basis <- function(object,data) {
+## Compact form of the model matrix of cr smooth 'object' at 'data', as PredictMat 
+## would produce it (including any `by' variable, constraints and re-parameterization).
+## Row i of the model matrix is u_i'P + r0', where u_i is zero apart from a[i,1:2] in 
+## positions jj[i]+1:2 and a[i,3:4] in positions nk+jj[i]+1:2 (a is n by 4). P is 
+## the linear part of PredictMat.cons applied to rbind(diag(nk),t(F)), and r0 its 
+## constant part (only non-zero for `sweep and drop' constraints). So storage is 4 
+## doubles and an integer per datum, whatever the basis dimension. cr.XWX, cr.XWXd, 
+## cr.XWy and cr.Xb then form products in O(n) (plus small products with P), without 
+## forming X. Returns NULL if 'object' is not a "cr" smooth, or uses matrix arguments.
+  if (class(object)[1]!="cr.smooth"||is.null(object$F)) return(NULL)
+  x <- data[[object$term]]
+  if (is.null(x)||is.matrix(x)||length(x)<1) return(NULL)
+  nx <- length(x)
+  if (object$by!="NA") {
+    by <- get.var(object$by,data)
+    if (is.null(by)||is.matrix(by)) return(NULL)
+    by <- if (is.factor(by)) as.numeric(object$by.level==by) else as.numeric(by)
+  } else by <- NULL
+  nk <- object$bs.dim
+  oo <- .C(C_crspl_coef,x=as.double(x),n=as.integer(nx),xk=as.double(object$xp),
+           nk=as.integer(nk),jj=as.integer(rep(0,nx)),a=as.double(rep(0,4*nx)),
+           nt=as.integer(basis.nthreads(object)))
+  a <- if (is.null(by)) oo$a else by*oo$a ## by recycled over the 4 columns
+  P <- PredictMat.cons(object,rbind(diag(nk),t(matrix(object$F,nk,nk))))
+  r0 <- PredictMat.cons(object,matrix(0,2,nk))[1,] ## image of zero row (2 rows avoid dropping)
+  P <- P - matrix(r0,nrow(P),ncol(P),byrow=TRUE)
+  structure(list(jj=oo$jj,a=a,n=nx,nk=nk,P=P,r0=r0),class="cr.basis")
+} ## cr.basis
+
+cr.basis.rows <- function(cb,ind) {
+## compact cr basis cb (from cr.basis) for rows ind only
+  a <- matrix(cb$a,cb$n,4)[ind,,drop=FALSE]
+  cb$jj <- cb$jj[ind];cb$a <- as.numeric(a);cb$n <- nrow(a)
+  cb
+} ## cr.basis.rows
+
+cr.XWX <- function(cb,cb2=cb,w=rep(1,cb$n)) {
+## X'WX2, W = diag(w), for compact cr bases cb and cb2 (from cr.basis)
+  p <- ncol(cb$P);p2 <- ncol(cb2$P)
+  oo <- .C(C_cr_XtWX,XWX=as.double(rep(0,p*p2)),as.integer(cb$jj),as.double(cb$a),
+           as.double(cb$P),as.integer(cb$nk),as.integer(p),as.integer(cb2$jj),as.double(cb2$a),
+           as.double(cb2$P),as.integer(cb2$nk),as.integer(p2),as.double(w),as.integer(cb$n))
+  XWX <- matrix(oo$XWX,p,p2)
+  if (any(cb$r0!=0)||any(cb2$r0!=0)) { ## add the terms from the constant rows
+    h <- cr.XWy(cb,rep(1,cb$n),w);h2 <- cr.XWy(cb2,rep(1,cb$n),w)
+    XWX <- XWX + outer(h,cb2$r0) + outer(cb$r0,h2) - sum(w)*outer(cb$r0,cb2$r0) 
+  }
+  XWX
+} ## cr.XWX
+
+cr.XWXd <- function(cb,Xd,w=rep(1,cb$n)) {
+## X'WXd, W = diag(w), for compact cr basis cb (from cr.basis) and dense matrix Xd
+  p <- ncol(cb$P);pd <- ncol(Xd)
+  oo <- .C(C_cr_XtWXd,XWX=as.double(rep(0,p*pd)),as.integer(cb$jj),as.double(cb$a),
+           as.double(cb$P),as.integer(cb$nk),as.integer(p),as.double(Xd),as.integer(pd),
+           as.double(w),as.integer(cb$n))
+  matrix(oo$XWX,p,pd) + outer(cb$r0,colSums(w*Xd))
+} ## cr.XWXd
+
+cr.XWy <- function(cb,y,w=rep(1,cb$n)) {
+## X'Wy, W = diag(w), for compact cr basis cb (from cr.basis)
+  p <- ncol(cb$P)
+  oo <- .C(C_cr_XtWz,XWy=as.double(rep(0,p)),as.integer(cb$jj),as.double(cb$a),
+           as.double(w),as.double(y),as.integer(cb$n),as.double(cb$P),as.integer(cb$nk),
+           as.integer(p))
+  oo$XWy + cb$r0*sum(w*y)
+} ## cr.XWy
+
+cr.Xb <- function(cb,beta) {
+## X %*% beta for compact cr basis cb (from cr.basis)
+  oo <- .C(C_cr_Xb,f=as.double(rep(0,cb$n)),as.integer(cb$jj),as.double(cb$a),
+           as.double(beta),as.integer(cb$n),as.double(cb$P),as.integer(cb$nk),
+           as.integer(ncol(cb$P)))
+  oo$f + sum(cb$r0*beta)
+} ## cr.Xb
 
 Predict.matrix.cs.smooth <- function(object,data)
 # this is the prediction method for a cubic regression spline 
@@ -3325,8 +3411,16 @@ PredictMat <- function(object,data,n=nrow(data))
     }
   }
 
-  ## finished by and summation handling. do constraints...  
+  ## finished by and summation handling. do constraints etc...
+  X <- PredictMat.cons(object,X)
+  attr(X,"offset") <- offset
+  X
+} ## end of PredictMat
 
+PredictMat.cons <- function(object,X) {
+## applies to the columns of X the identifiability constraints, re-parameterization 
+## and side constraint deletions that smoothCon applied to 'object'. Used by 
+## PredictMat, and to transform compact bases (see cr.basis).
   qrc <- attr(object,"qrc")
   if (!is.null(qrc)) { ## then smoothCon absorbed constraints
     j <- attr(object,"nCons")
@@ -3375,9 +3469,8 @@ PredictMat <- function(object,data,n=nrow(data))
   ## drop columns eliminated by side-conditions...
   del.index <- attr(object,"del.index") 
   if (!is.null(del.index)) X <- X[,-del.index]
-  attr(X,"offset") <- offset
   X
-} ## end of PredictMat
+} ## PredictMat.cons
 
 
 
@@ -122,7 +122,7 @@ kd.vis <- function(kd,X,cex=.5) {
   #points(X[,1],X[,2],pch=19,cex=cex,col=2)
 }
 
-nearest <- function(k,X,gt.zero = FALSE,get.a=FALSE) {
+nearest <- function(k,X,gt.zero = FALSE,get.a=FALSE,nthreads=1,eps=0,max.visit=0) {
 ## The rows of X contain coordinates of points.
 ## For each point, this routine finds its k nearest 
 ## neighbours, returning a list of 2, n by k matrices:
@@ -134,6 +134,10 @@ nearest <- function(k,X,gt.zero = FALSE,get.a=FALSE) {
 ## ties are broken arbitrarily.
 ## gt.zero indicates that neighbours must have distances greater
 ## than zero...
+## nthreads is the number of threads to use for tree building and search.
+## eps > 0 gives a (1+eps)-approximate search: returned neighbour distances are
+## within a factor 1+eps of exact. max.visit > 0 stops the search for each 
+## point after that many points beyond its initial kd box have been checked.
  
   if (gt.zero) {
     Xu <- uniquecombs(X);ind <- attr(Xu,"index") ## Xu[ind,] == X
@@ -146,7 +150,8 @@ nearest <- function(k,X,gt.zero = FALSE,get.a=FALSE) {
   if (get.a) a <- 1:n else a=1
 
   oo <- .C(C_k_nn,Xu=as.double(Xu),dist=as.double(dist),a=as.double(a),ni=as.integer(dist),
-                    n=as.integer(n),d=as.integer(d),k=as.integer(k),get.a=as.integer(get.a))
+                    n=as.integer(n),d=as.integer(d),k=as.integer(k),get.a=as.integer(get.a),
+                    nt=as.integer(nthreads),eps=as.double(eps),maxv=as.integer(max.visit))
 
   dist <- matrix(oo$dist,n,k)[ind,]
   rind <- 1:nobs
@@ -156,51 +161,88 @@ nearest <- function(k,X,gt.zero = FALSE,get.a=FALSE) {
   list(ni=ni,dist=dist,a=a)
 } # nearest
 
-kd.tree <- function(X) {
-## function to obtain kd tree for points in rows of X
+kd.tree <- function(X,nthreads=1) {
+## function to obtain kd tree for points in rows of X, using
+## nthreads threads to build the tree.
   n <- nrow(X) ## number of points
   d <- ncol(X) ## dimension of points
   ## compute the number of boxes in the kd tree, nb
   m <- 2;while (m < n) m <- m* 2;
   nb = n * 2 - m %/% 2 - 1;
   if (nb > m-1) nb = m - 1; 
+  if (nb < 1) nb = 1
   ## compute the storage requirements for the tree
   nd = 1 + d * nb * 2 ## number of doubles
   ni = 3 + 5 * nb  + 2*n   ## number of integers
   oo <- .C(C_Rkdtree,as.double(X),as.integer(n),as.integer(d),idat = as.integer(rep(0,ni)),
-                     ddat = as.double(rep(0,nd)))
+                     ddat = as.double(rep(0,nd)),as.integer(nthreads))
   list(idat=oo$idat,ddat=oo$ddat)
 }
 
-kd.nearest <- function(kd,X,x,k) {
+kd.save <- function(kd,X,file) {
+## writes kd tree, kd, for points in rows of X (kd from kd.tree(X)) to 
+## an index file, which can then be loaded by kd.load (in any number of
+## R sessions at once) and queried in place by kd.nearest and kd.radius. 
+  oo <- .C(C_Rkdsave,as.integer(kd$idat),as.double(kd$ddat),as.double(X),
+           as.character(path.expand(file)),ok=as.integer(0))
+  if (oo$ok==1) stop("can not open ",file," for writing")
+  if (oo$ok) stop("failed writing kd tree index to ",file)
+  invisible(file)
+} ## kd.save
+
+kd.load <- function(file) {
+## loads (memory maps, where possible) a kd tree index written by kd.save. 
+## The result can be used as the 'kd' argument of kd.nearest or kd.radius 
+## (X is then not needed). It does not survive saving and re-loading
+## the R session.
+  ptr <- .Call(C_mgcv_kdload,as.character(path.expand(file)))
+  structure(list(ptr=ptr,n=attr(ptr,"n"),d=attr(ptr,"d"),file=file),class="kd.index")
+} ## kd.load
+
+kd.nearest <- function(kd,X,x,k,nthreads=1,eps=0,max.visit=0) {
 ## given a set of points in rows of X, and corresponding kd tree, kd 
 ## (produced by a call to kd.tree(X)), then this routine finds the 
 ## k nearest neighbours in X, to the points in the rows of x.
+## kd can also be an index from kd.load, in which case X is not used.
 ## outputs: ni[i,] lists k nearest neighbours of X[i,].
 ##          dost[i,] is distance to those neighbours.
-## note R indexing of output
-  n <- nrow(X)
+## note R indexing of output. nthreads threads are used for the search.
+## eps and max.visit give approximate search, as for 'nearest'.
   m <- nrow(x)
+  if (inherits(kd,"kd.index")) {
+    if (ncol(x)!=kd$d) stop("x and kd tree index dimensions do not match")
+    oo <- .Call(C_mgcv_kdnearest,kd$ptr,as.double(x),as.integer(k),as.integer(nthreads),
+                as.double(eps),as.integer(max.visit))
+    return(list(ni=matrix(oo[[1]]+1,m,k),dist=matrix(oo[[2]],m,k)))
+  }
+  n <- nrow(X)
   ni <- matrix(0,m,k)
   oo <- .C(C_Rkdnearest,as.double(X),as.integer(kd$idat),as.double(kd$ddat),as.integer(n),as.double(x), 
-           as.integer(m), ni=as.integer(ni), dist=as.double(ni),as.integer(k))
+           as.integer(m), ni=as.integer(ni), dist=as.double(ni),as.integer(k),as.integer(nthreads),
+           as.double(eps),as.integer(max.visit))
   list(ni=matrix(oo$ni+1,m,k),dist=matrix(oo$dist,m,k))
 }
 
-kd.radius <- function(kd,X,x,r) {
+kd.radius <- function(kd,X,x,r,nthreads=1) {
 ## find all points in kd tree (kd,X) in radius r of points in x.
-## kd should come from kd.tree(X).
+## kd should come from kd.tree(X), or kd.load (in which case X is not used).
 ## neighbours of x[i,] in X are the rows given by ni[off[i]:(off[i+1]-1)]
+## nthreads threads are used for the search.
    m <- nrow(x);
+   if (inherits(kd,"kd.index")) {
+     if (ncol(x)!=kd$d) stop("x and kd tree index dimensions do not match")
+     oo <- .Call(C_mgcv_kdradius,kd$ptr,as.double(t(x)),as.double(r),as.integer(nthreads))
+     return(list(off=oo[[1]]+1,ni=oo[[2]]+1))
+   }
    off <- rep(0,m+1)
    ## do the work...
    oo <- .C(C_Rkradius,as.double(r),as.integer(kd$idat),as.double(kd$ddat),as.double(X),as.double(t(x)),
-         as.integer(m),off=as.integer(off),ni=as.integer(0),op=as.integer(0))
+         as.integer(m),off=as.integer(off),ni=as.integer(0),op=as.integer(0),nt=as.integer(nthreads))
    off <- oo$off
    ni <- rep(0,off[m+1])
    ## extract to R and clean up...
    oo <- .C(C_Rkradius,as.double(r),as.integer(kd$idat),as.double(kd$ddat),as.double(X),as.double(t(x)),
-         as.integer(m),off=as.integer(off),ni=as.integer(ni),op=as.integer(1))
+         as.integer(m),off=as.integer(off),ni=as.integer(ni),op=as.integer(1),nt=as.integer(nthreads))
    list(off=off+1,ni=oo$ni+1) ## note R indexing here.
 } ## kd.radius
 
@@ -14,61 +14,147 @@
 #include <stdio.h>
 #include <math.h>
 #include <R.h>
+#include <Rconfig.h>
+#include <R_ext/BLAS.h>
+#ifdef SUPPORT_OPENMP
+#include <omp.h>
+#endif
 #include "mgcv.h"
 
 
 void coxpred(double *X,double *t,double *beta,double *Vb,double *a,double *h,double *q,
-             double *tr,int *n,int *p, int *nt,double *s,double *se) {
+             double *tr,int *n,int *p, int *nt,double *s,double *se,int *m,int *nthreads) {
 /* Function to predict the survivor function for the new data in 
    X (n by p), t, given fit results in a, h, q, Vb, and original event times 
-   tr (length nt). 
-   The new data are in descending order on entry, as is tr. 
-   On exit n - vectors s and se contain the estimated survival function and its se.
+   tr (length nt, in descending order). 
+   t is n by m: the survivor function is predicted at each of the m times in row i 
+   of t for row i of X. 
+   On exit n by m matrices s and se contain the estimated survival function and its se.
+   
+   Prediction is by blocks of nb rows of X. For each block and time the vectors 
+   v = a - x h are formed as the rows of a matrix V, and the v'Vb v terms are 
+   then the row sums of V * (V Vb), with V Vb obtained by dsymm. The blocks are 
+   processed in parallel using *nthreads threads.
 */
-  double eta,*p1,*p2,*p3,*v,*pv,*pa,x,vVv,hi; 
-  int ir=0,i=0;
-  v = (double *)R_chk_calloc((size_t)*p,sizeof(double)); 
-  for (i=0;i<*n;i++) { /* loop through new data */
-    while (ir < *nt && t[i]<tr[ir]) { /* find current interval */
-      ir++;
-      a += *p; /* moving the a pointer to a vector for this interval */
-    } 
-    if (ir == *nt) { /* before start of fit data */
-      se[i] = 0; 
-      s[i] = 1;
-    } else { /* in the range */
-      hi = h[ir]; /* cumulative hazard for this point */
-      pv = v;pa = a;
-      for (eta=0,p1=X,p2=beta + *p,p3=beta;p3<p2;pa++,p3++,pv++,p1+= *n) { 
-        eta += *p1 * *p3; /* X beta */
-        *pv = *pa - *p1 * hi; /* v = a - x * h */
+  double *eta,*V,*W,*p1,*p2,hi,x,one=1.0,zero=0.0;
+  ptrdiff_t l;
+  int nb=256,nblock,ib,i0,nr,i,j,k,*ir,lo,hi0,mid,tid=0,nth,ione=1;
+  char side='R',uplo='U',ntrans='N';
+  if (*n < 1) return;
+  if (nb > *n) nb = *n;
+  nblock = (*n + nb - 1)/nb;
+  nth = mgcv_nthreads(*nthreads);if (nth > nblock) nth = nblock;
+  eta = (double *)R_chk_calloc((size_t)nb * nth,sizeof(double)); 
+  ir = (int *)R_chk_calloc((size_t)nb * nth,sizeof(int)); 
+  V = (double *)R_chk_calloc((size_t)nb * *p * nth,sizeof(double)); 
+  W = (double *)R_chk_calloc((size_t)nb * *p * nth,sizeof(double)); 
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(ib,i0,nr,i,j,k,l,lo,hi0,mid,p1,p2,hi,x,tid) num_threads(nth) schedule(static)
+  #endif
+  for (ib=0;ib<nblock;ib++) { /* loop through blocks of new data */
+    #ifdef SUPPORT_OPENMP
+    tid = omp_get_thread_num(); /* thread running this bit */
+    #endif
+    i0 = ib * nb;nr = *n - i0;if (nr > nb) nr = nb;
+    p1 = eta + nb * tid;
+    if (*p > 0) F77_CALL(dgemv)(&ntrans,&nr,p,&one,X + i0,n,beta,&ione,&zero,p1,&ione); /* X beta */
+    else for (i=0;i<nr;i++) p1[i] = 0.0;
+    for (k=0;k < *m;k++) { /* the prediction times */
+      for (i=0;i<nr;i++) { /* find interval, ir, the first with tr[ir] <= t */
+        x = t[i0 + i + (ptrdiff_t) *n * k];
+        lo = 0;hi0 = *nt;
+        while (lo < hi0) { mid = (lo + hi0)/2;if (tr[mid] <= x) hi0 = mid; else lo = mid + 1;}
+        ir[nb * tid + i] = lo;
       }
-      s[i] = exp(-hi*exp(eta)); /* estimated survivor function */
-      /* now get the s.e. for this... */
-      p1 = Vb;pv = v;p2 = pv + *p;
-      for (vVv=0;pv<p2;pv++) {
-        for (x=0.0,p3 = v;p3<p2;p3++,p1++) x += *p3 * *p1;
-        vVv += x * *pv; /* v'Vbv */
+      /* form V, with zero rows before start of fit data */
+      for (j=0;j < *p;j++) for (p1 = V + (ptrdiff_t) nb * (*p * tid + j),p2 = X + i0 + (ptrdiff_t) *n * j,i=0;i<nr;i++) {
+        lo = ir[nb * tid + i];
+        if (lo == *nt) p1[i] = 0.0; else p1[i] = a[(ptrdiff_t) lo * *p + j] - p2[i] * h[lo]; /* v = a - x * h */
       }
-      se[i] = s[i]*sqrt(q[ir] + vVv); /* standard error on survivor function */
-    }
-    X++; /* next prediction */
-  } /* data loop */
-  R_chk_free(v);
+      p1 = V + (ptrdiff_t) nb * *p * tid;p2 = W + (ptrdiff_t) nb * *p * tid;
+      if (*p > 0) F77_CALL(dsymm)(&side,&uplo,&nr,p,&one,Vb,p,p1,&nb,&zero,p2,&nb); /* W = V Vb */
+      for (i=0;i<nr;i++) {
+        lo = ir[nb * tid + i];
+        l = i0 + i + (ptrdiff_t) *n * k; /* output element */
+        if (lo == *nt) { /* before start of fit data */
+          se[l] = 0; 
+          s[l] = 1;
+        } else { /* in the range */
+          hi = h[lo]; /* cumulative hazard for this point */
+          s[l] = exp(-hi*exp(eta[nb * tid + i])); /* estimated survivor function */
+          for (x=0.0,j=0;j < *p;j++) x += p1[i + nb * j] * p2[i + nb * j]; /* v'Vbv */
+          se[l] = s[l]*sqrt(q[lo] + x); /* standard error on survivor function */
+        }
+      }
+    } /* times loop */
+  } /* block loop */
+  R_chk_free(eta);R_chk_free(ir);R_chk_free(V);R_chk_free(W);
 } /* coxpred */
 
-void coxpp(double *eta,double *X,int *r, int *d,double *h,double *q,double *km, 
-            int *n,int *p, int *nt) {
+static int cox_segments(int *seg,int *r,int n,int nth) {
+/* The Cox PH computations are running sums backwards in time over the risk set.
+   To parallelize them the rows of X (in reverse time order) are split into at
+   most nth contiguous segments of roughly equal size, without splitting a set of
+   tied times between segments. Sums are then formed for each segment in parallel,
+   scanned over segments to give the sums at the start of each segment, and then
+   each segment's running sums are completed in parallel.
+   On exit seg[s] is the first row of segment s and seg[ns] = n, where ns is the
+   number of segments returned.
+*/
+  int s,i,ns=1;
+  seg[0] = 0;
+  for (s=1;s<nth;s++) {
+    i = (int)(((double) n * s)/nth);
+    if (i <= seg[ns-1]) continue;
+    while (i < n && r[i]==r[i-1]) i++; /* don't split ties */
+    if (i < n) { seg[ns] = i;ns++;}
+  }
+  seg[ns] = n;
+  return(ns);
+} /* cox_segments */
+
+static int cox_nthreads(int nthreads,int n) {
+/* number of threads to use for n data: not worth the overhead for few rows per thread */
+  int nth;
+  nth = mgcv_nthreads(nthreads);
+  if (nth > 1 + n/500) nth = 1 + n/500;
+  return(nth);
+} /* cox_nthreads */
+
+static void cox_risk_sets(int *sf,int *lv,int *r,int *e,int *so,int *st,int n,int nt) {
+/* Set up for (start, stop] risk sets and strata. Rows are in stratum blocks, and 
+   in reverse time order within each stratum. r[i] (1-based) is the index of row i's 
+   event/censoring time and row i is in the risk set for the times r[i] to e[i]-1 
+   (e[i] = nt+1, or the first time of the next stratum, for a row that never leaves 
+   the risk set). st[i] is the stratum code of row i. so is the (1-based) ordering 
+   of the rows by e. On exit: 
+   * sf[j] is 1 if time j is the first (latest) time in its stratum, and 0 otherwise. 
+     The risk set sums are reset to zero at such times.
+   * The rows leaving the risk set at time j (i.e. e-1==j) are so[lv[j]] to 
+     so[lv[j+1]-1] (lv has nt+1 elements). 
+*/
+  int i,j,k;
+  for (j=0;j<nt;j++) sf[j] = 0;
+  for (i=0;i<n;i++) if (i==0||st[i]!=st[i-1]) sf[r[i]-1] = 1;
+  for (k=0,j=0;j<=nt;j++) {
+    while (k < n && e[so[k]-1]-1 < j) k++;
+    lv[j] = k;
+  }
+} /* cox_risk_sets */
+
+void coxpp(double *eta,double *X,int *r, int *d,int *e,int *so,int *st,double *h,double *q,double *km, 
+           int *n,int *p, int *nt,int *nthreads) {
 /* Cox PH post-processing code computing 
    1. Baseline hazard + variance
    2. The a vectors used to compute the survival function variance.
 
    On entry 'eta' is X%*%beta - the linear predictor. rows of 'X' and 'eta'
-   are arranged in reverse time order. There are 'nt' unique times. 
+   are arranged in reverse time order (within strata). There are 'nt' unique times. 
    r[i] is the index of the unique time corresponding to row i of 'X'.
    The latest times have the lowest indices. Notionally tr[r[i]] is the 
    time corresponding to row i, although this functions does not use 'tr'.
-   'X' is 'n' by 'p'.
+   'X' is 'n' by 'p'. 'e', 'so' and 'st' define the (start, stop] risk sets
+   and strata, as described in cox_risk_sets. 
 
    On exit:
    *  X is over written with the 'a' vectors. Each is length 'p' and all
@@ -81,10 +167,14 @@ void coxpp(double *eta,double *X,int *r, int *d,double *h,double *q,double *km,
      -h[r+1]*eta ## r+1 to convert C indices to R indices.
 
    These ingredients are to be supplied to 'coxpred' to obtain the predicted 
-   survivor function for individuals. 
+   survivor function for individuals. For stratified data h, q, km and a are 
+   accumulated separately within each stratum.
+
+   The backward (b, gamma_p) and forward (a) running sums are computed by
+   segments of time in parallel using *nthreads threads (see cox_segments).
 */
-  double *b,*gamma_p,*gamma,*gamma_np,*bj,*bj1,*p1,*p2,gamma_i,*Xp,*aj,*aj1,x,y;
-  int *dc,i,j;
+  double *b,*gamma_p,*gamma,*gamma_np,*bj,*bj1,*p1,*p2,gamma_i,*Xp,*aj,*aj1,x,y,*off;
+  int *dc,i,j,j0,j1,k,s,ns,nth,*seg,*sf,*lv,*rs;
   b = (double *)R_chk_calloc((size_t) *nt * *p,sizeof(double)); /* storage for the b vectors */
   gamma_p = (double *)R_chk_calloc((size_t) *nt,sizeof(double)); 
   gamma_np = (double *)R_chk_calloc((size_t) *nt,sizeof(double));
@@ -92,71 +182,234 @@ void coxpp(double *eta,double *X,int *r, int *d,double *h,double *q,double *km,
   gamma = (double *)R_chk_calloc((size_t)*n,sizeof(double)); 
   if (*p>0) for (i=0;i<*n;i++) gamma[i] = exp(eta[i]);
   else for (p1=gamma,p2=p1 + *n;p1<p2;p1++) *p1 = 1.0;
-
-  bj1 = bj = b;
-  for (i=0,j=0;j<*nt;j++) { /* work back in time */
-    if (j>0) {
-      gamma_p[j] = gamma_p[j-1]; gamma_np[j] = gamma_np[j-1];
-      /* copy b^+_{j-1}, bj1, into b^+_j, bj */
-      for (p1=bj,p2=p1 + *p;p1<p2;p1++,bj1++) *p1 = *bj1;
+  sf = (int *)R_chk_calloc((size_t) *nt,sizeof(int));
+  lv = (int *)R_chk_calloc((size_t) *nt + 1,sizeof(int));
+  cox_risk_sets(sf,lv,r,e,so,st,*n,*nt);
+
+  nth = cox_nthreads(*nthreads,*n);
+  seg = (int *)R_chk_calloc((size_t) nth + 1,sizeof(int));
+  rs = (int *)R_chk_calloc((size_t) nth,sizeof(int)); /* does segment contain a reset? */
+  ns = cox_segments(seg,r,*n,nth);
+  off = (double *)R_chk_calloc((size_t) nth * (*p + 2),sizeof(double)); /* segment offsets */
+
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(s,i,j,j0,j1,k,bj,bj1,p1,p2,Xp,gamma_i) num_threads(nth)
+  #endif
+  { /* open parallel section */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=0;s<ns;s++) { /* running sums within each segment, starting from zero */
+      j0 = r[seg[s]] - 1; /* first time of segment */
+      for (i=seg[s];i<seg[s+1];) { /* work back in time */
+        j = r[i] - 1;bj = b + (ptrdiff_t) j * *p;
+        if (sf[j]) rs[s] = 1; /* new stratum: sums start again from zero */
+        else if (j>j0) {
+          gamma_p[j] = gamma_p[j-1]; gamma_np[j] = gamma_np[j-1];
+          /* copy b^+_{j-1}, bj1, into b^+_j, bj */
+          for (p1=bj,p2=p1 + *p,bj1 = bj - *p;p1<p2;p1++,bj1++) *p1 = *bj1;
+        }
+        while (i < seg[s+1] && r[i]==j+1) { /* accumulating this event's information */
+          gamma_i = gamma[i];
+          gamma_p[j] +=  gamma_i; gamma_np[j] += 1.0;
+          dc[j] += d[i]; /* count the events */
+          /* accumulate gamma[i]*X[i,] into bj */
+          for (p1=bj,p2=p1 + *p,Xp = X + i;p1<p2;p1++,Xp += *n) *p1 += *Xp * gamma_i; 
+          i++; /* increase the data counter */
+        }
+        if (!sf[j]) for (k=lv[j];k<lv[j+1];k++) { /* rows leaving the risk set */
+          gamma_i = gamma[so[k]-1];
+          gamma_p[j] -=  gamma_i; gamma_np[j] -= 1.0;
+          for (p1=bj,p2=p1 + *p,Xp = X + so[k] - 1;p1<p2;p1++,Xp += *n) *p1 -= *Xp * gamma_i; 
+        }
+      }
+    } /* segment loop */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp single
+    #endif
+    for (s=1;s<ns;s++) { /* scan the segment totals: off[s] is the total since the last reset before s */
+      j = r[seg[s]-1] - 1; /* last time of segment s-1 */
+      p1 = off + (ptrdiff_t) s * (*p + 2); p2 = p1 - *p - 2;
+      x = rs[s-1] ? 0.0 : 1.0;
+      p1[0] = x * p2[0] + gamma_p[j];p1[1] = x * p2[1] + gamma_np[j];
+      for (bj = b + (ptrdiff_t) j * *p,k=0;k < *p;k++) p1[k+2] = x * p2[k+2] + bj[k];
     }
-    while (i < *n && r[i]==j+1) { /* accumulating this event's information */
-      gamma_i = gamma[i];
-      gamma_p[j] +=  gamma_i; gamma_np[j] += 1.0;
-      dc[j] += d[i]; /* count the events */
-      /* accumulate gamma[i]*X[i,] into bj */
-      for (p1=bj,p2=p1 + *p,Xp = X + i;p1<p2;p1++,Xp += *n) *bj += *Xp * gamma_i; 
-      i++; /* increase the data counter */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=1;s<ns;s++) { /* complete the running sums of each segment, up to its first reset */
+      p1 = off + (ptrdiff_t) s * (*p + 2);
+      j0 = r[seg[s]] - 1;j1 = r[seg[s+1]-1];
+      for (j=j0;j<j1 && !sf[j];j++) {
+        gamma_p[j] += p1[0];gamma_np[j] += p1[1];
+        for (bj = b + (ptrdiff_t) j * *p,k=0;k < *p;k++) bj[k] += p1[k+2];
+      }
     }
-    bj += *p; /* move on to next b^+ vector */
-  } /* back in time loop done */
+  } /* end of parallel section */
   
   /* with gamma_p, dc and b computed, we can now do time forward accumulations 
-     of h, q and a... */
-  j = *nt - 1;
-  x =  dc[j]/gamma_p[j];h[j] = x;km[j] = dc[j]/gamma_np[j];
-  x /= gamma_p[j];q[j] = x;
-  i = j * *p;
-  for (aj=X+i,p1=aj+ *p,p2=b+i;aj<p1;p2++,aj++) *aj = *p1 * x;
-  for (j--;j>=0;j--) { /* back recursion, forwards in time */
+     of h, q and a... The accumulations restart at the last (earliest) time of 
+     each stratum, j, where j == nt-1 or sf[j+1]. */
+  for (j = *nt - 1;j>=0;j--) { /* back recursion, forwards in time */
     y = dc[j];
     x = y/gamma_p[j];
     y/=gamma_np[j];
-    h[j] = h[j+1] + x;
-    km[j] = km[j+1] + y; /* kaplan meier hazard estimate */
+    if (j == *nt - 1 || sf[j+1]) { h[j] = x;km[j] = y;} else {
+      h[j] = h[j+1] + x;
+      km[j] = km[j+1] + y; /* kaplan meier hazard estimate */
+    }
     x /= gamma_p[j];
-    q[j] = q[j+1] + x;
-    /* now accumulate the a vectors into X for return */
-    i = j * *p;
-    for (aj=X+i,aj1=p1=aj+ *p,p2=b+i;aj<p1;p2++,aj++) *aj = *aj1 + *p1 * x; 
+    q[j] = (j == *nt - 1 || sf[j+1]) ? x : q[j+1] + x;
   }
+  /* now accumulate the a vectors into X for return, a_j = a_{j+1} + b_j dc_j/gamma_p_j^2,
+     by equal segments of time, in parallel */
+  if (nth > *nt) nth = *nt;
+  for (s=0;s<nth;s++) rs[s] = 0;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(s,j,j0,j1,k,x,aj,aj1,p1,p2) num_threads(nth)
+  #endif
+  { /* open parallel section */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=0;s<nth;s++) { /* suffix sums within each segment */
+      j0 = (int)(((double) *nt * s)/nth);j1 = (int)(((double) *nt * (s+1))/nth);
+      for (j=j1-1;j>=j0;j--) {
+        x = dc[j]/gamma_p[j];x /= gamma_p[j];
+        k = j * *p;
+        if (j == *nt - 1 || sf[j+1]) rs[s] = 1; /* restart at the end of a stratum */
+        if (j==j1-1 || sf[j+1]) for (aj=X+k,p1=aj+ *p,p2=b+k;aj<p1;p2++,aj++) *aj = *p2 * x;
+        else for (aj=X+k,aj1=p1=aj+ *p,p2=b+k;aj<p1;p2++,aj++,aj1++) *aj = *aj1 + *p2 * x;
+      }
+    }
+    #ifdef SUPPORT_OPENMP
+    #pragma omp single
+    #endif
+    for (s=nth-2;s>=0;s--) { /* off[s] is the sum carried into the end of segment s */
+      j = (int)(((double) *nt * (s+1))/nth); /* first time of segment s+1 */
+      p1 = off + (ptrdiff_t) s * *p;p2 = p1 + *p;
+      x = (s==nth-2 || rs[s+1]) ? 0.0 : 1.0;
+      for (aj = X + (ptrdiff_t) j * *p,k=0;k < *p;k++) p1[k] = x * p2[k] + aj[k];
+    }
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=0;s<nth-1;s++) { /* complete the suffix sums, back to the first restart */
+      j0 = (int)(((double) *nt * s)/nth);j1 = (int)(((double) *nt * (s+1))/nth);
+      p1 = off + (ptrdiff_t) s * *p;
+      for (j=j1-1;j>=j0 && !sf[j+1];j--) for (aj = X + (ptrdiff_t) j * *p,k=0;k < *p;k++) aj[k] += p1[k];
+    }
+  } /* end of parallel section */
   R_chk_free(b);R_chk_free(gamma);R_chk_free(dc);
   R_chk_free(gamma_p);R_chk_free(gamma_np);
+  R_chk_free(seg);R_chk_free(off);R_chk_free(rs);R_chk_free(sf);R_chk_free(lv);
 } /* coxpp */
 
 
+static int cox_risk_size(int p,int n_sp,int nhh,int deriv) {
+/* length of the packed risk set sums used by coxlpl - see cox_risk_add */
+  int k1,k2,L;
+  k1 = deriv > 0 ? n_sp : 0;k2 = deriv > 2 ? nhh : 0;
+  L = 1 + k1 + k2;
+  if (deriv >= 0) L += p * (1 + k1 + k2); /* b_p and derivatives */
+  if (deriv > 2) L += p * (1 + k1 + k2); /* leading diagonal of A_p and derivatives */
+  return(L);
+} /* cox_risk_size */
+
+static void cox_risk_add(double *v,double *X,double *gamma,double *d1gamma,double *d2gamma,
+                         int i0,int nr,int n,int p,int n_sp,int nhh,int deriv) {
+/* Adds rows i0 to i0+nr-1 of n by p matrix X to the risk set sums packed in v.
+   v contains gamma_p, d1gamma_p (n_sp), d2gamma_p (nhh), then b_p (p), d1b_p
+   (p by n_sp), d2b_p (p by nhh), and finally the leading diagonals of A_p (p),
+   d1A_p (p by n_sp) and d2A_p (p by nhh). The d1 terms are only present if deriv>0,
+   the d2 and A_p terms only if deriv>2 and the b_p terms only if deriv>=0. Since
+   these are all sums over the risk set, the sums for several blocks of rows can
+   simply be added.
+*/
+  int i,l,m,off,one=1,k1,k2;
+  char trans='T',ntrans='N';
+  double done=1.0,xx,*b,*d1b,*d2b,*A,*d1A,*d2A,*p1;
+  if (nr < 1) return;
+  k1 = deriv > 0 ? n_sp : 0;k2 = deriv > 2 ? nhh : 0;
+  for (i=i0;i<i0+nr;i++) v[0] += gamma[i];
+  for (m=0;m<k1;m++) for (p1 = d1gamma + (ptrdiff_t) n * m,i=i0;i<i0+nr;i++) v[1+m] += p1[i];
+  for (off=0;off<k2;off++) for (p1 = d2gamma + (ptrdiff_t) n * off,i=i0;i<i0+nr;i++) v[1+k1+off] += p1[i];
+  if (deriv < 0 || p < 1) return;
+  b = v + 1 + k1 + k2;d1b = b + p;d2b = d1b + p * k1;
+  F77_CALL(dgemv)(&trans,&nr,&p,&done,X+i0,&n,gamma+i0,&one,&done,b,&one);
+  if (k1) F77_CALL(dgemm)(&trans,&ntrans,&p,&k1,&nr,&done,X+i0,&n,d1gamma+i0,&n,&done,d1b,&p);
+  if (k2) {
+    F77_CALL(dgemm)(&trans,&ntrans,&p,&k2,&nr,&done,X+i0,&n,d2gamma+i0,&n,&done,d2b,&p);
+    A = d2b + p * k2;d1A = A + p;d2A = d1A + p * k1;
+    for (l=0;l<p;l++) for (p1 = X + (ptrdiff_t) n * l,i=i0;i<i0+nr;i++) {
+      xx = p1[i];xx *= xx;
+      A[l] += gamma[i] * xx;
+      for (m=0;m<k1;m++) d1A[l + p * m] += d1gamma[i + (ptrdiff_t) n * m] * xx;
+      for (off=0;off<k2;off++) d2A[l + p * off] += d2gamma[i + (ptrdiff_t) n * off] * xx;
+    } 
+  }
+} /* cox_risk_add */
 
-void coxlpl(double *eta,double *X,int *r, int *d,double *tr, 
+static void cox_risk_drop(double *v,double *X,double *gamma,double *d1gamma,double *d2gamma,
+                          int *ii,int nr,int n,int p,int n_sp,int nhh,int deriv) {
+/* Removes rows ii[0] to ii[nr-1] (1-based indices) of X from the risk set sums packed
+   in v (see cox_risk_add). These are the rows leaving the risk set at some time for
+   (start, stop] data, which are not contiguous in X.
+*/
+  int i,k,l,m,off,k1,k2;
+  double gi,xx,*b,*d1b,*d2b,*A,*d1A,*d2A,*Xi;
+  k1 = deriv > 0 ? n_sp : 0;k2 = deriv > 2 ? nhh : 0;
+  b = v + 1 + k1 + k2;d1b = b + p;d2b = d1b + p * k1;
+  A = d2b + p * k2;d1A = A + p;d2A = d1A + p * k1;
+  for (k=0;k<nr;k++) {
+    i = ii[k] - 1;gi = gamma[i];
+    v[0] -= gi;
+    for (m=0;m<k1;m++) v[1+m] -= d1gamma[i + (ptrdiff_t) n * m];
+    for (off=0;off<k2;off++) v[1+k1+off] -= d2gamma[i + (ptrdiff_t) n * off];
+    if (deriv < 0) continue;
+    for (Xi = X + i,l=0;l<p;l++) {
+      xx = Xi[(ptrdiff_t) n * l];
+      b[l] -= gi * xx;
+      for (m=0;m<k1;m++) d1b[l + p * m] -= d1gamma[i + (ptrdiff_t) n * m] * xx;
+      for (off=0;off<k2;off++) d2b[l + p * off] -= d2gamma[i + (ptrdiff_t) n * off] * xx;
+      if (k2) {
+        xx *= xx;
+        A[l] -= gi * xx;
+        for (m=0;m<k1;m++) d1A[l + p * m] -= d1gamma[i + (ptrdiff_t) n * m] * xx;
+        for (off=0;off<k2;off++) d2A[l + p * off] -= d2gamma[i + (ptrdiff_t) n * off] * xx;
+      }
+    }
+  }
+} /* cox_risk_drop */
+
+void coxlpl(double *eta,double *X,int *r, int *d,int *e,int *so,int *st,double *tr, 
             int *n,int *p, int *nt,double *lp,double *g,double *H,
             double *d1beta,
             double *d1H,
             double *d2beta,
             double *d2H,
-            int *n_sp,int *deriv)
+            int *n_sp,int *deriv,int *nthreads)
 /* rows of n by p model matrix X are arranged in decreasing order
    of time. The unique event times are in nt vector tr in time reverse order.
    The ith row of X corresponds to event time tr[r[i]]. If d[i] is 0 then the 
    event is censoring. 
 
+   For (start, stop] data row i is in the risk set for times tr[r[i]] to tr[e[i]-1],
+   and for stratified data the rows are in blocks for each stratum, stratum codes 
+   st, each block in reverse time order. See cox_risk_sets. So the risk set sums are 
+   updated incrementally as rows enter and leave the risk set, and reset at the start 
+   of each stratum. The unique times are then unique within strata. For right 
+   censored, unstratified data e[i] = nt + 1 and st[i] = 1.   
+
    On output:
    lp is the log partial likelihood.
    g is the p vector of derivatives of lp w.r.t. beta.
    H is the p by p second derivative matrix of lp wrt beta
-   
+
    The d1* are the derivatives of H and beta wrt rho=log(lambda), 
    the log smoothing parameters. In each case there are n_sp replicates
    of the same dimension as the original object stored end to end. 
-   
+
    The d1* & d2* are unused unless deriv is non-zero. d1/2beta contains the derivatives
    of beta wrt the log smoothing parameters, on entry.
 
@@ -184,21 +437,37 @@ void coxlpl(double *eta,double *X,int *r, int *d,double *tr,
 
    d2H contains second derivatives of the leading diagonal of H, only.
 
+   *nthreads threads are used: the time loop is split into segments of time
+   (see cox_segments), and each thread accumulates its own contributions to
+   g, H and derivatives, which are summed at the end.
 */
 
-{ int dr,i,j,tB=0,tC=0,k,l,m,off,nhh;
-  double lpl=0.0,*gamma,gamma_p=0.0,
+{ int dr,i,j,tB=0,tC=0,k,l,m,off,nhh=0,i0,nr,nb,nc,cs=256,one=1,ti,te,k1,k2,L,nth,ns,s,
+    *seg,nd1H=0,nd2H=0,nacc,nblock,ib,tid=0,*sf,*lv,*rs,jr;
+  char trans='T',ntrans='N',uplo='U';
+  double lpl,*gamma,gamma_p,
     eta_sum,
-    *b_p,*A_p,*p1,*p2,*p3,*p4,
+    *b_p,*p1,*p2,*p3,*p4,
     *d1gamma,
-    *d1gamma_p,*d1eta,xx,xx0,xx1,xx2,xx3,*d1b_p,*d1A_p,
+    *d1gamma_p,*d1eta,xx,xx0,xx1,xx2,xx3,*d1b_p,
     *d2eta,*d2gamma,*d2gamma_p,*d2b_p,
-    *d2ldA_p;
+    *d2ldA_p,*A_p,*d1A_p,*S,*T,*Bs,*Zs,*WX,*u,done=1.0,dmone=-1.0,
+    *v,*w,*lpa,*acc,**Ha,**d1Ha,**d2Ha,**ga,*Hs,*d1Hs,*d2Hs,*Bss,*Zss,*WXs,*us;
+  d1eta=d1gamma=d2eta=d2gamma=NULL;
+  T=Bs=Zs=acc=NULL;
+
+  nth = cox_nthreads(*nthreads,*n);
+  seg = (int *)R_chk_calloc((size_t) nth + 1,sizeof(int));
+  ns = cox_segments(seg,r,*n,nth); /* time segments for parallel accumulation */
+  rs = (int *)R_chk_calloc((size_t) ns,sizeof(int)); /* does segment contain a reset? */
+  sf = (int *)R_chk_calloc((size_t) *nt,sizeof(int));
+  lv = (int *)R_chk_calloc((size_t) *nt + 1,sizeof(int));
+  cox_risk_sets(sf,lv,r,e,so,st,*n,*nt);
+
   gamma = (double *)R_chk_calloc((size_t)*n,sizeof(double)); 
-  if (*deriv >=0) {
-    b_p = (double *)R_chk_calloc((size_t)*p,sizeof(double));
-    A_p = (double *)R_chk_calloc((size_t)(*p * *p),sizeof(double));
-  }
+  S = (double *)R_chk_calloc((size_t)*nt + 1,sizeof(double)); /* dr/gamma_p at each time */
+  if (*deriv >=0) Bs = (double *)R_chk_calloc((size_t)(ns * cs * *p),sizeof(double)); /* event time blocks of b_p vectors */
+
   /* form exponential of l.p. */
 
   for (i=0;i<*n;i++) gamma[i] = exp(eta[i]);
@@ -206,25 +475,24 @@ void coxlpl(double *eta,double *X,int *r, int *d,double *tr,
   if (*deriv>0) { /* prepare for first derivatives */
     /* Get basic first derivatives given d1beta */
     d1eta = (double *)R_chk_calloc((size_t)(*n * *n_sp),sizeof(double));
-    mgcv_mmult(d1eta,X,d1beta,&tB,&tC,n,n_sp,p);
+    mgcv_pmmult(d1eta,X,d1beta,&tB,&tC,n,n_sp,p,&nth);
     p1=d1gamma = (double *)R_chk_calloc((size_t)(*n * *n_sp),sizeof(double));
     p2=d1eta;
     for (j=0;j<*n_sp;j++) 
     for (i=0;i<*n;i++) {
 	*p1 = *p2 * gamma[i]; p1++; p2++;
-    }
-    /* accumulation storage */
-    d1gamma_p = (double *)R_chk_calloc((size_t)*n_sp,sizeof(double));
-    d1b_p = (double *)R_chk_calloc((size_t)(*n_sp * *p),sizeof(double));   
+    } 
+    T = (double *)R_chk_calloc((size_t)((*nt + 1) * *n_sp),sizeof(double)); /* dr d1gamma_p/gamma_p^2 */
+    if (*deriv>1) Zs = (double *)R_chk_calloc((size_t)(ns * cs * *p * *n_sp),sizeof(double));
   }
 
   if (*deriv>2) { /* prepare for second derivative calculations */
     /* Basic second derivative derived from d2beta */ 
     nhh = *n_sp * (*n_sp+1) / 2; /* elements in `half hessian' */
     d2eta  = (double *)R_chk_calloc((size_t)(*n * nhh),sizeof(double));
-     
-    mgcv_mmult(d2eta,X,d2beta,&tB,&tC,n,&nhh,p);
-   
+
+    mgcv_pmmult(d2eta,X,d2beta,&tB,&tC,n,&nhh,p,&nth);
+
     p1=d2gamma  = (double *)R_chk_calloc((size_t)(*n * nhh),sizeof(double));
     p2=d2eta;
     for (j=0;j<*n_sp;j++) {  /* create d2gamma */
@@ -237,105 +505,128 @@ void coxlpl(double *eta,double *X,int *r, int *d,double *tr,
         }
       }
     } /* end of d2gamma loop */  
-    /* accumulation storage */
-    d2gamma_p = (double *)R_chk_calloc((size_t) nhh,sizeof(double));
-    d2b_p = (double *)R_chk_calloc((size_t)( nhh * *p),sizeof(double));
   }
 
   if (*deriv>0) { /* Derivatives of H are required */
-    /* create storage for accumulating derivatives */
-    d1A_p = (double *)R_chk_calloc((size_t)(*n_sp * *p * *p),sizeof(double));
     /* clear incoming storage */
-    for (j = *n_sp * *p * *p,k=0;k<j;k++) d1H[k] = 0.0;
+    if (*deriv==1) nd1H = *n_sp * *p; else nd1H = *n_sp * *p * *p;
+    for (j=0;j<nd1H;j++) d1H[j] = 0.0;
     /* note that only leading diagonal of d2H is obtained and stored */ 
-    if (*deriv>2) {   
-      d2ldA_p = (double *)R_chk_calloc((size_t)(nhh * *p),sizeof(double));
-      for (j = nhh * *p,k=0;k<j;k++) d2H[k] = 0.0; 
-    }
+    if (*deriv>2) { nd2H = nhh * *p;for (k=0;k<nd2H;k++) d2H[k] = 0.0;}
   }
 
-  /* now accumulate the log partial likelihood */
-  lpl=0.0;
+  /* The Hessian and its derivatives involve two sorts of term. Those involving
+     A_p = \sum_{i in risk set} gamma_i x_i x_i' (and its derivatives) at each 
+     event time can be re-ordered as a single weighted cross product over the 
+     data, X'diag(w)X, where w_i is gamma_i times a sum over the event 
+     times for which i is in the risk set (a difference of suffix sums). These are computed by blocks of rows 
+     of X using level 3 BLAS, once the time loop has given the suffix sums. The 
+     terms involving b_p b_p' are accumulated by BLAS rank-k updates using blocks 
+     of cs event times, within the time loop. So there is no O(p^2) work per datum. */
+
   for (k=0;k<*p;k++) g[k] =0.0; 
   for (k = 0;k < *p;k++) for (m = 0;m < *p ;m++)  H[k + *p * m] = 0.0;
-  i=0; /* the row index */
-
-  for (j=0;j<*nt;j++) { /* work back in time */
-    eta_sum=0.0;
-    dr=0;
-    while (i < *n && r[i]==j+1) { /* accumulating this event's information */
-      /* lpl part first */ 
-      gamma_p += gamma[i];
-      if (d[i]==1) { dr++;eta_sum+=eta[i];}
-      /* now the first derivatives */
-      if (*deriv >= 0) {
-        for (k=0;k<*p;k++) b_p[k] += gamma[i]*X[i + *n * k];
-        if (d[i]==1) for (k=0;k<*p;k++) g[k] += X[i + *n * k];
-        /* and second derivatives */
-        for (k = 0;k < *p;k++) for (m = k;m < *p ;m++)
-	    A_p[k + *p *m] +=  gamma[i]*X[i + *n * k] * X[i + *n * m];
-      }
-      /* derivatives w.r.t. smoothing parameters */
-      if (*deriv >0 ) { /* first derivative stuff only */
-        for (k=0;k<*n_sp;k++) d1gamma_p[k] += d1gamma[i + *n * k];
-        for (m=0;m<*n_sp;m++) {
-          xx = d1gamma[i + *n * m];
-          for (k=0;k<*p;k++) d1b_p[k + *p * m] += xx * X[i + *n * k];
-        }
-      } /* end of first derivative accumulation */
-    
-      if (*deriv>2) { /* second derivative accumulation */
-         off = 0;         
-         for (m=0;m<*n_sp;m++)   
-         for (k=m;k<*n_sp;k++) { /* second derivates loop */
-	      d2gamma_p[off] += d2gamma[i+ off * *n];
-              for (l=0;l<*p;l++) 
-              d2b_p[l + off * *p] +=  d2gamma[i+ off * *n] * X[i + *n * l];
-              off++;
-         } /* end k-loop */
-      }
 
-      if (*deriv>0) { /* H derivatives needed */	                
-          for (m=0;m<*n_sp;m++) { /* First derivatives of A_p */
-	      xx = d1gamma[i + *n * m];
-              for (k = 0;k < *p;k++) for (l = k;l < *p ;l++) 
-              d1A_p[k + *p * l + m * *p * *p] += xx * X[i + *n * k] * X[i + *n * l];             
+  /* Thread/segment specific accumulators for g, H, d1H and d2H. The first
+     set is the output storage itself. */
+  Ha = (double **)R_chk_calloc((size_t) nth,sizeof(double *));
+  d1Ha = (double **)R_chk_calloc((size_t) nth,sizeof(double *));
+  d2Ha = (double **)R_chk_calloc((size_t) nth,sizeof(double *));
+  ga = (double **)R_chk_calloc((size_t) nth,sizeof(double *));
+  Ha[0] = H;d1Ha[0] = d1H;d2Ha[0] = d2H;ga[0] = g;
+  nacc = *p * *p + nd1H + nd2H + *p;
+  if (nth > 1 && *deriv >= 0) {
+    acc = (double *)R_chk_calloc((size_t) (nth - 1) * nacc,sizeof(double));
+    for (p1=acc,s=1;s<nth;s++,p1 += nacc) {
+      Ha[s] = p1;d1Ha[s] = p1 + *p * *p;d2Ha[s] = d1Ha[s] + nd1H;ga[s] = d2Ha[s] + nd2H;
+    } 
+  }
+  lpa = (double *)R_chk_calloc((size_t) ns,sizeof(double));
+
+  /* Risk set sums at the start of each segment. v + s*L is for segment s. */
+  k1 = *deriv > 0 ? *n_sp : 0;k2 = *deriv > 2 ? nhh : 0;
+  L = cox_risk_size(*p,*n_sp,nhh,*deriv);
+  v = (double *)R_chk_calloc((size_t) (ns + 1) * L,sizeof(double));
+  w = (double *)R_chk_calloc((size_t) ns * L,sizeof(double)); /* running sums for each segment */
+
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(s,i,j,jr,k,l,m,off,i0,dr,nc,eta_sum,lpl,gamma_p,d1gamma_p,d2gamma_p,b_p,d1b_p,d2b_p,A_p,d1A_p,d2ldA_p,Hs,d1Hs,d2Hs,Bss,Zss,p1,xx,xx0,xx1,xx2,xx3) num_threads(nth)
+  #endif
+  { /* open parallel section */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=0;s<ns;s++) { /* risk set sums for each segment, since its last reset */
+      j = r[seg[s+1]-1] - 1; /* last time of segment */
+      for (jr = j;jr >= r[seg[s]] - 1 && !sf[jr];jr--);
+      if (jr >= r[seg[s]] - 1) rs[s] = 1; else jr = r[seg[s]] - 1;
+      for (i=seg[s];r[i]-1 < jr;i++); /* first row of time jr */
+      cox_risk_add(v + (ptrdiff_t) (s+1) * L,X,gamma,d1gamma,d2gamma,i,seg[s+1]-i,*n,*p,*n_sp,nhh,*deriv);
+      if (sf[jr]) jr++; /* rows leaving at a reset are from the previous stratum */
+      if (jr <= j) cox_risk_drop(v + (ptrdiff_t) (s+1) * L,X,gamma,d1gamma,d2gamma,so + lv[jr],lv[j+1]-lv[jr],
+                                 *n,*p,*n_sp,nhh,*deriv);
+    }
+    /* scan over the segment totals, so that v + s*L contains the sums over segments before s, 
+       since the last reset */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (k=0;k<L;k++) for (s=1;s<=ns;s++) if (!rs[s-1]) v[k + (ptrdiff_t) s * L] += v[k + (ptrdiff_t) (s-1) * L];
+
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (s=0;s<ns;s++) { /* the final pass through the event times of each segment */
+      p1 = w + (ptrdiff_t) s * L;
+      for (k=0;k<L;k++) p1[k] = v[k + (ptrdiff_t) s * L]; /* risk set sums at segment start */
+      d1gamma_p = p1 + 1;d2gamma_p = d1gamma_p + k1;
+      b_p = d2gamma_p + k2;d1b_p = b_p + *p;d2b_p = d1b_p + *p * k1;
+      A_p = d2b_p + *p * k2;d1A_p = A_p + *p;d2ldA_p = d1A_p + *p * k1;
+      Hs = Ha[s];d1Hs = d1Ha[s];d2Hs = d2Ha[s];
+      Bss = Bs ? Bs + (ptrdiff_t) s * cs * *p : NULL;
+      Zss = Zs ? Zs + (ptrdiff_t) s * cs * *p * *n_sp : NULL;
+      lpl = 0.0;nc = 0;
+      for (i=seg[s];i<seg[s+1];) { /* work back in time */
+        j = r[i] - 1;
+        eta_sum=0.0;
+        dr=0;i0=i;
+        while (i < seg[s+1] && r[i]==j+1) { /* accumulating this event's information */
+          if (d[i]==1) { dr++;eta_sum+=eta[i];}
+          i++;
+        } /* finished getting this event's information */
+        /* update the risk set sums for the rows tied at this time, and those leaving */
+        if (sf[j]) for (k=0;k<L;k++) p1[k] = 0.0; /* start of a stratum */
+        cox_risk_add(p1,X,gamma,d1gamma,d2gamma,i0,i-i0,*n,*p,*n_sp,nhh,*deriv);
+        if (!sf[j]) cox_risk_drop(p1,X,gamma,d1gamma,d2gamma,so + lv[j],lv[j+1]-lv[j],*n,*p,*n_sp,nhh,*deriv);
+        gamma_p = p1[0];
+
+        lpl += eta_sum - dr * log(gamma_p);
+        S[j] = dr/gamma_p;
+        if (*deriv>0) for (m=0;m<*n_sp;m++) T[j + (*nt + 1) * m] = S[j] * d1gamma_p[m]/gamma_p;
+
+        if (*deriv>=0 && dr>0) { /* b_p b_p' terms of H and its derivatives */
+          xx1 = dr/(gamma_p*gamma_p);xx = sqrt(xx1);
+          for (l=0;l<*p;l++) Bss[nc + cs * l] = xx * b_p[l];
+          if (*deriv>1) for (m=0;m<*n_sp;m++) {
+            xx0 = d1gamma_p[m]/gamma_p;
+            for (p2 = Zss + cs * *p * m + nc,l=0;l<*p;l++,p2 += cs) *p2 = xx * (d1b_p[l + *p * m] - xx0 * b_p[l]);
+          } else if (*deriv==1) for (m=0;m<*n_sp;m++) { /* leading diagonal only */
+            xx0 = d1gamma_p[m]/gamma_p;
+            for (l=0;l<*p;l++) d1Hs[l + *p * m] += 2 * xx1 * (d1b_p[l + *p * m] - xx0 * b_p[l]) * b_p[l];
           }
-          if (*deriv>2) {      
-            off = 0;         
-            for (m=0;m<*n_sp;m++)   
-	    for (k=m;k<*n_sp;k++) { /* second derivates of leading diagonal of A_p loop */
-                for (l=0;l<*p;l++) 
-                d2ldA_p[l + off * *p] +=  d2gamma[i+ off * *n] * X[i + *n * l] * X[ i + *n *l];
-                off++;
-            } /* end m/k -loop */
-	  }        
-      }
-
-      i++;
-    } /* finished getting this event's information */
+          nc++;
+        }
 
-    lpl += eta_sum - dr * log(gamma_p);
-    if (*deriv>=0) {
-      for (k=0;k<*p;k++) g[k] += - dr/gamma_p * b_p[k]; 
-      for (k = 0;k < *p;k++) for (m = k;m < *p ;m++) 
-      H[k + *p * m] += - dr * A_p[k + *p *m] /gamma_p +
-        	        dr * b_p[k]*b_p[m]/(gamma_p*gamma_p); 
-    }
+        if ((nc==cs || (i == seg[s+1] && nc>0)) && *p>0) { /* flush the block of event time terms */
+          /* H += \sum_j dr_j b_p b_p'/gamma_p^2 */
+          F77_CALL(dsyrk)(&uplo,&trans,p,&nc,&done,Bss,&cs,&done,Hs,p);
+          /* d1H_m += \sum_j dr_j/gamma_p^2 (z b_p' + b_p z'), z = d1b_p - d1gamma_p b_p/gamma_p */
+          if (*deriv>1) for (m=0;m<*n_sp;m++)
+            F77_CALL(dsyr2k)(&uplo,&trans,p,&nc,&done,Zss + cs * *p * m,&cs,Bss,&cs,&done,d1Hs + *p * *p * m,p);
+          nc=0;
+        }
 
-    if (*deriv>0) { /* need derivatives of H */
-        for (m=0;m<*n_sp;m++) { /* first derivatives of H */
-	    xx0 =dr/gamma_p;
-            xx = d1gamma_p[m]*xx0/gamma_p;        
-            xx1 = xx0/gamma_p;
-            xx2 = xx1*2*d1gamma_p[m]/gamma_p;
-            for (k = 0;k < *p;k++) for (l = k;l < *p ;l++) {
-		off = k + *p * l + m * *p * *p;
-                d1H[off] += xx1 * (d1b_p[k + *p *m] * b_p[l] + b_p[k] * d1b_p[l + *p *m]) -
-		    xx2 * b_p[k] * b_p[l] + xx * A_p[k + *p * l] - xx0 * d1A_p[off];
-            }
-        } /* m-loop end */
-        if (*deriv>2) {
+        if (*deriv>2 && dr>0) { /* second derivatives of leading diagonal of H */
           xx = dr/gamma_p;
           xx0 = xx/gamma_p; /* dr/gamma_p^2 */
           xx1 = xx0/gamma_p; /* dr/gamma_p^3 */
@@ -345,26 +636,89 @@ void coxlpl(double *eta,double *X,int *r, int *d,double *tr,
 	    xx3 = -2*xx1*d1gamma_p[m];
 	    for (k=m;k<*n_sp;k++) { /* second derivates of leading diagonal of H */
               for (l=0;l<*p;l++) {
-		  d2H[l + off * *p] += xx3 * (A_p[l + *p *l] * d1gamma_p[k] + 
+		  d2Hs[l + off * *p] += xx3 * (A_p[l] * d1gamma_p[k] +
                                               2 * d1b_p[l + *p * k] * b_p[l]) + 
-		                       xx0 * (d1A_p[l + l * *p + m * *p * *p] * d1gamma_p[k] 
-                                              + A_p[l + *p * l] * d2gamma_p[off] + 
+		                       xx0 * (d1A_p[l + m * *p] * d1gamma_p[k] 
+                                              + A_p[l] * d2gamma_p[off] + 
                                               d2b_p[l + off * *p] * b_p[l] + 
                                               2 * d1b_p[l + *p * k] * d1b_p[ l + *p * m] + 
 		                              b_p[l] * d2b_p[l + off * *p]) +
-                                       xx0 * d1gamma_p[m] * d1A_p[l + l * *p + k * *p * *p] -
+                                       xx0 * d1gamma_p[m] * d1A_p[l + k * *p] -
                                        xx * d2ldA_p[l + off * *p] + 
                                        6 * xx2 * d1gamma_p[m] * b_p[l] * b_p[l] * d1gamma_p[k] -
 		                       2 * xx1 * (2*d1b_p[l + *p * m] * b_p[l] * d1gamma_p[k] +
 						  b_p[l]*b_p[l]*d2gamma_p[off]);
-               
+
               }
               off++;
             } /* end k -loop */    
 	  } /* end m - loop */
         } /* end if (*deriv>2) */
-     } /* end of H derivatives */
-  } /* end of j loop (work back in time) */
+      } /* end of time loop (work back in time) */
+      lpa[s] = lpl;
+    } /* end of segment loop */
+  } /* end of parallel section */
+  for (lpl=0.0,s=0;s<ns;s++) lpl += lpa[s];
+
+  if (*deriv>=0 && *p>0) { /* the A_p terms, via weighted cross products of X */ 
+    /* suffix sums over time, S[j] = \sum_{k>=j} dr_k/gamma_p[k], and similarly T. 
+       Row i is in the risk set for times r[i]-1 to e[i]-2, so its weights involve 
+       S[r[i]-1] - S[e[i]-1] (S[nt] = 0). */
+    for (j = *nt-2;j>=0;j--) S[j] += S[j+1];
+    if (*deriv>0) for (m=0;m<*n_sp;m++) for (p1 = T + (*nt + 1) * m,j = *nt-2;j>=0;j--) p1[j] += p1[j+1];
+    nb = 1024; if (nb > *n) nb = *n;
+    nblock = (*n + nb - 1)/nb;
+    WX = (double *)R_chk_calloc((size_t)(nth * nb * *p),sizeof(double));
+    u = (double *)R_chk_calloc((size_t)(nth * nb),sizeof(double));
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(ib,i0,nr,i,k,ti,te,l,m,p1,p2,xx,tid,WXs,us) num_threads(nth) schedule(static)
+    #endif
+    for (ib=0;ib<nblock;ib++) { /* blocks of rows */
+      #ifdef SUPPORT_OPENMP
+      tid = omp_get_thread_num(); /* thread running this bit */
+      #endif
+      WXs = WX + (ptrdiff_t) tid * nb * *p;us = u + tid * nb;
+      i0 = ib * nb;nr = *n - i0; if (nr > nb) nr = nb;
+      /* g = \sum_{d_i=1} x_i - \sum_j dr_j b_p/gamma_p = X'(d - gamma S) */
+      for (i=0;i<nr;i++) { k = i0 + i;us[i] = (d[k]==1 ? 1.0 : 0.0) - gamma[k] * (S[r[k]-1] - S[e[k]-1]);}
+      F77_CALL(dgemv)(&trans,&nr,p,&done,X+i0,n,us,&one,&done,ga[tid],&one);
+      /* H -= \sum_j dr_j A_p/gamma_p = X'diag(gamma S)X */
+      for (i=0;i<nr;i++) { k = i0 + i;xx = S[r[k]-1] - S[e[k]-1];us[i] = xx > 0 ? sqrt(gamma[k] * xx) : 0.0;}
+      for (l=0;l<*p;l++) for (p1=WXs + nb * l,p2 = X + i0 + (ptrdiff_t) *n * l,i=0;i<nr;i++) p1[i] = p2[i] * us[i];
+      F77_CALL(dsyrk)(&uplo,&trans,p,&nr,&dmone,WXs,&nb,&done,Ha[tid],p);
+      /* d1H_m += \sum_j (dr_j d1gamma_p/gamma_p^2 A_p - dr_j/gamma_p d1A_p) = X'diag(v)X */ 
+      if (*deriv>0) for (m=0;m<*n_sp;m++) { 
+        for (i=0;i<nr;i++) { 
+          k = i0 + i;ti = r[k] - 1 + (*nt + 1) * m;te = e[k] - 1 + (*nt + 1) * m;
+          us[i] = gamma[k] * (T[ti] - T[te]) - d1gamma[k + *n * m] * (S[r[k]-1] - S[e[k]-1]);
+        }
+        if (*deriv==1) for (l=0;l<*p;l++) { /* leading diagonal only */
+          for (xx=0.0,p2 = X + i0 + (ptrdiff_t) *n * l,i=0;i<nr;i++) xx += p2[i] * p2[i] * us[i];
+          d1Ha[tid][l + *p * m] += xx;
+        } else { 
+          for (l=0;l<*p;l++) for (p1=WXs + nb * l,p2 = X + i0 + (ptrdiff_t) *n * l,i=0;i<nr;i++) p1[i] = p2[i] * us[i];
+          F77_CALL(dgemm)(&trans,&ntrans,p,p,&nr,&done,X+i0,n,WXs,&nb,&done,d1Ha[tid] + *p * *p * m,p);
+        }
+      }
+    } 
+    R_chk_free(WX);R_chk_free(u);
+  }
+
+  if (acc) { /* sum the thread specific accumulators into the output storage */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(k,s) num_threads(nth) schedule(static)
+    #endif
+    for (k=0;k < *p * *p;k++) for (s=1;s<nth;s++) H[k] += Ha[s][k];
+    for (s=1;s<nth;s++) {
+      for (k=0;k < *p;k++) g[k] += ga[s][k];
+      for (k=0;k < nd2H;k++) d2H[k] += d2Ha[s][k];
+    } 
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(k,s) num_threads(nth) schedule(static)
+    #endif
+    for (k=0;k < nd1H;k++) for (s=1;s<nth;s++) d1H[k] += d1Ha[s][k];
+    R_chk_free(acc);
+  }
 
   for (k=0;k<*p;k++) for (m=0;m<k;m++) H[k + *p *m] = H[m + *p *k];
   if (*deriv>1) for (m=0;m<*n_sp;m++) {
@@ -372,23 +726,22 @@ void coxlpl(double *eta,double *X,int *r, int *d,double *tr,
     for (k = 0;k < *p;k++) for (l = 0;l < k ;l++) 
 	d1H[k + *p * l + off] = d1H[l + *p * k + off];
   }
- 
-  if (*deriv>=0) { R_chk_free(A_p);R_chk_free(b_p);}
-  R_chk_free(gamma);
+
+  if (*deriv>=0) R_chk_free(Bs);
+  R_chk_free(gamma);R_chk_free(S);R_chk_free(seg);R_chk_free(rs);R_chk_free(sf);R_chk_free(lv);R_chk_free(v);R_chk_free(w);R_chk_free(lpa);
+  R_chk_free(Ha);R_chk_free(d1Ha);R_chk_free(d2Ha);R_chk_free(ga);
 
   if (*deriv > 0) { /* clear up first derivative storage */
-    R_chk_free(d1eta);R_chk_free(d1gamma);
-    R_chk_free(d1gamma_p);R_chk_free(d1b_p);
-    R_chk_free(d1A_p);
+    R_chk_free(d1eta);R_chk_free(d1gamma);R_chk_free(T);
+    if (*deriv>1) R_chk_free(Zs);
   }
 
   if (*deriv > 2) { /* clear up second derivative storage */
     R_chk_free(d2eta);R_chk_free(d2gamma);
-    R_chk_free(d2gamma_p);R_chk_free(d2b_p);
-    R_chk_free(d2ldA_p);    
   }
   *lp = lpl;
 } /* end coxlpl */
 
 
 
+
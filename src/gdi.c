@@ -19,6 +19,7 @@ USA. */
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <R.h>
 #include <Rconfig.h>
 #ifdef SUPPORT_OPENMP
@@ -26,6 +27,7 @@ USA. */
 #endif
 #define ANSI
 /*#define DEBUG*/
+#include "general.h"
 #include "mgcv.h"
 
 
@@ -642,6 +644,141 @@ void get_detS2(double *sp,double *sqrtS, int *rSncol, int *q,int *M, int * deriv
 
 
 
+/* get_stableS is called repeatedly with the same square root penalties during 
+   smoothing parameter estimation. The partition of the terms into successive 
+   dominant sets depends on sp only via the ordering of the frob[i]*sp[i], while 
+   the S_i at each level, their Frobenius norms and the null space basis at each 
+   level do not depend on sp at all, given the partition. So these are cached, 
+   and when the partition is unchanged only the eigen-decomposition of the dominant 
+   term within its (cached) range space has to be recomputed: r by r rather than 
+   Q by Q. The rank determining eigen-decomposition and the S_i transforms are 
+   skipped altogether. A few entries are kept, as `fast-REML' re-parameterizes 
+   several blocks in turn. 
+
+   Cached bases are never updated from results, so within a fit the output 
+   depends only on the sp of the call that filled the entry. The cache is 
+   emptied from R (stableS_cache_clear via .C) at the start and end of each 
+   gam or bam fit, so that identical fits give identical results, and memory 
+   is not held between fits. It is only accessed from .C calls on the main 
+   thread, never from parallel sections. 
+*/
+
+#define STABLES_CACHE_N 4          /* number of cached partitions */
+#define STABLES_CACHE_MAX 4194304  /* maximum doubles stored over all entries (32Mb) */
+
+typedef struct { /* one level of the similarity transform partition */
+  int Q,r,     /* block dimension at this level and rank of the dominant term */
+    *alpha,    /* alpha[i] is 1 if term i is dominant at this level */ 
+    *gamma;    /* gamma[i] is 1 if term i is still to be dealt with at this level */
+  double *frob,/* Frobenius norms of the S_i at this level */
+    *Si,       /* the Q by Q S_i at this level, packed as in get_stableS */
+    *U;        /* range space eigenvectors (first r columns) and null space basis */
+} stableS_level_type;
+
+typedef struct { 
+  int q,Mf,*rSncol,n_level;
+  double *rS,d_tol,r_tol; /* key: untransformed square roots and tolerances */
+  unsigned long stamp;    /* last use, for least recently used replacement */ 
+  size_t size;            /* number of doubles stored */
+  stableS_level_type *level;
+} stableS_cache_type;
+
+static stableS_cache_type stableS_cache[STABLES_CACHE_N];
+static unsigned long stableS_stamp=0;
+
+static void stableS_cache_free_entry(stableS_cache_type *c) {
+  int l;
+  if (c->level==NULL) return;
+  for (l=0;l<c->n_level;l++) { 
+    R_chk_free(c->level[l].alpha);R_chk_free(c->level[l].gamma);
+    R_chk_free(c->level[l].frob);R_chk_free(c->level[l].Si);
+    if (c->level[l].U) R_chk_free(c->level[l].U);
+  }
+  R_chk_free(c->level);R_chk_free(c->rS);R_chk_free(c->rSncol);
+  c->level=NULL;c->n_level=0;c->size=0;
+}
+
+void stableS_cache_clear(void) 
+/* frees all cached get_stableS partitions: called from R at the start and 
+   end of each fit, and on unloading */
+{ int i;
+  for (i=0;i<STABLES_CACHE_N;i++) stableS_cache_free_entry(stableS_cache+i);
+}
+
+static stableS_cache_type *stableS_cache_find(double *rS,int *rSncol,int q,int Mf,
+                                              double d_tol,double r_tol) 
+/* returns the cache entry for this set of square roots, or NULL if there is none */
+{ stableS_cache_type *c;
+  int i,j,n_rS;
+  for (n_rS=0,i=0;i<Mf;i++) n_rS += rSncol[i];
+  n_rS *= q;
+  for (c=stableS_cache,i=0;i<STABLES_CACHE_N;i++,c++) {
+    if (c->level==NULL||c->q!=q||c->Mf!=Mf||c->d_tol!=d_tol||c->r_tol!=r_tol) continue;
+    for (j=0;j<Mf;j++) if (c->rSncol[j]!=rSncol[j]) break;
+    if (j<Mf) continue;
+    if (memcmp(c->rS,rS,(size_t)n_rS*sizeof(double))==0) return(c);
+  }
+  return(NULL);
+}
+
+static stableS_cache_type *stableS_cache_new(double *rS,int *rSncol,int q,int Mf,
+                                             double d_tol,double r_tol)
+/* Replaces the least recently used entry with an empty entry for rS. Levels 
+   are then added by get_stableS as the partition is found.  */ 
+{ stableS_cache_type *c,*c0;
+  int i,n_rS;
+  for (c0=c=stableS_cache,i=0;i<STABLES_CACHE_N;i++,c++) {
+    if (c->level==NULL) { c0=c;break;} 
+    if (c->stamp < c0->stamp) c0=c;
+  }
+  stableS_cache_free_entry(c0);
+  for (n_rS=0,i=0;i<Mf;i++) n_rS += rSncol[i];
+  n_rS *= q;
+  c0->q=q;c0->Mf=Mf;c0->d_tol=d_tol;c0->r_tol=r_tol;
+  c0->rSncol = (int *)R_chk_calloc((size_t)Mf,sizeof(int));
+  for (i=0;i<Mf;i++) c0->rSncol[i]=rSncol[i];
+  c0->rS = (double *)R_chk_calloc((size_t)n_rS,sizeof(double));
+  for (i=0;i<n_rS;i++) c0->rS[i] = rS[i];
+  c0->level = (stableS_level_type *)R_chk_calloc((size_t)Mf+1,sizeof(stableS_level_type));
+  c0->size = n_rS;c0->n_level=0;c0->stamp = ++stableS_stamp;
+  return(c0);
+}
+
+static int stableS_cache_fits(stableS_cache_type *c0) 
+/* Evicts least recently used entries other than c0 until the total stored is 
+   within STABLES_CACHE_MAX. Returns 0 if c0 alone is too large to keep. */
+{ stableS_cache_type *c,*cl;
+  size_t total;
+  int i;
+  if (c0->size > STABLES_CACHE_MAX) return(0);
+  while (1) {
+    for (total=0,cl=NULL,c=stableS_cache,i=0;i<STABLES_CACHE_N;i++,c++) if (c->level) {
+      total += c->size;
+      if (c!=c0 && (cl==NULL || c->stamp < cl->stamp)) cl=c;
+    }
+    if (total <= STABLES_CACHE_MAX || cl==NULL) return(1);
+    stableS_cache_free_entry(cl);
+  }
+}
+
+static int stableS_partition_ok(stableS_cache_type *c,double *spf) 
+/* checks whether the cached partition into dominant sets is still the one 
+   that get_stableS would find at smoothing parameters spf. */
+{ stableS_level_type *lev;
+  double max_frob;
+  int i,l,a;
+  for (lev=c->level,l=0;l<c->n_level;l++,lev++) {
+    for (max_frob=0.0,i=0;i<c->Mf;i++) 
+    if (lev->gamma[i] && lev->frob[i]*spf[i] > max_frob) max_frob = lev->frob[i]*spf[i];
+    for (i=0;i<c->Mf;i++) if (lev->gamma[i]) {
+      a = lev->frob[i]*spf[i] > max_frob * c->d_tol;
+      if (a != lev->alpha[i]) return(0);
+    }
+  }
+  return(1);
+}
+
+
 void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int *q,int *M, int * deriv, 
                double *det, double *det1, double *det2, double *d_tol,
                double *r_tol,int *fixed_penalty)
@@ -677,9 +814,14 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
           original total penalty then S = Qf' S0 Qf 
     sqrtS - the square roots of the components of S, transformed as S itself.        
    
+   The partition, level S_i and bases are cached between calls within a fit (see 
+   stableS_cache above), so Qf may differ by an orthogonal transform within each 
+   dominant range space from a fresh computation, but not between repeated fits. 
 */
-{ double *rS, *Un, *U, *Si,*Sb,*B,*C,*Sg,*p,*p1,*p2,*p3,*frob,*ev,max_frob,x,*spf;
-  int iter,i,j,k,bt,ct,rSoff,K,Q,Qr,*gamma,*gamma1,*alpha,TRUE=1,FALSE=0,r,max_col,Mf,n_gamma1;
+{ double *rS, *Un, *U, *Si,*Sl,*Sb,*B,*C,*Sg,*p,*p1,*p2,*p3,*frob,*ev,max_frob,x,*spf;
+  int iter,i,j,k,bt,ct,rSoff,K,Q,Qr,*gamma,*gamma1,*alpha,TRUE=1,FALSE=0,r,max_col,Mf,n_gamma1,cached;
+  stableS_cache_type *cache;
+  stableS_level_type *lev;
 
   if (*fixed_penalty) { 
     Mf = *M + 1;  /* total number of components, including fixed one */
@@ -688,16 +830,30 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
   } 
   else {spf=sp;Mf = *M;} /* total number of components, including fixed one */
 
+  /* Is there a cached partition for these square roots, still valid at this sp?
+     If not start a new entry, to be filled in as the partition is found. Must 
+     happen before sqrtS is modified. */
+  cache = stableS_cache_find(sqrtS,rSncol,*q,Mf,*d_tol,*r_tol);
+  if (cache && !stableS_partition_ok(cache,spf)) {
+    stableS_cache_free_entry(cache);cache=NULL;
+  } 
+  if (cache) { 
+    cached = 1;cache->stamp = ++stableS_stamp;
+  } else {
+    cached = 0;cache = stableS_cache_new(sqrtS,rSncol,*q,Mf,*d_tol,*r_tol);
+  }
+
   /* Create a working copy of sqrtS, which can be modified  */
  
   rS = sqrtS; /* this routine modifies sqrtS */
   /* Explicitly form the Si (stored in a single block), so S_i is stored
      in Si + i * q * q (starting i from 0). As iteration progresses,
-     blocks are shrunk -- always Q by Q */
+     blocks are shrunk -- always Q by Q. If cached, the Si for each level 
+     are already available, and Si is only used as workspace at the end. */
   p = Si = (double *)R_chk_calloc((size_t)*q * *q * Mf,sizeof(double));
   max_col = *q; /* need enough storage just in case square roots are over-sized */
   for (rSoff=i=0;i<Mf;p+= *q * *q,rSoff+=rSncol[i],i++) {
-    bt=0;ct=1;mgcv_mmult(p,sqrtS+rSoff * *q,sqrtS+rSoff * *q,&bt,&ct,q,q,rSncol+i);
+    if (!cached) { bt=0;ct=1;mgcv_mmult(p,sqrtS+rSoff * *q,sqrtS+rSoff * *q,&bt,&ct,q,q,rSncol+i);}
     if (rSncol[i]>max_col) max_col=rSncol[i];
   }
 
@@ -724,7 +880,15 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
   iter =0;
   while(1) {
     iter ++;
-
+    if (cached) { /* partition, rank and level Si all known */
+      lev = cache->level + iter - 1;
+      Sl = lev->Si;r = lev->r;
+      for (n_gamma1=0,i=0;i<Mf;i++) {
+        alpha[i] = lev->alpha[i];
+        gamma1[i] = gamma[i] && !alpha[i];n_gamma1 += gamma1[i];
+      }
+    } else {
+      Sl = Si;lev = NULL;
   /* Find the Frobenius norms of the Si in set gamma */
     max_frob=0.0;
     for (p=Si,i=0;i<Mf;i++,p += Q * Q) 
@@ -761,13 +925,30 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
       r=Q;
     }
     /* ...  r is the rank of Sb, or any other positively weighted sum over alpha */
-
+    
+      if (cache) { /* record this level of the partition */
+        cache->size += (size_t)Q * Q * (Mf + (Q==r ? 0:1));
+        if (!stableS_cache_fits(cache)) { /* not worth storing */
+          stableS_cache_free_entry(cache);cache=NULL;lev=NULL;
+        } else {
+          lev = cache->level + cache->n_level;cache->n_level++;
+          lev->Q = Q;lev->r = r;
+          lev->alpha = (int *)R_chk_calloc((size_t)Mf,sizeof(int));
+          lev->gamma = (int *)R_chk_calloc((size_t)Mf,sizeof(int));
+          lev->frob = (double *)R_chk_calloc((size_t)Mf,sizeof(double));
+          for (i=0;i<Mf;i++) { lev->alpha[i]=alpha[i];lev->gamma[i]=gamma[i];lev->frob[i]=frob[i];}
+          lev->Si = (double *)R_chk_calloc((size_t)Q*Q*Mf,sizeof(double));
+          for (p=Si,p1=Si+Q*Q*Mf,p2=lev->Si;p<p1;p++,p2++) *p2 = *p;
+          lev->U = NULL;
+        }
+      }
+    } /* end of partition finding for this level */
 
     /* If Q==r then terminate (form S first if it's the first iteration) */
     
     if (Q==r) { 
       if (iter==1 ) { /* form S and Qf*/
-        for (p=Si,i=0;i<Mf;i++,p += Q*Q) { 
+        for (p=Sl,i=0;i<Mf;i++,p += Q*Q) { 
           x = spf[i];
           for (p1=p,p2=S,p3=p+Q*Q;p1<p3;p1++,p2++) *p2 += *p1 * x;
         }
@@ -780,12 +961,24 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
 
   /* Form the dominant term and eigen-decompose it */
     for (p=Sb,p1=p+Q*Q;p<p1;p++) *p = 0.0; /* clear Sb */
-    for (p=Si,i=0;i<Mf;i++,p += Q*Q) if (alpha[i]) { /* summing S[[i]]*sp[i] over i in alpha */
+    for (p=Sl,i=0;i<Mf;i++,p += Q*Q) if (alpha[i]) { /* summing S[[i]]*sp[i] over i in alpha */
       x = spf[i];
       for (p1=p,p2=Sb,p3=p+Q*Q;p1<p3;p1++,p2++) *p2 += *p1 * x;
     } 
 
-    mgcv_symeig(Sb,ev,&Q,&FALSE,&TRUE,&TRUE); /* get eigen decomposition of dominant term (ev descending) */
+    if (cached) { /* only need the decomposition within the cached range space, Ur */
+      bt=0;ct=0;mgcv_mmult(B,Sb,lev->U,&bt,&ct,&Q,&r,&Q); /* Sb Ur */
+      bt=1;ct=0;mgcv_mmult(C,lev->U,B,&bt,&ct,&r,&r,&Q);  /* Ur'Sb Ur, r by r */
+      mgcv_symeig(C,ev,&r,&FALSE,&TRUE,&TRUE); /* ev descending */
+      bt=0;ct=0;mgcv_mmult(Sb,lev->U,C,&bt,&ct,&Q,&r,&r); /* eigenvectors of dominant term (lev->U unchanged) */
+      for (p=Sb+Q*r,p1=Sb+Q*Q,p2=lev->U+Q*r;p<p1;p++,p2++) *p = *p2; /* null space basis is sp invariant */
+    } else {
+      mgcv_symeig(Sb,ev,&Q,&FALSE,&TRUE,&TRUE); /* get eigen decomposition of dominant term (ev descending) */
+      if (lev) { 
+        lev->U = (double *)R_chk_calloc((size_t)Q*Q,sizeof(double));
+        for (p=Sb,p1=p+Q*Q,p2=lev->U;p<p1;p++,p2++) *p2 = *p;
+      } 
+    }
     
   /* .... U points to Sb, which now contains eigenvectors */
     if (iter==1) for (p=U,p1=Qf,p2 = p+Q*Q;p<p2;p++,p1++) *p1 = *p;
@@ -796,11 +989,10 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
   /* Form the sum over the elements in gamma1, Sg */
 
     for (p=Sg,p1=p+Q*Q;p<p1;p++) *p=0.0; /* clear Sg */
-    for (p=Si,i=0;i<Mf;i++,p += Q*Q) if (gamma1[i]) { /* summing S[[i]]*sp[i] over i in gamma1 */
+    for (p=Sl,i=0;i<Mf;i++,p += Q*Q) if (gamma1[i]) { /* summing S[[i]]*sp[i] over i in gamma1 */
       x = spf[i];
       for (p1=p,p2=Sg,p3=p+Q*Q;p1<p3;p1++,p2++) *p2 += *p1 * x;
     } 
-
   /* Form S' the similarity transformed S */
     if (K>0) { /* deal with upper right component B */
       /* first copy out K by Q matrix B  */ 
@@ -839,10 +1031,10 @@ void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int
       }
    
 
-  /* Transform the Si in gamma' */
+  /* Transform the Si in gamma' (already available for the next level, if cached) */
     Qr = Q - r;Un = U + r * Q;
    
-    for (p1=p=Si,i=0;i<Mf;i++,p += Q*Q,p1 +=Qr*Qr) if (gamma1[i]) { /* p points to old Si, and p1 to new */
+    if (!cached) for (p1=p=Si,i=0;i<Mf;i++,p += Q*Q,p1 +=Qr*Qr) if (gamma1[i]) { /* p points to old Si, and p1 to new */
       bt=1;ct=0;mgcv_mmult(B,Un,p,&bt,&ct,&Qr,&Q,&Q);
       bt=0;ct=0;mgcv_mmult(p1,B,Un,&bt,&ct,&Qr,&Qr,&Q); 
     }
@@ -1896,6 +2088,66 @@ int icompare (const void * a, const void * b)
 
 
 
+static void form_WX(double *WX,double *X,double *raw,int n,int q,int nt) 
+/* forms WX = diag(raw) X for n by q X. Parallel over columns. */
+{ int j;
+  double *p0,*p1,*p2,*pr;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(j,p0,p1,p2,pr) num_threads(nt)
+  #endif
+  for (j=0;j<q;j++) {
+    p0 = WX + (size_t)n * j;p1 = X + (size_t)n * j;
+    for (p2=p1 + n,pr=raw;p1<p2;p0++,p1++,pr++) *p0 = *p1 * *pr;
+  }
+} /* form_WX */
+
+static int form_raw(double *raw,double *z,double *y,double *w,int n) 
+/* forms raw = sqrt(|w|) and, if z non NULL, z = y*raw with the sign of w, 
+   in a single pass. Returns the number of negative w. */
+{ int i,neg_w=0;
+  for (i=0;i<n;i++) if (w[i]<0) { 
+    neg_w++;raw[i] = sqrt(-w[i]);
+    if (z) z[i] = - y[i]*raw[i];
+  } else { 
+    raw[i] = sqrt(w[i]);
+    if (z) z[i] = y[i]*raw[i];
+  }
+  return(neg_w);
+} /* form_raw */
+
+static void drop_pivot_cols(double *X,int n,int q,int *drop,int n_drop,int *pivot,int rank,int nt)
+/* Equivalent to drop_cols(X,n,q,drop,n_drop) followed by column pivoting of the resulting 
+   n by rank matrix (as pivoter(X,n,rank,pivot,TRUE,FALSE)), but X is traversed only once, 
+   in blocks of rows. Each block only involves its own rows, so blocks are processed in 
+   parallel. `drop' is in ascending order. 
+*/
+{ int *col,*kept,i,j,k,b,i0,i1,nb=128,n_block,tid=0;
+  double *buf,*bp,*p;
+  kept = (int *)R_chk_calloc((size_t)q,sizeof(int));
+  for (k=j=0;j<q;j++) if (k<n_drop&&drop[k]==j) k++; else kept[j-k] = j; 
+  col = (int *)R_chk_calloc((size_t)rank,sizeof(int));
+  for (k=1,j=0;j<rank;j++) { col[j] = kept[pivot[j]];if (col[j]!=j) k=0;}
+  R_chk_free(kept);
+  if (k) { R_chk_free(col);return;} /* nothing to do */
+  if (nt<1) nt=1;
+  n_block = (n + nb - 1)/nb;
+  if (nt>n_block) nt = n_block;
+  buf = (double *)R_chk_calloc((size_t)nb * rank * nt,sizeof(double));
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(b,i,j,i0,i1,bp,p,tid) num_threads(nt)
+  #endif
+  for (b=0;b<n_block;b++) {
+    #ifdef SUPPORT_OPENMP
+    tid = omp_get_thread_num(); /* thread running this bit */
+    #endif
+    bp = buf + (size_t)tid * nb * rank;
+    i0 = b * nb;i1 = i0 + nb;if (i1>n) i1 = n;
+    for (j=0;j<rank;j++) for (p = X + (size_t)n * col[j],i=i0;i<i1;i++) bp[i - i0 + nb * j] = p[i];
+    for (j=0;j<rank;j++) for (p = X + (size_t)n * j,i=i0;i<i1;i++) p[i] = bp[i - i0 + nb * j];
+  }
+  R_chk_free(buf);R_chk_free(col);
+} /* drop_pivot_cols */
+
 void gdiPK(double *work,double *X,double *E,double *Es,double *rS,double *U1,double *z,double *raw,double *R,
            double *nulli,double *dev_hess,double *P, double *K,double *Vt,double *PKtz,double *Q1,
            int *nind,int *pivot1,int *drop,
@@ -1911,12 +2163,7 @@ void gdiPK(double *work,double *X,double *E,double *Es,double *rS,double *U1,dou
   for (i=0;i<neg_w;i++) { k=nind[i];zz[k] = -zz[k];} 
 
   WX = (double *) R_chk_calloc((size_t) ( (*n + *nt * *q) * *q),sizeof(double));
-  for (j=0;j<*q;j++) 
-  { for (i=0;i<*n;i++) /* form WX */
-    { k = i + *n * j;
-      WX[k]=raw[i]*X[k];
-    }
-  }
+  form_WX(WX,X,raw,*n,*q,*nt);
   /* get the QR decomposition of WX */
  
   tau=(double *)R_chk_calloc((size_t) *q * (*nt + 1),sizeof(double)); /* part of reflector storage */
@@ -1969,7 +2216,7 @@ void gdiPK(double *work,double *X,double *E,double *Es,double *rS,double *U1,dou
     /* drop columns indexed in `drop'... */
     drop_cols(R1,*q,*q,drop,*n_drop);    /* R1 now q by rank */
     drop_cols(E,*Enrow,*q,drop,*n_drop); /* E now q by rank */ 
-    drop_cols(X,*n,*q,drop,*n_drop);     /* X now n by rank */
+    /* X is dropped and pivoted together, at the end */
     drop_rows(rS,*q,ScS,drop,*n_drop);   /* rS now rank by ScS */ 
     drop_rows(nulli,*q,1,drop,*n_drop);  /* keeps track of null space params */
   }
@@ -2063,8 +2310,11 @@ void gdiPK(double *work,double *X,double *E,double *Es,double *rS,double *U1,dou
     R_chk_free(d);   
   } else { /* no negative weights so P and K much simpler */
     /* Form K */
-    for (p0=K,p1=Q1,j=0;j< *rank;j++,p1 += *n) /* copy just Q1 into K */
-    for (p2 = p1,p3=p1 + *n;p2<p3;p0++,p2++) *p0 = *p2; 
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(j,p0,p2,p3) num_threads(*nt)
+    #endif
+    for (j=0;j< *rank;j++) /* copy just Q1 into K */
+    for (p0=K + (size_t)j * *n,p2=Q1 + (size_t)j * *n,p3=p2 + *n;p2<p3;p0++,p2++) *p0 = *p2; 
     /* Form P */
     for (p0=P,p1=Ri,j=0;j < *rank;j++,p0+= *rank) /* copy R^{-1} into P */
     for (p2=p0,p3=p0 + *rank;p2<p3;p1++,p2++) *p2 = *p1;  
@@ -2088,7 +2338,7 @@ void gdiPK(double *work,double *X,double *E,double *Es,double *rS,double *U1,dou
   
   pivoter(E,Enrow,rank,pivot1,&TRUE,&FALSE);  /* column pivot of E */  
 
-  pivoter(X,n,rank,pivot1,&TRUE,&FALSE);  /* column pivot of X */ 
+  drop_pivot_cols(X,*n,*q,drop,*n_drop,pivot1,*rank,*nt); /* drop and column pivot X */ 
  
   /* PK'z --- the pivoted coefficients...*/
   bt=1;ct=0;mgcv_mmult(work,K,zz,&bt,&ct,rank,&one,n);
@@ -2188,14 +2438,7 @@ void gdi2(double *X,double *E,double *Es,double *rS,double *U1,
     ntot,n_2dCols=0,n_drop,*drop,tp,
     n_work,deriv2,neg_w=0,*nind,nr,TRUE=1,FALSE=0,ML=0; 
   
-  #ifdef SUPPORT_OPENMP
-  int m;
-  m = omp_get_num_procs(); /* detected number of processors */
-  if (*nt > m || *nt < 1) *nt = m; /* no point in more threads than m */
-  omp_set_num_threads(*nt); /* set number of threads to use */
-  #else
-  *nt = 1;
-  #endif
+  *nt = mgcv_nthreads(*nt); /* passed explicitly to parallel sections, not set globally */
 
   if (*ldet<0) ML=1; /* require ML not REML */ 
 
@@ -2223,9 +2466,7 @@ void gdi2(double *X,double *E,double *Es,double *rS,double *U1,
   P = (double *)R_chk_calloc((size_t) *q * *q,sizeof(double));
   Q1 = (double *)R_chk_calloc((size_t) *n * *q,sizeof(double)); 
 
-  for (i=0;i< *n;i++) 
-    if (w[i]<0) { neg_w++;raw[i] = sqrt(-w[i]);} 
-    else raw[i] = sqrt(w[i]);
+  neg_w = form_raw(raw,NULL,NULL,w,*n);
 
   if (neg_w) {  
     Vt = (double *)R_chk_calloc((size_t) *q * *q,sizeof(double));
@@ -2567,13 +2808,7 @@ void gdi1(double *X,double *E,double *Es,double *rS,double *U1,
     n_2dCols=0,n_b2,n_drop,*drop,nt1,
       n_eta1=0,n_eta2=0,n_work,deriv2,neg_w=0,*nind,nr,TRUE=1,FALSE=0; 
   
-  #ifdef SUPPORT_OPENMP
-  m = omp_get_num_procs(); /* detected number of processors */
-  if (*nt > m || *nt < 1) *nt = m; /* no point in more threads than m */
-  omp_set_num_threads(*nt); /* set number of threads to use */
-  #else
-  *nt = 1;
-  #endif
+  *nt = mgcv_nthreads(*nt); /* passed explicitly to parallel sections, not set globally */
   nt1 = *nt; /* allows threading to be switched off for QR for debugging*/ 
 
   if (*deriv==2) deriv2=1; else deriv2=0;
@@ -2600,9 +2835,7 @@ void gdi1(double *X,double *E,double *Es,double *rS,double *U1,
   P = (double *)R_chk_calloc((size_t) *q * *q,sizeof(double));
   Q1 = (double *)R_chk_calloc((size_t) *n * *q,sizeof(double)); 
 
-  for (i=0;i< *n;i++) 
-    if (w[i]<0) { neg_w++;raw[i] = sqrt(-w[i]);} 
-    else raw[i] = sqrt(w[i]);
+  neg_w = form_raw(raw,NULL,NULL,w,*n);
 
   if (neg_w) {  
     Vt = (double *)R_chk_calloc((size_t) *q * *q,sizeof(double));
@@ -3057,42 +3290,23 @@ void pls_fit1(double *y,double *X,double *w,double *E,double *Es,int *n,int *q,i
 { int i,j,k,rank,one=1,*pivot,*pivot1,left,tp,neg_w=0,*nind,bt,ct,nr,n_drop=0,*drop,TRUE=1,nz;
   double *z,*WX,*tau,Rcond,xx,*work,*Q,*Q1,*IQ,*raw,*d,*Vt,*p0,*p1,
     *R1,*tau1,Rnorm,Enorm,*R;
-  #ifdef SUPPORT_OPENMP
-  int m;
-  m = omp_get_num_procs(); /* detected number of processors */
-  if (*nt > m || *nt < 1) *nt = m; /* no point in more threads than m */
-  omp_set_num_threads(*nt); /* set number of threads to use */
-  #else
-  *nt = 1; /* no openMP support - turn off threading */
-  #endif
+  *nt = mgcv_nthreads(*nt); /* passed explicitly to parallel sections, not set globally */
 
   nr = *q + *rE;
   nz = *n; if (nz<nr) nz=nr; /* possible for nr to be more than n */
   z = (double *)R_chk_calloc((size_t) nz,sizeof(double)); /* storage for z=[sqrt(|W|)z,0] */
   raw = (double *)R_chk_calloc((size_t) *n,sizeof(double)); /* storage for sqrt(|w|) */
   
-  for (i=0;i< *n;i++) 
-    if (w[i]<0) { neg_w++;raw[i] = sqrt(-w[i]);} 
-    else raw[i] = sqrt(w[i]);
+  neg_w = form_raw(raw,z,y,w,*n); /* raw = sqrt(|w|) and z = sign(w) raw y together */
 
   if (neg_w) {
     nind = (int *)R_chk_calloc((size_t)neg_w,sizeof(int)); /* index the negative w_i */
     k=0;for (i=0;i< *n;i++) if (w[i]<0) { nind[k]=i;k++;}
   } else { nind = (int *)NULL;}
 
-  for (i=0;i< *n;i++) z[i] = y[i]*raw[i]; /* form z itself*/
-
-  for (i=0;i<neg_w;i++) {k=nind[i];z[k] = -z[k];} 
-
   /* st WX = (double *) R_chk_calloc((size_t) ( *n * *q),sizeof(double)); */
   WX = (double *) R_chk_calloc((size_t) ( (*n + *nt * *q) * *q),sizeof(double));
-  for (p0=WX,j=0;j<*q;j++) { 
-    for (p1=raw,i=0;i<*n;i++,p1++,p0++,X++) { /* form WX */
-      *p0 = *X * *p1;
-      /* k = i + nn * j;
-         WX[k]=raw[i]*X[i + *n *j];*/
-    }
-  } 
+  form_WX(WX,X,raw,*n,*q,*nt);
   /* get the QR decomposition of WX */
   /* st tau=(double *)R_chk_calloc((size_t)*q,sizeof(double)); */ /* part of reflector storage */
   tau=(double *)R_chk_calloc((size_t) *q * (*nt + 1),sizeof(double)); 
@@ -3251,3 +3465,183 @@ void pls_fit1(double *y,double *X,double *w,double *E,double *Es,int *n,int *q,i
 } /* end pls_fit1 */
 
 
+
+
+/* .Call interfaces to gdi1, gdi2 and pls_fit1. Via .C every argument is duplicated, 
+   including the n by q model matrix (and x[good,] at R level), which is the dominant 
+   copying cost in smoothness selection. Here the model matrix and the n-vectors are 
+   accessed in place. Only arguments that the routines overwrite are copied: the 
+   informative rows of X go straight into the returned K matrix (which gdi1/gdi2 
+   overwrite X with), w and the (small) penalty matrices go into workspace. Results 
+   are returned in a newly allocated named list, with the names used for the 
+   corresponding .C results. Workspace is R_alloc'd, so freed on exit. 
+*/
+
+static int good_rows(double *Xg,double *X,int n,int q,SEXP GOOD) 
+/* copy the rows of n by q X flagged in logical GOOD into Xg (all rows if GOOD is NULL).
+   Returns the number of rows copied. */
+{ int i,j,ng,*good;
+  double *p,*p1;
+  if (isNull(GOOD)) {
+    for (p=X,p1=X + (ptrdiff_t)n * q;p<p1;p++,Xg++) *Xg = *p;
+    return(n);
+  }
+  good = LOGICAL(GOOD);
+  for (ng=i=0;i<n;i++) if (good[i]) ng++;
+  for (p=Xg,j=0;j<q;j++,X += n) for (i=0;i<n;i++) if (good[i]) { *p = X[i];p++;}
+  return(ng);
+}
+
+static double *Rcopy(SEXP x) 
+/* workspace copy of a double vector, for arguments modified in place */
+{ double *y,*p,*p1,*p2;
+  int n;
+  n = length(x); if (n<1) n = 1;
+  y = (double *)R_alloc((size_t)n,sizeof(double));
+  for (p2=y,p=REAL(x),p1=p + length(x);p<p1;p++,p2++) *p2 = *p;
+  return(y);
+}
+
+static SEXP named_list(SEXP *el,const char **nm,int n) 
+/* named list from n elements */
+{ SEXP ans,names;
+  int i;
+  ans = PROTECT(allocVector(VECSXP,n));
+  names = PROTECT(allocVector(STRSXP,n));
+  for (i=0;i<n;i++) { SET_VECTOR_ELT(ans,i,el[i]);SET_STRING_ELT(names,i,mkChar(nm[i]));}
+  setAttrib(ans,R_NamesSymbol,names);
+  UNPROTECT(2);
+  return(ans);
+}
+
+SEXP mgcv_Rgdi1(SEXP X,SEXP GOOD,SEXP E,SEXP Es,SEXP rS,SEXP U1,SEXP sp,SEXP z,SEXP w,SEXP wf,
+                SEXP alpha,SEXP mu,SEXP eta,SEXP y,SEXP p_weights,SEXP g1,SEXP g2,SEXP g3,SEXP g4,
+                SEXP V0,SEXP V1,SEXP V2,SEXP V3,SEXP beta,SEXP rSncol,SEXP ICTRL,SEXP DCTRL) {
+/* gdi1 via .Call. X is the full model matrix, of which the rows flagged in GOOD are used. 
+   ICTRL is c(M,Mp,Enrow,deriv,REML,fisher,fixed_penalty,nthreads), DCTRL is c(rank_tol,conv_tol).
+   Returns list(X,beta,b1,D1,D2,P,P1,P2,trA,trA1,trA2,rV,rank.tol,conv.tol,rank.est,deriv),
+   as the .C call would, with X containing K.
+*/
+  int n,q,M,Mp,Enrow,deriv,REML,fisher,fixed_penalty,nt,rank_est=0,i,nprot=0;
+  double rank_tol,conv_tol,trA=0.0,P0=0.0;
+  SEXP el[16];
+  const char *nm[] = {"X","beta","b1","D1","D2","P","P1","P2","trA","trA1","trA2","rV",
+                      "rank.tol","conv.tol","rank.est","deriv"};
+  M = INTEGER(ICTRL)[0];Mp = INTEGER(ICTRL)[1];Enrow = INTEGER(ICTRL)[2];deriv = INTEGER(ICTRL)[3];
+  REML = INTEGER(ICTRL)[4];fisher = INTEGER(ICTRL)[5];fixed_penalty = INTEGER(ICTRL)[6];
+  nt = INTEGER(ICTRL)[7];
+  rank_tol = REAL(DCTRL)[0];conv_tol = REAL(DCTRL)[1];
+  q = ncols(X);
+  n = length(z); /* number of informative data */
+  el[0] = PROTECT(allocMatrix(REALSXP,n,q));nprot++;
+  if (good_rows(REAL(el[0]),REAL(X),nrows(X),q,GOOD)!=n) error(_("gdi1: data length mismatch"));
+  el[1] = PROTECT(allocVector(REALSXP,q));nprot++;
+  for (i=0;i<q;i++) REAL(el[1])[i] = REAL(beta)[i];
+  el[2] = PROTECT(allocVector(REALSXP,q*M));nprot++;
+  el[3] = PROTECT(allocVector(REALSXP,M));nprot++;
+  el[4] = PROTECT(allocVector(REALSXP,M*M));nprot++;
+  el[6] = PROTECT(allocVector(REALSXP,M));nprot++;
+  el[7] = PROTECT(allocVector(REALSXP,M*M));nprot++;
+  el[9] = PROTECT(allocVector(REALSXP,M));nprot++;
+  el[10] = PROTECT(allocVector(REALSXP,M*M));nprot++;
+  el[11] = PROTECT(allocVector(REALSXP,q*q));nprot++;
+  for (i=0;i<q*M;i++) REAL(el[2])[i] = 0.0;
+  for (i=0;i<M;i++) REAL(el[3])[i] = REAL(el[6])[i] = REAL(el[9])[i] = 0.0;
+  for (i=0;i<M*M;i++) REAL(el[4])[i] = REAL(el[7])[i] = REAL(el[10])[i] = 0.0;
+  for (i=0;i<q*q;i++) REAL(el[11])[i] = 0.0;
+  gdi1(REAL(el[0]),Rcopy(E),Rcopy(Es),Rcopy(rS),Rcopy(U1),REAL(sp),REAL(z),Rcopy(w),REAL(wf),
+       REAL(alpha),REAL(mu),REAL(eta),REAL(y),REAL(p_weights),REAL(g1),REAL(g2),REAL(g3),REAL(g4),
+       REAL(V0),REAL(V1),REAL(V2),REAL(V3),REAL(el[1]),REAL(el[2]),REAL(el[3]),REAL(el[4]),
+       &P0,REAL(el[6]),REAL(el[7]),&trA,REAL(el[9]),REAL(el[10]),REAL(el[11]),&rank_tol,&conv_tol,
+       &rank_est,&n,&q,&M,&Mp,&Enrow,INTEGER(rSncol),&deriv,&REML,&fisher,&fixed_penalty,&nt);
+  el[5] = PROTECT(ScalarReal(P0));nprot++;
+  el[8] = PROTECT(ScalarReal(trA));nprot++;
+  el[12] = PROTECT(ScalarReal(rank_tol));nprot++;
+  el[13] = PROTECT(ScalarReal(conv_tol));nprot++;
+  el[14] = PROTECT(ScalarInteger(rank_est));nprot++;
+  el[15] = PROTECT(ScalarInteger(deriv));nprot++;
+  el[0] = named_list(el,nm,16);
+  UNPROTECT(nprot);
+  return(el[0]);
+} /* mgcv_Rgdi1 */
+
+SEXP mgcv_Rgdi2(SEXP X,SEXP GOOD,SEXP E,SEXP Es,SEXP rS,SEXP U1,SEXP sp,SEXP theta,SEXP z,SEXP w,
+                SEXP wf,SEXP Dth,SEXP Det,SEXP Det2,SEXP Dth2,SEXP Det_th,SEXP Det2_th,SEXP Det3,
+                SEXP Det_th2,SEXP Det4,SEXP Det3_th,SEXP Det2_th2,SEXP beta,SEXP ldet,SEXP rSncol,
+                SEXP ICTRL,SEXP DCTRL) {
+/* gdi2 via .Call. X is the full model matrix, of which the rows flagged in GOOD are used. 
+   ICTRL is c(M,Mp,Enrow,deriv,fixed_penalty,nthreads), DCTRL is rank_tol. `ldet' on entry
+   is the REML/ML flag, as for gdi2. Returns list(X,beta,b1,D1,D2,P,P1,P2,ldet,ldet1,ldet2,
+   rV,rank.est), as the .C call would, with X containing K.
+*/
+  int n,q,M,n_theta,ntot,Mp,Enrow,deriv,fixed_penalty,nt,rank_est=0,i,nprot=0;
+  double rank_tol,P0=0.0,ld;
+  SEXP el[13];
+  const char *nm[] = {"X","beta","b1","D1","D2","P","P1","P2","ldet","ldet1","ldet2","rV","rank.est"};
+  M = INTEGER(ICTRL)[0];Mp = INTEGER(ICTRL)[1];Enrow = INTEGER(ICTRL)[2];deriv = INTEGER(ICTRL)[3];
+  fixed_penalty = INTEGER(ICTRL)[4];nt = INTEGER(ICTRL)[5];
+  rank_tol = REAL(DCTRL)[0];ld = REAL(ldet)[0];
+  n_theta = length(theta);ntot = M + n_theta;
+  q = ncols(X);
+  n = length(z);
+  el[0] = PROTECT(allocMatrix(REALSXP,n,q));nprot++;
+  if (good_rows(REAL(el[0]),REAL(X),nrows(X),q,GOOD)!=n) error(_("gdi2: data length mismatch"));
+  el[1] = PROTECT(allocVector(REALSXP,q));nprot++;
+  for (i=0;i<q;i++) REAL(el[1])[i] = REAL(beta)[i];
+  el[2] = PROTECT(allocVector(REALSXP,q*ntot));nprot++;
+  el[3] = PROTECT(allocVector(REALSXP,ntot));nprot++;
+  el[4] = PROTECT(allocVector(REALSXP,ntot*ntot));nprot++;
+  el[6] = PROTECT(allocVector(REALSXP,ntot));nprot++;
+  el[7] = PROTECT(allocVector(REALSXP,ntot*ntot));nprot++;
+  el[9] = PROTECT(allocVector(REALSXP,ntot));nprot++;
+  el[10] = PROTECT(allocVector(REALSXP,ntot*ntot));nprot++;
+  el[11] = PROTECT(allocVector(REALSXP,q*q));nprot++;
+  for (i=0;i<q*ntot;i++) REAL(el[2])[i] = 0.0;
+  for (i=0;i<ntot;i++) REAL(el[3])[i] = REAL(el[6])[i] = REAL(el[9])[i] = 0.0;
+  for (i=0;i<ntot*ntot;i++) REAL(el[4])[i] = REAL(el[7])[i] = REAL(el[10])[i] = 0.0;
+  for (i=0;i<q*q;i++) REAL(el[11])[i] = 0.0;
+  gdi2(REAL(el[0]),Rcopy(E),Rcopy(Es),Rcopy(rS),Rcopy(U1),REAL(sp),REAL(theta),REAL(z),Rcopy(w),
+       REAL(wf),REAL(Dth),REAL(Det),REAL(Det2),REAL(Dth2),REAL(Det_th),REAL(Det2_th),REAL(Det3),
+       REAL(Det_th2),REAL(Det4),REAL(Det3_th),REAL(Det2_th2),REAL(el[1]),REAL(el[2]),
+       REAL(el[3]),REAL(el[4]),&P0,REAL(el[6]),REAL(el[7]),&ld,REAL(el[9]),REAL(el[10]),
+       REAL(el[11]),&rank_tol,&rank_est,&n,&q,&M,&n_theta,&Mp,&Enrow,INTEGER(rSncol),&deriv,
+       &fixed_penalty,&nt);
+  el[5] = PROTECT(ScalarReal(P0));nprot++;
+  el[8] = PROTECT(ScalarReal(ld));nprot++;
+  el[12] = PROTECT(ScalarInteger(rank_est));nprot++;
+  el[0] = named_list(el,nm,13);
+  UNPROTECT(nprot);
+  return(el[0]);
+} /* mgcv_Rgdi2 */
+
+SEXP mgcv_Rpls_fit1(SEXP y,SEXP X,SEXP GOOD,SEXP w,SEXP E,SEXP Es,SEXP RE,SEXP RANK_TOL,SEXP NT) {
+/* pls_fit1 via .Call. X is the full model matrix, of which the rows flagged in GOOD 
+   are used (X itself is used, uncopied, if GOOD is NULL, since pls_fit1 does not modify it). 
+   RE is the number of rows of E. Returns list(y,eta,penalty,n), as the .C call would, 
+   except that y is only the q coefficients.
+*/
+  int n,q,rE,nt,ng,i;
+  double *Xg,*yw,*eta,penalty=0.0,rank_tol;
+  SEXP el[4];
+  const char *nm[] = {"y","eta","penalty","n"};
+  q = ncols(X);rE = asInteger(RE);nt = asInteger(NT);rank_tol = asReal(RANK_TOL);
+  n = length(y);
+  if (isNull(GOOD)) { 
+    Xg = REAL(X);ng = nrows(X); 
+  } else {
+    Xg = (double *)R_alloc((size_t)n * q,sizeof(double));
+    ng = good_rows(Xg,REAL(X),nrows(X),q,GOOD);
+  }
+  if (ng!=n) error(_("pls_fit1: data length mismatch"));
+  yw = (double *)R_alloc((size_t)(n > q ? n : q),sizeof(double));
+  for (i=0;i<n;i++) yw[i] = REAL(y)[i];
+  el[1] = PROTECT(allocVector(REALSXP,n));eta = REAL(el[1]);
+  pls_fit1(yw,Xg,REAL(w),Rcopy(E),REAL(Es),&n,&q,&rE,eta,&penalty,&rank_tol,&nt);
+  el[0] = PROTECT(allocVector(REALSXP,q));
+  for (i=0;i<q;i++) REAL(el[0])[i] = yw[i];
+  el[2] = PROTECT(ScalarReal(penalty));
+  el[3] = PROTECT(ScalarInteger(n));
+  el[0] = named_list(el,nm,4);
+  UNPROTECT(4);
+  return(el[0]);
+} /* mgcv_Rpls_fit1 */
@@ -14,21 +14,34 @@ R_CallMethodDef CallMethods[] = {
   { "mgcv_Rpbsi",(DL_FUNC)&mgcv_Rpbsi,2},
   { "mgcv_RPPt",(DL_FUNC)&mgcv_RPPt,3},
   { "mgcv_Rpchol",(DL_FUNC)&mgcv_Rpchol,4},
+  { "mgcv_pirls",(DL_FUNC)&mgcv_pirls,11},
+  { "mgcv_Rgdi1",(DL_FUNC)&mgcv_Rgdi1,27},
+  { "mgcv_Rgdi2",(DL_FUNC)&mgcv_Rgdi2,27},
+  { "mgcv_Rpls_fit1",(DL_FUNC)&mgcv_Rpls_fit1,9},
+  { "mgcv_Rmagic",(DL_FUNC)&mgcv_Rmagic,17},
+  { "mgcv_kdload",(DL_FUNC)&mgcv_kdload,1},
+  { "mgcv_kdnearest",(DL_FUNC)&mgcv_kdnearest,6},
+  { "mgcv_kdradius",(DL_FUNC)&mgcv_kdradius,4},
   {NULL, NULL, 0}
 };
 
 R_CMethodDef CEntries[] = {
-    {"coxpred", (DL_FUNC) &coxpred, 13},
-    {"coxpp", (DL_FUNC) &coxpp, 10},
-    {"coxlpl", (DL_FUNC) &coxlpl, 17},
-    {"mvn_ll", (DL_FUNC) &mvn_ll,15},
+    {"coxpred", (DL_FUNC) &coxpred, 15},
+    {"coxpp", (DL_FUNC) &coxpp, 14},
+    {"coxlpl", (DL_FUNC) &coxlpl, 21},
+    {"mvn_ll", (DL_FUNC) &mvn_ll,16},
     {"RMonoCon", (DL_FUNC) &RMonoCon, 7},
     {"RuniqueCombs", (DL_FUNC) &RuniqueCombs, 4},
-    {"RPCLS", (DL_FUNC) &RPCLS, 14},
-    {"construct_tprs", (DL_FUNC) &construct_tprs, 13},
-    {"crspl", (DL_FUNC) &crspl,8},
-    {"predict_tprs", (DL_FUNC) &predict_tprs, 12},
-    {"MinimumSeparation", (DL_FUNC) &MinimumSeparation, 6},
+    {"RPCLS", (DL_FUNC) &RPCLS, 15},
+    {"construct_tprs", (DL_FUNC) &construct_tprs, 15},
+    {"crspl", (DL_FUNC) &crspl,9},
+    {"crspl_coef", (DL_FUNC) &crspl_coef,7},
+    {"cr_XtWX", (DL_FUNC) &cr_XtWX,13},
+    {"cr_XtWXd", (DL_FUNC) &cr_XtWXd,10},
+    {"cr_XtWz", (DL_FUNC) &cr_XtWz,9},
+    {"cr_Xb", (DL_FUNC) &cr_Xb,8},
+    {"predict_tprs", (DL_FUNC) &predict_tprs, 13},
+    {"MinimumSeparation", (DL_FUNC) &MinimumSeparation, 7},
     {"magic", (DL_FUNC) &magic, 19},
     {"mgcv_mmult", (DL_FUNC) &mgcv_mmult,8},
     {"mgcv_pmmult", (DL_FUNC) &mgcv_pmmult,9},
@@ -36,10 +49,11 @@ R_CMethodDef CEntries[] = {
     {"gdi2",(DL_FUNC) &gdi2,44},
     {"R_cond",(DL_FUNC) &R_cond,5} ,
     {"pls_fit1",(DL_FUNC)&pls_fit1,12},
-    {"tweedious",(DL_FUNC)&tweedious,13},
+    {"tweedious",(DL_FUNC)&tweedious,15},
     {"psum",(DL_FUNC)&psum,4},
     {"get_detS2",(DL_FUNC)&get_detS2,12},
     {"get_stableS",(DL_FUNC)&get_stableS,14},
+    {"stableS_cache_clear",(DL_FUNC)&stableS_cache_clear,0},
     {"mgcv_tri_diag",(DL_FUNC)&mgcv_tri_diag,3},
     {"mgcv_td_qy",(DL_FUNC)&mgcv_td_qy,7},
     {"mgcv_symeig",(DL_FUNC)&mgcv_symeig,6},
@@ -49,10 +63,11 @@ R_CMethodDef CEntries[] = {
     {"Rlanczos",(DL_FUNC)&Rlanczos,8},
     {"rksos",(DL_FUNC)&rksos,3},
     {"gen_tps_poly_powers",(DL_FUNC)&gen_tps_poly_powers,4},
-    {"k_nn",(DL_FUNC)&k_nn,8},
-    {"Rkdtree",(DL_FUNC)&Rkdtree,5},
-    {"Rkdnearest",(DL_FUNC)&Rkdnearest,9},
-    {"Rkradius",(DL_FUNC)&Rkradius,9},
+    {"k_nn",(DL_FUNC)&k_nn,11},
+    {"Rkdtree",(DL_FUNC)&Rkdtree,6},
+    {"Rkdnearest",(DL_FUNC)&Rkdnearest,12},
+    {"Rkradius",(DL_FUNC)&Rkradius,10},
+    {"Rkdsave",(DL_FUNC)&Rkdsave,5},
     {"sspl_construct",(DL_FUNC)&sspl_construct,9},
     {"sspl_mapply",(DL_FUNC)&sspl_mapply,9},
     {"tri2nei",(DL_FUNC)&tri2nei,5},
@@ -72,3 +87,8 @@ void R_init_mgcv(DllInfo *dll)
     R_registerRoutines(dll, CEntries, CallMethods, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
 }
+
+void R_unload_mgcv(DllInfo *dll)
+{
+    stableS_cache_clear(); /* free get_stableS partition cache */
+}
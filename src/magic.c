@@ -192,7 +192,7 @@ double **crude_hess(double *X,double *sp,double **Si,double *H,double *gamma,dou
 void magic_gH(double *U1U1,double **M,double **K,double *VS,double **My,double **Ky,double **yK,double **hess,
               double *grad,double *dnorm,double *ddelta,double *sp,double **d2norm,double **d2delta,double *S,
               double *U1,double *V,double *d,double *y1,int rank,int q,int m,int *cS,int *cucS,int gcv,double *gamma,double *scale,
-              double norm,double delta,int n,double *norm_const)
+              double norm,double delta,int n,double *norm_const,int nt)
 
 /* service routine for magic that calculates gradient and hessian of score w.r.t. sp. 
    Note that n is assumed to be used only in the score calculation, not as an actual physical 
@@ -206,7 +206,7 @@ void magic_gH(double *U1U1,double **M,double **K,double *VS,double **My,double *
   getXtX(U1U1,U1,&q,&rank);
   /* for (p=S,ip=cS,i=0;ip<cS+m;p+= *ip *q,ip++,i++) */ /* work through all smooths */ 
   #ifdef SUPPORT_OPENMP
-  #pragma omp parallel private(i,j,ip,bt,ct,c,r,p,p1,p2,p3,p4,xx,tid,VSi)
+  #pragma omp parallel private(i,j,ip,bt,ct,c,r,p,p1,p2,p3,p4,xx,tid,VSi) num_threads(nt)
   #endif
   { /* open parallel section */
     #ifdef SUPPORT_OPENMP
@@ -366,13 +366,7 @@ void magic(double *y,double *X,double *sp0,double *def_sp,double *S,double *H,do
   double *sp=NULL,*p,*p1,*p2,*tau,xx,*y1,*y0,yy,**Si=NULL,*work,score,*sd_step,*n_step,*U1,*V,*d,**M,**K,
          *VS,*U1U1,**My,**Ky,**yK,*dnorm,*ddelta,**d2norm,**d2delta,norm,delta,*grad,**hess,*nsp,
     min_score,*step,d_score=1e10,*ev=NULL,*u,msg=0.0,Xms,*rSms,*bag,*bsp,sign,*grad1,*u0,*R;
-  #ifdef SUPPORT_OPENMP
-  m = omp_get_num_procs(); /* detected number of processors */
-  if (*nt > m || *nt < 1) *nt = m; /* no point in more threads than m */
-  omp_set_num_threads(*nt); /* set number of threads to use */
-  #else
-  *nt = 1;
-  #endif
+  *nt = mgcv_nthreads(*nt); /* passed explicitly to parallel sections, not set globally */
 
   gcv=control[0];q=control[2];n=control[1];m=control[4];max_half=control[5];mp=control[6];
   
@@ -501,7 +495,7 @@ void magic(double *y,double *X,double *sp0,double *def_sp,double *S,double *H,do
 
   if (mp>0&&!autoinit)
   { magic_gH(U1U1,M,K,VS,My,Ky,yK,hess,grad1,dnorm,ddelta,sp,d2norm,d2delta,S,
-             U1,V,d,y1,rank,q,m,cS,cucS,gcv,gamma,scale,norm,delta,*n_score,norm_const);
+             U1,V,d,y1,rank,q,m,cS,cucS,gcv,gamma,scale,norm,delta,*n_score,norm_const,*nt);
     xx=1e-4*(1+fabs(score));
     ok=1;
     /* reset to default any sp w.r.t. which score is flat */
@@ -600,7 +594,7 @@ void magic(double *y,double *X,double *sp0,double *def_sp,double *S,double *H,do
           for (i=0;i<m;i++) sp[i]=sp0[i];
         }
         magic_gH(U1U1,M,K,VS,My,Ky,yK,hess,grad1,dnorm,ddelta,sp,d2norm,d2delta,S,
-		 U1,V,d,y1,rank,q,m,cS,cucS,gcv,gamma,scale,norm,delta,*n_score,norm_const);
+		 U1,V,d,y1,rank,q,m,cS,cucS,gcv,gamma,scale,norm,delta,*n_score,norm_const,*nt);
         /* Now get the search directions */
         for (i=0;i<m;i++) for (j=0;j<m;j++) u[i+m*j]=hess[i][j]; 
 	if (L_exists) { /* transform grad and hess */
@@ -696,6 +690,53 @@ void magic(double *y,double *X,double *sp0,double *def_sp,double *S,double *H,do
     
 } /* magic */
 
+SEXP mgcv_Rmagic(SEXP y,SEXP X,SEXP sp,SEXP def_sp,SEXP S,SEXP H,SEXP L,SEXP lsp0,SEXP gamma,
+                 SEXP scale,SEXP control,SEXP cS,SEXP rank_tol,SEXP tol,SEXP norm_const,
+                 SEXP n_score,SEXP NT) {
+/* magic via .Call. The .C interface duplicates y and X (as well as the copy of X made 
+   at R level to append the threading workspace). Here y is used in place and X is copied 
+   once, into workspace with the nt*q^2 extra storage magic requires. Returns 
+   list(b,scale,score,sp,info,rms.grad,rV,X), where X is the q by q R factor and the 
+   other elements are as for the .C call. 
+*/
+  int n,q,nt,i,k;
+  size_t nx;
+  double *Xw,*Sw,*Hw,*dsp,*p,*p1,*p2;
+  SEXP ans,names,el[8];
+  const char *nm[] = {"b","scale","score","sp","info","rms.grad","rV","X"};
+  n = nrows(X);q = ncols(X);
+  nt = asInteger(NT);if (nt<1) nt = 1;
+  nt = mgcv_nthreads(nt); /* magic will not use more */
+  nx = (size_t) n * q; if (nt > 1) nx += (size_t) nt * q * q;
+  Xw = (double *)R_alloc(nx,sizeof(double));
+  for (p=REAL(X),p1=p + (ptrdiff_t) n * q,p2=Xw;p<p1;p++,p2++) *p2 = *p;
+  /* S, H and def_sp are modified in place, and are small */ 
+  k = length(S);Sw = (double *)R_alloc((size_t)(k>0 ? k:1),sizeof(double));
+  for (i=0;i<k;i++) Sw[i] = REAL(S)[i];
+  k = length(H);Hw = (double *)R_alloc((size_t)(k>0 ? k:1),sizeof(double));
+  for (i=0;i<k;i++) Hw[i] = REAL(H)[i];
+  k = length(def_sp);dsp = (double *)R_alloc((size_t)(k>0 ? k:1),sizeof(double));
+  for (i=0;i<k;i++) dsp[i] = REAL(def_sp)[i];
+  el[0] = PROTECT(allocVector(REALSXP,q));for (i=0;i<q;i++) REAL(el[0])[i] = 0.0;
+  el[1] = PROTECT(ScalarReal(asReal(scale)));
+  el[2] = PROTECT(ScalarReal(asReal(gamma)));
+  el[3] = PROTECT(duplicate(sp));
+  el[4] = PROTECT(duplicate(control));
+  el[5] = PROTECT(ScalarReal(asReal(tol)));
+  el[6] = PROTECT(allocVector(REALSXP,q*q));for (i=0;i<q*q;i++) REAL(el[6])[i] = 0.0;
+  magic(REAL(y),Xw,REAL(el[3]),dsp,Sw,Hw,REAL(L),REAL(lsp0),REAL(el[2]),REAL(el[1]),
+        INTEGER(el[4]),INTEGER(cS),REAL(rank_tol),REAL(el[5]),REAL(el[0]),REAL(el[6]),
+        REAL(norm_const),INTEGER(n_score),&nt);
+  el[7] = PROTECT(allocVector(REALSXP,q*q));
+  for (i=0;i<q*q;i++) REAL(el[7])[i] = Xw[i];
+  ans = PROTECT(allocVector(VECSXP,8));
+  names = PROTECT(allocVector(STRSXP,8));
+  for (i=0;i<8;i++) { SET_VECTOR_ELT(ans,i,el[i]);SET_STRING_ELT(names,i,mkChar(nm[i]));}
+  setAttrib(ans,R_NamesSymbol,names);
+  UNPROTECT(10);
+  return(ans);
+} /* mgcv_Rmagic */
+
 
 
 /*main()
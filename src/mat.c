@@ -238,9 +238,6 @@ SEXP mgcv_pmmult2(SEXP b, SEXP c,SEXP bt,SEXP ct, SEXP nthreads) {
 /* parallel matrix multiplication using .Call interface */
   double *A,*B,*C;
   int r,col,n,nt,Ct,Bt;
-  #ifdef SUPPORT_OPENMP
-  int m;
-  #endif
 
   SEXP a; 
  
@@ -262,14 +259,7 @@ SEXP mgcv_pmmult2(SEXP b, SEXP c,SEXP bt,SEXP ct, SEXP nthreads) {
   B = REAL(b);C=REAL(c);
   a = PROTECT(allocMatrix(REALSXP,r,col));
   A = REAL(a);
-  #ifdef SUPPORT_OPENMP
-  m = omp_get_num_procs(); /* detected number of processors */
-  if (nt > m || nt < 1) nt = m; /* no point in more threads than m */
-  /*Rprintf("\n open mp %d cores, %d used\n",m,nt);*/
-  #else
-  /*Rprintf("\n no openmp\n");*/
-  nt = 1; /* no openMP support - turn off threading */
-  #endif
+  nt = mgcv_nthreads(nt);
   mgcv_pmmult(A,B,C,&Bt,&Ct,&r,&col,&n,&nt);
   UNPROTECT(1);
   return(a);
@@ -519,7 +509,7 @@ SEXP mgcv_Rpchol(SEXP Amat,SEXP PIV,SEXP NT,SEXP NB) {
   double *A;
   SEXP rr;
   nb = asInteger(NB);
-  nt = asInteger(NT);
+  nt = mgcv_nthreads(asInteger(NT));
   n = nrows(Amat);
   A = REAL(Amat);
   piv = INTEGER(PIV);
@@ -760,16 +750,21 @@ int mgcv_piqr(double *x,int n, int p, double *beta, int *piv, int nt) {
    
    Parallelization here is based on splitting the application of householder
    rotations to the 'remaining columns' between cores using openMP. 
+
+   A single parallel region is opened for the whole factorization: the serial 
+   pivoting/reflector generation and norm update steps are done by one thread 
+   (`single') and the column updates are shared (`for'), so each column costs 
+   a couple of barriers rather than a fork and join of the thread team.
 */
 
-  int i,k,r,nh,j,one=1,cpt,nth,cpf,ii;
+  int i,k,r,nh,j,one=1,cpt,nth,cpf,ii,done=0;
   double *c,*p0,*p1,*p2,xx,tau,*work,zz,*v,*z,*z1,br;
   /* const char side = 'L';*/
 
   #ifndef SUPPORT_OPENMP
   nt = 1;
   #endif
-
+  if (nt<1) nt = 1;
   c =(double *)R_chk_calloc((size_t) p,sizeof(double)); 
   work =(double *)R_chk_calloc((size_t) (p*nt),sizeof(double));
   k=0;tau=0.0;
@@ -782,76 +777,84 @@ int mgcv_piqr(double *x,int n, int p, double *beta, int *piv, int nt) {
   }
   r = -1;
   nh = n; /* householder length */
-  
-  while (tau > 0) {
-    r++;
-    i=piv[r]; piv[r] = piv[k];piv[k] = i;
-    /* swap r with k O(n) */
-    xx = c[r];c[r] = c[k];c[k] = xx;
-    for (p0 = x + n * r, p1 = x + n * k,p2 = p0 + n;p0<p2;p0++,p1++) {
+  cpt=nth=cpf=0;p0=NULL;xx=br=0.0;
+  if (tau <= 0) done = 1;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(i,j,p1,p2,v,z,z1,zz,ii) num_threads(nt)
+  #endif
+  { while (!done) {
+      #ifdef SUPPORT_OPENMP
+      #pragma omp single
+      #endif
+      { r++;
+        i=piv[r]; piv[r] = piv[k];piv[k] = i;
+        /* swap r with k O(n) */
+        xx = c[r];c[r] = c[k];c[k] = xx;
+        for (p0 = x + n * r, p1 = x + n * k,p2 = p0 + n;p0<p2;p0++,p1++) {
           xx = *p0; *p0 = *p1; *p1 = xx;
-    }
-    /* now generate the householder reflector for column r O(n)*/
-    p0 = x + r * n + r; /* first element of column */
-    p1 = p0 + 1; /* remaining elements of column */
-    xx = *p0; /* contains first element of column to be worked on */
-    F77_CALL(dlarfg)(&nh,&xx,p1,&one,beta+r);
-    /* now xx contains first element of rotated column - i.e. leading 
-       diagonal element of R[r,r]. Elements of column r of x below the 
-       diagonal now contain elements of the housholder vector apart from 
-       the first, which is 1. So if v' = [1,x[(r+1):n,r]'] then 
-       H = I - beta[r]*v*v' */
-
-    /* next apply the rotation to the remaining columns of x O(np) */
+        }
+        /* now generate the householder reflector for column r O(n)*/
+        p0 = x + r * n + r; /* first element of column */
+        p1 = p0 + 1; /* remaining elements of column */
+        xx = *p0; /* contains first element of column to be worked on */
+        F77_CALL(dlarfg)(&nh,&xx,p1,&one,beta+r);
+        /* now xx contains first element of rotated column - i.e. leading 
+           diagonal element of R[r,r]. Elements of column r of x below the 
+           diagonal now contain elements of the housholder vector apart from 
+           the first, which is 1. So if v' = [1,x[(r+1):n,r]'] then 
+           H = I - beta[r]*v*v' */
+
+        /* next apply the rotation to the remaining columns of x O(np) */
        
-    *p0 = 1.0; /* put 1 into leading diagonal element of x so that v = x[r:n,r] */
-    j=p-r-1;
+        *p0 = 1.0; /* put 1 into leading diagonal element of x so that v = x[r:n,r] */
+        j=p-r-1;
     
-    /* now distribute the j columns between nt threads */
-    if (j) {
+        /* now distribute the j columns between nt threads */
+        if (j) {
           cpt = j / nt; /* cols per thread */
           if (cpt * nt < j) cpt++; 
           nth = j/cpt; /* actual number of threads */
           if (nth * cpt < j) nth++;
           cpf = j - cpt * (nth-1); /* columns on final block */
-    } else nth=cpf=cpt=0;
-
-    br = beta[r];
-    #ifdef SUPPORT_OPENMP
-    #pragma omp parallel private(i,j,p1,v,z,z1,zz,ii) num_threads(nt)
-    #endif
-    { j = cpt;
+        } else nth=cpf=cpt=0;
+        br = beta[r];
+      } /* single: implicit barrier */
+      j = cpt;
       if (j) {        
         #ifdef SUPPORT_OPENMP
         #pragma omp for
         #endif
         for (i=0;i<nth;i++) {
-	    if (i == nth-1) j = cpf;
-            p1 = p0 + n + n * cpt *i; 
-            z1=p1+nh;
-            for (ii =0;ii<j;ii++,p1+=n,z1+=n) {
+	  if (i == nth-1) j = cpf; else j = cpt;
+          p1 = p0 + n + n * cpt *i; 
+          z1=p1+nh;
+          for (ii =0;ii<j;ii++,p1+=n,z1+=n) {
             /* apply reflection I - beta v v' */ 
             for (zz=0.0,v=p0,z=p1;z<z1;z++,v++) zz += *z * *v * br;
             for (z=p1,v=p0;z<z1;z++,v++) *z -= zz * *v;
-	   }
-	   /*F77_CALL(dlarfx)(&side, &nh, &j, p0, beta+r, p0 + n + n * cpt * i , &n , work + p * i);*/
-        }
+	  }
+	  /*F77_CALL(dlarfx)(&side, &nh, &j, p0, beta+r, p0 + n + n * cpt * i , &n , work + p * i);*/
+        } /* for: implicit barrier */
       } /* if (j) */
-    } /* end parallel */ 
-    nh--;
-    *p0 = xx; /* now restore leading diagonal element of R to x[r,r] */
-    /* update c, get new k... */
-    k = r + 1;
-    for (tau=0.0,p0+=n,i=r+1;i<p;i++,p0+=n) { 
-          c[i] -= *p0 * *p0;
+      #ifdef SUPPORT_OPENMP
+      #pragma omp single
+      #endif
+      { nh--;
+        *p0 = xx; /* now restore leading diagonal element of R to x[r,r] */
+        /* update c, get new k... */
+        k = r + 1;
+        for (tau=0.0,p2=p0+n,i=r+1;i<p;i++,p2+=n) { 
+          c[i] -= *p2 * *p2;
           if (c[i]>tau) { 
             tau = c[i];
             k=i;
           }
-     }
-     if (r==n-1) tau = 0.0;
-    
-    } /* end while (tau > 0) */
+        }
+        if (r==n-1) tau = 0.0;
+        if (tau <= 0) done = 1;
+      } /* single: implicit barrier, so all threads see `done' */
+    } /* end while (!done) */
+  } /* end parallel */
   
   R_chk_free(c); R_chk_free(work);
   return(r+1);
@@ -870,7 +873,7 @@ int mgcv_piqr(double *x,int n, int p, double *beta, int *piv, int nt) {
   int n,p,nt,*piv,r,*rrp,nb;
   double *x,*beta;
   SEXP rr;
-  nt = asInteger(NT);nb = asInteger(NB);
+  nt = mgcv_nthreads(asInteger(NT));nb = asInteger(NB);
   n = nrows(X);
   p = ncols(X);
   x = REAL(X);beta = REAL(BETA);
@@ -1416,7 +1419,7 @@ void mgcv_Rpbsi(SEXP A, SEXP NT) {
 */
   int nt,r;
   double *R;
-  nt = asInteger(NT);
+  nt = mgcv_nthreads(asInteger(NT));
   r = nrows(A);
   R = REAL(A);
   mgcv_pbsi(R,&r,&nt);
@@ -1517,7 +1520,7 @@ void mgcv_RPPt(SEXP a,SEXP r, SEXP NT) {
 */
   int nt,n;
   double *R,*A;
-  nt = asInteger(NT);
+  nt = mgcv_nthreads(asInteger(NT));
   n = nrows(a);
   A = REAL(a);
   R = REAL(r);
@@ -1674,6 +1677,28 @@ void row_block_reorder(double *x,int *r,int *c,int *nb,int *reverse) {
 } /* row_block_reorder */
 
 
+int mgcv_nthreads(int nt) {
+/* The number of threads that a kernel should use when nt are requested. All the 
+   openMP code should obtain its thread count from here, and pass it via 
+   num_threads(), rather than by resetting the global default with 
+   omp_set_num_threads (which also changes the team size of any subsequent 
+   parallel region in R or other packages, and of multi-threaded BLAS built on 
+   the same openMP runtime). nt < 1 requests all available processors. The
+   processor count respects the affinity mask the process is bound to (e.g. by 
+   OMP_PLACES, taskset or a job scheduler), and the result never exceeds the 
+   openMP thread limit, to avoid oversubscription.
+*/
+  #ifdef SUPPORT_OPENMP
+  int m,l;
+  m = omp_get_num_procs(); /* processors available to this process */
+  l = omp_get_thread_limit();if (l < m) m = l;
+  if (nt > m || nt < 1) nt = m; /* no point in more threads than m */
+  return(nt);
+  #else
+  return(1); /* no openMP support - turn off threading */
+  #endif
+} /* mgcv_nthreads */
+
 int get_qpr_k(int *r,int *c,int *nt) {
 /* For a machine with nt available cores, computes k, the best number of threads to 
    use for a parallel QR.
@@ -2000,12 +2025,15 @@ void mgcv_qr2(double *x, int *r, int *c,int *pivot,double *tau)
    um<-.C("mgcv_qr",as.double(X),as.integer(r),as.integer(c),as.integer(pivot),as.double(tau))
    qr.R(qr(X));matrix(um[[1]],r,c)[1:c,1:c]
 */
-{ int info,*ip,i;
-  double *work;
-  work=(double *)R_chk_calloc((size_t)*r,sizeof(double));
-   /* actual call */
-  /* Args: M, N, A, LDA, TAU, WORK, INFO */
-  F77_CALL(dgeqr2)(r,c,x,r,tau,work,&info); 
+{ int info,*ip,i,lwork=-1;
+  double *work,work1;
+  /* workspace query */
+  /* Args: M, N, A, LDA, TAU, WORK, LWORK, INFO */
+  F77_CALL(dgeqrf)(r,c,x,r,tau,&work1,&lwork,&info);
+  lwork=(int)floor(work1);if (work1-lwork>0.5) lwork++;
+  work=(double *)R_chk_calloc((size_t)lwork,sizeof(double));
+   /* actual call - blocked, so that the bulk of the work is BLAS 3 */
+  F77_CALL(dgeqrf)(r,c,x,r,tau,work,&lwork,&info); 
   R_chk_free(work);
   /*if (*r<*c) lwork= *r; else lwork= *c;*/ 
   for (i=0,ip=pivot;ip < pivot + *c;ip++,i++) *ip = i;
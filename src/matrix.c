@@ -25,6 +25,8 @@ USA.*/
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <R_ext/BLAS.h>
 #include "mgcv.h"
 #include "matrix.h"
 #include "general.h"
@@ -589,55 +591,51 @@ void HQmult(C,U,p,t) matrix C,U;int p,t;
 
    If appropriate zero packing conventions have been used then OrthMult() is
    more efficient....
+
+   The product is formed using the compact WY representation Q = I - V T V',
+   where the columns of V are the ui and T is upper triangular (see Golub 
+   and van Loan, 5.1.7). T is built from V'V by the recursion 
+   T_k = [T_{k-1}, -T_{k-1} V_{k-1}'u_k; 0, 1]. C is copied to column major 
+   storage, so that the whole product costs two dgemm calls rather than 
+   2 U.r level 1 passes through C. 
    */
 
-{ double *u,*CuV,**CM;
-  matrix Cu;
-  int i,j,k;
-  if (p) Cu=initmat(C.c,1);else Cu=initmat(C.r,1);
-  CuV=Cu.V;CM=C.M;
-  if (p)
-  { if (t)
-    { for (k=0;k<U.r;k++) /* loop through the householder matrices */
-      { u=U.M[k];
-        for (i=0;i<C.c;i++)
-	     { CuV[i]=0.0;
-          for (j=0;j<C.r;j++) CuV[i]+=CM[j][i]*u[j];
-	     }
-	     for (i=0;i<C.r;i++) for (j=0;j<C.c;j++) CM[i][j] -= CuV[j]*u[i];
-      }
-    }  else
-    { for (k=U.r-1;k>=0;k--) /* loop through the householder matrices */
-      { u=U.M[k];
-	     for (i=0;i<C.c;i++)
-	     { CuV[i]=0.0;
-	       for (j=0;j<C.r;j++) CuV[i]+=CM[j][i]*u[j];
-	     }
-	     for (i=0;i<C.r;i++) for (j=0;j<C.c;j++) CM[i][j] -= CuV[j]*u[i];
-      }
-    }
-  } else  /* postmultiplication */
-  { if (t)
-    { for (k=U.r-1;k>=0;k--) /* loop through the householder matrices */
-      { u=U.M[k];
-	     for (i=0;i<C.r;i++)
-	     { CuV[i]=0.0;
-	       for (j=0;j<C.c;j++) CuV[i]+=CM[i][j]*u[j];
-	     }
-	     for (i=0;i<C.r;i++) for (j=0;j<C.c;j++) CM[i][j] -= CuV[i]*u[j];
-      }
-      } else
-      { for (k=0;k<U.r;k++) /* loop through the householder matrices */
-      { u=U.M[k];
-	     for (i=0;i<C.r;i++)
-	     { CuV[i]=0.0;
-	       for (j=0;j<C.c;j++) CuV[i]+=CM[i][j]*u[j];
-	     }
-	     for (i=0;i<C.r;i++) for (j=0;j<C.c;j++) CM[i][j] -= CuV[i]*u[j];
-      }
+{ double *V,*Cc,*W,*T,*A,*p0,x,alpha=1.0,beta=0.0,malpha=-1.0;
+  int i,j,k,m,nv,nr,nc;
+  char N='N',Tr='T',L='L',R='R',Up='U';
+  m = U.r;if (m<=0) return;
+  nr = C.r;nc = C.c;
+  if (nr<=0||nc<=0) return;
+  nv = p ? nr : nc; /* length of the householder vectors */
+  V = (double *)R_chk_calloc((size_t)nv*m,sizeof(double));
+  for (k=0;k<m;k++) for (p0=V+(ptrdiff_t)k*nv,j=0;j<nv;j++) p0[j] = U.M[k][j];
+  /* form T, upper triangular */
+  W = (double *)R_chk_calloc((size_t)m*m,sizeof(double));
+  T = (double *)R_chk_calloc((size_t)m*m,sizeof(double));
+  F77_CALL(dgemm)(&Tr,&N,&m,&m,&nv,&alpha,V,&nv,V,&nv,&beta,W,&m); /* W = V'V */
+  for (k=0;k<m;k++) {
+    T[k + k * m] = 1.0;
+    for (i=0;i<k;i++) {
+      for (x=0.0,j=i;j<k;j++) x += T[i + j * m] * W[j + k * m];
+      T[i + k * m] = -x;
     }
   }
-  freemat(Cu);
+  R_chk_free(W);
+  /* copy C to column major storage */ 
+  Cc = (double *)R_chk_calloc((size_t)nr*nc,sizeof(double));
+  for (i=0;i<nr;i++) for (p0=C.M[i],j=0;j<nc;j++) Cc[i + (ptrdiff_t)j * nr] = p0[j];
+  A = (double *)R_chk_calloc((size_t)m*(p ? nc : nr),sizeof(double));
+  if (p) { /* QC = C - V T V'C, Q'C = C - V T'V'C */
+    F77_CALL(dgemm)(&Tr,&N,&m,&nc,&nr,&alpha,V,&nr,Cc,&nr,&beta,A,&m); /* A = V'C */
+    F77_CALL(dtrmm)(&L,&Up,t ? &Tr : &N,&N,&m,&nc,&alpha,T,&m,A,&m); /* A = T A or T'A */
+    F77_CALL(dgemm)(&N,&N,&nr,&nc,&m,&malpha,V,&nr,A,&m,&alpha,Cc,&nr); /* C = C - V A */
+  } else { /* CQ = C - C V T V', CQ' = C - C V T'V' */
+    F77_CALL(dgemm)(&N,&N,&nr,&m,&nc,&alpha,Cc,&nr,V,&nc,&beta,A,&nr); /* A = CV */
+    F77_CALL(dtrmm)(&R,&Up,t ? &Tr : &N,&N,&nr,&m,&alpha,T,&m,A,&nr); /* A = A T or A T' */
+    F77_CALL(dgemm)(&N,&Tr,&nr,&nc,&m,&malpha,A,&nr,V,&nc,&alpha,Cc,&nr); /* C = C - A V' */
+  }
+  for (i=0;i<nr;i++) for (p0=C.M[i],j=0;j<nc;j++) p0[j] = Cc[i + (ptrdiff_t)j * nr];
+  R_chk_free(V);R_chk_free(T);R_chk_free(Cc);R_chk_free(A);
 }
 
 
@@ -24,10 +24,14 @@ USA. */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <Rconfig.h>
 #include "tprs.h"
 #include "mgcv.h"
 #include "matrix.h"
 #include "qp.h"
+#ifdef SUPPORT_OPENMP
+#include <omp.h>
+#endif
 #include "general.h"
 #include <R_ext/Lapack.h>
 #include <R_ext/BLAS.h>
@@ -246,95 +250,247 @@ void getFS(double *x,int n,double *S,double *F) {
 } /* end of getFS*/
 
 
-void crspl(double *x,int *n,double *xk, int *nk,double *X,double *S, double *F,int *Fsupplied) {
-/* Routine to compute model matrix and optionally penalty matrix for cubic regression spline.
-   * nk knots are supplied in an increasing sequence in xk. 
-   * n data are in x (arbitrary order).
-   * If Fsupplied!=0 then F' is matrix mapping function values at knots to second derivs,
-     otherwise F and the penalty matrix S are computed and returned, along with X.         
+static void crspl_interval(double *x,int n,double *xk, int nk,int *jj) {
+/* Finds the knot interval, jj[i], containing each of the n data, x[i]: by a single 
+   sweep through the knots if x is in ascending order, and otherwise by local search 
+   from the previous interval, or bisection. Data outside the knot range are assigned 
+   to the end intervals. 
 */
-  int i,j=0,k,extrapolate,jup,jmid;
-  double xlast=0.0,h=0.0,xi,kmax,kmin,ajm,ajp,cjm,cjp,*Fp,*Fp1,*Xp,xj,xj1,xik;
-  if (! *Fsupplied) getFS(xk,*nk,S,F);
-  kmax = xk[*nk-1];kmin = xk[0];
-  for (i=0;i<*n;i++) { /* loop through x */
-    xi = x[i];extrapolate=0;
+  int i,j=0,jup,jmid,sorted;
+  double xlast=0.0,h=0.0,xi,kmax,kmin;
+  kmax = xk[nk-1];kmin = xk[0];
+  for (sorted=1,i=1;i<n;i++) if (x[i]<x[i-1]) { sorted=0;break;}
+  if (sorted) for (i=0;i<n;i++) { /* merge like sweep through knots */
+    xi = x[i];
+    while (j < nk-2 && xi > xk[j+1]) j++;
+    /* now xk[j] <= x[i] <= xk[j+1], unless x[i] outside knot range */
+    jj[i] = j;
+  } else for (i=0;i<n;i++) { /* loop through x */
+    xi = x[i];
     /* find interval containing x[i] */
-    if (xi < kmin||xi>kmax) {
-      extrapolate=1;
-    } else if (i>0 && fabs(xlast-xi) < 2*h) { /* use simple direct search */
+    if (xi < kmin) j = 0; 
+    else if (xi>kmax) j = nk-2;
+    else if (i>0 && fabs(xlast-xi) < 2*h) { /* use simple direct search */
       while (xi <= xk[j] && j > 0) j--;
-      while (xi > xk[j+1] && j < *nk-2) j++;
+      while (j < nk-2 && xi > xk[j+1]) j++;
       /* next line should not be needed, except under dodgy use of 
          fpu registers during optimization... */
-      if (j<0) j=0;if (j > *nk-2) j = *nk - 2; 
+      if (j<0) j=0;if (j > nk-2) j = nk - 2; 
       /* now xk[j] <= x[i] <= xk[j+1] */ 
+      h = xk[j+1] - xk[j];
     } else { /* bisection search required */ 
-      j=0;jup=*nk-1;
+      j=0;jup=nk-1;
       while (jup-j>1) {
         jmid = (jup+j) >> 1; /* a midpoint */
         if (xi > xk[jmid]) j = jmid; else jup = jmid;
       }
       /* now xk[j] <= x[i] <= xk[j+1] */ 
+      h = xk[j+1] - xk[j];
     } /* end of bisection */
-    
-    /* knot interval containing x[i] now known. Compute spline basis */ 
-    if (extrapolate) { /* x[i] is outside knot range */
-      if (xi<kmin) {
-        j = 0;
-        h = xk[1] - kmin;
-        xik = xi - kmin;
-        cjm = -xik*h/3;
-        cjp = -xik*h/6;
-        Xp = X + i; /* ith row of X */
-        for (Fp = F,Fp1 = F + *nk,k=0;k < *nk;k++,Xp += *n,Fp++,Fp1++) *Xp = cjm * *Fp + cjp * *Fp1 ;
-        X[i] += 1 - xik/h;
-        X[i + *n] += xik/h;
-      } else { /* xi>kmax */
-        j = *nk-1;
-        h = kmax - xk[j-1];
-        xik = xi - kmax;
-        cjm= xik*h/6;
-        cjp = xik*h/3;
-        Xp = X + i; /* ith row of X */
-        for (Fp1 = F+ j * *nk,Fp = Fp1 - *nk,k=0;k < *nk;k++,Xp += *n,Fp++) 
-             *Xp = cjm * *Fp + cjp * *Fp1  ;
-        X[i + *n * (*nk-2)] += - xik/h;
-        X[i + *n * (*nk-1)] += 1+ xik/h;
-      }
-    } else { /* routine evaluation */
-      xj = xk[j];xj1=xk[j+1];
-      h = xj1-xj; /* interval width */
-      ajm = (xj1 - xi);ajp = (xi-xj);
-      cjm = (ajm*(ajm*ajm/h - h))/6;
-      cjp = (ajp*(ajp*ajp/h - h))/6;
-      ajm /= h;ajp /= h;
-      
-      Xp = X + i; /* ith row of X */
-
-      for (Fp = F+ j * *nk, Fp1 = F+(j+1)* *nk,k=0;k < *nk;k++,Xp += *n,Fp++,Fp1++) 
-        *Xp = cjm * *Fp + cjp * *Fp1;
-
-      Xp = X + i + j * *n;
-      *Xp += ajm; Xp += *n; *Xp += ajp;
-    } 
-    /* basis computation complete */
+    jj[i] = j;
     xlast=xi;
   }
+} /* crspl_interval */
+
+static inline void crspl_ab(double xi,int j,double *xk,int nk,double *a) {
+/* The 4 basis coefficients ajm, ajp, cjm, cjp for datum xi in knot interval j 
+   (as found by crspl_interval), returned in a. Data outside the knot range 
+   are linearly extrapolated. */
+  double h,xj,xj1,am,ap,xik;
+  xj = xk[j];xj1 = xk[j+1];
+  h = xj1-xj; /* interval width */
+  if (xi < xk[0]) {
+    xik = xi - xj;
+    a[2] = -xik*h/3;
+    a[3] = -xik*h/6;
+    a[0] = 1 - xik/h;
+    a[1] = xik/h;
+  } else if (xi > xk[nk-1]) {
+    xik = xi - xj1;
+    a[2] = xik*h/6;
+    a[3] = xik*h/3;
+    a[0] = - xik/h;
+    a[1] = 1 + xik/h;
+  } else {
+    am = (xj1 - xi);ap = (xi-xj);
+    a[2] = (am*(am*am/h - h))/6;
+    a[3] = (ap*(ap*ap/h - h))/6;
+    a[0] = am/h;a[1] = ap/h;
+  }
+} /* crspl_ab */
 
+void crspl(double *x,int *n,double *xk, int *nk,double *X,double *S, double *F,int *Fsupplied,int *nt) {
+/* Routine to compute model matrix and optionally penalty matrix for cubic regression spline.
+   * nk knots are supplied in an increasing sequence in xk. 
+   * n data are in x (arbitrary order).
+   * If Fsupplied!=0 then F' is matrix mapping function values at knots to second derivs,
+     otherwise F and the penalty matrix S are computed and returned, along with X.         
+   * nt is the number of threads to use. 
+   The rows of X are produced in chunks, shared between threads. For each chunk the 
+   knot intervals are found first, and then the rows are computed.
+*/
+  int i,j,k,*jj,nth,c,nc,cs=1024,i0,ni;
+  double ab[4],*Xp,*Fp,*Fp1;
+  if (! *Fsupplied) getFS(xk,*nk,S,F);
+  nth = mgcv_nthreads(*nt);
+  nc = *n/cs; if (nc * cs < *n) nc++; /* number of chunks */
+  if (nth > nc) nth = nc > 0 ? nc : 1;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(i,j,k,jj,ab,Xp,Fp,Fp1,c,i0,ni) num_threads(nth)
+  #endif
+  { /* start of parallel section */
+  jj = (int *)R_chk_calloc((size_t) cs,sizeof(int));
+  #ifdef SUPPORT_OPENMP
+  #pragma omp for schedule(static)
+  #endif
+  for (c=0;c<nc;c++) {
+    i0 = c * cs;ni = *n - i0; if (ni > cs) ni = cs;
+    crspl_interval(x+i0,ni,xk,*nk,jj);
+    for (i=0;i<ni;i++) { /* row i0+i of X */
+      j = jj[i];
+      crspl_ab(x[i0+i],j,xk,*nk,ab);
+      Xp = X + i0 + i;
+      for (Fp = F+ j * *nk, Fp1 = Fp + *nk,k=0;k < *nk;k++,Xp += *n,Fp++,Fp1++) 
+        *Xp = ab[2] * *Fp + ab[3] * *Fp1;
+      Xp = X + i0 + i + (ptrdiff_t) j * *n;
+      *Xp += ab[0]; Xp += *n; *Xp += ab[1];
+    }
+  }
+  R_chk_free(jj);
+  } /* end of parallel section */
 } /* end crspl */
 
+void crspl_coef(double *x,int *n,double *xk, int *nk,int *jj,double *a,int *nt) {
+/* Compact form of the cubic regression spline basis with the nk knots in 
+   increasing sequence xk, evaluated at the n data in x (arbitrary order). 
+   For each x[i] the knot interval index jj[i] (0..nk-2) and the 4 coefficients
+   ajm = a[i], ajp = a[i+n], cjm = a[i+2n] and cjp = a[i+3n] are returned, such
+   that, with j = jj[i], row i of the model matrix is 
+      ajm e_j' + ajp e_{j+1}' + cjm F[j,] + cjp F[j+1,]
+   where e_j is the jth unit vector and F[j,] is the jth row of F (i.e. F+j*nk, 
+   F as returned by getFS, so F' maps function values at knots to second 
+   derivatives). Values outside the knot range are linearly extrapolated.
+   The data are split into blocks processed in parallel, using nt threads.
+*/
+  int b,nb,bs,i0,i1,i,nth;
+  double *ajm,*ajp,*cjm,*cjp,ab[4];
+  ajm = a;ajp = a + *n;cjm = ajp + *n;cjp = cjm + *n;
+  nth = mgcv_nthreads(*nt);
+  nb = *n/2000; if (nb > nth) nb = nth; /* blocks are not worth having if too small */ 
+  if (nb < 1) nb = 1;
+  bs = *n/nb; if (bs * nb < *n) bs++; /* block size */
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(b,i0,i1,i,ab) num_threads(nb)
+  #endif
+  for (b=0;b<nb;b++) {
+    i0 = b * bs;
+    if (i0 < *n) { 
+      i1 = b==nb-1 ? *n : i0 + bs;
+      crspl_interval(x+i0,i1-i0,xk,*nk,jj+i0);
+      for (i=i0;i<i1;i++) {
+        crspl_ab(x[i],jj[i],xk,*nk,ab);
+        ajm[i] = ab[0];ajp[i] = ab[1];cjm[i] = ab[2];cjp[i] = ab[3];
+      }
+    }
+  }
+} /* end crspl_coef */
+
+/* Products with the compact cr basis. Write row i of X as u_i'P where u_i is the 
+   2nk vector that is zero apart from ajm, ajp in positions j, j+1 and cjm, cjp in 
+   positions nk+j, nk+j+1 (see crspl_coef), and P is 2nk by p. For the basis 
+   itself P = [I;F'], but any constraint or re-parameterization applied to the 
+   columns of X can be applied to P instead, and a `by' variable to the rows of a 
+   (constant row offsets, from `sweep and drop' constraints, are left to the caller). 
+   Then X'WX = P'MP, where M = sum_i w_i u_i u_i' is accumulated in O(n), and 
+   similarly for the other products. Only the final products with P cost more 
+   than O(n). */
+
+void cr_XtWX(double *XtWX,int *jj1,double *a1,double *P1,int *nk1,int *p1,
+             int *jj2,double *a2,double *P2,int *nk2,int *p2,double *w,int *n) {
+/* Forms the p1 by p2 matrix X1'WX2 for the cr bases held in compact form in 
+   (jj1,a1,P1) and (jj2,a2,P2), where W = diag(w). The two may be the same. */
+  int i,p,q,n1,n2,id1[4],id2[4],one=1,zero=0;
+  double *M,*MP,v1[4],v2[4],wv;
+  n1 = 2 * *nk1;n2 = 2 * *nk2;
+  M = (double *)R_chk_calloc((size_t)n1*n2,sizeof(double));
+  for (i=0;i<*n;i++) { /* accumulate M, only touching 4 by 4 blocks */
+    id1[0] = jj1[i];id1[1] = id1[0]+1;id1[2] = id1[0] + *nk1;id1[3] = id1[2]+1;
+    id2[0] = jj2[i];id2[1] = id2[0]+1;id2[2] = id2[0] + *nk2;id2[3] = id2[2]+1;
+    for (p=0;p<4;p++) { v1[p] = a1[i + (ptrdiff_t) p * *n];v2[p] = a2[i + (ptrdiff_t) p * *n];}
+    for (p=0;p<4;p++) { 
+      wv = w[i]*v1[p];
+      for (q=0;q<4;q++) M[id1[p] + id2[q] * n1] += wv * v2[q];
+    }
+  }
+  MP = (double *)R_chk_calloc((size_t)n1 * *p2,sizeof(double));
+  mgcv_mmult(MP,M,P2,&zero,&zero,&n1,p2,&n2); /* MP = M P2 */
+  mgcv_mmult(XtWX,P1,MP,&one,&zero,p1,p2,&n1); /* X1'WX2 = P1'M P2 */
+  R_chk_free(M);R_chk_free(MP);
+} /* cr_XtWX */
+
+void cr_XtWXd(double *XtWX,int *jj,double *a,double *P,int *nk,int *p,
+              double *Xd,int *pd,double *w,int *n) {
+/* Forms the p by pd matrix X'WXd for the cr basis held in compact form in 
+   (jj,a,P) and the n by pd dense matrix Xd, where W = diag(w). */
+  int i,j,k,n2,one=1,zero=0;
+  double *G,*Gk,*Xk,x;
+  ptrdiff_t n1=*n,n3=2 * n1;
+  n2 = 2 * *nk;
+  G = (double *)R_chk_calloc((size_t)n2 * *pd,sizeof(double));
+  for (k=0;k<*pd;k++) { /* G[,k] = sum_i w_i u_i Xd[i,k] */
+    Gk = G + (ptrdiff_t) k * n2;Xk = Xd + (ptrdiff_t) k * n1;
+    for (i=0;i<*n;i++) { 
+      j = jj[i];x = w[i] * Xk[i];
+      Gk[j] += a[i] * x;Gk[j+1] += a[i + n1] * x;
+      Gk[*nk + j] += a[i + n3] * x;Gk[*nk + j + 1] += a[i + n3 + n1] * x;
+    }
+  }
+  mgcv_mmult(XtWX,P,G,&one,&zero,p,pd,&n2); /* P'G */
+  R_chk_free(G);
+} /* cr_XtWXd */
+
+void cr_XtWz(double *XtWz,int *jj,double *a,double *w,double *z,int *n,double *P,int *nk,int *p) {
+/* Forms the p vector X'Wz for the cr basis held in compact form in (jj,a,P), 
+   where W = diag(w). */
+  int i,j,n2,one=1,zero=0;
+  double *v,wz;
+  ptrdiff_t n1=*n;
+  n2 = 2 * *nk;
+  v = (double *)R_chk_calloc((size_t)n2,sizeof(double));
+  for (i=0;i<*n;i++) {
+    j = jj[i];wz = w[i]*z[i];
+    v[j] += wz * a[i];v[j+1] += wz * a[i + n1];
+    v[*nk + j] += wz * a[i + 2 * n1];v[*nk + j + 1] += wz * a[i + 3 * n1];
+  }
+  mgcv_mmult(XtWz,P,v,&one,&zero,p,&one,&n2); /* P'v */
+  R_chk_free(v);
+} /* cr_XtWz */
+
+void cr_Xb(double *f,int *jj,double *a,double *b,int *n,double *P,int *nk,int *p) {
+/* Forms the n vector f = Xb for the cr basis held in compact form in (jj,a,P). */
+  int i,j,n2,one=1,zero=0;
+  double *Pb;
+  ptrdiff_t n1=*n;
+  n2 = 2 * *nk;
+  Pb = (double *)R_chk_calloc((size_t)n2,sizeof(double));
+  mgcv_mmult(Pb,P,b,&zero,&zero,&n2,&one,p); /* Pb = P b */
+  for (i=0;i<*n;i++) {
+    j = jj[i];
+    f[i] = a[i] * Pb[j] + a[i + n1] * Pb[j+1] + a[i + 2 * n1] * Pb[*nk + j] + a[i + 3 * n1] * Pb[*nk + j + 1];
+  }
+  R_chk_free(Pb);
+} /* cr_Xb */
 
-
-void MinimumSeparation(double *x,int *n, int *d,double *t,int *m,double *dist) {
+void MinimumSeparation(double *x,int *n, int *d,double *t,int *m,double *dist,int *nt) {
 /* For each of n ppoints point x[i,] calculates the minimum Euclidian distance 
    to a point in m by d matrix t. These distances are stored in dist. 
+   nt is the number of threads to use.
 */
   int one=1,*ni;
   kdtree_type kd;
-  kd_tree(t,m,d,&kd); /* build kd tree for target points */
+  kd_tree(t,m,d,&kd,*nt); /* build kd tree for target points */
   ni = (int *)R_chk_calloc((size_t)*n,sizeof(int));
-  k_newn_work(x,kd,t,dist,ni,n,m,d,&one);
+  k_newn_work(x,kd,t,dist,ni,n,m,d,&one,*nt,0.0,0); /* exact search */
   // for (i=0;i<*n;i++) {
   //  k = closest(&kd,t,x + i * *d,*m,&j,-1); /* index of nearest neighbour of x[i,] */
   //  dist[i] = xidist(x + i * *d,t,k,*d, *m); /* distance to this nearest neighbour */
@@ -369,21 +525,19 @@ void RuniqueCombs(double *X,int *ind,int *r, int *c)
 
 /* X is a matrix. This routine finds its unique rows and strips out the 
    duplicates. This is useful for finding out the number of unique covariate
-   combinations present in a set of data. */
-
-{ matrix B,Xd;
-  int i,*ind1;
-  B=Rmatrix(X,(long)(*r),(long)(*c));
-  Xd=initmat(B.r,B.c+1);
-  Xd.c--;mcopy(&B,&Xd);freemat(B);Xd.c++;
-  for (i=0;i<Xd.r;i++) Xd.M[i][Xd.c-1]=(double)i;
-  ind1=Xd_strip(&Xd);
-  for (i=0;i<*r;i++) ind[i] = ind1[i]; /* copy index for return */
-  Xd.c--; /* hide index array  */
-  RArrayFromMatrix(X,Xd.r,&Xd);  /* NOTE: not sure about rows here!!!! */
-  *r = (int)Xd.r; 
-  freemat(Xd);R_chk_free(ind1);
-
+   combinations present in a set of data. On exit the first *r rows of X 
+   (now *r by *c) are the unique rows, and ind[i] is the unique row matching 
+   row i of the original X. Works directly on X via unique_rows. */
+
+{ int i,j,nu,*ui;
+  double *Xu;
+  ui = (int *)R_chk_calloc((size_t) *r,sizeof(int));
+  nu = unique_rows(X,*r,*c,ind,ui,1);
+  Xu = (double *)R_chk_calloc((size_t) nu * *c,sizeof(double));
+  for (j=0;j < *c;j++) for (i=0;i<nu;i++) Xu[i + j * nu] = X[ui[i] + j * *r];
+  for (i=0;i < nu * *c;i++) X[i] = Xu[i];
+  *r = nu; 
+  R_chk_free(ui);R_chk_free(Xu);
 }
 
 void RMonoCon(double *Ad,double *bd,double *xd,int *control,double *lower,double *upper,int *n)
@@ -419,7 +573,7 @@ void RMonoCon(double *Ad,double *bd,double *xd,int *control,double *lower,double
 
 void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd,
             double *Afd,double *Hd,double *Sd,
-            int *off,int *dim,double *theta, int *m,int *nar)
+            int *off,int *dim,double *theta, int *m,int *nar,int *active)
 
 /* Interface routine for PCLS the constrained penalized weighted least squares solver.
    nar is an array of dimensions. Let:
@@ -445,9 +599,16 @@ void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd
 
    on exit p contains the best fit parameter vector. 
 
+   active is an array of length np+1. On entry active[0] is the number of rows of 
+   Ain to use as the initial working set for the active set search, and these 
+   rows are listed in active[1..active[0]], so that a solve can be warm started 
+   from the active set of a previous one (active[0]=0 for a cold start). 
+   On exit active[0] is the number of active inequality constraints at the 
+   solution, which are listed in the following elements of active.
+
 */
 { matrix y,X,p,w,Ain,Af,b,H,*S;
-  int n,np,i,*active;
+  int n,np,i;
  
   np=nar[1];n=nar[0];
   /* unpack from R into matrices */
@@ -465,7 +626,7 @@ void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd
   RUnpackSarray(*m,S,Sd);
   
   if (nar[4]) H=initmat(y.r,y.r); else H.r=H.c=0L;
-  active=(int *)R_chk_calloc((size_t)(p.r+1),sizeof(int)); /* array for active constraints at best fit active[0] will be  number of them */
+  if (nar[2]==0) active[0]=0; /* nothing to warm start from */
   /* call routine that actually does the work */
  
   PCLS(&X,&p,&y,&w,&Ain,&b,&Af,&H,S,off,theta,*m,active);
@@ -475,8 +636,6 @@ void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd
  
   if (H.r) RArrayFromMatrix(Hd,H.r,&H);
   /* clear up .... */
-  R_chk_free(active);
- 
   for (i=0;i< *m;i++) freemat(S[i]);
   if (*m) R_chk_free(S);
  
@@ -26,6 +26,19 @@ void gdi2(double *X,double *E,double *Es,double *rS,double *U1,
 
 void pls_fit1(double *y,double *X,double *w,double *E,double *Es,int *n,int *q,int *rE,double *eta,
 	      double *penalty,double *rank_tol,int *nt);
+SEXP mgcv_pirls(SEXP X,SEXP Y,SEXP PW,SEXP OFF,SEXP ETA,SEXP NULLCOEF,SEXP ST,SEXP SR,SEXP EB,
+                SEXP ICTRL,SEXP DCTRL);
+SEXP mgcv_Rgdi1(SEXP X,SEXP GOOD,SEXP E,SEXP Es,SEXP rS,SEXP U1,SEXP sp,SEXP z,SEXP w,SEXP wf,
+                SEXP alpha,SEXP mu,SEXP eta,SEXP y,SEXP p_weights,SEXP g1,SEXP g2,SEXP g3,SEXP g4,
+                SEXP V0,SEXP V1,SEXP V2,SEXP V3,SEXP beta,SEXP rSncol,SEXP ICTRL,SEXP DCTRL);
+SEXP mgcv_Rgdi2(SEXP X,SEXP GOOD,SEXP E,SEXP Es,SEXP rS,SEXP U1,SEXP sp,SEXP theta,SEXP z,SEXP w,
+                SEXP wf,SEXP Dth,SEXP Det,SEXP Det2,SEXP Dth2,SEXP Det_th,SEXP Det2_th,SEXP Det3,
+                SEXP Det_th2,SEXP Det4,SEXP Det3_th,SEXP Det2_th2,SEXP beta,SEXP ldet,SEXP rSncol,
+                SEXP ICTRL,SEXP DCTRL);
+SEXP mgcv_Rpls_fit1(SEXP y,SEXP X,SEXP GOOD,SEXP w,SEXP E,SEXP Es,SEXP RE,SEXP RANK_TOL,SEXP NT);
+SEXP mgcv_Rmagic(SEXP y,SEXP X,SEXP sp,SEXP def_sp,SEXP S,SEXP H,SEXP L,SEXP lsp0,SEXP gamma,
+                 SEXP scale,SEXP control,SEXP cS,SEXP rank_tol,SEXP tol,SEXP norm_const,
+                 SEXP n_score,SEXP NT);
 
 void get_detS2(double *sp,double *sqrtS, int *rSncol, int *q,int *M, int * deriv, 
                double *det, double *det1, double *det2, double *d_tol,
@@ -34,37 +47,38 @@ void get_detS2(double *sp,double *sqrtS, int *rSncol, int *q,int *M, int * deriv
 void get_stableS(double *S,double *Qf,double *sp,double *sqrtS, int *rSncol, int *q,int *M, int * deriv, 
                double *det, double *det1, double *det2, double *d_tol,
 		 double *r_tol,int *fixed_penalty);
+void stableS_cache_clear(void);
 
 /* cox model routines */
 
 void coxpred(double *X,double *t,double *beta,double *Vb,double *a,double *h,double *q,
-             double *tr,int *n,int *p, int *nt,double *s,double *se);
-void coxpp(double *eta,double *X,int *r, int *d,double *h,double *q,double *km,
-	   int *n,int *p, int *nt);
-void coxlpl(double *eta,double *X,int *r, int *d,double *tr, 
+             double *tr,int *n,int *p, int *nt,double *s,double *se,int *m,int *nthreads);
+void coxpp(double *eta,double *X,int *r, int *d,int *e,int *so,int *st,double *h,double *q,double *km,
+	   int *n,int *p, int *nt,int *nthreads);
+void coxlpl(double *eta,double *X,int *r, int *d,int *e,int *so,int *st,double *tr, 
             int *n,int *p, int *nt,double *lp,double *g,double *H,
             double *d1beta,double *d1H,double *d2beta,
-            double *d2H,int *n_sp,int *deriv);
+            double *d2H,int *n_sp,int *deriv,int *nthreads);
 
 /* MVN smooth additive */
 void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi,
             int *m,double *ll,double *lb,double *lbb,double *dbeta,
-            double *dH,int *deriv,int *nsp,int *nt);
+            double *dH,int *deriv,int *nsp,int *nt,int *ytr);
 
 /* various service routines */
 
 void tweedious(double *w,double *w1,double *w2, double *w1p,double *w2p,double *w2pp, 
 	       double *y,double *eps,int *n,
-               double *th,double *rho,double *a, double *b);
+               double *th,double *rho,double *a, double *b,int *nt,double *tol);
 void psum(double *y, double *x,int *index,int *n);
 void rwMatrix(int *stop,int *row,double *w,double *X,int *n,int *p);
 void in_out(double *bx, double *by, double *break_code, double *x,double *y,int *in, int *nb, int *n);
 void Rlanczos(double *A,double *U,double *D,int *n, int *m, int *lm,double *tol,int *nt);
 void RuniqueCombs(double *X,int *ind,int *r, int *c);
-void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd,double *Afd,double *Hd,double *Sd,int *off,int *dim,double *theta, int *m,int *nar);
+void  RPCLS(double *Xd,double *pd,double *yd, double *wd,double *Aind,double *bd,double *Afd,double *Hd,double *Sd,int *off,int *dim,double *theta, int *m,int *nar,int *active);
 void RMonoCon(double *Ad,double *bd,double *xd,int *control,double *lower,double *upper,int *n);
 /*void MinimumSeparation(double *gx,double *gy,int *gn,double *dx,double *dy, int *dn,double *dist);*/
-void MinimumSeparation(double *x,int *n, int *d,double *t,int *m,double *dist);
+void MinimumSeparation(double *x,int *n, int *d,double *t,int *m,double *dist,int *nt);
 void rksos(double *x,int *n,double *eps);
 void pivoter(double *x,int *r,int *c,int *pivot, int *col, int *reverse);
 
@@ -81,6 +95,7 @@ void update_qr(double *Q,double *R,int *n, int *q,double *lam, int *k);
 extern void mgcv_mmult(double *A,double *B,double *C,int *bt,int *ct,int *r,int *c,int *n);
 void mgcv_pmmult(double *A,double *B,double *C,int *bt,int *ct,int *r,int *c,int *n,int *nt);
 SEXP mgcv_pmmult2(SEXP b, SEXP c,SEXP bt,SEXP ct, SEXP nthreads);
+int mgcv_nthreads(int nt);
 void mgcv_mmult0(double *A,double *B,double *C,int *bt,int *ct,int *r,int *c,int *n);
 void mgcv_svd_full(double *x,double *vt,double *d,int *r,int *c);
 void mgcv_symeig(double *A,double *ev,int *n,int *use_dsyevd, int *get_vectors,int *descending);
@@ -106,11 +121,18 @@ SEXP mgcv_Rpchol(SEXP Amat,SEXP PIV,SEXP NT,SEXP NB);
 
 /* basis constructor/prediction routines*/
 
-void crspl(double *x,int *n,double *xk, int *nk,double *X,double *S, double *F,int *Fsupplied);
+void crspl(double *x,int *n,double *xk, int *nk,double *X,double *S, double *F,int *Fsupplied,int *nt);
+void crspl_coef(double *x,int *n,double *xk, int *nk,int *jj,double *a,int *nt);
+void cr_XtWX(double *XtWX,int *jj1,double *a1,double *P1,int *nk1,int *p1,
+             int *jj2,double *a2,double *P2,int *nk2,int *p2,double *w,int *n);
+void cr_XtWXd(double *XtWX,int *jj,double *a,double *P,int *nk,int *p,
+              double *Xd,int *pd,double *w,int *n);
+void cr_XtWz(double *XtWz,int *jj,double *a,double *w,double *z,int *n,double *P,int *nk,int *p);
+void cr_Xb(double *f,int *jj,double *a,double *b,int *n,double *P,int *nk,int *p);
 void predict_tprs(double *x, int *d,int *n,int *m,int *k,int *M,double *Xu,int *nXu,
-                  double *UZ,double *by,int *by_exists,double *X);
+                  double *UZ,double *by,int *by_exists,double *X,int *nt);
 void construct_tprs(double *x,int *d,int *n,double *knt,int *nk,int *m,int *k,double *X,double *S,
-                    double *UZ,double *Xu,int *nXu,double *C);
+                    double *UZ,double *Xu,int *nXu,double *C,int *rand_eig,int *nt);
 void gen_tps_poly_powers(int *pi,int *M,int *m, int *d);
 void boundary(int *G, double *d, double *dto, double *x0, double *y0, double *dx, double *dy,
               int *nx, int *ny, double *x, double *y,double *break_code, int *n, int *nb);
@@ -135,17 +157,24 @@ typedef struct {
       d, /* dimension */
     n; /* number of points that tree relates to */
   double huge; /* number indicating an open boundary */
+  double *Xo; /* points in ind order, stored row-wise (see kd_points) */
 } kdtree_type;
 
-void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,int *n,int *d,int *k);
-void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get_a);
-void Rkdtree(double *X,int *n, int *d,int *idat,double *ddat);
-void Rkdnearest(double *X,int *idat,double *ddat,int *n,double *x, int *m, int *ni, double *dist,int *k);
-void Rkradius(double *r,int *idat,double *ddat,double *X,double *x,int *m,int *off,int *ni,int *op);
+void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,int *n,int *d,int *k,int nt,double eps,int maxv);
+void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get_a,int *nt,double *eps,int *maxv);
+void Rkdtree(double *X,int *n, int *d,int *idat,double *ddat,int *nt);
+void Rkdnearest(double *X,int *idat,double *ddat,int *n,double *x, int *m, int *ni, double *dist,int *k,int *nt,double *eps,int *maxv);
+void Rkradius(double *r,int *idat,double *ddat,double *X,double *x,int *m,int *off,int *ni,int *op,int *nt);
+void Rkdsave(int *idat,double *ddat,double *X,char **fname,int *ok);
+SEXP mgcv_kdload(SEXP FNAME);
+SEXP mgcv_kdnearest(SEXP KD,SEXP X,SEXP K,SEXP NT,SEXP EPS,SEXP MAXV);
+SEXP mgcv_kdradius(SEXP KD,SEXP X,SEXP R,SEXP NT);
 double xidist(double *x,double *X,int i,int d, int n);
 int closest(kdtree_type *kd, double *X,double *x,int n,int *ex,int nex);
-void kd_tree(double *X,int *n, int *d,kdtree_type *kd);
+void kd_tree(double *X,int *n, int *d,kdtree_type *kd,int nt);
+int kd_nbox(int n);
 void free_kdtree(kdtree_type kd);
+void kd_points(kdtree_type *kd,double *X);
 
 void tri2nei(int *t,int *nt,int *n,int *d,int *off);
 void nei_penalty(double *X,int *n,int *d,double *D,int *ni,int *ii,int *off,
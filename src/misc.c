@@ -21,6 +21,7 @@ USA. */
 #include <math.h>
 #include <R.h>
 #include <Rmath.h>
+#include <Rconfig.h>
 #include "mgcv.h"
 
 /* Compute reproducing kernel for spline on the sphere */
@@ -156,81 +157,55 @@ double *backward_buf(double *buf,int *jal,int *j0,int *j_lo,int *j_hi,int update
 } /* backward_buf */
 
 
-void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
-	       double *w2pp,double *y,double *eps,int *n,
-               double *th,double *rho,double *a, double *b)
-/* Routine to perform tedious series summation needed for Tweedie distribution
-   evaluation, following Dunn & Smyth (2005) Statistics and Computing 15:267-280.
-   Notation as in that paper. For 
-   
-   log W returned in w. (where W means sum_j W_j)
-   d logW / drho in w1, 
-   d2 logW / d rho2 in w2.
-   d logW / dth in w1p
-   d2 logW / dth2 in w2p
-   d2 logW / dth drho in W2pp
-
-   rho=log(phi), and th defines p = (a + b * exp(th))/(exp(th)+1). 
-   note, 1<a<b<2 (all strict) 
-
-   The somewhat involved approach is all about avoiding overflow or underflow. 
-   Extensive use is made of 
-        log { sum_j exp(x_j)} = log { sum_j exp(x_j-x_max) } + x_max
-   digamma and trigamma functions are from Rmath.h
-
-
-
-   NOTE: still some redundancy for readability 
- 
+static void tweedie_terms(double *wb,double *wb1,double *wp1,double *wp2,double *wpp,int jb,int j,
+			  double alpha,double onep,double onep2,double w_base,double wp_base,double wp2_base)
+/* fills buffer location jb with the parts of log W_j and its derivatives not depending on y, 
+   for true index j. The derivatives are w.r.t. rho and p. */
+{ double x,xx;
+  wb[jb] = j * w_base - lgamma((double)j+1) - lgamma(-j * alpha);
+  wb1[jb] = -j/onep;
+  xx = j/onep2;
+  x = xx*digamma(-j*alpha);
+  wp1[jb] = j * wp_base + x; /* base for d logW_j/dp */
+  xx = trigamma(-j*alpha) * xx * xx;
+  wp2[jb] = j * wp2_base + 2*x/onep - xx;
+  wpp[jb] = j /onep2;
+} /* tweedie_terms */
+
+static void tweedious_block(double *w,double *w1,double *w2,double *w1p,double *w2p,
+			    double *w2pp,double *y,int n,double log_eps,double p,double rho,
+			    double dpth1,double dpth2)
+/* Does the work of tweedious for the n values in y (see below), with its own buffers,
+   so that blocks of data can be processed in parallel. 
+
+   For each y[i], the range of j over which the series terms are summed is found first,
+   by scanning up and down from the maximum term until log W_j drops below 
+   log(eps) + the max, filling the buffers as needed. The terms are then accumulated 
+   over this range in loops free of tests and buffer management.
 */
-{ int j_max,i,j_lo,j_hi,jb,jal,j0,j,ok;
-  double x,x1,x2,xx,ymax,ymin,alpha,*alogy,*p1,*p2,*p3,*p4,*p5,
-    *wb,*wb1,//*wb2,
-    *wp1,*wp2,*wpp,dpth1=0,dpth2=0,//xmax,x1max,x2max,
+{ int j_max,i,j_lo,j_hi,jb,jal,j0,j,jd,ju,k,dj,jend;
+  double x,x1,x2,ymax,ymin,alpha,*alogy,*p1,*p2,*p3,*p4,*p5,
+    *wb,*wb1,*wp1,*wp2,*wpp,
     w_base,wp_base,wp2_base,wp1j,wp2j,wppj,wj_scaled,wdlogwdp,
-    wdW2d2W,dWpp,exp_th,
-    wmax,wmin,
-    wi,w1i,w2i,//drho_const,
-    log_eps,wj,w1j,jalogy,onep,onep2,*logy1p2,*logy1p3,p,phi;
-  
-  /* do everything in terms of working parameters, rho, th */
-  phi = exp(*rho); 
-  /* compute p and its derivatives w.r.t. th */
-  if (*th>0) { 
-      exp_th =  exp(- *th);
-      //drho_const = (1+exp_th)/(1 - *b + (1 - *a)*exp_th);
-      x = 1 + exp_th;p = (*b + *a * exp_th)/x;
-      x1 = x*x;dpth1 = exp_th*(*b - *a)/x1;
-      dpth2 =  ((*a - *b)*exp_th+(*b - *a)*exp_th*exp_th)/(x1*x);
-  } else {
-      exp_th =  exp(*th);
-      //drho_const = (1+exp_th)/((1 - *b)*exp_th + 1 - *a);
-      x = exp_th+1;p = (*b * exp_th + *a)/x;
-      x1 = x*x;dpth1 = exp_th*(*b - *a)/x1;
-      dpth2 = ((*a - *b)*exp_th*exp_th+(*b - *a)*exp_th)/(x*x1);
-  }
+    wdW2d2W,dWpp,wmax,wmin,wi,w1i,w2i,wj,w1j,onep,onep2,*logy1p2,*logy1p3,phi;
   
-  log_eps = log(*eps);
+  phi = exp(rho); 
   onep = 1 - p;onep2 = onep * onep;
   alpha = (2 - p)/onep;
   /* get terms that are repeated in logWj etc., but simply multiplied by j */
-  w_base = alpha * log(p-1) + *rho/onep - log(2 - p);
-  wp_base = (log(-onep) + *rho)/onep2 - alpha/onep + 1/(2 - p);
-  wp2_base= 2*(log(-onep) + *rho)/(onep2*onep) - (3*alpha-2)/(onep2) + 1/((2 - p)*(2 - p));
+  w_base = alpha * log(p-1) + rho/onep - log(2 - p);
+  wp_base = (log(-onep) + rho)/onep2 - alpha/onep + 1/(2 - p);
+  wp2_base= 2*(log(-onep) + rho)/(onep2*onep) - (3*alpha-2)/(onep2) + 1/((2 - p)*(2 - p));
  
   /* initially establish the min and max y values, and hence the initial buffer range,
      at the same time produce the alpha log(y) log(y)/(1-p)^2 and log(y)/(1-p)^3 vectors. */ 
   
-  alogy = (double *)R_chk_calloc((size_t)*n,sizeof(double));
-  logy1p2 = (double *)R_chk_calloc((size_t)*n,sizeof(double));
-  logy1p3 = (double *)R_chk_calloc((size_t)*n,sizeof(double));
+  alogy = (double *)R_chk_calloc((size_t)n,sizeof(double));
+  logy1p2 = (double *)R_chk_calloc((size_t)n,sizeof(double));
+  logy1p3 = (double *)R_chk_calloc((size_t)n,sizeof(double));
 
   ymax = ymin = *y;
-  *alogy = alpha * log(*y);
-  *logy1p2 = log(*y)/(onep2);
-  *logy1p3 = *logy1p2/onep;
- 
-  for (p1=y+1,p2=y+ *n,p3=alogy+1,p4=logy1p2+1,p5=logy1p3+1;p1<p2;p1++,p3++,p4++,p5++) {
+  for (p1=y,p2=y + n,p3=alogy,p4=logy1p2,p5=logy1p3;p1<p2;p1++,p3++,p4++,p5++) {
     x = log(*p1); /* log(y) */
     *p3 = alpha * x; /* alogy[i] = alpha * log(y[i]) */
     *p4 = x/onep2; /* log(y[i])/(1-p)^2 */ 
@@ -257,8 +232,6 @@ void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
   wb = (double *)R_chk_calloc((size_t)jal,sizeof(double)); /* add -j*alogy[i] to get logW_j, for y[i] */
   /* first deriv wrt phi... */
   wb1 = (double *)R_chk_calloc((size_t)jal,sizeof(double)); /* add -j*alogy[i] to get logW_j', for y[i] */
-  /* second deriv wrt phi... */
-  // wb2 = (double *)R_chk_calloc((size_t)jal,sizeof(double)); /* add -j*alogy[i] to get logW_j'', for y[i] */
   /* ... note that in the above it's log of derivative, not derivative of log, but in the 
     following it's the derivative of the log... */
 
@@ -269,128 +242,63 @@ void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
   /* second deriv wrt p and phi... */
   wpp = (double *)R_chk_calloc((size_t)jal,sizeof(double));
 
-  for (jb=j_lo,j=j_lo+j0;jb <= j_hi;jb++,j++) { /* jb is in buffer index, j is true index */ 
-    wb[jb] = j * w_base - lgamma((double)j+1) - lgamma(-j * alpha);
-    wb1[jb] = -j/onep;
-    xx = j/onep2;
-    x = xx*digamma(-j*alpha);
-    wp1[jb] = j * wp_base + x; /* base for d logW_j/dp */
-    xx = trigamma(-j*alpha) * xx * xx;
-    wp2[jb] = j * wp2_base + 2*x/onep - xx;
-    wpp[jb] = j /onep2;
-  }
+  for (jb=j_lo,j=j_lo+j0;jb <= j_hi;jb++,j++) /* jb is in buffer index, j is true index */ 
+    tweedie_terms(wb,wb1,wp1,wp2,wpp,jb,j,alpha,onep,onep2,w_base,wp_base,wp2_base);
 
   /* Now j0 is the true j corresponding to buffer position 0. j starts at 1.
      jal is the number of buffer locations allocated. locations in the buffer between 
      j_lo and j_hi contain data. */
 
-
-  for (i=0;i<*n;i++) { /* loop through y */
+  for (i=0;i<n;i++) { /* loop through y */
     /* first find the location of the series maximum... */
     x = pow(y[i],2 - p)/(phi * (2 - p));
     j_max = (int) floor(x);
     if (x - j_max  > .5||j_max<1) j_max++; 
     j_max -= j0; /* converted to buffer index */
     
-    j = j_max+j0;
-    jalogy = j*alogy[i];
-    wdW2d2W= wdlogwdp=dWpp=0.0;
-    wi=w1i=w2i=0.0; // 1.0;
-    wmax = wb[j_max] - jalogy;wmin = wmax + log_eps; 
-    //  w1max = wb1[j_max] - jalogy;w1min = w1max + log_eps;    
-    // w2max = wb2[j_max] - jalogy;w2min = w2max + log_eps;
- 
-    /* start upsweep to convergence or end of available buffered values */
-    ok = 0;//xmax=x1max=x2max=0.0;
-    for (j=j_max+j0,jb=j_max;jb<=j_hi;jb++,j++) { // note initially wi etc initialized to 1 and summation starts 1 later
-      jalogy = j * alogy[i];
-      wj = wb[jb] - jalogy;
-      w1j = wb1[jb];
-      wp1j = wp1[jb] - j * logy1p2[i]; /* d log W / dp */
-      wp2j = wp2[jb] - 2 * j * logy1p3[i]; /* d^2 log W/ dp^2 */
-      /* transform to working parameterization ... */
-      wp2j = wp1j * dpth2 + wp2j * dpth1 * dpth1; /* d^2 log W/ dth^2 */
-      wp1j *= dpth1; /* d log W / dth */
-      wppj = wpp[jb] * dpth1; 
-
-      wj_scaled =  exp(wj-wmax);
-      wi += wj_scaled; /* sum of the scaled W_j */
-
-      w1i += wj_scaled * w1j; /* sum W_j dlogW_j / d rho */
-      w2i += wj_scaled * w1j*w1j; /*  sum W_j d^2logW_j / d rho^2 */ 
- 
-      x = wj_scaled*wp1j;
-      wdlogwdp += x;    /* sum_j W_j dlogW_j/dp */
-      x1 = wj_scaled*(wp1j*wp1j + wp2j);
-      wdW2d2W += x1;  /* sum_j  (dlog W_j/dp)^2 + W_j d^2logW_j/dp^2 */     
-      
-      x2 = wj_scaled*(wp1j*j/onep + wppj);
-      dWpp += x2; 
-      //  x=fabs(x);x1=fabs(x1);x2=fabs(x2);
- 
-      // if (x>xmax) {xmax=x;wp1jmin=x * *eps;}
-      //if (x1>x1max) {x1max=x1;wdW2min=x1 * *eps;}
-      //if (x2>x2max) {x2max=x2;Wppmin=x2 * *eps;}
-      if (wj < wmin) { ok=1;break;}
-      //&&(w1j < w1min)&&(w2j < w2min)&&
-      //  (x < wp1jmin)&&(x1 < wdW2min)&&(x2 < Wppmin)) { ok=1;break;} /* converged on upsweep */
-    } /* end of upsweep to buffer end */ 
-
-    while (!ok) { /* while upsweep unconverged need to fill in more buffer */
-      for (;jb<jal;jb++,j++) { /* fill buffers and calculate w terms */
-        wb[jb] = j * w_base - lgamma((double)j+1) - lgamma(-j * alpha);
-        wb1[jb] = -j/onep;
-        xx = j/onep2;
-        x = xx*digamma(-j*alpha);
-        wp1[jb] = j * wp_base + x; /* base for d logW_j/dp */
-        xx = trigamma(-j*alpha) * xx * xx;
-        wp2[jb] = j * wp2_base + 2*x/onep - xx;
-        wpp[jb] = j /onep2;
-
-        jalogy = j * alogy[i];
-        wj = wb[jb] - jalogy;
-        w1j = wb1[jb];
-        wp1j = wp1[jb] - j * logy1p2[i]; /* d log W / dp */
-        wp2j = wp2[jb] - 2 * j * logy1p3[i]; /* d^2 log W/ dp^2 */
-        /* transform to working parameterization ... */
-        wp2j = wp1j * dpth2 + wp2j * dpth1 * dpth1; /* d^2 log W/ dth^2 */
-        wp1j *= dpth1; /* d log W / dth */
-        wppj = wpp[jb] * dpth1; 
-    
-        wj_scaled =  exp(wj-wmax);
-        wi += wj_scaled; /* sum of the scaled W_j */
-
-        w1i += wj_scaled * w1j; /* sum W_j dlogW_j / d rho */
-        w2i += wj_scaled * w1j*w1j; /*  sum W_j d^2logW_j / d rho^2 */ 
+    wmax = wb[j_max] - (j_max+j0)*alogy[i];wmin = wmax + log_eps; 
  
-        x = wj_scaled*wp1j;
-        wdlogwdp += x;    /* sum_j W_j dlogW_j/dp */
-        x1 = wj_scaled*(wp1j*wp1j + wp2j);
-        wdW2d2W += x1;  /* sum_j  (dlog W_j/dp)^2 + W_j d^2logW_j/dp^2 */     
-      
-        x2 = wj_scaled*(wp1j*j/onep + wppj);
-        dWpp += x2; 
-    
-        if (wj < wmin) { ok=1;break;} /* converged on upsweep */
-        
-      } 
-      j_hi = jb; if (j_hi > jal-1) j_hi = jal-1; /* set j_hi to last element filled */
-      if (!ok) { /* need to expand buffer storage*/
-        /*Rprintf("forward buffer expansion\n");*/
-        wb = forward_buf(wb,&jal,0);
-        wb1 = forward_buf(wb1,&jal,0);
-	// wb2 = forward_buf(wb2,&jal,0);
-        wp1 = forward_buf(wp1,&jal,0);
-        wp2 = forward_buf(wp2,&jal,0);
-        wpp = forward_buf(wpp,&jal,1);
+    /* upsweep to convergence, extending the buffers as needed */
+    for (jb=j_max+1;;jb++) {
+      if (jb>j_hi) { /* need to fill in more buffer */
+        if (jb>=jal) { /* need to expand buffer storage*/
+          wb = forward_buf(wb,&jal,0);
+          wb1 = forward_buf(wb1,&jal,0);
+          wp1 = forward_buf(wp1,&jal,0);
+          wp2 = forward_buf(wp2,&jal,0);
+          wpp = forward_buf(wpp,&jal,1);
+        }
+        tweedie_terms(wb,wb1,wp1,wp2,wpp,jb,jb+j0,alpha,onep,onep2,w_base,wp_base,wp2_base);
+        j_hi = jb;
       }
-    } /* finished upsweep and any buffer expansion */
-  
-    /* start downsweep to convergence or start of available buffered values */
-    ok=0;
-    for (j=j_max-1+j0,jb=j_max-1;jb>=j_lo;jb--,j--) { 
-        jalogy = j * alogy[i];
-      wj = wb[jb] - jalogy;
+      if (wb[jb] - (jb+j0)*alogy[i] < wmin) break; /* converged on upsweep */
+    }
+    ju = jb;
+
+    /* downsweep to convergence or j=1, extending the buffers as needed */
+    for (jb=j_max-1;jb+j0>=1;jb--) {
+      if (jb<j_lo) { /* need to fill in more buffer */
+        if (jb<0) { /* need to expand buffer storage, which shifts the buffer indices */
+          k = j0;
+          wb = backward_buf(wb,&jal,&j0,&j_lo,&j_hi,0);
+          wb1 = backward_buf(wb1,&jal,&j0,&j_lo,&j_hi,0);
+          wp1 = backward_buf(wp1,&jal,&j0,&j_lo,&j_hi,0);
+          wp2 = backward_buf(wp2,&jal,&j0,&j_lo,&j_hi,0);
+          wpp = backward_buf(wpp,&jal,&j0,&j_lo,&j_hi,1); /* final '1' updates jal,j0 etc. */
+          k -= j0;jb += k;j_max += k;ju += k;
+        }
+        tweedie_terms(wb,wb1,wp1,wp2,wpp,jb,jb+j0,alpha,onep,onep2,w_base,wp_base,wp2_base);
+        j_lo = jb;
+      }
+      if (wb[jb] - (jb+j0)*alogy[i] < wmin) break; /* converged on downsweep */
+    }
+    jd = jb;if (jd+j0<1) jd = 1 - j0; /* reached base */
+
+    /* now sum the terms: upsweep from j_max to ju, then downsweep from j_max-1 to jd */
+    wdW2d2W= wdlogwdp=dWpp=0.0;
+    wi=w1i=w2i=0.0; 
+    for (k=0;k<2;k++) for (jb = k ? j_max-1:j_max,dj = k ? -1:1,j=jb+j0,jend = k ? jd-1:ju+1;jb!=jend;jb+=dj,j+=dj) { 
+      wj = wb[jb] - j * alogy[i];
       w1j = wb1[jb];
       wp1j = wp1[jb] - j * logy1p2[i]; /* d log W / dp */
       wp2j = wp2[jb] - 2 * j * logy1p3[i]; /* d^2 log W/ dp^2 */
@@ -412,64 +320,8 @@ void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
       
       x2 = wj_scaled*(wp1j*j/onep + wppj);
       dWpp += x2; 
+    } 
 
-      if (wj < wmin) { ok=1;break;} /* converged on downsweep */
-    } /* end of downsweep to buffer end */ 
-   
-    if (j<=1&&j_lo==0) ok=1; /* don't care about element size if reached base */
-
-    while (!ok) { /* while downsweep unconverged need to fill in more buffer */
-      for (jb=j_lo-1;jb>=0;jb--,j--) { /* fill buffers and calculate w terms */
-        wb[jb] = j * w_base - lgamma((double)j+1) - lgamma(-j * alpha);
-        wb1[jb] = -j/onep;
-        xx = j/onep2;
-        x = xx*digamma(-j*alpha);
-        wp1[jb] = j * wp_base + x; /* base for d logW_j/dp */
-        xx = trigamma(-j*alpha) * xx * xx;
-        wp2[jb] = j * wp2_base + 2*x/onep - xx;
-        wpp[jb] = j /onep2;
-
-        jalogy = j * alogy[i];
-        wj = wb[jb] - jalogy;
-        w1j = wb1[jb];
-        wp1j = wp1[jb] - j * logy1p2[i]; /* d log W / dp */
-        wp2j = wp2[jb] - 2 * j * logy1p3[i]; /* d^2 log W/ dp^2 */
-        /* transform to working parameterization ... */
-        wp2j = wp1j * dpth2 + wp2j * dpth1 * dpth1; /* d^2 log W/ dth^2 */
-        wp1j *= dpth1; /* d log W / dth */
-        wppj = wpp[jb] * dpth1; 
-    
-        wj_scaled =  exp(wj-wmax);
-        wi += wj_scaled; /* sum of the scaled W_j */
-
-        w1i += wj_scaled * w1j; /* sum W_j dlogW_j / d rho */
-        w2i += wj_scaled * w1j*w1j; /*  sum W_j d^2logW_j / d rho^2 */ 
- 
-        x = wj_scaled*wp1j;
-        wdlogwdp += x;    /* sum_j W_j dlogW_j/dp */
-        x1 = wj_scaled*(wp1j*wp1j + wp2j);
-        wdW2d2W += x1;  /* sum_j  (dlog W_j/dp)^2 + W_j d^2logW_j/dp^2 */     
-      
-        x2 = wj_scaled*(wp1j*j/onep + wppj);
-        dWpp += x2; 
-    
-        if (wj < wmin) { ok=1;break;} /* converged on upsweep */
-      } 
-
-      if (j<=1) ok=1; /* don't care about element size if reached base */
-
-      j_lo = jb; if (j_lo<0) j_lo=0; /* set j_lo to first element filled */
-      if (!ok) { /* need to expand buffer storage*/
-        /*Rprintf("backward buffer expansion\n");*/
-        wb = backward_buf(wb,&jal,&j0,&j_lo,&j_hi,0);
-        wb1 = backward_buf(wb1,&jal,&j0,&j_lo,&j_hi,0);
-	// wb2 = backward_buf(wb2,&jal,&j0,&j_lo,&j_hi,0);
-        wp1 = backward_buf(wp1,&jal,&j0,&j_lo,&j_hi,0);
-        wp2 = backward_buf(wp2,&jal,&j0,&j_lo,&j_hi,0);
-        wpp = backward_buf(wpp,&jal,&j0,&j_lo,&j_hi,1); /* final '1' updates jal,j0 etc. */
-      }
-
-    } /* finished downsweep and any buffer expansion */
     /* Summation now complete: need to do final transformations */
     w[i] = wmax + log(wi);    /* contains log W */
     w2[i] = w2i/wi - (w1i/wi)*(w1i/wi);
@@ -479,8 +331,150 @@ void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
     w1p[i] =  wdlogwdp/wi;
 
   } /* end of looping through y */
-  R_chk_free(alogy);R_chk_free(wb);R_chk_free(wb1);//R_chk_free(wb2);
+  R_chk_free(alogy);R_chk_free(wb);R_chk_free(wb1);
   R_chk_free(logy1p2);R_chk_free(logy1p3);R_chk_free(wp1);R_chk_free(wp2);R_chk_free(wpp);
+} /* tweedious_block */
+
+static void tweedious_par(double *w,double *w1,double *w2,double *w1p,double *w2p,
+			  double *w2pp,double *y,int n,double log_eps,double p,double rho,
+			  double dpth1,double dpth2,int nt)
+/* direct evaluation of the tweedious quantities for the n values in y, splitting them 
+   into blocks processed in parallel by tweedious_block */
+{ int i,i0,i1,nth,nb;
+  nth = mgcv_nthreads(nt);
+  nb = n/100; /* not worth a thread for fewer than 100 y values */
+  if (nb<1) nb=1;
+  if (nth>nb) nth=nb;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(i,i0,i1) num_threads(nth) schedule(static)
+  #endif
+  for (i=0;i<nth;i++) {
+    i0 = (int)(((double) n * i)/nth);i1 = (int)(((double) n * (i+1))/nth);
+    if (i1>i0) tweedious_block(w+i0,w1+i0,w2+i0,w1p+i0,w2p+i0,w2pp+i0,y+i0,i1-i0,log_eps,p,rho,dpth1,dpth2);
+  }
+} /* tweedious_par */
+
+static int tweedie_table(double *w,double *w1,double *w2,double *w1p,double *w2p,
+			 double *w2pp,double *y,int n,double tol,double log_eps,double p,double rho,
+			 double dpth1,double dpth2,int nt)
+/* For given p and phi the tweedious quantities depend on y only via log(y), smoothly. 
+   This routine tabulates them on an evenly spaced grid over the range of log(y), and 
+   then obtains the values for each y by 4 point Lagrange interpolation. The grid starts 
+   with 32 intervals. The interpolation error is checked against direct evaluation at the 
+   interval midpoints, which are then added to the table, until the relative error 
+   (|error|/(1+|value|)) is below tol for all 6 quantities. 
+
+   Returns 0, having done nothing useful, if the table would need more than n/4 entries, 
+   in which case direct evaluation is not much more costly. 
+*/
+{ int nk,K,k,i,q,nth;
+  double zmin,zmax,z,h,*tb,*tm,*tb1,*yk,err,e,u,t,a[4],x,*wo[6];
+  wo[0]=w;wo[1]=w1;wo[2]=w2;wo[3]=w1p;wo[4]=w2p;wo[5]=w2pp;
+  zmin = zmax = log(*y);
+  for (i=1;i<n;i++) { z = log(y[i]);if (z<zmin) zmin=z; else if (z>zmax) zmax=z;}
+  if (!(zmax>zmin)) return(0); /* all y the same - (or not finite) */
+  K = 32;
+  if (4*(2*K+1) > n) return(0);
+  nk = K+1;h = (zmax-zmin)/K;
+  tb = (double *)R_chk_calloc((size_t)6*nk,sizeof(double)); /* the table, quantity q in tb[q*nk..] */
+  yk = (double *)R_chk_calloc((size_t)nk,sizeof(double));
+  for (k=0;k<nk;k++) yk[k] = exp(zmin + k*h);
+  tweedious_par(tb,tb+nk,tb+2*nk,tb+3*nk,tb+4*nk,tb+5*nk,yk,nk,log_eps,p,rho,dpth1,dpth2,nt);
+  for (;;) { /* refinement loop */
+    /* direct evaluation at the interval mid points */
+    for (k=0;k<K;k++) yk[k] = exp(zmin + (k+.5)*h);
+    tm = (double *)R_chk_calloc((size_t)6*K,sizeof(double));
+    tweedious_par(tm,tm+K,tm+2*K,tm+3*K,tm+4*K,tm+5*K,yk,K,log_eps,p,rho,dpth1,dpth2,nt);
+    /* interpolation error at the mid points, using the stencil k-1..k+2 */
+    for (err=0.0,k=0;k<K;k++) {
+      i = k-1;if (i<0) i=0;if (i>nk-4) i=nk-4;
+      t = k + .5 - i;
+      a[0] = -(t-1)*(t-2)*(t-3)/6;a[1] = t*(t-2)*(t-3)/2;a[2] = -t*(t-1)*(t-3)/2;a[3] = t*(t-1)*(t-2)/6;
+      for (q=0;q<6;q++) {
+        x = tm[q*K+k];
+        e = fabs(a[0]*tb[q*nk+i]+a[1]*tb[q*nk+i+1]+a[2]*tb[q*nk+i+2]+a[3]*tb[q*nk+i+3] - x)/(1+fabs(x));
+        if (!(e<=err)) err = e; /* NaN propagates, and prevents table use */ 
+      }
+    }
+    /* add the mid points to the table */
+    tb1 = (double *)R_chk_calloc((size_t)6*(2*K+1),sizeof(double));
+    for (q=0;q<6;q++) {
+      for (k=0;k<nk;k++) tb1[q*(2*K+1)+2*k] = tb[q*nk+k];
+      for (k=0;k<K;k++) tb1[q*(2*K+1)+2*k+1] = tm[q*K+k];
+    }
+    R_chk_free(tb);R_chk_free(tm);tb = tb1;
+    K *= 2;nk = K+1;h /= 2;
+    if (err<=tol) break; /* table accurate enough */
+    if (4*(2*K+1) > n) { /* too costly - give up */
+      R_chk_free(tb);R_chk_free(yk);return(0);
+    }
+    R_chk_free(yk);yk = (double *)R_chk_calloc((size_t)K,sizeof(double));
+  }
+  /* interpolate the table for each y */
+  nth = mgcv_nthreads(nt);
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(i,u,k,t,a,q) num_threads(nth) schedule(static)
+  #endif
+  for (i=0;i<n;i++) {
+    u = (log(y[i])-zmin)/h; /* in grid units */
+    k = (int)floor(u) - 1;if (k<0) k=0;if (k>nk-4) k=nk-4;
+    t = u - k;
+    a[0] = -(t-1)*(t-2)*(t-3)/6;a[1] = t*(t-2)*(t-3)/2;a[2] = -t*(t-1)*(t-3)/2;a[3] = t*(t-1)*(t-2)/6;
+    for (q=0;q<6;q++) wo[q][i] = a[0]*tb[q*nk+k]+a[1]*tb[q*nk+k+1]+a[2]*tb[q*nk+k+2]+a[3]*tb[q*nk+k+3];
+  }
+  R_chk_free(tb);R_chk_free(yk);
+  return(1);
+} /* tweedie_table */
+
+void tweedious(double *w,double *w1,double *w2,double *w1p,double *w2p,
+	       double *w2pp,double *y,double *eps,int *n,
+               double *th,double *rho,double *a, double *b,int *nt,double *tol)
+/* Routine to perform tedious series summation needed for Tweedie distribution
+   evaluation, following Dunn & Smyth (2005) Statistics and Computing 15:267-280.
+   Notation as in that paper. For 
+   
+   log W returned in w. (where W means sum_j W_j)
+   d logW / drho in w1, 
+   d2 logW / d rho2 in w2.
+   d logW / dth in w1p
+   d2 logW / dth2 in w2p
+   d2 logW / dth drho in W2pp
+
+   rho=log(phi), and th defines p = (a + b * exp(th))/(exp(th)+1). 
+   note, 1<a<b<2 (all strict) 
+
+   The somewhat involved approach is all about avoiding overflow or underflow. 
+   Extensive use is made of 
+        log { sum_j exp(x_j)} = log { sum_j exp(x_j-x_max) } + x_max
+   digamma and trigamma functions are from Rmath.h
+
+   The y values are split into *nt blocks, processed in parallel by tweedious_block, 
+   each with its own buffers of the y independent parts of the series terms. 
+
+   If *tol > 0 then the results may instead be interpolated from a table over log(y) 
+   (see tweedie_table), with relative error less than *tol. This pays for large n.
+
+   NOTE: still some redundancy for readability 
+ 
+*/
+{ double x,x1,dpth1=0,dpth2=0,exp_th,p;
+  
+  /* do everything in terms of working parameters, rho, th */
+  /* compute p and its derivatives w.r.t. th */
+  if (*th>0) { 
+      exp_th =  exp(- *th);
+      x = 1 + exp_th;p = (*b + *a * exp_th)/x;
+      x1 = x*x;dpth1 = exp_th*(*b - *a)/x1;
+      dpth2 =  ((*a - *b)*exp_th+(*b - *a)*exp_th*exp_th)/(x1*x);
+  } else {
+      exp_th =  exp(*th);
+      x = exp_th+1;p = (*b * exp_th + *a)/x;
+      x1 = x*x;dpth1 = exp_th*(*b - *a)/x1;
+      dpth2 = ((*a - *b)*exp_th*exp_th+(*b - *a)*exp_th)/(x*x1);
+  }
+  if (*n<1) return;
+  if (*tol>0&&tweedie_table(w,w1,w2,w1p,w2p,w2pp,y,*n,*tol,log(*eps),p,*rho,dpth1,dpth2,*nt)) return;
+  tweedious_par(w,w1,w2,w1p,w2p,w2pp,y,*n,log(*eps),p,*rho,dpth1,dpth2,*nt);
 } /* tweedious */
 
 
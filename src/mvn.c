@@ -9,14 +9,16 @@
 #include <math.h>
 #include <R.h>
 #include <R_ext/BLAS.h>
+#include <Rconfig.h>
 #include "mgcv.h"
 
 void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note zero indexing */
             int *m,double *ll,double *lb,double *lbb,double *dbeta,
-            double *dH,int *deriv,int *nsp,int *nt) {
+            double *dH,int *deriv,int *nsp,int *nt,int *ytr) {
 /* inputs:
     * 'y' is an m by n matrix, each column of which is a m-dimensional observation of a 
-      multivariate normal r.v.
+      multivariate normal r.v. If *ytr is non-zero then 'y' is instead stored as its n by m 
+      transpose, so that each response is contiguous. This is the faster layout.
     * 'X' is a sequence of model matrices. The first (0th) model matrix runs from columns 0 to lpi[0]-1,
       the jth from cols lpi[j-1] to lpi[j]-1. lpi indexing starts from 0!!
     * XX is the pre-computed X'X matrix.
@@ -27,13 +29,18 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
     outputs:
     * 'll' is the evaluated log likelihood.
     * 'lb' is the grad vector 
+
+   All the O(n) work is done up front: forming y-mu, and then (y-mu)X and (y-mu)(y-mu)'. 
+   R(y-mu)X and R(y-mu)(y-mu)' follow from these at O(m^2 ncoef) cost, and R(y-mu) is 
+   never formed. Everything else is then O(ncoef^2) or less, and the coefficient blocks 
+   of the Hessian (and its derivatives, by smoothing parameter) are filled in parallel.
 */
-  double *R,*theta,ldetR,*Xl,*bl,oned=1.0,zerod=0.0,*p,*p1,*p2,*p3,xx,zz,yy,*yty,
-    *mu,*Rymu,rip,*dtheta,*db,*deriv_theta,*yX,*yRX;
-  int i,j,k,l,pl,one=1,bt,ct,nb,*din,ntheta,ncoef,*rri,*rci,ri,rj,ril,rjl,rik,rjk,rij,rjj,q,r;
+  double *R,*theta,ldetR,*Xl,*bl,oned=1.0,zerod=0.0,mone=-1.0,*p,*p1,*p2,xx,zz,yy,*yty,*yRy,*RtR,
+    *mu,*dtheta,*db,*deriv_theta,*yX,*yRX,*dR,*M,*W,*Wr;
+  int i,j,k,l,pl,one=1,bt,ct,nb,*din,ntheta,ncoef,*rri,*rci,ri,rj,ril,rjl,rik,rjk,rij,rjj,q,r,a,nth;
   const char not_trans='N';
   ntheta = *m * (*m+1)/2;ncoef = lpi[*m-1];
- 
+  nth = mgcv_nthreads(*nt);
   nb = ncoef + ntheta; /* number of coefficients overall */
   /* Create the Choleski factor of the precision matrix */
   R = (double *)R_chk_calloc((size_t)*m * *m,sizeof(double));
@@ -53,74 +60,93 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
     }
   }  
   /* obtain y - mu */
-  mu  = (double *)R_chk_calloc((size_t)*n,sizeof(double));
-  for (l=0;l<*m;l++) { /* loop through components */
+  if (*ytr) for (l=0;l<*m;l++) { /* contiguous component: y_l <- y_l - Xl bl directly */
     if (l==0) { Xl = X;pl = lpi[0];bl=beta;} /* Xl is lth model matrix with pl columns, coef vec bl */ 
     else { Xl = X + *n * lpi[l-1];pl = lpi[l]-lpi[l-1];bl = beta + lpi[l-1];}   
-    F77_CALL(dgemv)(&not_trans,n,&pl,&oned,Xl,n, bl, &one,&zerod, mu, &one); /* BLAS call for mu = Xl bl */
-    /* now subtract mu from relevant component of y */
-    for (p=mu,p1= mu + *n,p2=y+l;p<p1;p++,p2 += *m) *p2 -= *p;
+    F77_CALL(dgemv)(&not_trans,n,&pl,&mone,Xl,n, bl, &one,&oned, y + (ptrdiff_t)*n * l, &one);
+  } else { 
+    mu  = (double *)R_chk_calloc((size_t)*n,sizeof(double));
+    for (l=0;l<*m;l++) { /* loop through components */
+      if (l==0) { Xl = X;pl = lpi[0];bl=beta;} /* Xl is lth model matrix with pl columns, coef vec bl */ 
+      else { Xl = X + *n * lpi[l-1];pl = lpi[l]-lpi[l-1];bl = beta + lpi[l-1];}   
+      F77_CALL(dgemv)(&not_trans,n,&pl,&oned,Xl,n, bl, &one,&zerod, mu, &one); /* BLAS call for mu = Xl bl */
+      /* now subtract mu from relevant component of y */
+      for (p=mu,p1= mu + *n,p2=y+l;p<p1;p++,p2 += *m) *p2 -= *p;
+    }
+    R_chk_free(mu);
   }
-  R_chk_free(mu);
   /* so y now contains y-mu */
   
-  /* R(y-mu) is required repeatedly... */
-  Rymu =  (double *)R_chk_calloc((size_t)*n * *m,sizeof(double));
-  bt=0;ct=0;mgcv_pmmult(Rymu,R,y,&bt,&ct,m,n,m,nt);  
-  /* compute the log likelihood */
-  for (*ll=0.0,p=Rymu,p1=p + *n * *m;p<p1;p++) *ll += *p * *p;
+  /* (y-mu)X and (y-mu)(y-mu)' are required repeatedly... */
+  yX = (double *)R_chk_calloc((size_t)*m * ncoef,sizeof(double)); /* need (y-mu)X - m by ncoef */
+  bt = *ytr ? 1:0;ct=0;mgcv_pmmult(yX,y,X,&bt,&ct,m,&ncoef,n,nt); /* rows, dim, cols coef */   
+  yty = (double *)R_chk_calloc((size_t)*m * *m,sizeof(double)); /* need (y-mu)(y-mu)' - m by m */
+  if (*ytr) getXtX(yty,y,n,m); else getXXt(yty,y,m,n);
+  /* ... as are R(y-mu)X and R(y-mu)(y-mu)'. R is upper triangular. */
+  yRX = (double *)R_chk_calloc((size_t)*m * ncoef,sizeof(double)); /* need R(y-mu)X - m by ncoef*/
+  for (i=0;i<ncoef;i++) for (p=yX + *m * i,a=0;a<*m;a++) {
+    for (xx=0.0,k=a;k<*m;k++) xx += R[a + *m * k]*p[k];
+    yRX[a + *m * i] = xx;
+  }
+  yRy = (double *)R_chk_calloc((size_t)*m * *m,sizeof(double)); /* need R(y-mu)(y-mu)' - m by m */
+  for (i=0;i<*m;i++) for (p=yty + *m * i,a=0;a<*m;a++) {
+    for (xx=0.0,k=a;k<*m;k++) xx += R[a + *m * k]*p[k];
+    yRy[a + *m * i] = xx;
+  }
+  /* R'R - element l,k is the inner product of cols l and k of R */
+  RtR = (double *)R_chk_calloc((size_t)*m * *m,sizeof(double));
+  for (l=0;l<*m;l++) for (k=0;k<=l;k++) {
+    for (p=R+l * *m,p1=R+k * *m,xx=0.0,p2=p1+k;p1<=p2;p++,p1++) xx += *p * *p1;
+    RtR[l + *m * k] = RtR[k + *m * l] = xx;
+  }
+  /* compute the log likelihood: ||R(y-mu)||^2 = tr(R'R (y-mu)(y-mu)') */
+  for (*ll=0.0,p=RtR,p1=yty,p2=p + *m * *m;p<p2;p++,p1++) *ll += *p * *p1;
   *ll = - *ll/2 + ldetR * *n;  
   
   /* now the grad vector */
   
-  p = lb;
-  /* first the derivatives w.r.t. the coeffs of the linear predictors */
-  for (l=0;l<*m;l++) { /* work through dimensions */
-    if (l==0) { Xl = X;pl = lpi[0];} /* Xl is lth model matrix with pl columns */ 
-    else { Xl = X + *n * lpi[l-1];pl = lpi[l]-lpi[l-1];} 
-    for (i=0;i<pl;i++) { /* work through coefs for this dimension */
-      *p = 0.0; /* clear lb */
-      for (j=0;j<*n;j++) {
-        xx = Xl[j + *n * i];
-        for (p1=R + l * *m,p2 = p1 + l,p3 = Rymu + *m *j;p1<=p2;p1++,p3++) *p += xx * *p1 * *p3; 
-      }
-      p++;
-    }
+  /* create index vector of dimension to which each coef relates ...*/ 
+  din =  (int *)R_chk_calloc((size_t)ncoef,sizeof(int));
+  for (k=0,i=0;i<ncoef;i++) { 
+    if (i==lpi[k]) k++; 
+    din[i] = k;
+  } 
+  /* first the derivatives w.r.t. the coeffs of the linear predictors: 
+     x_i^l'R_l'R(y-mu) where R_l is column l of R. */
+  for (p=lb,i=0;i<ncoef;i++,p++) {
+    l = din[i];
+    for (*p=0.0,p1=R + l * *m,p2 = yRX + i * *m,a=0;a<=l;a++) *p += p1[a]*p2[a]; 
   }
   /* now the derivatives w.r.t. the parameters, theta, of R */ 
   
   for (k=0,i=0;i<*m;i++) { /* i is row */ 
     /* get tr(R^{-1}R R_theta^k) */
     xx = deriv_theta[k]; /* the non-zero element of R_theta^i at i,i */;
-    *p += *n;
+    *p = *n;
     k++; /* increment the theta index */ 
     /* quadratic form involves only ith dimension */
-    for (zz=0.0,l=0,p1 = Rymu+i,p2=y+i;l<*n;l++,p1 += *m,p2 += *m) zz += *p1 * *p2 * xx;
-    *p += -zz; 
+    *p += -yRy[i + *m * i] * xx; 
     p++;
     for (j=i+1;j<*m;j++) { /* j is col */
       k++; /* increment the theta index */ 
-      for (zz=0.0,l=0,p1 = Rymu+i,p2=y+j;l<*n;l++,p1 += *m,p2 += *m) zz += *p1 * *p2;
-      *p += -zz;
+      *p = -yRy[i + *m * j];
       p++;
     }
   }  
 
   /* the Hessian is needed next */
-  /* create index vector of dimension to which each coef relates ...*/ 
-  din =  (int *)R_chk_calloc((size_t)ncoef,sizeof(int));
-  for (k=0,i=0;i<ncoef;i++) { 
-    if (i==lpi[k]) k++; 
-    din[i] = k;
-  } 
   /* first the mean coef blocks */
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(i,j,l,k) num_threads(nth) schedule(dynamic)
+  #endif
   for (i=0;i<ncoef;i++) for (j=0;j<=i;j++) {
      l=din[i];k=din[j]; /* note l>=k */
-     /* inner product of col l and col k of R ... */
-     for (p=R+l * *m,p1=R+k * *m,rip=0.0,p2=p1+k;p1<=p2;p++,p1++) rip += *p * *p1;
-     lbb[i + nb * j] = lbb[j + nb * i] = -XX[i + ncoef * j]*rip; /* -xx*rip; */ 
+     lbb[i + nb * j] = lbb[j + nb * i] = -XX[i + ncoef * j]*RtR[l + *m * k]; /* -xx*rip; */ 
   }
   /* now the mixed blocks */
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(i,j,l,ri,rj,xx,zz) num_threads(nth) schedule(static)
+  #endif
   for (i=0;i<ncoef;i++) for (j=0;j<ntheta;j++) {
      ri = rri[j]; /* row index of theta[j] in R */
      rj = rci[j]; /* col index of theta[j] in R */
@@ -128,13 +154,10 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
      xx = 0.0;
      zz = deriv_theta[j];  /* the non-zero derivative of R w.r.t. theta */
      /* term \bar x_i^{lT} R_\theta^{jT} R(y-\mu) is only non zero if l=rj... */
-     if (l==rj) for (p = X + i* *n,p1=Rymu+ri,p2=p + *n;p<p2;p++,p1 += *m) xx += *p * *p1;
+     if (l==rj) xx += yRX[ri + *m * i]; 
      xx *= zz;
-     /* next term is inner product of ith col of X with row rj of y-mu (in y), multiplied by a constant*/
-     if (ri<=l) { 
-       for (yy=0.0,p = X + i* *n,p1=y+rj,p2=p + *n;p<p2;p++,p1 += *m) yy += *p * *p1;
-       xx += yy * R[ri + *m * l]*zz;
-     }
+     /* next term is inner product of ith col of X with row rj of y-mu, multiplied by a constant*/
+     if (ri<=l) xx += yX[rj + *m * i] * R[ri + *m * l]*zz;
      lbb[i + nb * (j+ncoef)] = lbb[j + ncoef + nb * i] = xx;
   }
   /* the theta block completes the Hessian... */
@@ -144,8 +167,7 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
         ri=rri[k];rj=rci[k];
         if (ri==rj) { 
           /* compute (y-\mu)'R'R_\theta^k_\theta^l(y-\mu) */
-          for (zz=0.0,i=0,p=Rymu+ri,p2=y+ri;i<*n;i++,p += *m,p2+= *m) zz += *p * *p2;
-          xx -= zz *  deriv_theta[k];
+          xx -= yRy[ri + *m * ri] *  deriv_theta[k];
         }
       } 
       
@@ -155,7 +177,7 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
       ril=rri[l];rjl=rci[l];
       rik=rri[k];rjk=rci[k];
       if (ril==rik) { /* then term is non-zero */
-	for (yy=0.0,i=0,p=y+rjl,p1=y+rjk;i<*n;i++,p+= *m, p1+= *m) yy += *p * *p1;
+        yy = yty[rjl + *m * rjk];
         yy *= zz;
         if (ril==rjl) yy *= deriv_theta[l];
         xx -= yy;
@@ -164,43 +186,47 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
   }
 
   /* Now the derivatives of the Hessian, given the derivatives of the coefficients,
-     wrt the smoothing parameters */
+     wrt the smoothing parameters. Each smoothing parameter's dH is independent, so
+     these are computed in parallel. */
   if (*deriv) {
-    yX = (double *)R_chk_calloc((size_t)*m * ncoef,sizeof(double)); /* need (y-mu)X - m by ncoef */
-    bt=0;ct=0;mgcv_pmmult(yX,y,X,&bt,&ct,m,&ncoef,n,nt); /* rows, dim, cols coef */   
-    yRX = (double *)R_chk_calloc((size_t)*m * ncoef,sizeof(double)); /* need R(y-mu)X - m by ncoef*/
-    bt=0;ct=0;mgcv_pmmult(yRX,Rymu,X,&bt,&ct,m,&ncoef,n,nt); /* rows, dim, cols coef */  
-    yty = (double *)R_chk_calloc((size_t)*m * *m,sizeof(double)); /* need (y-mu)(y-mu)' - m by m */
-    bt=0;ct=1;mgcv_pmmult(yty,y,y,&bt,&ct,m,m,n,nt); /* rows, cols dim */  
+    dR = (double *)R_chk_calloc((size_t)*m * *m * *nsp,sizeof(double)); /* dR/drho_r */
+    M = (double *)R_chk_calloc((size_t)*m * *m * *nsp,sizeof(double)); /* dR'R + R'dR */
+    W = (double *)R_chk_calloc((size_t)*m * ncoef * *nsp,sizeof(double)); /* XX d beta by dimension */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(r,db,dtheta,Wr,i,j,k,l,q,a,pl,p,p1,xx,yy,zz,ri,rj,rij,rjj,rik,rjk) num_threads(nth) schedule(dynamic)
+    #endif
     for (r=0;r< *nsp;r++) { 
+      double *dHr,*dRr,*Mr;
+      dHr = dH + (ptrdiff_t)nb * nb * r; /* Hessian derivative for this smoothing parameter */
       db = dbeta + nb * r; /* d coefs / d rho_r */
       dtheta = db + ncoef; /* d theta / d rho_r */
-
+      dRr = dR + *m * *m * r;Mr = M + *m * *m * r;Wr = W + *m * ncoef * r;
+      /* dR has the non-zero pattern of R, with R_\theta^q d\theta_q/d \rho_r in element q */
+      for (q=0;q<ntheta;q++) dRr[rri[q] + *m * rci[q]] = deriv_theta[q]*dtheta[q];
+      for (l=0;l<*m;l++) for (k=0;k<=l;k++) {
+        for (xx=0.0,a=0;a<*m;a++) xx += dRr[a + *m * l]*R[a + *m * k] + R[a + *m * l]*dRr[a + *m * k];
+        Mr[l + *m * k] = Mr[k + *m * l] = xx;
+      }
+      /* W[i,k] = sum_{q in dimension k} XX[i,q] d beta_q / d rho_r, one dgemv per dimension */
+      for (k=0;k<*m;k++) {
+        q = k ? lpi[k-1] : 0;pl = lpi[k] - q;
+        F77_CALL(dgemv)(&not_trans,&ncoef,&pl,&oned,XX + (ptrdiff_t)ncoef * q,&ncoef,db + q,&one,&zerod,Wr + ncoef * k,&one);
+      }
       /* the derivatives of the hessian w.r.t. the smoothing parameters. First the portions 
-         relating to the coefficients */
+         relating to the coefficients. M contains (R_\theta^{qT} R + R^T R_\theta^q) d\theta_q/d \rho_r 
+         which is multiplied by the inner product of columns i and j of X... */
       for (i=0;i<ncoef;i++) for (j=0;j<=i;j++) {
 	l = din[i];k = din[j]; /* dimensions for these elements */
-	xx=0.0;p=R+l* *m;p1=R+k* *m;
-        for (q=0;q<ntheta;q++) { /* sum over derivs of theta_q */
-          ri=rri[q];rj=rci[q]; /* row and col of non zero element of deriv of R wrt theta_q */
-          if (rj==l) xx += p1[ri]*deriv_theta[q]*dtheta[q];
-          if (rj==k) xx += p[ri]*deriv_theta[q]*dtheta[q];
-        }
-        /* xx now contains the required element of (R_\theta^{qT} R + R^T R_\theta^q) d\theta_q/d \rho_r 
-           which is multiplied by the inner product of columns i and j of X... */
-        dH[i + nb * j] = dH[j + nb * i] = -xx * XX[i +  ncoef * j];
+        dHr[i + nb * j] = dHr[j + nb * i] = -Mr[l + *m * k] * XX[i +  ncoef * j];
       } 
       /* now the mixed blocks */
       for (i=0;i<ncoef;i++) for (j=0;j<ntheta;j++) {  
 	/* first the summation over the derivatives of beta */
         l=din[i];
-	for (xx=0.0,q=0;q<ncoef;q++) {
-          k=din[q];
-          ri=rri[j];rj=rci[j]; /* row and col of non zero element of deriv of R wrt theta_j */
-          zz = deriv_theta[j];/* deriv R w.r.t theta_l */
-          if (rj==l) xx += -R[ri + *m * k]*zz*XX[i + ncoef * q] * db[q];
-          if (rj==k) xx += -R[ri + *m * l]*zz*XX[i + ncoef * q] * db[q];
-	}
+        ri=rri[j];rj=rci[j]; /* row and col of non zero element of deriv of R wrt theta_j */
+        zz = deriv_theta[j];/* deriv R w.r.t theta_l */
+        xx = -R[ri + *m * l]*zz*Wr[i + ncoef * rj];
+        if (rj==l) for (p=R+ri,p1=Wr+i,k=0;k<*m;k++,p += *m,p1 += ncoef) xx += - *p * zz * *p1;
         /* now the summation over the derivatives of theta */
         rij=rri[j];rjj=rci[j]; /* row and col of non zero element of deriv of R wrt theta_j */
         for (k=0;k<ntheta;k++) {
@@ -216,7 +242,7 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
           }
           if (k==j&&rik==rjk) xx += dtheta[k]* deriv_theta[k] * R[rjj + *m * l] * yX[rjj + *m * i];/* x_i^l'R'R_tt^jk(y-mu) */
         }
-        dH[i + (j+ncoef) * nb] = dH[j+ncoef + i * nb] = xx;   
+        dHr[i + (j+ncoef) * nb] = dHr[j+ncoef + i * nb] = xx;   
       } /* mixed block loop */
       
       /* finally the theta block... */
@@ -246,23 +272,20 @@ void mvn_ll(double *y,double *X,double *XX,double *beta,int *n,int *lpi, /* note
           if (i==j&&rik==rij&&rj==ri) zz += deriv_theta[k]*deriv_theta[i]*yty[rjk * *m + rj];  /* row rjk, col rj */ 
 
           if (i==j&&j==k&&ri==rj) { /* pure derivative on diagonal of R: (y-mu)'R'R_ttt^iii(y-mu)*/
-            for (yy=0.0,p=Rymu+ri,p1=y+ri,q=0;q<*n;p+= *m,p1+= *m,q++) yy += *p * *p1;           
-            zz += deriv_theta[k]*yy;
+            zz += deriv_theta[k]*yRy[ri + *m * ri];
           }
           xx += -zz*dtheta[i];
         }
-	dH[k + ncoef + (j+ncoef) * nb] = dH[j+ncoef + (k+ncoef) * nb] = xx;
+	dHr[k + ncoef + (j+ncoef) * nb] = dHr[j+ncoef + (k+ncoef) * nb] = xx;
       }
-
-      dH += nb * nb; /* move on to next Hessian */
     } /* smoothing parameter loop */ 
-    R_chk_free(yX);R_chk_free(yRX);R_chk_free(yty);
+    R_chk_free(dR);R_chk_free(M);R_chk_free(W);
   } /* if (*deriv) */
   
 
-  R_chk_free(din); R_chk_free(rri); R_chk_free(rci);
-  
-  R_chk_free(R);R_chk_free(Rymu);R_chk_free(deriv_theta);
+  R_chk_free(din); R_chk_free(rri); R_chk_free(rci);R_chk_free(yX);R_chk_free(yRX);
+  R_chk_free(yty);R_chk_free(yRy);R_chk_free(RtR);
+  R_chk_free(R);R_chk_free(deriv_theta);
 } /* mvn_ll */
 
 
@@ -0,0 +1,396 @@
+/* Copyright (C) 2014 Simon N. Wood  simon.wood@r-project.org
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+(www.gnu.org/copyleft/gpl.html)
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+USA. */
+
+/* P-IRLS inner iteration of gam.fit3, in compiled code, for the standard
+   exponential families. The R loop evaluates the family functions on
+   n-vectors, and copies X (x[good,]) to pls_fit1 via .C at every step.
+   Here X is accessed in place via .Call, and all workspace is allocated
+   once. The iteration mirrors the R code exactly: Fisher or full Newton
+   updates, step halving on non-finite deviance, invalid eta/mu or penalized
+   deviance increase, and the same convergence test (including gradient
+   check). Link and variance functions match stats::make.link and the
+   standard family objects.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <R.h>
+#include <Rinternals.h>
+#include <Rmath.h>
+#include <R_ext/BLAS.h>
+#include "general.h"
+#include "mgcv.h"
+
+/* link and variance function codes - must match pirls.code in gam.fit3.r */
+#define LINK_IDENTITY 0
+#define LINK_LOG 1
+#define LINK_LOGIT 2
+#define LINK_PROBIT 3
+#define LINK_CLOGLOG 4
+#define LINK_INVERSE 5
+#define LINK_SQRT 6
+#define LINK_INVSQ 7 /* 1/mu^2 */
+
+#define FAM_GAUSSIAN 0
+#define FAM_POISSON 1  /* also quasipoisson */
+#define FAM_BINOMIAL 2 /* also quasibinomial */
+#define FAM_GAMMA 3
+#define FAM_INVGAUSS 4
+
+/* warning flags returned to R */
+#define PIRLS_NO_INFO 1
+#define PIRLS_NONFINITE_COEF 2
+#define PIRLS_DIVERGE 4
+#define PIRLS_OUT_OF_BOUNDS 8
+
+static double linkinv(double eta,int link) {
+  double x;
+  switch (link) {
+  case LINK_LOG: x = exp(eta);return(x < DBL_EPSILON ? DBL_EPSILON : x);
+  case LINK_LOGIT: /* as C_logit_linkinv in stats */
+    if (eta < -30) x = DBL_EPSILON; else if (eta > 30) x = 1/DBL_EPSILON; else x = exp(eta);
+    return(x/(1+x));
+  case LINK_PROBIT:
+    x = -qnorm(DBL_EPSILON,0.0,1.0,1,0);
+    if (eta < -x) eta = -x; else if (eta > x) eta = x;
+    return(pnorm(eta,0.0,1.0,1,0));
+  case LINK_CLOGLOG:
+    x = -expm1(-exp(eta));
+    if (x > 1 - DBL_EPSILON) x = 1 - DBL_EPSILON;
+    return(x < DBL_EPSILON ? DBL_EPSILON : x);
+  case LINK_INVERSE: return(1/eta);
+  case LINK_SQRT: return(eta*eta);
+  case LINK_INVSQ: return(1/sqrt(eta));
+  default: return(eta);
+  }
+}
+
+static double mu_eta(double eta,int link) {
+  double x;
+  switch (link) {
+  case LINK_LOG: x = exp(eta);return(x < DBL_EPSILON ? DBL_EPSILON : x);
+  case LINK_LOGIT:
+    if (eta < -30 || eta > 30) return(DBL_EPSILON);
+    x = 1 + exp(eta);return(exp(eta)/(x*x));
+  case LINK_PROBIT: x = dnorm(eta,0.0,1.0,0);return(x < DBL_EPSILON ? DBL_EPSILON : x);
+  case LINK_CLOGLOG:
+    if (eta > 700) eta = 700;
+    x = exp(eta)*exp(-exp(eta));return(x < DBL_EPSILON ? DBL_EPSILON : x);
+  case LINK_INVERSE: return(-1/(eta*eta));
+  case LINK_SQRT: return(2*eta);
+  case LINK_INVSQ: return(-1/(2*pow(eta,1.5)));
+  default: return(1.0);
+  }
+}
+
+static double d2link(double mu,int link)
+/* second derivative of link w.r.t. mu, as fix.family.link */
+{ double x;
+  switch (link) {
+  case LINK_LOG: return(-1/(mu*mu));
+  case LINK_LOGIT: return(1/((1-mu)*(1-mu)) - 1/(mu*mu));
+  case LINK_PROBIT: x = qnorm(mu,0.0,1.0,1,0);return(x/pow(mu_eta(x,link),2.0));
+  case LINK_CLOGLOG: x = log(1-mu);return(-1/((1-mu)*(1-mu)*x)*(1+1/x));
+  case LINK_INVERSE: return(2/(mu*mu*mu));
+  case LINK_SQRT: return(-.25*pow(mu,-1.5));
+  case LINK_INVSQ: return(6*pow(mu,-4.0));
+  default: return(0.0);
+  }
+}
+
+static int valideta(double *eta,int n,int link) {
+  int i;
+  if (link==LINK_INVERSE) { for (i=0;i<n;i++) if (!R_FINITE(eta[i])||eta[i]==0) return(0);}
+  else if (link==LINK_INVSQ||link==LINK_SQRT) { for (i=0;i<n;i++) if (!R_FINITE(eta[i])||eta[i]<=0) return(0);}
+  return(1);
+}
+
+static double variance(double mu,int fam) {
+  switch (fam) {
+  case FAM_POISSON: return(mu);
+  case FAM_BINOMIAL: return(mu*(1-mu));
+  case FAM_GAMMA: return(mu*mu);
+  case FAM_INVGAUSS: return(mu*mu*mu);
+  default: return(1.0);
+  }
+}
+
+static double dvar(double mu,int fam) {
+  switch (fam) {
+  case FAM_POISSON: return(1.0);
+  case FAM_BINOMIAL: return(1-2*mu);
+  case FAM_GAMMA: return(2*mu);
+  case FAM_INVGAUSS: return(3*mu*mu);
+  default: return(0.0);
+  }
+}
+
+static int validmu(double *mu,int n,int fam) {
+  int i;
+  if (fam==FAM_POISSON||fam==FAM_GAMMA) { for (i=0;i<n;i++) if (!R_FINITE(mu[i])||mu[i]<=0) return(0);}
+  else if (fam==FAM_BINOMIAL) { for (i=0;i<n;i++) if (!R_FINITE(mu[i])||mu[i]<=0||mu[i]>=1) return(0);}
+  return(1);
+}
+
+static double ylogy(double y,double mu) { return(y != 0.0 ? y * log(y/mu) : 0.0);}
+
+static double deviance(double *y,double *mu,double *w,int n,int fam)
+/* sum of the family dev.resids */
+{ double dev=0.0,r;
+  int i;
+  for (i=0;i<n;i++) {
+    switch (fam) {
+    case FAM_POISSON:
+      r = y[i] > 0 ? w[i]*(y[i]*log(y[i]/mu[i]) - (y[i]-mu[i])) : mu[i]*w[i];
+      r *= 2;break;
+    case FAM_BINOMIAL: r = 2*w[i]*(ylogy(y[i],mu[i]) + ylogy(1-y[i],1-mu[i]));break;
+    case FAM_GAMMA: r = -2*w[i]*(log(y[i]==0 ? 1.0 : y[i]/mu[i]) - (y[i]-mu[i])/mu[i]);break;
+    case FAM_INVGAUSS: r = mu[i]-y[i];r = w[i]*r*r/(y[i]*mu[i]*mu[i]);break;
+    default: r = y[i]-mu[i];r *= r*w[i];
+    }
+    dev += r;
+  }
+  return(dev);
+}
+
+static double quad_pen(double *b,double *St,double *work,int q)
+/* b'St b */
+{ char trans='N';
+  double one=1.0,zero=0.0,x=0.0;
+  int i,inc=1;
+  if (q<1) return(0.0);
+  F77_CALL(dgemv)(&trans,&q,&q,&one,St,&q,b,&inc,&zero,work,&inc);
+  for (i=0;i<q;i++) x += b[i]*work[i];
+  return(x);
+}
+
+static void fitted(double *eta,double *X,double *b,double *off,int n,int q)
+/* eta = X b + off */
+{ char trans='N';
+  double one=1.0;
+  int i,inc=1;
+  for (i=0;i<n;i++) eta[i] = off[i];
+  if (q>0) F77_CALL(dgemv)(&trans,&n,&q,&one,X,&n,b,&inc,&one,eta,&inc);
+}
+
+static void pseudodata(double *z,double *w,int *gi,int ng,double *y,double *mu,double *eta,
+                       double *off,double *pw,int link,int fam,int fisher)
+/* z and w for the ng good data indexed in gi, as gam.fit3 */
+{ int j,i;
+  double me,V,c,alpha;
+  for (j=0;j<ng;j++) {
+    i = gi[j];me = mu_eta(eta[i],link);V = variance(mu[i],fam);
+    if (fisher) {
+      z[j] = eta[i] - off[i] + (y[i]-mu[i])/me;
+      w[j] = pw[i]*me*me/V;
+    } else {
+      c = y[i] - mu[i];
+      alpha = 1 + c*(dvar(mu[i],fam)/V + d2link(mu[i],link)*me);
+      if (alpha==0) alpha = DBL_EPSILON;
+      z[j] = eta[i] - off[i] + c/(me*alpha);
+      w[j] = pw[i]*alpha*me*me/V;
+    }
+  }
+}
+
+SEXP mgcv_pirls(SEXP X,SEXP Y,SEXP PW,SEXP OFF,SEXP ETA,SEXP NULLCOEF,SEXP ST,SEXP SR,SEXP EB,
+                SEXP ICTRL,SEXP DCTRL) {
+/* Penalized IRLS for gam.fit3. X is the n by q model matrix (not copied), Y the response,
+   PW the prior weights, OFF the offset and ETA the initial linear predictor (including offset,
+   valid). NULLCOEF are the null model coefficients used to judge initial divergence. ST is the
+   q by q total penalty, SR its rE by q square root and EB the balanced root for rank detection.
+   ICTRL is c(link, family, fisher, strictly additive, maxit, nthreads, rE), DCTRL is
+   c(epsilon, rank.tol).
+
+   Returns list(coef,start,eta,etaold,mu,iter,conv,boundary,warn), each as in gam.fit3 on
+   exit from the P-IRLS loop. Workspace is R_alloc'd, so is freed on error.
+*/
+  int n,q,link,fam,fisher,additive,maxit,nt,rE,iter,conv=0,boundary=0,warn=0,
+    i,j,ng,ngx=-1,nn,ii,*gi,*gx,*good,nprot=0;
+  double *x,*y,*pw,*off,*eta,*St,*Sr,*Eb,eps,rank_tol,*coef,*start,*coefold,*etaold,
+    *mu,*nulleta,*nullcoef,*z,*w,*zw,*Xg,*E1,*etaw,*work,*grad,old_pdev,pdev,dev,penalty,
+    div_thresh,xx,gmax,bmax;
+  char trans='T';
+  double one=1.0,zero=0.0;
+  int inc=1;
+  SEXP ans,names,r_coef,r_start,r_eta,r_etaold,r_mu;
+  const char *nm[] = {"coef","start","eta","etaold","mu","iter","conv","boundary","warn"};
+
+  n = nrows(X);q = ncols(X);x = REAL(X);
+  y = REAL(Y);pw = REAL(PW);off = REAL(OFF);nullcoef = REAL(NULLCOEF);
+  St = REAL(ST);Sr = REAL(SR);Eb = REAL(EB);
+  link = INTEGER(ICTRL)[0];fam = INTEGER(ICTRL)[1];fisher = INTEGER(ICTRL)[2];
+  additive = INTEGER(ICTRL)[3];maxit = INTEGER(ICTRL)[4];nt = INTEGER(ICTRL)[5];
+  rE = INTEGER(ICTRL)[6];
+  eps = REAL(DCTRL)[0];rank_tol = REAL(DCTRL)[1];
+
+  r_coef = PROTECT(allocVector(REALSXP,q));nprot++;coef = REAL(r_coef);
+  r_start = PROTECT(allocVector(REALSXP,q));nprot++;start = REAL(r_start);
+  r_eta = PROTECT(allocVector(REALSXP,n));nprot++;eta = REAL(r_eta);
+  r_etaold = PROTECT(allocVector(REALSXP,n));nprot++;etaold = REAL(r_etaold);
+  r_mu = PROTECT(allocVector(REALSXP,n));nprot++;mu = REAL(r_mu);
+
+  coefold = (double *)R_alloc((size_t)q,sizeof(double));
+  nulleta = (double *)R_alloc((size_t)n,sizeof(double));
+  work = (double *)R_alloc((size_t)q,sizeof(double));
+  grad = (double *)R_alloc((size_t)n,sizeof(double));
+  z = (double *)R_alloc((size_t)n,sizeof(double));
+  zw = (double *)R_alloc((size_t)(n > q ? n : q),sizeof(double));
+  w = (double *)R_alloc((size_t)n,sizeof(double));
+  etaw = (double *)R_alloc((size_t)n,sizeof(double));
+  E1 = (double *)R_alloc((size_t)(rE * q > 1 ? rE * q : 1),sizeof(double));
+  gi = (int *)R_alloc((size_t)n,sizeof(int));
+  good = (int *)R_alloc((size_t)n,sizeof(int));
+  Xg = NULL;gx = NULL; /* only needed if some data are uninformative */
+
+  for (i=0;i<q;i++) { coef[i] = 0.0;coefold[i] = start[i] = nullcoef[i];}
+  for (i=0;i<n;i++) { eta[i] = REAL(ETA)[i];mu[i] = linkinv(eta[i],link);}
+  fitted(nulleta,x,nullcoef,off,n,q);
+  for (i=0;i<n;i++) { etaold[i] = nulleta[i];grad[i] = linkinv(nulleta[i],link);}
+  old_pdev = deviance(y,grad,pw,n,fam) + quad_pen(nullcoef,St,work,q);
+
+  for (iter=1;iter<=maxit;iter++) {
+    for (ng=i=0;i<n;i++) {
+      good[i] = 0;
+      if (pw[i] > 0) {
+        xx = variance(mu[i],fam);
+        if (ISNAN(xx)) error(_("NAs in V(mu)"));
+        if (xx==0) error(_("0s in V(mu)"));
+        xx = mu_eta(eta[i],link);
+        if (ISNAN(xx)) error(_("NAs in d(mu)/d(eta)"));
+        if (xx != 0) { good[i]=1;gi[ng] = i;ng++;}
+      }
+    }
+    if (ng==0) { conv=0;warn |= PIRLS_NO_INFO;break;}
+    if (ng<q) error(_("Not enough informative observations."));
+    pseudodata(z,w,gi,ng,y,mu,eta,off,pw,link,fam,fisher);
+    if (ng<n) { /* copy out informative rows, unless they are unchanged since the last copy */
+      if (!Xg) { 
+        Xg = (double *)R_alloc((size_t)n * q,sizeof(double));
+        gx = (int *)R_alloc((size_t)n,sizeof(int));
+      }
+      if (ng==ngx) for (i=0;i<ng;i++) if (gi[i]!=gx[i]) break;
+      if (ng!=ngx||i<ng) {
+        for (j=0;j<q;j++) for (i=0;i<ng;i++) Xg[i + (ptrdiff_t) ng * j] = x[gi[i] + (ptrdiff_t) n * j];
+        for (i=0;i<ng;i++) gx[i] = gi[i];
+        ngx = ng;
+      }
+    }
+    for (i=0;i<ng;i++) zw[i] = z[i];
+    for (i=0;i<rE*q;i++) E1[i] = Sr[i]; /* pls_fit1 modifies E */
+    nn = ng;
+    pls_fit1(zw,ng<n ? Xg:x,w,E1,Eb,&nn,&q,&rE,etaw,&penalty,&rank_tol,&nt);
+    if (!fisher && nn<0) { /* likelihood indefinite - switch to Fisher for this step */
+      pseudodata(z,w,gi,ng,y,mu,eta,off,pw,link,fam,1);
+      for (i=0;i<ng;i++) zw[i] = z[i];
+      for (i=0;i<rE*q;i++) E1[i] = Sr[i];
+      nn = ng;
+      pls_fit1(zw,ng<n ? Xg:x,w,E1,Eb,&nn,&q,&rE,etaw,&penalty,&rank_tol,&nt);
+    }
+    for (i=0;i<q;i++) start[i] = zw[i];
+    for (i=0;i<q;i++) if (!R_FINITE(start[i])) break;
+    if (i<q) { conv=0;warn |= PIRLS_NONFINITE_COEF;break;}
+    fitted(eta,x,start,off,n,q);
+    for (i=0;i<n;i++) mu[i] = linkinv(eta[i],link);
+    dev = deviance(y,mu,pw,n,fam);
+    boundary = 0;
+    if (!R_FINITE(dev)) { /* step halve towards last good coefs */
+      warn |= PIRLS_DIVERGE;
+      ii = 1;
+      while (!R_FINITE(dev)) {
+        if (ii > maxit) error(_("inner loop 1; can't correct step size"));
+        ii++;
+        for (i=0;i<q;i++) start[i] = (start[i] + coefold[i])/2;
+        for (i=0;i<n;i++) { eta[i] = (eta[i] + etaold[i])/2;mu[i] = linkinv(eta[i],link);}
+        dev = deviance(y,mu,pw,n,fam);
+      }
+      boundary = 1;
+      penalty = quad_pen(start,St,work,q);
+    }
+    if (!(valideta(eta,n,link) && validmu(mu,n,fam))) {
+      warn |= PIRLS_OUT_OF_BOUNDS;
+      ii = 1;
+      while (!(valideta(eta,n,link) && validmu(mu,n,fam))) {
+        if (ii > maxit) error(_("inner loop 2; can't correct step size"));
+        ii++;
+        for (i=0;i<q;i++) start[i] = (start[i] + coefold[i])/2;
+        for (i=0;i<n;i++) { eta[i] = (eta[i] + etaold[i])/2;mu[i] = linkinv(eta[i],link);}
+      }
+      boundary = 1;
+      penalty = quad_pen(start,St,work,q);
+      dev = deviance(y,mu,pw,n,fam);
+    }
+    pdev = dev + penalty;
+    div_thresh = 10*(.1+fabs(old_pdev))*sqrt(DBL_EPSILON);
+    if (pdev - old_pdev > div_thresh) { /* solution diverging */
+      ii = 1;
+      if (iter==1) { /* immediate divergence, need to shrink towards null coefs */
+        for (i=0;i<n;i++) etaold[i] = nulleta[i];
+        for (i=0;i<q;i++) coefold[i] = nullcoef[i];
+      }
+      while (pdev - old_pdev > div_thresh) {
+        if (ii > 100) error(_("inner loop 3; can't correct step size"));
+        ii++;
+        for (i=0;i<q;i++) start[i] = (start[i] + coefold[i])/2;
+        for (i=0;i<n;i++) { eta[i] = (eta[i] + etaold[i])/2;mu[i] = linkinv(eta[i],link);}
+        pdev = deviance(y,mu,pw,n,fam) + quad_pen(start,St,work,q);
+      }
+    }
+    if (additive) { conv=1;for (i=0;i<q;i++) coef[i] = start[i];break;}
+    if (fabs(pdev - old_pdev)/(0.1 + fabs(pdev)) < eps) {
+      /* check gradient of penalized deviance: 2X'W(X start - z) + 2 St start,
+         using full X with zero residual for uninformative rows */
+      for (i=0;i<n;i++) grad[i] = 0.0;
+      for (j=0;j<ng;j++) { i = gi[j];grad[i] = w[j]*(eta[i] - off[i] - z[j]);}
+      F77_CALL(dgemv)(&trans,&n,&q,&one,x,&n,grad,&inc,&zero,zw,&inc);
+      xx = quad_pen(start,St,work,q); /* work now St start */
+      for (gmax=bmax=0.0,i=0;i<q;i++) {
+        xx = fabs(2*zw[i] + 2*work[i]);if (xx>gmax) gmax = xx;
+        xx = fabs(start[i] + coefold[i]);if (xx>bmax) bmax = xx;
+      }
+      if (gmax > eps*bmax/2) {
+        old_pdev = pdev;
+        for (i=0;i<q;i++) coef[i] = coefold[i] = start[i];
+        for (i=0;i<n;i++) etaold[i] = eta[i];
+      } else {
+        conv = 1;
+        for (i=0;i<q;i++) coef[i] = start[i];
+        for (i=0;i<n;i++) etaold[i] = eta[i];
+        break;
+      }
+    } else {
+      old_pdev = pdev;
+      for (i=0;i<q;i++) coef[i] = coefold[i] = start[i];
+      for (i=0;i<n;i++) etaold[i] = eta[i];
+    }
+  } /* end of P-IRLS loop */
+  if (iter>maxit) iter = maxit;
+
+  ans = PROTECT(allocVector(VECSXP,9));nprot++;
+  SET_VECTOR_ELT(ans,0,r_coef);SET_VECTOR_ELT(ans,1,r_start);
+  SET_VECTOR_ELT(ans,2,r_eta);SET_VECTOR_ELT(ans,3,r_etaold);SET_VECTOR_ELT(ans,4,r_mu);
+  SET_VECTOR_ELT(ans,5,ScalarInteger(iter));SET_VECTOR_ELT(ans,6,ScalarLogical(conv));
+  SET_VECTOR_ELT(ans,7,ScalarLogical(boundary));SET_VECTOR_ELT(ans,8,ScalarInteger(warn));
+  names = PROTECT(allocVector(STRSXP,9));nprot++;
+  for (i=0;i<9;i++) SET_STRING_ELT(names,i,mkChar(nm[i]));
+  setAttrib(ans,R_NamesSymbol,names);
+  UNPROTECT(nprot);
+  return(ans);
+} /* mgcv_pirls */
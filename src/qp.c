@@ -23,6 +23,9 @@ USA.*/
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stddef.h>
+#include <R_ext/BLAS.h>
+#include "mgcv.h"
 #include "matrix.h"
 #include "qp.h"
 #include "general.h"
@@ -359,6 +362,43 @@ int LSQPlagrange(matrix *X,matrix *Q,matrix *T,matrix *p,matrix *Xy,matrix *p1,
 /* Main Public Routines.                                                   */
 /***************************************************************************/
 
+static void LSQPqr(matrix *Rf,matrix *X,matrix *Q,matrix *y,matrix *PX,matrix *Py)
+/* Forms Rf = P X Q, where P is orthogonal, and Rf is upper triangular on exit. 
+   PX = P X and Py = P y are also formed. Q is p by p orthogonal (NULL for the 
+   identity). The work is done by BLAS/LAPACK on contiguous column major copies, 
+   with XQ from dgemm and a blocked QR (dgeqrf/dormqr), so that the cost is 
+   dominated by BLAS 3 operations. Rf, X and PX are all n by p, y and Py are n 
+   by 1, with n >= p. 
+*/
+{ double *a,*B,*Qc,*tau,*p0,alpha=1.0,beta=0.0;
+  int i,j,n,q,k,nb,*pivot,left=1,tp=1;
+  char N='N';
+  n = (int)X->r;q = (int)X->c;k = n < q ? n : q;nb = q + 1;
+  a = (double *)R_chk_calloc((size_t)n*q,sizeof(double));
+  B = (double *)R_chk_calloc((size_t)n*nb,sizeof(double)); /* [y,X] */
+  tau = (double *)R_chk_calloc((size_t)k+1,sizeof(double));
+  pivot = (int *)R_chk_calloc((size_t)q+1,sizeof(int));
+  for (i=0;i<n;i++) { 
+    B[i] = y->V[i];
+    for (p0=X->M[i],j=0;j<q;j++) B[i + (ptrdiff_t)(j+1)*n] = p0[j];
+  }
+  if (Q) { /* a = XQ */ 
+    Qc = (double *)R_chk_calloc((size_t)q*q,sizeof(double));
+    for (i=0;i<q;i++) for (p0=Q->M[i],j=0;j<q;j++) Qc[i + j*q] = p0[j];
+    F77_CALL(dgemm)(&N,&N,&n,&q,&q,&alpha,B+n,&n,Qc,&q,&beta,a,&n);
+    R_chk_free(Qc);
+  } else for (p0=B+n,i=0;i<n*q;i++) a[i] = p0[i];
+  mgcv_qr2(a,&n,&q,pivot,tau); /* un-pivoted QR */
+  mgcv_qrqy(B,a,tau,&n,&nb,&k,&left,&tp); /* B = P[y,X] */
+  for (i=0;i<n;i++) {
+    for (p0=Rf->M[i],j=0;j<q;j++) p0[j] = j<i ? 0.0 : a[i + (ptrdiff_t)j*n];
+    Py->V[i] = B[i];
+    for (p0=PX->M[i],j=0;j<q;j++) p0[j] = B[i + (ptrdiff_t)(j+1)*n];
+  }
+  R_chk_free(a);R_chk_free(B);R_chk_free(tau);R_chk_free(pivot);
+}
+
+
 void QPCLS(matrix *Z,matrix *X, matrix *p, matrix *y,matrix *Ain,matrix *b,matrix *Af,int *active)
 
 /* This routine aims to fit linearly constrained least squares problems of the
@@ -404,6 +444,17 @@ void QPCLS(matrix *Z,matrix *X, matrix *p, matrix *y,matrix *Ain,matrix *b,matri
    and the row number of these constraints in Ain in the remaining elements of
    active[], active must be initialized to length p.r+1 on entry.
 
+   Warm starting: if active[0]>0 on entry then the rows of Ain given in 
+   active[1..active[0]] form the initial working set, in place of the empty set
+   (e.g. the active set returned by a previous call for a similar problem). 
+   Listed constraints that p does not satisfy as equalities (to within a relative
+   tolerance of sqrt(eps)), or that are (near) dependent on those already in the
+   working set, are skipped. The working set constraints are added to the QT 
+   factorization along with those of Af, before the QR factorization of XQ, so if 
+   the supplied set is the active set at the solution then the search terminates
+   after one step and one Lagrange multiplier check. Otherwise the usual 
+   add/delete iteration proceeds from the supplied set. 
+
    See documentation in service routines:
    LSQPlagrange(); LSQPaddcon(); LSQPdelcon(); (above)
    Rsolv() (in matrix.c)
@@ -418,9 +469,9 @@ void QPCLS(matrix *Z,matrix *X, matrix *p, matrix *y,matrix *Ain,matrix *b,matri
 
 */
 
-{ matrix Q,T,Rf,PX,Py,a,P,p1,s,c,Xy,y1,u,Pd,pz,pk;
-  int k,i,j,tk,*I,*ignore,iter=0,*fixed,*delog,maxdel=100;
-  double x;
+{ matrix Q,T,Rf,PX,Py,a,P,p1,s,c,Xy,y1,u,Pd,pz,pk,Ap;
+  int k,i,j,l,tk,nw,*w,*I,*ignore,iter=0,*fixed,*delog,maxdel=100;
+  double x,xx,z,tol;
   I=(int *)R_chk_calloc((size_t) p->r,sizeof(int)); /* I[i] is the row of Ain containing ith active constraint */
   fixed=(int *)R_chk_calloc((size_t) p->r,sizeof(int)); /* fixed[i] is set to 1 when the corresponding inequality constraint is to be left in regardless of l.m. estimate */
   ignore=(int *)R_chk_calloc((size_t) Ain->r,sizeof(int)); /* ignore[i] is 1 if ith row of Ain is in active set, 0 otherwise */
@@ -431,30 +482,50 @@ void QPCLS(matrix *Z,matrix *X, matrix *p, matrix *y,matrix *Ain,matrix *b,matri
   Xy=initmat(p->r,1);     /* vector storing X'y for use in lagrange multiplier calculation */
   vmult(X,y,&Xy,1);      /* form X'y */
   Rf=initmat(X->r,X->c);  /* Rf=PXQ, where P and Q are orthogonal */
-  mcopy(X,&Rf);          /* initialize Rf while P and Q are identity matrices */
   T=initmat(p->r,p->r);   /* initialised to max possible size */
   Q=initmat(p->r,p->r);   /* required for access to Z for null space to full space transform */
-  /* initialize Q, T and Rf using fixed constraints (if any) .... */
+  /* initialize Q and T using fixed constraints (if any), Rf=PXQ is formed once Q is complete .... */
   for (i=0;i<p->r;i++) for (j=0;j<p->r;j++) Q.M[i][j]=0.0;
   for (i=0;i<p->r;i++) Q.M[i][i]=1.0;
   T.r=0;a.r=1;a.c=Af->c;
   for (i=0;i<Af->r;i++)
   { a.V=Af->M[i];
     T=addconQT(&Q,T,a,&u); /* adding constraint from Af to working set */
-    Hmult(Rf,u);           /* updating Rf (=XQ, at present) */
     freemat(u);            /* freeing u created by addconQT() */
   }
-  /* Now Form Rf, proper. i.e. PXQ, using QR factorization */
-  P=initmat(Rf.c,Rf.r);
-  QR(&P,&Rf);   /* Rf now contains Rf=PXQ   (on entry it contained XQ) */
-  Py=initmat(y->r,1);mcopy(y,&Py);
-  OrthoMult(&P,&Py,0,(int)P.r,0,1,1); /* Form Py */
-  PX=initmat(X->r,X->c);mcopy(X,&PX);
-  OrthoMult(&P,&PX,0,(int)P.r,0,1,1); /* Form PX */
-  freemat(P); /* no longer needed */
+  tk=0;             /* The number of inequality constraints currently active */
+  if (active[0]>0&&Ain->r>0) /* warm start from the supplied working set */
+  { tol=sqrt(DOUBLE_EPS);
+    nw=active[0];if (nw>(int)p->r) nw=(int)p->r;
+    w=(int *)R_chk_calloc((size_t)nw,sizeof(int));
+    for (i=0;i<nw;i++) w[i]=active[i+1]; /* active[] is over-written on exit */
+    Ap=initmat(Ain->r,1);matmult(Ap,*Ain,*p,0,0);
+    a.c=Ain->c;
+    for (l=0;l<nw;l++)
+    { k=w[l];
+      if (k<0||k>=Ain->r||ignore[k]||T.r>=p->r-1) continue;
+      /* only constraints that p satisfies as equalities can start in the working set... */
+      xx=fabs(b->V[k]);for (j=0;j<Ain->c;j++) xx+=fabs(Ain->M[k][j]*p->V[j]);
+      if (fabs(Ap.V[k]-b->V[k])>tol*xx) continue;
+      /* ... and they must not be (near) linearly dependent on the current working set */
+      for (x=xx=0.0,i=0;i<Q.c;i++)
+      { for (z=0.0,j=0;j<Ain->c;j++) z+=Ain->M[k][j]*Q.M[j][i];
+        x+=z*z;if (i<Q.c-T.r) xx+=z*z; /* null space component */
+      }
+      if (xx<=tol*x) continue;
+      a.V=Ain->M[k];
+      T=addconQT(&Q,T,a,&u); /* add to working set, as for the fixed constraints */
+      freemat(u);
+      I[tk]=k;ignore[k]=1;tk++;
+    }
+    freemat(Ap);R_chk_free(w);
+  }
+  /* Now Form Rf, proper. i.e. PXQ, using (blocked LAPACK) QR factorization */
+  Py=initmat(y->r,1);
+  PX=initmat(X->r,X->c);
+  LSQPqr(&Rf,X,T.r ? &Q:NULL,y,&PX,&Py); /* Rf now contains Rf=PXQ, Py and PX formed */
   P=initmat(b->r,1); /* used solely for feasibility checking */
   Pd=initmat(y->r,1);pz=initmat(p->r,1);pk=initmat(p->r,1);
-  tk=0;             /* The number of inequality constraints currently active */
   /*printf("\nLSQ");*/
   while(1)
   { iter++;
@@ -542,15 +613,17 @@ void PCLS(matrix *X,matrix *p,matrix *y,matrix *w,matrix *Ain,matrix *b,
    At present the calculation of H is inefficient and none too stable.
 
    On exit active[] contains a list of the active inequlity constraints in elements 
-   1->active[0]. This array should be initialized to length p.r+1 on entry.
+   1->active[0]. This array should be initialized to length p.r+1 on entry. On entry
+   it may contain a working set from which to warm start (see QPCLS), otherwise 
+   active[0] should be zero.
 
    20/11/99
 
 */
 
-{ int i,j,k;
-  matrix z,F,W,Z,B,C;
-  double x,xx;
+{ int i,j,k,q,rank;
+  matrix z,F,W,Z,B;
+  double x,xx,*Bd;
  
   /* form transformed data vector z */
   if (m>0) z=initmat(y->r+p->r,1);else z=initmat(y->r,1);
@@ -563,16 +636,18 @@ void PCLS(matrix *X,matrix *p,matrix *y,matrix *w,matrix *Ain,matrix *b,
   /* add up the Penalties */
  
   if (m>0)
-  { B=initmat(p->r,p->r);
+  { q=(int)p->r;
+    Bd=(double *)R_chk_calloc((size_t)q*q,sizeof(double));
     for (k=0;k<m;k++) for (i=0;i<S[k].r;i++) for (j=0;j<S[k].c;j++)
-    B.M[i+off[k]][j+off[k]]+=theta[k]*S[k].M[i][j];
-    /* and find a square root of B..... */
-
-    root(&B,&C,8*DOUBLE_EPS);
-
-    /* copy C' into the last p->r rows of F */
-    for (i=0;i<C.r;i++) for (j=0;j<C.c;j++) F.M[j+X->r][i]=C.M[i][j];
-    freemat(B);freemat(C);
+    Bd[i+off[k]+(ptrdiff_t)(j+off[k])*q]+=theta[k]*S[k].M[i][j];
+    /* and find a square root of B, by (LINPACK dchdc) pivoted Choleski..... 
+       rank is the number of positive pivots, rather than the number of 
+       eigenvalues above 8*eps times the largest, as with root */
+    rank=0;
+    mroot(Bd,&rank,&q); /* Bd now contains rank by q C, s.t. C'C = B */
+    /* copy C into the last p->r rows of F (remaining rows are zero) */
+    for (i=0;i<rank;i++) for (j=0;j<q;j++) F.M[i+X->r][j]=Bd[i+(ptrdiff_t)j*rank];
+    R_chk_free(Bd);
   }
   /*  printf("\ncond(F)=%g",condition(F));*/
   /* Which means that the problem is now in a form where QPCLS can solve it.... */
@@ -20,7 +20,18 @@
 #include <Rinternals.h>
 #include <math.h>
 #include <stdlib.h>
+#include <Rconfig.h>
+#include <stdio.h>
+#include <string.h>
 #include "mgcv.h"
+#include "general.h"
+#ifndef _WIN32
+#define MGCV_KD_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef SUPPORT_OPENMP
+#include <omp.h>
+#endif
 
 /* 
   kd-tree tasks:
@@ -42,6 +53,9 @@
    * kd_sizes, kd_dump, kd_read are concerned with encoding 
      kd tree in form suitable for storage in R and reading 
      from this format.
+   * kd_points stores a copy of the points in the order of kd.ind, 
+     one point per row, so that the points in any box are contiguous 
+     in memory. The neighbour searches work from this copy. 
  
    needed: 
    * k_closest - find k nearest neighbours in kd tree to points not 
@@ -100,7 +114,8 @@ void kd_read(kdtree_type *kd,int *idat,double *ddat) {
 /* creates a kd tree from the information packed into idat and ddat by
    kd_dump. Note that ind, rind, and kd.box[0].lo should not be freed 
    when freeing this structure, as no storage is allocated for these.
-   Only kd.box, should be freed!!
+   Only kd.box, should be freed!! kd.Xo is not set up: call kd_points 
+   if it is needed, in which case it must also be freed.
 
    Point of this is that kd_dump can be used to export structure to R for 
    storage, and this routine then reads in again.
@@ -113,6 +128,7 @@ void kd_read(kdtree_type *kd,int *idat,double *ddat) {
   kd->ind = idat + 3;
   kd->rind = idat + 3 + n;
   kd->huge = *ddat;ddat++;
+  kd->Xo = NULL;
   /* Now make an array of boxes (all cleared to zero)... */
   kd->box = (box_type *)R_chk_calloc((size_t)nb,sizeof(box_type));
   /* now work through boxes loading contents */
@@ -241,9 +257,95 @@ void free_kdtree(kdtree_type kd) {
   R_chk_free(kd.ind);R_chk_free(kd.rind);
   R_chk_free(kd.box[0].lo); /* storage for box coordinates */
   R_chk_free(kd.box);
+  if (kd.Xo) R_chk_free(kd.Xo);
 }
 
-void kd_tree(double *X,int *n, int *d,kdtree_type *kd) {
+void kd_points(kdtree_type *kd,double *X) {
+/* Sets up kd->Xo, a copy of the n by d matrix of points X on which the 
+   tree is built, re-ordered so that its jth row is point ind[j], and 
+   stored row-wise (so Xo[j*d + l] is X[ind[j],l]). The points in any box,
+   ind[p0..p1], then occupy a contiguous stretch of Xo, and the coordinates 
+   of each point are adjacent, which is much kinder to the cache when 
+   scanning boxes than striding through X. 
+*/
+  int i,j,d,n;
+  double *p;
+  d = kd->d;n = kd->n;
+  kd->Xo = p = (double *)R_chk_calloc((size_t)n * d,sizeof(double));
+  for (i=0;i<n;i++) for (j=0;j<d;j++,p++) *p = X[kd->ind[i] + (ptrdiff_t)j * n];
+}
+
+int kd_nbox(int n) {
+/* the number of boxes in a kd tree for n points (also the number of boxes in 
+   the subtree of any box containing n points) */
+  int m,nb;
+  m=2;while (m < n) m *= 2;
+  nb = n * 2 - m / 2 - 1;
+  if (nb > m-1) nb = m - 1; 
+  if (nb < 1) nb = 1;
+  return(nb);
+} /* kd_nbox */
+
+static void kd_split(box_type *box,int b,int *ind,double *X,int n,int d,int dim) {
+/* Split box[b], containing 3 or more points, into two child boxes, on dimension 
+   dim. Boxes are numbered in pre-order: child1 is box b+1, and the subtree of 
+   child1 is followed immediately by child2. So each subtree occupies a 
+   contiguous block of boxes, of known size, and disjoint subtrees can be 
+   built independently.
+*/ 
+  int np,k,p0,c1,c2;
+  double *x,*dum1,*dum2,*dum3;
+  p0 = box[b].p0;
+  np = box[b].p1-p0+1;      /* number of points in box b */
+  x = X + (ptrdiff_t)dim * n;  /* array of co-ordinates for current dimension to sort on */
+  k = (np-1)/2;          /* split the box around kth value in box */ 
+  /* next line re-orders the point index for this box only.
+     after reordering the index is split into two parts, indexing
+     points below and above the kth largest value */  
+  k_order(&k,ind+p0,x,&np); 
+  /*... so the box is now split at a plane/line through x[ind[p0+k]] */
+  c1 = b + 1; /* lower box first */
+  c2 = c1 + kd_nbox(k+1); /* then the higher box, after the lower box's subtree */
+  box[b].child1=c1;box[b].child2=c2; /* record box relationships */
+  /* copy box coordinates... */
+  for (dum1=box[c1].lo,dum2=dum1 + d,dum3=box[b].lo;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
+  for (dum1=box[c1].hi,dum2=dum1 + d,dum3=box[b].hi;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
+  box[c1].hi[dim] = x[ind[p0+k]]; /* split location */
+  box[c1].parent=b; 
+  box[c1].p0=p0;
+  box[c1].p1=p0+k;
+  for (dum1=box[c2].lo,dum2=dum1 + d,dum3=box[b].lo;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
+  for (dum1=box[c2].hi,dum2=dum1 + d,dum3=box[b].hi;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
+  box[c2].lo[dim] = x[ind[p0+k]]; /* split location */
+  box[c2].parent=b; 
+  box[c2].p1=box[b].p1;
+  box[c2].p0=p0+k+1;
+} /* kd_split */
+
+static void kd_subtree(box_type *box,int b,int *ind,double *X,int n,int d,int dim) {
+/* Build the subtree of box[b], which has its p0, p1, lo and hi already set, 
+   splitting it first on dimension dim. Each box contains 1 or 2 points, or it 
+   gets split into 2 smaller boxes. If the smaller boxes contain 3 or more points 
+   then they are added to the todo list. The todo list is always worked on from 
+   the end (i.e by processing box todo[item]).
+*/
+  int todo[50],todo_d[50],item;
+  todo[0]=b;   /* put box[b] on todo list for processing */ 
+  todo_d[0]=dim; /* which dimension to start with */
+  item=0;      /* which item of todo list to do next (item+1 is number of items on list) */
+  while (item >= 0) {   /* todo list still has items */
+    b = todo[item];     /* current box */
+    dim = todo_d[item]; /* dimension on which to split box */ 
+    item--; /* basically done that item */
+    if (box[b].p1-box[b].p0 < 2) continue; /* 1 or 2 points - no split */
+    kd_split(box,b,ind,X,n,d,dim);
+    dim++;if (dim == d) dim = 0;
+    item++;todo[item] = box[b].child2;todo_d[item] = dim;
+    item++;todo[item] = box[b].child1;todo_d[item] = dim;
+  }
+} /* kd_subtree */
+
+void kd_tree(double *X,int *n, int *d,kdtree_type *kd,int nt) {
 /* Create a kd tree for the points in n by d matrix X.
    X is in column order. Each row is one point. 
    At end of process... 
@@ -252,18 +354,18 @@ void kd_tree(double *X,int *n, int *d,kdtree_type *kd) {
    * box[i] has one parent and 2 children, unless it contains only one 
      or 2 points, in which case it has no children.
 
-   
+   nt is the number of threads to use. The top levels of the tree are split 
+   serially, until there are several subtrees per thread, and these are then
+   built in parallel. The tree does not depend on nt.
 */
-  int *ind,*rind,*p,i,m,todo[50],todo_d[50],item,bi,nb,np,k,dim,b,p0,p1;
+  int *ind,*rind,*p,i,nb,*tb,*tb1,*tb2,ntb,nnew,l,L,b,dim,nth;
   box_type *box;
-  double huge=1e100,*pd,*x,*dum1,*dum2,*dum3;
+  double huge=1e100,*pd;
   /* create index for points... */
   ind = (int *)R_chk_calloc((size_t) *n,sizeof(int)); 
   for (i=0,p=ind;i < *n;i++,p++) *p = i; 
   /* Find the number of boxes in the tree */
-  m=2;while (m < *n) m *= 2;
-  nb = *n * 2 - m / 2 - 1;
-  if (nb > m-1) nb = m - 1; 
+  nb = kd_nbox(*n);
   /* Now make an array of boxes (all cleared to zero)... */
   box = (box_type *)R_chk_calloc((size_t)nb,sizeof(box_type));
   /* allocate storage for box defining coordinates... */ 
@@ -278,77 +380,41 @@ void kd_tree(double *X,int *n, int *d,kdtree_type *kd) {
     box[0].lo[i] = -huge;box[0].hi[i] = huge;
   }
   box[0].p1 = *n-1; /* last index item in this box (.p0 is first) */
-  todo[0]=0;   /* put box[0] on todo list for processing */ 
-  todo_d[0]=0; /* which dimension to start with */
-  item=0;      /* which item of todo list to do next (item+1 is number of items on list) */
-  /* each box contains 1 or 2 points, or it gets split into
-     2 smaller boxes. If the smaller boxes contain 3 or more 
-     points then they are added to the todo list. The todo 
-     list is always worked on from the end (i.e by processing 
-     box todo[item]) */
-  bi=0; /* box index, counting number of boxes created so far */
-  while (item >= 0) {   /* todo list still has items */
-    b = todo[item];     /* current box */
-    dim = todo_d[item]; /* dimension on which to split box */ 
-    p0 = box[b].p0;p1=box[b].p1; 
-    np = p1-p0+1;      /* number of points in box k */
-    x = X + dim * *n;  /* array of co-ordinates for current dimension to sort on */
-    k = (np-1)/2;          /* split the box around kth value in box */ 
-    /* next line re-orders the point index for this box only.
-       after reordering the index is split into two parts, indexing
-       points below and above the kth largest value */  
- 
-    k_order(&k,ind+p0,x,&np); 
-  
-    /*... so the box is now split at a plane/line through x[ind[p0+k-1]] */
-    item--; /* basically done that item */
-    /* create the offspring boxes... */
-    
-    bi++; /* lower box first */ 
-    
-    if (bi>nb-1) Rprintf("too many boxes!!");
-    box[b].child1=bi;/* record box relationships */
-    /* copy box coordinates... */
-    for (dum1=box[bi].lo,dum2=dum1 + *d,dum3=box[b].lo;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
-    for (dum1=box[bi].hi,dum2=dum1 + *d,dum3=box[b].hi;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
-    box[bi].hi[dim] = x[ind[p0+k]]; /* split location */
-    box[bi].parent=b; /* record box relationships */
-    box[bi].p0=box[b].p0;
-    box[bi].p1=box[b].p0+k;
-    if (k>1) { /* more than two points , so more work needed */ 
-      item++;
-      todo[item] = bi;
-      todo_d[item] = dim+1;
-      if (todo_d[item] == *d) todo_d[item] = 0;
-    }
-    bi++; /* now the higher box */ 
-    if (bi>nb-1) Rprintf("too many boxes!!");
-    box[b].child2=bi;/* record box relationships */
-    /* copy box coordinates... */
-    for (dum1=box[bi].lo,dum2=dum1 + *d,dum3=box[b].lo;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
-    for (dum1=box[bi].hi,dum2=dum1 + *d,dum3=box[b].hi;dum1<dum2;dum1++,dum3++) *dum1 = *dum3;
-    box[bi].lo[dim] = x[ind[p0+k]]; /* split location */
-    box[bi].parent=b; 
-    box[bi].p1=box[b].p1;
-    box[bi].p0=box[b].p0+k+1;
-    if (np-k>3) { /* more than two points , so more work needed */ 
-      item++;
-      todo[item] = bi;
-      todo_d[item] = dim+1;
-      if (todo_d[item] == *d) todo_d[item] = 0;
+  nth = mgcv_nthreads(nt);
+  if (*n < 1000) nth = 1; /* not worth the overhead */
+  if (nth==1) kd_subtree(box,0,ind,X,*n,*d,0); else {
+    L=0;while ((1<<L) < 4*nth) L++; /* depth at which to go parallel */
+    tb1 = (int *)R_chk_calloc((size_t)(1<<L),sizeof(int));
+    tb2 = (int *)R_chk_calloc((size_t)(1<<L),sizeof(int));
+    tb = tb1;ntb=1;tb[0]=0;dim=0;
+    for (l=0;l<L;l++) { /* split all the boxes at depth l, collecting children in the other list */
+      p = tb==tb1 ? tb2:tb1;
+      for (nnew=0,i=0;i<ntb;i++) {
+        b = tb[i];
+        if (box[b].p1-box[b].p0 < 2) continue; /* 1 or 2 points - no split */
+        kd_split(box,b,ind,X,*n,*d,dim);
+        p[nnew++] = box[b].child1;p[nnew++] = box[b].child2;
+      }
+      tb = p;ntb = nnew;
+      dim++;if (dim == *d) dim = 0;
     }
-  }  
-  if (bi!=nb-1) Rprintf("bi not equal to nb-1 %d %d\n",bi,nb-1);
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(i) num_threads(nth) schedule(dynamic)
+    #endif
+    for (i=0;i<ntb;i++) kd_subtree(box,tb[i],ind,X,*n,*d,dim);
+    R_chk_free(tb1);R_chk_free(tb2);
+  }
   rind = (int *)R_chk_calloc((size_t) *n,sizeof(int));
   /* now create index of where ith row of X is in ind */
   for (i=0;i<*n;i++) rind[ind[i]]=i; 
   /* now put tree into kd object */
   kd->box = box;kd->ind = ind;kd->rind = rind;kd->n_box = nb;kd->huge = huge;
   kd->d = *d;kd->n = *n;
+  kd_points(kd,X); /* leaf ordered copy of points for searching */
 } /* end of kd_tree */
 
 
-void Rkdtree(double *X,int *n, int *d,int *idat,double *ddat) { 
+void Rkdtree(double *X,int *n, int *d,int *idat,double *ddat,int *nt) { 
 /* Routine to export kdtree data to R 
      m <- 2;
      while (m<n) m <- m*2
@@ -360,10 +426,10 @@ void Rkdtree(double *X,int *n, int *d,int *idat,double *ddat) {
        ddat is an nb*2*d vector
        idat is a 2 + 7*nb vector
        - together they encode the kd tree 
-
+     * nt is the number of threads to use for construction.
 */
   kdtree_type kd;
-  kd_tree(X,n,d,&kd); /* create kd tree */
+  kd_tree(X,n,d,&kd,*nt); /* create kd tree */
   kd_dump(kd,idat,ddat); /* dump it to idat,ddat */
   free_kdtree(kd); /* free structure */
 }
@@ -397,6 +463,26 @@ void update_heap(double *h,int *ind,int n) {
   ind[i0] = ind0;
 }
 
+static inline double box_dist2(box_type *box,double *x,int d) {
+/* squared distance from d dimensional box to point x */
+  double d2 = 0.0,z,*bl,*bh;
+  int l;
+  for (bl=box->lo,bh=box->hi,l=0;l<d;l++) {
+    if (x[l] < bl[l]) { z = x[l] - bl[l];d2 += z*z;}
+    else if (x[l] > bh[l]) { z = x[l] - bh[l];d2 += z*z;}
+  } 
+  return(d2);
+}
+
+static inline double xo_dist2(double *x,double *xo,int d) {
+/* squared distance between point x and a point stored contiguously at xo 
+   (e.g. a row of kd.Xo) */
+  double d2=0.0,z;
+  int l;
+  for (l=0;l<d;l++) { z = x[l] - xo[l];d2 += z*z;}
+  return(d2);
+}
+
 double box_dist(box_type *box,double *x,int d) {
 /* find distance from d dimensional box to point x */
   double d2 = 0.0,z,*bl,*bh,*xd;
@@ -654,14 +740,17 @@ void k_radius(double r, kdtree_type kd, double *X,double *x,int *list,int *nlist
    and return these in list (initialized to length n.) on output nlist is
    number of points returned. Could be made more efficient by checking if
    boxes are completely inside r-ball, and simply adding, rather than opening, 
-   if they are. 
+   if they are. Works with squared distances and the leaf ordered points kd.Xo 
+   (X is not used).
 */
-  int todo[100],item,bi,bi_old,dim,d,c1,c2,*ind,n,i;
+  int todo[100],item,bi,bi_old,dim,d,c1,c2,*ind,i;
   box_type *box;
+  double r2,*Xo;
   box = kd.box;
   d = kd.d;
-  n = kd.n;
   ind = kd.ind;
+  Xo = kd.Xo;
+  r2 = r*r;
   *nlist = 0; /* neighbour counter */
   bi = 0; /* box index */
   dim = 0; /* box dividing dimension (cycles as we move down tree) */
@@ -673,7 +762,7 @@ void k_radius(double r, kdtree_type kd, double *X,double *x,int *list,int *nlist
        of the children. Idea is that we know it's in bi, so only need
        both children, if r-ball cuts the divider between children. */
     if (x[dim]+r <= box[c1].hi[dim]) bi = c1; /* r-ball is completely inside child 1 */     
-    else if (x[dim]-2 >= box[c2].lo[dim]) bi = c2; /* r-ball completely in child 2 */
+    else if (x[dim]-r >= box[c2].lo[dim]) bi = c2; /* r-ball completely in child 2 */
     dim++; if (dim==d) dim = 0;
     if (bi==bi_old) break; /* neither child contained whole r-ball, so use box[bi] */
   }
@@ -683,13 +772,13 @@ void k_radius(double r, kdtree_type kd, double *X,double *x,int *list,int *nlist
   todo[0] = bi; /* initial task - box bi */
   while (item>=0) {
     bi = todo[item];item--;
-    if (box_dist(box+bi,x,d) < r) { /* box could contain a point in r-ball so check */
+    if (box_dist2(box+bi,x,d) < r2) { /* box could contain a point in r-ball so check */
       if (box[bi].child1) { /* box has children, so add them to todo list */
         item++;todo[item] = box[bi].child1;
         item++;todo[item] = box[bi].child2;
       } else { /* reached small end of tree - check actual points */
         for (i=box[bi].p0;i<=box[bi].p1;i++) {
-          if (xidist(x,X,ind[i],d,n) < r) {
+          if (xo_dist2(x,Xo + (ptrdiff_t)i * d,d) < r2) {
             list[*nlist] = ind[i]; (*nlist)++;             
           }
         }
@@ -698,49 +787,59 @@ void k_radius(double r, kdtree_type kd, double *X,double *x,int *list,int *nlist
   }
 } /* k_radius */
 
+static void kd_radius_work(kdtree_type kd,double r,double *x,int m,int *off,int *ni,int op,int nt) {
+/* Finds the points in kd tree kd within distance r of each of the m points in x 
+   (stored end-to-end). If op==0 the cumulative neighbour counts are returned in the 
+   m+1 vector off. If op==1 then off must be as returned by an op==0 call and the 
+   neighbours of point i are written to ni[off[i]:(off[i+1]-1)].
+   Both calls process the points in parallel using nt threads. Each point's neighbours are 
+   written directly to its own section of ni, so the result does not depend on nt. 
+*/
+  int d,i,nlist,*list,nth,tid=0;
+  d = kd.d; /* dimension */
+  nth = mgcv_nthreads(nt);
+  if (op) { /* fill in the neighbour lists */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(i,nlist) num_threads(nth) schedule(dynamic,64)
+    #endif
+    for (i=0;i<m;i++) k_radius(r, kd, NULL,x + (ptrdiff_t)i * d,ni + off[i],&nlist);
+  } else { /* count the neighbours */
+    list = (int *)R_chk_calloc((size_t)kd.n*nth,sizeof(int)); /* list of neighbours of ith point, per thread */
+    #ifdef SUPPORT_OPENMP
+    #pragma omp parallel for private(i,nlist,tid) num_threads(nth) schedule(dynamic,64)
+    #endif
+    for (i=0;i<m;i++) {
+      #ifdef SUPPORT_OPENMP
+      tid = omp_get_thread_num();
+      #endif
+      k_radius(r, kd, NULL,x + (ptrdiff_t)i * d,list + (ptrdiff_t)tid * kd.n,&nlist);
+      off[i+1] = nlist;
+    }
+    R_chk_free(list);
+    for (off[0]=0,i=0;i<m;i++) off[i+1] += off[i];
+  }
+} /* kd_radius_work */
+
 
-void Rkradius(double *r,int *idat,double *ddat,double *X,double *x,int *m,int *off,int *ni,int *op) {
+void Rkradius(double *r,int *idat,double *ddat,double *X,double *x,int *m,int *off,int *ni,int *op,int *nt) {
 /* Given kd tree defined by idat, ddat and X, from R, this routine finds all points in  
    the tree less than distance r from each point in x. x contains the points stored end-to-end.
-   Routine must be called twice. First with op==0, which does the work, but only returns the 
-   length required for ni, in off[m+1].
-   The second call must have op==1, and ni initialized to the correct length. Then neighbour
-   information is returned in off, ni.
+   Routine must be called twice. First with op==0, which counts the neighbours of each point,
+   returning the cumulative counts in off, so that off[m] is the length required for ni.
+   The second call must have op==1, off as returned by the first call, and ni initialized 
+   to the correct length. Then neighbour information is returned in ni.
    neighbours of ith point are in ni[off[i]:(off[i+1]-1)], where off is an m+1 vector. All indexes
    0 based (C style). Add one to off and ni to get R style.
+   Work is done by kd_radius_work.
  */
-  static int *nei,nn; 
   kdtree_type kd;
-  double *xx;
-  int d,i,j,n_buff=0,nlist,*list;
-  if (*op) { /* output saved nei data */
-    for (i=0;i<nn;i++) ni[i]=nei[i];
-    R_chk_free(nei);nn=0;
-    return;
-  }
   kd_read(&kd,idat,ddat); /* unpack kd tree */
-  d = kd.d; /* dimension */
-  /* get the r-radius neighbour information... */
-  list = (int *)R_chk_calloc((size_t)kd.n,sizeof(int)); /* list of neighbours of ith point */
-  n_buff = kd.n*10;
-  nei = (int *)R_chk_calloc((size_t)n_buff,sizeof(int)); /* global list of neighbours */
-  xx=x;nn=0;off[0]=0;
-  for (i=0;i<*m;i++) { /* work through points in x */
-    k_radius(*r, kd, X,xx,list,&nlist);
-    if (nn+nlist>n_buff) { /* expand nei */
-      n_buff *= 2;
-      nei = (int *)R_chk_realloc(nei,(size_t)n_buff*sizeof(int));
-    }
-    for (j=nn;j<nn+nlist;j++) nei[j] = list[j-nn];
-    nn += nlist;
-    off[i+1] = nn;
-    xx += d; /* next point */
-  }
-  R_chk_free(list);
-  R_chk_free(kd.box); /* free storage created by kd_read */
+  kd_points(&kd,X); /* leaf ordered copy of X */
+  kd_radius_work(kd,*r,x,*m,off,ni,*op,*nt);
+  R_chk_free(kd.box);R_chk_free(kd.Xo); /* free storage created by kd_read and kd_points */
 }
 
-void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,int *n,int *d,int *k) {
+void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,int *n,int *d,int *k,int nt,double eps,int maxv) {
 /* Given a kd tree, this routine does the actual work of finding the nearest neighbours
    within the tree (defined by kd, X), to a new set of m points in x
    * inputs: 
@@ -751,20 +850,40 @@ void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,
    * outputs:
      ni is m by k matrix of indices of k nearest neighbours in X
      dist is m by k matrix of distances to nearest neighbours indexed in ni.
+   The points are processed in parallel using nt threads, each with its own heap. 
+   The search uses squared distances and the leaf ordered points kd.Xo: X is 
+   not used.
+   If eps>0 the search is (1+eps)-approximate: boxes are only opened if they are 
+   nearer than the current kth neighbour distance divided by 1+eps, so that every
+   returned distance is within a factor 1+eps of the true kth nearest neighbour 
+   distance. If maxv>0 the search for each point stops once maxv points have 
+   been checked outside the initial box (so the result may then be further 
+   from exact). eps=0, maxv=0 gives the exact search.
 */
-  int i,j,bi,*ik,bii,todo[100],item,pcount,*ind;
+  int i,j,bi,*ik,bii,*todo,*todo_d,ntodo,item,pcount,*ind,nth,dd,dim,c1,c2,nv;
   box_type *box;
-  double *dk,huge,*p,*p1,*p2,dij,*x;
+  double *dk,huge,*p,*p1,*p2,dij,*x,*Xo,ef;
  
   huge = kd.huge;
+  Xo = kd.Xo;dd = *d;
   ind = kd.ind;
   box = kd.box;
-
+  nth = mgcv_nthreads(nt);
+  ef = (1+eps)*(1+eps); /* squared distance pruning factor */
+  pcount=0;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(i,j,bi,ik,bii,todo,todo_d,ntodo,item,dk,p,p1,p2,dij,x,dim,c1,c2,nv) reduction(+:pcount) num_threads(nth)
+  #endif
+  { /* start of parallel section */
   dk = (double *)R_chk_calloc((size_t)*k,sizeof(double)); /* distance k-array */
   ik = (int *)R_chk_calloc((size_t)*k,sizeof(int)); /* corresponding index array */
   x = (double *)R_chk_calloc((size_t)*d,sizeof(double)); /* array for current point */    
-  pcount=0;
-
+  ntodo = 64; /* todo list grows if needed (it is rarely much more than the tree depth) */
+  todo = (int *)R_chk_calloc((size_t)ntodo,sizeof(int));
+  todo_d = (int *)R_chk_calloc((size_t)ntodo,sizeof(int));
+  #ifdef SUPPORT_OPENMP
+  #pragma omp for schedule(dynamic,64)
+  #endif
   for (i=0;i < *m;i++) { /* work through all the points in Xm */
     for (p=Xm+i,p1=x,p2=p1 + *d;p1<p2;p1++, p+= *m) *p1 = *p; /* copy ith point (ith row of Xm) to x */
     for (p=dk,p1=dk + *k;p<p1;p++) *p = huge; /* initialize distances to huge */
@@ -783,8 +902,7 @@ void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,
    /* now find k nearest points in the box and put in dk... */     
     for (j=box[bi].p0;j<=box[bi].p1;j++) { 
       pcount++;
-      /*dij = ijdist(i,ind[j],X,*n,*d);*/ /* distance between points i and j */
-      dij = xidist(x,X,ind[j],*d,*n); 
+      dij = xo_dist2(x,Xo + (ptrdiff_t)j * dd,dd); /* squared distance between points i and j */
       if (dij<dk[0]) { /* distance smaller than top of heap */
         dk[0] = dij;       /* so replace top of distance heap */
         ik[0] = ind[j]; /* and put index on index heap */
@@ -796,39 +914,52 @@ void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,
        ith point than dk[0] (the largest of the current neighbour distances), then we 
        can ignore all the points it contains (and hence its descendents) */ 
     todo[0] = 0; /* index of root box... first to check */
-    item=0;
+    todo_d[0] = 0; /* ... and the dimension on which it is split */
+    item=0;nv=0;
     bii = bi; /* index of initializing box */ 
     while (item>=0) { /* items on the todo list */
       if (todo[item]==bii) { /* this is the initializing box - already dealt with */
         item--;
       } else {
         bi = todo[item]; /* box to deal with now */
+        dim = todo_d[item]; /* its splitting dimension */
         item--;
-        if (box_dist(box+bi,x,*d)<dk[0]) { /* box edge is closer than some of existing points 
+        if (box_dist2(box+bi,x,dd)*ef<dk[0]) { /* box edge is closer than some of existing points 
                                               -- need to check further */
-          if (box[bi].child1) { /* box has children --- add to todo list */
+          if (box[bi].child1) { /* box has children --- add to todo list, with the 
+                                   child on the same side of the split as x last,
+                                   so that it is searched first */
+            c1 = box[bi].child1;c2 = box[bi].child2;
+            if (x[dim] > box[c1].hi[dim]) { j=c1;c1=c2;c2=j;} /* c1 is now the near child */
+            dim++;if (dim == dd) dim = 0;
+            if (item+2 >= ntodo) { /* expand todo list */
+              ntodo *= 2;
+              todo = (int *)R_chk_realloc(todo,(size_t)ntodo*sizeof(int));
+              todo_d = (int *)R_chk_realloc(todo_d,(size_t)ntodo*sizeof(int));
+            }
             item++;
-            todo[item] = box[bi].child1;
+            todo[item] = c2;todo_d[item] = dim;
             item++;
-            todo[item] = box[bi].child2;
+            todo[item] = c1;todo_d[item] = dim;
           } else { /* at smallest box end of tree */
             for (j=box[bi].p0;j<=box[bi].p1;j++) {
               pcount++;
-              /*dij = ijdist(i,ind[j],X,*n,*d);*/ /* distance between points i and j */ 
-              dij = xidist(x,X,ind[j],*d,*n);
+              dij = xo_dist2(x,Xo + (ptrdiff_t)j * dd,dd); /* squared distance between points i and j */
               if (dij<dk[0]) { /* point closer than largest of current candidates -- add to heap */
                 dk[0] = dij; /* add distance to heap */
                 ik[0] = ind[j]; /* and corresponding index to heap index */
                 if (*k>1) update_heap(dk,ik,*k); /* update heap so it still obeys heap ordering */  
               } /* end of point addition */
             } /* done the one or two points in this box */
+            nv += box[bi].p1 - box[bi].p0 + 1;
+            if (maxv>0&&nv>=maxv) item = -1; /* visit budget used up: stop searching */
           } /* finished with this small box */
         } /* finished with possible candiate box */
       } /* end of else branch */
     } /* todo list end */
     /* So now the dk, ik contain the distances and indices of the k nearest neighbours */
     for (j=0;j<*k;j++) { /* copy to output matrices */
-      dist[i + j * *m] = dk[j];
+      dist[i + j * *m] = dk[j] < huge ? sqrt(dk[j]) : huge;
       ni[i + j * *m] = ik[j];
     }     
   } /* end of points loop (i) */
@@ -836,44 +967,332 @@ void k_newn_work(double *Xm,kdtree_type kd,double *X,double *dist,int *ni,int*m,
   R_chk_free(dk);
   R_chk_free(ik);
   R_chk_free(x);
+  R_chk_free(todo);R_chk_free(todo_d);
+  } /* end of parallel section */
   *n = pcount;
 } /* k_newn_work */
 
-void Rkdnearest(double *X,int *idat,double *ddat,int *n,double *x, int *m, int *ni, double *dist,int *k) {
+void Rkdnearest(double *X,int *idat,double *ddat,int *n,double *x, int *m, int *ni, double *dist,int *k,int *nt,double *eps,int *maxv) {
 /* given points in n rows of X and a kd tree stored in idat, ddat in R, find the 
    k neares neighbours to each row of x m by d matrix x.
    * outputs 
      ni is m by k matrix of neighbour indices 
      dist is m by k matrix of neighbour distances
+   * nt is the number of threads to use.
+   * eps and maxv control approximate search (0 for exact) - see k_newn_work.
 */
   kdtree_type kd;
   int d;
   kd_read(&kd,idat,ddat); /* unpack kd tree */
+  kd_points(&kd,X); /* leaf ordered copy of X */
   d = kd.d; /* dimension */
   /* get the nearest neighbour information... */
-  k_newn_work(x,kd,X,dist,ni,m,n,&d,k);
-  R_chk_free(kd.box); /* free storage created by kd_read */
+  k_newn_work(x,kd,X,dist,ni,m,n,&d,k,*nt,*eps,*maxv);
+  R_chk_free(kd.box);R_chk_free(kd.Xo); /* free storage created by kd_read and kd_points */
 }
 
 
-void k_nn_work(kdtree_type kd,double *X,double *dist,int *ni,int *n,int *d,int *k) {
+/* Memory mappable kd tree index files.
+
+   A kd tree for a fixed set of points can be written to a single file by Rkdsave, 
+   together with the leaf ordered points (kd.Xo). mgcv_kdload then maps the file 
+   into memory (read only and shared, so one file can serve several processes), 
+   and returns an external pointer to a kd tree whose ind, rind, box bounds and 
+   points all point into the mapped file. Queries via mgcv_kdnearest and 
+   mgcv_kdradius then work in place: nothing is unpacked or copied per call. 
+   Only the array of box_type is set up at load time. Where mmap is not available 
+   the file is simply read into memory.
+
+   The file is relocatable (it contains no pointers) and versioned. Layout, in native 
+   byte order (checked on load), with the offsets implied by n, d and n_box:
+     kd_file_header
+     int ind[n], rind[n], parent[nb], child1[nb], child2[nb], p0[nb], p1[nb]
+     padding to a multiple of 8 bytes
+     double bounds[nb*2*d] - lo then hi for each box in turn, as in kd_dump
+     double Xo[n*d]
+*/
+
+#define KD_FILE_VERSION 1
+#define KD_FILE_ENDIAN 0x01020304
+
+typedef struct {
+  char magic[8]; /* "mgcv.kd" */
+  int version, /* KD_FILE_VERSION */
+    endian,    /* KD_FILE_ENDIAN as written, to detect byte order mismatch */
+    n,d,n_box,pad;
+  double huge, 
+    size; /* total file size in bytes */
+} kd_file_header;
+
+typedef struct { /* a loaded index */
+  kdtree_type kd;
+  void *map;   /* the file contents */
+  size_t size; /* and their size */
+  int mapped;  /* 1 if map is from mmap, 0 if allocated */
+} kd_index_type;
+
+static size_t kd_file_layout(int n,int d,int nb,size_t *doff) {
+/* returns total size of index file, and in doff the offset of the double data */ 
+  size_t ioff;
+  ioff = sizeof(kd_file_header);
+  *doff = ioff + sizeof(int) * ((size_t)2 * n + (size_t)5 * nb);
+  *doff = (*doff + 7)/8*8;
+  return(*doff + sizeof(double) * ((size_t)nb * 2 * d + (size_t)n * d));
+} /* kd_file_layout */
+
+void Rkdsave(int *idat,double *ddat,double *X,char **fname,int *ok) {
+/* Writes the kd tree in idat, ddat (from Rkdtree) for the points in X to the 
+   index file fname. ok is 0 on success, 1 if the file could not be opened 
+   and 2 if writing failed. */
+  kdtree_type kd;
+  kd_file_header h;
+  size_t doff,size,ni,nb,nx;
+  FILE *f;
+  char pad[8] = {0,0,0,0,0,0,0,0};
+  kd_read(&kd,idat,ddat);
+  kd_points(&kd,X);
+  size = kd_file_layout(kd.n,kd.d,kd.n_box,&doff);
+  memset(&h,0,sizeof(h));
+  strncpy(h.magic,"mgcv.kd",8);
+  h.version = KD_FILE_VERSION;h.endian = KD_FILE_ENDIAN;
+  h.n = kd.n;h.d = kd.d;h.n_box = kd.n_box;h.huge = kd.huge;h.size = (double)size;
+  ni = (size_t)2*kd.n + (size_t)5*kd.n_box; /* ind, rind, parent, child1, child2, p0, p1 */
+  nb = (size_t)kd.n_box * 2 * kd.d; /* box bounds */
+  nx = (size_t)kd.n * kd.d; /* points */
+  f = fopen(*fname,"wb");
+  if (!f) *ok = 1; else {
+    *ok = 0;
+    if (fwrite(&h,sizeof(h),1,f)!=1) *ok = 2;
+    /* the integer data are already contiguous in idat, as are the bounds in ddat */
+    if (!*ok && fwrite(idat + 3,sizeof(int),ni,f)!=ni) *ok = 2;
+    ni = doff - sizeof(h) - sizeof(int) * ni; /* padding */
+    if (!*ok && ni && fwrite(pad,1,ni,f)!=ni) *ok = 2;
+    if (!*ok && fwrite(ddat + 1,sizeof(double),nb,f)!=nb) *ok = 2;
+    if (!*ok && fwrite(kd.Xo,sizeof(double),nx,f)!=nx) *ok = 2;
+    if (fclose(f)) *ok = 2;
+  }
+  R_chk_free(kd.box);R_chk_free(kd.Xo);
+} /* Rkdsave */
+
+static void kd_index_finalize(SEXP ptr) {
+/* finalizer for external pointer to a loaded kd tree index */
+  kd_index_type *kdi;
+  kdi = (kd_index_type *) R_ExternalPtrAddr(ptr);
+  if (!kdi) return;
+  R_chk_free(kdi->kd.box);
+  #ifdef MGCV_KD_MMAP
+  if (kdi->mapped) munmap(kdi->map,kdi->size); else
+  #endif
+  R_chk_free(kdi->map);
+  R_chk_free(kdi);
+  R_ClearExternalPtr(ptr);
+} /* kd_index_finalize */
+
+static int kd_index_ok(kdtree_type *kd) {
+/* checks that the integer data of a tree read from an index file are those of a 
+   tree that kd_tree could have built, so that searching it can not index outside 
+   the arrays, visit a point twice, or overrun the fixed size todo lists. ind must 
+   be a permutation with inverse rind. Box 0 holds all n points (its parent is 0, 
+   as set by kd_tree). Boxes are in pre-order (see kd_split): a box with 3 or more 
+   points is split into child1 = i+1, holding the first (np-1)/2+1 of its points, 
+   and child2, holding the rest and following child1's subtree. Boxes with 1 or 2 
+   points are leaves. Returns 1 if OK, 0 otherwise. */
+  int i,n,nb,np,k,c1,c2;
+  box_type *b,*box;
+  n = kd->n;nb = kd->n_box;box = kd->box;
+  for (i=0;i<n;i++) if (kd->ind[i] < 0 || kd->ind[i] >= n || kd->rind[i] < 0 || kd->rind[i] >= n) return(0);
+  for (i=0;i<n;i++) if (kd->rind[kd->ind[i]] != i) return(0);
+  if (box[0].p0 != 0 || box[0].p1 != n-1 || box[0].parent != 0) return(0);
+  for (b=box,i=0;i<nb;i++,b++) {
+    if (b->p0 < 0 || b->p1 < b->p0 || b->p1 >= n) return(0);
+    if (i > 0 && (b->parent < 0 || b->parent >= i)) return(0);
+    np = b->p1 - b->p0 + 1;
+    if (np < 3) { /* a leaf */
+      if (b->child1 || b->child2) return(0);
+    } else { /* split exactly as kd_split would */
+      k = (np-1)/2;c1 = i + 1;c2 = c1 + kd_nbox(k+1);
+      if (b->child1 != c1 || b->child2 != c2 || c2 >= nb) return(0);
+      if (box[c1].parent != i || box[c2].parent != i) return(0);
+      if (box[c1].p0 != b->p0 || box[c1].p1 != b->p0 + k || 
+          box[c2].p0 != b->p0 + k + 1 || box[c2].p1 != b->p1) return(0);
+    }
+  }
+  return(1);
+} /* kd_index_ok */
+
+SEXP mgcv_kdload(SEXP FNAME) {
+/* Loads (maps) the kd tree index file FNAME written by Rkdsave, returning an 
+   external pointer to it, with attributes "n" and "d". The index is released 
+   when the pointer is garbage collected. */
+  kd_file_header h;
+  kd_index_type *kdi;
+  kdtree_type *kd;
+  box_type *box;
+  FILE *f;
+  size_t size,doff,fsize;
+  int i,nb,d,n,*ip;
+  double *dp;
+  const char *fname;
+  SEXP ptr,a;
+  fname = CHAR(STRING_ELT(FNAME,0));
+  f = fopen(fname,"rb");
+  if (!f) error(_("can not open kd tree index file %s"),fname);
+  if (fread(&h,sizeof(h),1,f)!=1||strncmp(h.magic,"mgcv.kd",8)) {
+    fclose(f);error(_("%s is not a kd tree index file"),fname);
+  }
+  if (h.endian != KD_FILE_ENDIAN) { fclose(f);error(_("kd tree index file %s has wrong byte order"),fname);}
+  if (h.version != KD_FILE_VERSION) { 
+    fclose(f);error(_("kd tree index file %s has version %d, but version %d is required"),fname,h.version,KD_FILE_VERSION);
+  }
+  n = h.n;d = h.d;nb = h.n_box;
+  if (n < 1 || d < 1 || nb != kd_nbox(n)) { fclose(f);error(_("kd tree index file %s is corrupt"),fname);}
+  size = kd_file_layout(n,d,nb,&doff);
+  fseek(f,0,SEEK_END);fsize = (size_t) ftell(f);
+  if ((double)size != h.size || fsize < size) { fclose(f);error(_("kd tree index file %s is corrupt or truncated"),fname);}
+  kdi = (kd_index_type *)R_chk_calloc((size_t)1,sizeof(kd_index_type));
+  kdi->size = size;
+  kdi->map = NULL;
+  #ifdef MGCV_KD_MMAP
+  kdi->map = mmap(NULL,size,PROT_READ,MAP_SHARED,fileno(f),0);
+  if (kdi->map == MAP_FAILED) kdi->map = NULL; else kdi->mapped = 1;
+  #endif
+  if (!kdi->map) { /* no mapping, so read the file */
+    kdi->map = R_chk_calloc(size,1);
+    fseek(f,0,SEEK_SET);
+    if (fread(kdi->map,1,size,f)!=size) { 
+      fclose(f);R_chk_free(kdi->map);R_chk_free(kdi);
+      error(_("failed to read kd tree index file %s"),fname);
+    }
+  }
+  fclose(f); /* a mapping survives closing the file */
+  /* now point the tree into the file contents... */
+  kd = &(kdi->kd);
+  kd->n = n;kd->d = d;kd->n_box = nb;kd->huge = h.huge;
+  ip = (int *)((char *)kdi->map + sizeof(h));
+  kd->ind = ip;kd->rind = ip + n;
+  ip += 2 * n; /* parent, child1, child2, p0, p1 follow */
+  dp = (double *)((char *)kdi->map + doff);
+  kd->box = box = (box_type *)R_chk_calloc((size_t)nb,sizeof(box_type));
+  for (i=0;i<nb;i++,box++) {
+    box->lo = dp;dp += d;
+    box->hi = dp;dp += d;
+    box->parent = ip[i];box->child1 = ip[i+nb];box->child2 = ip[i+2*nb];
+    box->p0 = ip[i+3*nb];box->p1 = ip[i+4*nb];
+  }
+  kd->Xo = dp;
+  if (!kd_index_ok(kd)) { /* indices out of range: do not let queries use them */
+    R_chk_free(kd->box);
+    #ifdef MGCV_KD_MMAP
+    if (kdi->mapped) munmap(kdi->map,kdi->size); else
+    #endif
+    R_chk_free(kdi->map);
+    R_chk_free(kdi);
+    error(_("kd tree index file %s is corrupt"),fname);
+  }
+  ptr = PROTECT(R_MakeExternalPtr(kdi,install("mgcv_kd_index"),R_NilValue));
+  R_RegisterCFinalizerEx(ptr,kd_index_finalize,TRUE);
+  a = PROTECT(allocVector(INTSXP,1));INTEGER(a)[0] = n;
+  setAttrib(ptr,install("n"),a);
+  a = PROTECT(allocVector(INTSXP,1));INTEGER(a)[0] = d;
+  setAttrib(ptr,install("d"),a);
+  UNPROTECT(3);
+  return(ptr);
+} /* mgcv_kdload */
+
+static kdtree_type *kd_index_tree(SEXP KD) {
+/* extract tree from external pointer, checking it is still valid (pointers 
+   do not survive saving and re-loading an R session) */
+  kd_index_type *kdi;
+  kdi = (kd_index_type *) R_ExternalPtrAddr(KD);
+  if (!kdi) error(_("kd tree index is not loaded: use kd.load again"));
+  return(&(kdi->kd));
+} /* kd_index_tree */
+
+SEXP mgcv_kdnearest(SEXP KD,SEXP X,SEXP K,SEXP NT,SEXP EPS,SEXP MAXV) {
+/* Finds the k nearest neighbours in loaded kd tree index KD of each point in 
+   the rows of the m by d matrix X. Returns a list containing the m by k
+   matrix of neighbour indices (0 based) and the m by k matrix of distances.  
+   EPS and MAXV control approximate search (0 for exact) - see k_newn_work.
+*/
+  kdtree_type *kd;
+  int m,k,n,d;
+  SEXP ni,dist,res;
+  kd = kd_index_tree(KD);
+  d = kd->d;k = asInteger(K);
+  m = length(X)/d;
+  if (k < 1) error(_("number of neighbours requested must be at least 1"));
+  if (k >= kd->n) error(_("kd tree index must have more points than neighbours requested"));
+  ni = PROTECT(allocVector(INTSXP,(ptrdiff_t)m*k));
+  dist = PROTECT(allocVector(REALSXP,(ptrdiff_t)m*k));
+  n = kd->n;
+  k_newn_work(REAL(X),*kd,NULL,REAL(dist),INTEGER(ni),&m,&n,&d,&k,asInteger(NT),asReal(EPS),asInteger(MAXV));
+  res = PROTECT(allocVector(VECSXP,2));
+  SET_VECTOR_ELT(res,0,ni);SET_VECTOR_ELT(res,1,dist);
+  UNPROTECT(3);
+  return(res);
+} /* mgcv_kdnearest */
+
+SEXP mgcv_kdradius(SEXP KD,SEXP X,SEXP R,SEXP NT) {
+/* Finds the points in loaded kd tree index KD within distance R of each of the 
+   points stored end to end in X. Returns a list containing the m+1 vector off and 
+   the vector ni, such that the neighbours of point i are ni[off[i]:(off[i+1]-1)] 
+   (0 based).   
+*/
+  kdtree_type *kd;
+  int m,nt;
+  double r;
+  SEXP ni,off,res;
+  kd = kd_index_tree(KD);
+  m = length(X)/kd->d;r = asReal(R);nt = asInteger(NT);
+  off = PROTECT(allocVector(INTSXP,m+1));
+  kd_radius_work(*kd,r,REAL(X),m,INTEGER(off),NULL,0,nt); /* count */
+  ni = PROTECT(allocVector(INTSXP,INTEGER(off)[m]));
+  kd_radius_work(*kd,r,REAL(X),m,INTEGER(off),INTEGER(ni),1,nt); /* fill */
+  res = PROTECT(allocVector(VECSXP,2));
+  SET_VECTOR_ELT(res,0,off);SET_VECTOR_ELT(res,1,ni);
+  UNPROTECT(3);
+  return(res);
+} /* mgcv_kdradius */
+
+
+void k_nn_work(kdtree_type kd,double *X,double *dist,int *ni,int *n,int *d,int *k,int nt,double eps,int maxv) {
 /* Given a kd tree, this routine does the actual work of finding the nearest neighbours.
+   The points are processed in parallel using nt threads, each with its own heap. 
+   The search uses squared distances and the leaf ordered points kd.Xo: X is 
+   not used.
+   If eps>0 the search is (1+eps)-approximate: boxes are only opened if they are 
+   nearer than the current kth neighbour distance divided by 1+eps, so that every
+   returned distance is within a factor 1+eps of the true kth nearest neighbour 
+   distance. If maxv>0 the search for each point stops once maxv points have 
+   been checked outside the initial box (so the result may then be further 
+   from exact). eps=0, maxv=0 gives the exact search.
 */
-  int i,j,bi,*ik,bii,todo[100],item,pcount,*ind;
+  int i,j,bi,*ik,bii,*todo,*todo_d,ntodo,item,pcount,*ind,nth,dd,dim,c1,c2,nv;
   box_type *box;
-  double *dk,huge,*p,*p1,*p2,dij,*x;
+  double *dk,huge,*p,*p1,*p2,dij,*x,*Xo,ef;
  
   huge = kd.huge;
+  Xo = kd.Xo;dd = *d;
   ind = kd.ind;
   box = kd.box;
-
+  nth = mgcv_nthreads(nt);
+  ef = (1+eps)*(1+eps); /* squared distance pruning factor */
+  pcount=0;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(i,j,bi,ik,bii,todo,todo_d,ntodo,item,dk,p,p1,p2,dij,x,dim,c1,c2,nv) reduction(+:pcount) num_threads(nth)
+  #endif
+  { /* start of parallel section */
   dk = (double *)R_chk_calloc((size_t)*k,sizeof(double)); /* distance k-array */
   ik = (int *)R_chk_calloc((size_t)*k,sizeof(int)); /* corresponding index array */
   x = (double *)R_chk_calloc((size_t)*d,sizeof(double)); /* array for current point */    
-  pcount=0;
-
+  ntodo = 64; /* todo list grows if needed (it is rarely much more than the tree depth) */
+  todo = (int *)R_chk_calloc((size_t)ntodo,sizeof(int));
+  todo_d = (int *)R_chk_calloc((size_t)ntodo,sizeof(int));
+  #ifdef SUPPORT_OPENMP
+  #pragma omp for schedule(dynamic,64)
+  #endif
   for (i=0;i < *n;i++) { /* work through all the points in X */
-    for (p=X+i,p1=x,p2=p1 + *d;p1<p2;p1++, p+= *n) *p1 = *p; /* copy ith point (ith row of X) to x */
+    for (p=Xo + (ptrdiff_t)kd.rind[i] * dd,p1=x,p2=p1 + dd;p1<p2;p1++,p++) *p1 = *p; /* copy ith point (ith row of X) to x */
     for (p=dk,p1=dk + *k;p<p1;p++) *p = huge; /* initialize distances to huge */
     /* here I have followed Press et al. in descending tree to smallest 
        box and then re-ascending to find box with enough points. This is
@@ -902,7 +1321,7 @@ void k_nn_work(kdtree_type kd,double *X,double *dist,int *ni,int *n,int *d,int *
     for (j=box[bi].p0;j<=box[bi].p1;j++) 
     if (ind[j]!=i) { /* avoid self! */
       pcount++;
-      dij = ijdist(i,ind[j],X,*n,*d); /* distance between points i and j */ 
+      dij = xo_dist2(x,Xo + (ptrdiff_t)j * dd,dd); /* squared distance between points i and j */ 
       if (dij<dk[0]) { /* distance smaller than top of heap */
         dk[0] = dij;       /* so replace top of distance heap */
         ik[0] = ind[j]; /* and put index on index heap */
@@ -914,38 +1333,52 @@ void k_nn_work(kdtree_type kd,double *X,double *dist,int *ni,int *n,int *d,int *
        ith point than dk[0] (the largest of the current neighbour distances), then we 
        can ignore all the points it contains (and hence its descendents) */ 
     todo[0] = 0; /* index of root box... first to check */
-    item=0;
+    todo_d[0] = 0; /* ... and the dimension on which it is split */
+    item=0;nv=0;
     bii = bi; /* index of initializing box */ 
     while (item>=0) { /* items on the todo list */
       if (todo[item]==bii) { /* this is the initializing box - already dealt with */
         item--;
       } else {
         bi = todo[item]; /* box to deal with now */
+        dim = todo_d[item]; /* its splitting dimension */
         item--;
-        if (box_dist(box+bi,x,*d)<dk[0]) { /* box edge is closer than some of existing points 
+        if (box_dist2(box+bi,x,dd)*ef<dk[0]) { /* box edge is closer than some of existing points 
                                               -- need to check further */
-          if (box[bi].child1) { /* box has children --- add to todo list */
+          if (box[bi].child1) { /* box has children --- add to todo list, with the 
+                                   child on the same side of the split as x last,
+                                   so that it is searched first */
+            c1 = box[bi].child1;c2 = box[bi].child2;
+            if (x[dim] > box[c1].hi[dim]) { j=c1;c1=c2;c2=j;} /* c1 is now the near child */
+            dim++;if (dim == dd) dim = 0;
+            if (item+2 >= ntodo) { /* expand todo list */
+              ntodo *= 2;
+              todo = (int *)R_chk_realloc(todo,(size_t)ntodo*sizeof(int));
+              todo_d = (int *)R_chk_realloc(todo_d,(size_t)ntodo*sizeof(int));
+            }
             item++;
-            todo[item] = box[bi].child1;
+            todo[item] = c2;todo_d[item] = dim;
             item++;
-            todo[item] = box[bi].child2;
+            todo[item] = c1;todo_d[item] = dim;
           } else { /* at smallest box end of tree */
             for (j=box[bi].p0;j<=box[bi].p1;j++) {
               pcount++;
-              dij = ijdist(i,ind[j],X,*n,*d); /* distance between points i and j */ 
+              dij = xo_dist2(x,Xo + (ptrdiff_t)j * dd,dd); /* squared distance between points i and j */ 
               if (dij<dk[0]) { /* point closer than largest of current candidates -- add to heap */
                 dk[0] = dij; /* add distance to heap */
                 ik[0] = ind[j]; /* and corresponding index to heap index */
                 if (*k>1) update_heap(dk,ik,*k); /* update heap so it still obeys heap ordering */  
               } /* end of point addition */
             } /* done the one or two points in this box */
+            nv += box[bi].p1 - box[bi].p0 + 1;
+            if (maxv>0&&nv>=maxv) item = -1; /* visit budget used up: stop searching */
           } /* finished with this small box */
         } /* finished with possible candiate box */
       } /* end of else branch */
     } /* todo list end */
     /* So now the dk, ik contain the distances and indices of the k nearest neighbours */
     for (j=0;j<*k;j++) { /* copy to output matrices */
-      dist[i + j * *n] = dk[j];
+      dist[i + j * *n] = dk[j] < huge ? sqrt(dk[j]) : huge;
       ni[i + j * *n] = ik[j];
     }     
   } /* end of points loop (i) */
@@ -953,10 +1386,12 @@ void k_nn_work(kdtree_type kd,double *X,double *dist,int *ni,int *n,int *d,int *
   R_chk_free(dk);
   R_chk_free(ik);
   R_chk_free(x);
+  R_chk_free(todo);R_chk_free(todo_d);
+  } /* end of parallel section */
   *n = pcount;
 } /* k_nn_work */
 
-void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get_a) {
+void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get_a,int *nt,double *eps,int *maxv) {
 /* NOTE: n modified on exit!!
          no tie handling... impractical without!
          
@@ -966,7 +1401,8 @@ void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get
    ni and dist are both n by k. each row of ni contains the neighbour list.
    Each row of dist is contains the corresponding distances. 
    if get_a is non zero, then volumes of kd boxes are associated with each point
-   and returned in a.
+   and returned in a. nt is the number of threads to use. eps and maxv control
+   approximate search (0 for exact) - see k_nn_work.
    
    Some R test code...
    cd ~simon/mgcv-related/sparse-smooth
@@ -1000,9 +1436,9 @@ void k_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,int *get
 
 */
   kdtree_type kd; 
-  kd_tree(X,n,d,&kd); /* set up the tree */ 
+  kd_tree(X,n,d,&kd,*nt); /* set up the tree */ 
   if (*get_a) p_area(a,X,kd,*n,*d);
-  k_nn_work(kd,X,dist,ni,n,d,k);
+  k_nn_work(kd,X,dist,ni,n,d,k,*nt,*eps,*maxv);
   free_kdtree(kd);
 }
 
@@ -1022,12 +1458,12 @@ void kba_nn(double *X,double *dist,double *a,int *ni,int *n,int *d,int *k,
   int ii,i,j,nn,d2k,bi,bj,max_i,q,n1,n2,*count,method=1;
   double dx,*x,max_dist,d1,d2,maxnd,xj,*db,*p,*p1,d0;
   kdtree_type kd; 
-  kd_tree(X,n,d,&kd); /* set up the tree */ 
+  kd_tree(X,n,d,&kd,1); /* set up the tree */ 
   kd_sanity(kd); /* DEBUG only */
   if (*get_a) p_area(a,X,kd,*n,*d);
   d2k = 2 * *d + *k;
   nn = *n; /* following modifies n!!*/
-  k_nn_work(kd,X,dist,ni,&nn,d,&d2k); /* get 2d+k nearest neighbours */
+  k_nn_work(kd,X,dist,ni,&nn,d,&d2k,1,0.0,0); /* get 2d+k nearest neighbours */
   
   /* d0 = average of distance to 2d+k nearest neighbours - a useful basic length scale */
   for (d0=0.0,p=dist,p1=dist+ *n * d2k;p<p1;p++) d0 += *p;d0 /= *n * d2k;
@@ -19,6 +19,10 @@ USA.*/
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <Rconfig.h>
+#ifdef SUPPORT_OPENMP
+#include <omp.h>
+#endif
 #include "mgcv.h"
 #include "matrix.h"
 #include "general.h"
@@ -111,6 +115,28 @@ static inline double fast_eta(int m,int d,double r,double f) {
   return(f);
 }
 
+static void eta_vec(int m,int d,double *r,int n,double f) {
+/* Replaces the n squared distances in r by the corresponding TPS basis function 
+   values, eta, where f is the constant from eta_const. The (m,d) dependent form of 
+   eta is selected once, with simple closed form loops for the common cases 
+   (including the default m for d = 1 to 4), and fast_eta used otherwise. Each 
+   closed form matches fast_eta exactly: d even, eta = f log(r)/2 r^p with p = m-d/2; 
+   d odd, eta = f r^p sqrt(r) with p = m-(d-1)/2-1 (r being the squared distance).
+*/
+  int i,p;
+  if (d%2==0) { /* d even */
+    p = m - d/2;
+    if (p==1) for (i=0;i<n;i++) r[i] = r[i] > 0.0 ? f * (log(r[i]) * .5) * r[i] : 0.0;
+    else if (p==2) for (i=0;i<n;i++) r[i] = r[i] > 0.0 ? f * (log(r[i]) * .5) * r[i] * r[i] : 0.0;
+    else for (i=0;i<n;i++) r[i] = fast_eta(m,d,r[i],f);
+  } else { /* d odd */
+    p = m - d/2 - 1;
+    if (p==0) for (i=0;i<n;i++) r[i] = r[i] > 0.0 ? f * sqrt(r[i]) : 0.0;
+    else if (p==1) for (i=0;i<n;i++) r[i] = r[i] > 0.0 ? f * r[i] * sqrt(r[i]) : 0.0;
+    else for (i=0;i<n;i++) r[i] = fast_eta(m,d,r[i],f);
+  }
+} /* eta_vec */
+
 void tpsE(matrix *E,matrix *X,int m,int d)
 
 /* obtains E the tps penalty matrix (and all round weird object). It is assumed that the ith
@@ -264,9 +290,10 @@ double tps_g(matrix *X,matrix *p,double *x,int d,int m,double *b,int constant)
   { r=0.0;XMi=XM[i];
     for (dum=x;dum<x+d;dum++) { z= *XMi - *dum;XMi++;r+=z*z;}
     /* r = sqrt(r); */ /* eta set up to expect squared dist */ 
-    *pb = fast_eta(m,d,r,eta0);
-    if (p->r) g += *pb *p->V[i];
+    *pb = r;
   } 
+  eta_vec(m,d,b,n,eta0);
+  if (p->r) for (i=0;i<n;i++) g += b[i] * p->V[i];
   off=1-constant;
   for (i=off;i<M;i++,pb++) /* work through null space */
   { r=1.0;
@@ -279,72 +306,230 @@ double tps_g(matrix *X,matrix *p,double *x,int d,int m,double *b,int constant)
   return(g);
 }
 
-int Xd_row_comp(double *a,double *b,int k)
-
-/* service routine for Xd_strip(), compares k elements of two rows for equality */
-
-{ int i;
-  for (i=0;i<k;i++) if (a[i]!=b[i]) return(0);
-  return(1);
+static unsigned long long row_hash(double *x,int n,int d) {
+/* hash of the d elements x[0], x[n], x[2n], ... (a row of a column-wise n by d matrix).
+   +0.0 ensures -0 and 0 hash alike, since they compare equal. */
+  union { double x; unsigned long long u;} v;
+  unsigned long long h=0x9E3779B97F4A7C15ULL;
+  int j;
+  for (j=0;j<d;j++,x+=n) {
+    v.x = *x + 0.0;
+    h ^= v.u + 0x9E3779B97F4A7C15ULL + (h<<6) + (h>>2);
+  }
+  h ^= h >> 31;h *= 0x7FB5D329728EA185ULL; /* final mixing */ 
+  h ^= h >> 27;h *= 0x81DADEF4BC2DD44DULL;h ^= h >> 33;
+  return(h);
 }
 
-int *Xd_strip(matrix *Xd)
-
-/* The rows of Xd (excluding last col) contain the covariate values for
-   a set of data to which a thin plate spline is to be fitted. The purpose
-   of this routine is to locate co-incident points, and strip out redundant
-   copies of these points. At the same time a record is kept of what has 
-   been done, so that the function returns an array yxindex, such that 
-   yxindex[i] contains the row of the stripped down Xd that corresponds to 
-   the ith response datum. Note that the identification of ties involves 
-   sorting Xd - even if there are no ties.
-    
-   Note that this routine assumes that the final column of Xd consists of the 
-   integers 0 to Xd->r-1. These are vital for constructing the index.
+static double *ur_X; /* data for qsort comparison of rows by ur_comp */ 
+static int ur_n,ur_d;
+
+static int ur_comp(const void *a,const void *b) {
+/* compares rows *a and *b of the ur_n by ur_d column-wise matrix ur_X, 
+   for sorting rows so that first column is ascending, then second for ties in the first, etc. */
+  double *xa,*xb,*xe;
+  xa = ur_X + *(int *)a;xb = ur_X + *(int *)b;
+  for (xe = xa + (ptrdiff_t) ur_n * ur_d;xa<xe;xa+=ur_n,xb+=ur_n) {
+    if (*xa < *xb) return(-1);
+    if (*xa > *xb) return(1);
+  }
+  return(0);
+}
 
-   On exit Xd->r will contain the number of unique covariate points.
+int unique_rows(double *X,int n,int d,int *ind,int *ui,int nt) {
+/* Finds the unique rows of n by d matrix X (stored column-wise). Returns the number 
+   of unique rows, nu. On exit ui[0..nu-1] contains the original indices of the unique 
+   rows in the order in which the first column is ascending, the second ascending 
+   for ties in the first, and so on. ind[i] is the index in ui of the unique row 
+   equal to row i of X. i.e. X[ui[ind[i]],] = X[i,]. ui must be of length n.
+
+   Ties are found by hashing: each row is hashed, and a row matches an earlier 
+   row only if hashes match and all elements are equal (so matches are exact, 
+   as with ==). The rows are partitioned on their hash, and each partition has 
+   its own open addressing hash table, so that partitions can be handled in 
+   parallel (nt threads). Only the unique rows are then sorted.   
 */
-
-{ int *yxindex,start,stop,ok,i;
-  double xi,**dum;
-  yxindex = (int *)R_chk_calloc((size_t)Xd->r,sizeof(int));
-  dum = (double **)R_chk_calloc((size_t)Xd->r,sizeof(double *));
-  msort(*Xd);
-  start=stop=0;ok=1;
-  while(ok)
-  { /* look for start of run of equal rows ..... */
-    while(start<Xd->r-1&&!Xd_row_comp(Xd->M[start],Xd->M[start+1],Xd->c-1)) 
-    { /* Xd->M[start] not tied with anything, nothing to erase.... */
-      xi=Xd->M[start][Xd->c-1];
-      yxindex[ROUND(xi)]=start;
-      start++;
+  unsigned long long *h;
+  int i,j,p,np,nth,*off,*pr,*rep,*tab,ts,mask,nu,k,a,*rp,np2,pn;
+  double *xa,*xb;
+  h = (unsigned long long *)R_chk_calloc((size_t) n,sizeof(unsigned long long));
+  rep = (int *)R_chk_calloc((size_t) n,sizeof(int)); /* index of first occurrence of each row */ 
+  nth = mgcv_nthreads(nt);
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel for private(i) num_threads(nth)
+  #endif
+  for (i=0;i<n;i++) h[i] = row_hash(X+i,n,d);
+  /* partition on top bits of hash: np is a power of 2 */
+  for (np=1,np2=0;np < nth && np < n/1000;np *= 2,np2++);
+  off = (int *)R_chk_calloc((size_t) np + 1,sizeof(int));
+  pr = (int *)R_chk_calloc((size_t) n,sizeof(int)); /* rows, by partition, in original order */
+  if (np>1) {
+    for (i=0;i<n;i++) off[(h[i] >> (64-np2)) + 1]++;
+    for (p=0;p<np;p++) off[p+1] += off[p];
+    for (i=0;i<n;i++) { p = h[i] >> (64-np2);pr[off[p]++] = i;}
+    for (p=np;p>0;p--) off[p] = off[p-1];
+    off[0] = 0;
+  } else { off[1] = n;for (i=0;i<n;i++) pr[i] = i;}
+  if (nth > np) nth = np;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(p,i,j,k,a,ts,mask,tab,rp,xa,xb,pn) num_threads(nth)
+  #endif
+  { /* parallel section */
+  #ifdef SUPPORT_OPENMP
+  #pragma omp for schedule(dynamic)
+  #endif
+  for (p=0;p<np;p++) {
+    pn = off[p+1]-off[p]; /* rows in this partition */ 
+    for (ts=16;ts < 2*pn;ts *= 2); /* table size, power of 2, at most half full */
+    mask = ts - 1;
+    tab = (int *)R_chk_calloc((size_t) ts,sizeof(int));
+    for (i=0;i<ts;i++) tab[i] = -1;
+    for (rp = pr + off[p];rp < pr + off[p+1];rp++) {
+      i = *rp;
+      for (j = (int)(h[i] & mask);;j = (j+1) & mask) { /* linear probing */
+        a = tab[j];
+        if (a<0) { tab[j] = rep[i] = i;break;} /* new unique row */
+        if (h[a]==h[i]) { /* check for equality */
+          for (xa = X+a,xb = X+i,k=0;k<d;k++,xa+=n,xb+=n) if (*xa != *xb) break;
+          if (k==d) { rep[i] = a;break;} /* found it */
+        }
+      }
     }
-    if (start==Xd->r-1) 
-    { ok=0; /* reached end with no more ties */
-      xi=Xd->M[start][Xd->c-1];
-      yxindex[ROUND(xi)]=start; /* final index entry needed */
+    R_chk_free(tab);
+  }
+  } /* end parallel section */
+  /* collect and sort the unique rows */
+  for (nu=0,i=0;i<n;i++) if (rep[i]==i) ui[nu++] = i;
+  ur_X = X;ur_n = n;ur_d = d;
+  qsort(ui,(size_t)nu,sizeof(int),ur_comp);
+  for (i=0;i<nu;i++) pr[ui[i]] = i; /* position of unique row in sorted order */
+  for (i=0;i<n;i++) ind[i] = pr[rep[i]];
+  R_chk_free(h);R_chk_free(rep);R_chk_free(off);R_chk_free(pr);
+  return(nu);
+} /* unique_rows */
+
+static void tps_E_mult(double *Y,double *A,int c,double *xu,int n,int d,int m,double eta0,int nt) {
+/* Forms Y = E A, where E is the n by n TPS matrix with E[i,j] = eta(||x_i-x_j||) for 
+   the n locations in xu (n by d, stored column-wise), and A is n by c. E is never 
+   stored: it is evaluated in bs by bs tiles, each multiplied into Y by dgemm. Each 
+   thread works on its own blocks of rows of Y. Y and A are n by c, stored column-wise.   
+*/
+  int bs=128,nb,b,r0,nr,c0,nc,i,j,l,nth;
+  double *Et,*Ep,*xp,xj,z,alpha=1.0,beta=1.0;
+  const char trans='N';
+  nb = n/bs; if (nb * bs < n) nb++; /* number of row (and column) blocks */
+  nth = mgcv_nthreads(nt);if (nth > nb) nth = nb;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(b,r0,nr,c0,nc,i,j,l,Et,Ep,xp,xj,z) num_threads(nth)
+  #endif
+  { /* start parallel section */
+    Et = (double *)R_chk_calloc((size_t) bs * bs,sizeof(double));
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (b=0;b<nb;b++) { /* loop over row blocks */
+      r0 = b * bs;nr = n - r0; if (nr > bs) nr = bs;
+      for (j=0;j<c;j++) for (i=0;i<nr;i++) Y[r0 + i + (ptrdiff_t) j * n] = 0.0;
+      for (c0=0;c0<n;c0+=bs) { /* loop over column blocks */
+        nc = n - c0; if (nc > bs) nc = bs;
+        for (Ep=Et,j=0;j<nc;j++,Ep += nr) { /* form column j of the tile */
+          for (i=0;i<nr;i++) Ep[i] = 0.0;
+          for (l=0;l<d;l++) {
+            xj = xu[c0 + j + (ptrdiff_t) l * n];xp = xu + r0 + (ptrdiff_t) l * n;
+            for (i=0;i<nr;i++) { z = xp[i] - xj;Ep[i] += z*z;}
+          }
+          eta_vec(m,d,Ep,nr,eta0);
+        }
+        /* Y[r0:r0+nr,] += tile A[c0:c0+nc,] */ 
+        F77_CALL(dgemm)(&trans,&trans,&nr,&c,&nc,&alpha,Et,&nr,A+c0,&n,&beta,Y+r0,&n);
+      }
     }
-    if (ok) /* search for end of run */
-    { stop=start+1;
-      while(stop<Xd->r-1&&Xd_row_comp(Xd->M[stop],Xd->M[stop+1],Xd->c-1)) stop++;
-      for (i=start;i<=stop;i++) /* fill out the index array */
-      { xi=Xd->M[i][Xd->c-1];
-        yxindex[ROUND(xi)]=start;
-        dum[i-start]=Xd->M[i]; /* Rows stored to copy back onto end, so matrix can be freed properly */
+    R_chk_free(Et);
+  } /* end parallel section */
+} /* tps_E_mult */
+
+static void orth_cols(double *Y,double *Q,int n,int c) {
+/* Q is set to an orthonormal basis for the columns of the n by c matrix Y,
+   obtained by QR decomposition. Y is overwritten. */
+  int *pivot,i,one=1,zero=0;
+  ptrdiff_t j,nc;
+  double *tau;
+  pivot = (int *)R_chk_calloc((size_t) c,sizeof(int));
+  tau = (double *)R_chk_calloc((size_t) c,sizeof(double));
+  mgcv_qr(Y,&n,&c,pivot,tau);
+  nc = (ptrdiff_t) n * c;
+  for (j=0;j < nc;j++) Q[j] = 0.0;
+  for (i=0;i<c;i++) Q[i + (ptrdiff_t) i * n] = 1.0;
+  mgcv_qrqy(Q,Y,tau,&n,&c,&c,&one,&zero); /* Q = first c columns of Q factor */
+  R_chk_free(pivot);R_chk_free(tau);
+} /* orth_cols */
+
+static void tps_rand_eigen(double *xu,int n,int d,int m,int k,double *U,double *v,double tol,int nt) {
+/* Randomized alternative to Rlanczos(E,...) for finding the k largest magnitude 
+   eigenvalues, v, and corresponding eigenvectors, U (n by k), of the n by n TPS 
+   matrix E for the locations in xu (n by d, column-wise). E is only used via tps_E_mult,
+   so it is never formed, and storage is O(nk). A random n by k+p start matrix is 
+   multiplied by E, followed by steps of subspace iteration, orthogonalizing at each 
+   step (Halko, Martinsson and Tropp, 2011, SIAM Review 53:217-288). At each step the 
+   eigen decomposition of E projected onto the current subspace gives the approximate 
+   eigen-pairs (Rayleigh-Ritz). Iteration stops when the residual ||Eu - vu|| of each 
+   of the k selected pairs is below tol times the largest magnitude eigenvalue, as in 
+   Rlanczos, or after max_iter steps, with a warning. Eigenvalues are returned in 
+   descending order, as from Rlanczos.
+*/
+  int kp,i,j,pi,ni,iter,max_iter=500,TRUE=1;
+  unsigned long jran=1,ia=106,ic=1283,im=6075; /* simple RNG, as Rlanczos */
+  double *Om,*Y,*Q,*B,*ev,*V,*R,*p,*p1,*p2,eta0,alpha=1.0,beta=0.0,x,err,max_err;
+  ptrdiff_t nkp,ii;
+  const char ntrans='N',trans='T';
+  eta0 = eta_const(m,d);
+  kp = 2 * k + 10; if (kp > n) kp = n; /* oversampled dimension */
+  nkp = (ptrdiff_t) n * kp;
+  Om = (double *)R_chk_calloc((size_t) nkp,sizeof(double));
+  Y = (double *)R_chk_calloc((size_t) nkp,sizeof(double));
+  for (ii=0;ii < nkp;ii++) { jran=(jran*ia+ic) % im;Om[ii] = (double)jran/(double)im - 0.5;} 
+  B = (double *)R_chk_calloc((size_t) kp * kp,sizeof(double));
+  ev = (double *)R_chk_calloc((size_t) kp,sizeof(double));
+  V = (double *)R_chk_calloc((size_t) kp * k,sizeof(double));
+  R = (double *)R_chk_calloc((size_t) n * k,sizeof(double));
+  tps_E_mult(Y,Om,kp,xu,n,d,m,eta0,nt);
+  Q = Om;
+  for (iter=0;;iter++) { /* subspace iteration */
+    orth_cols(Y,Q,n,kp);
+    tps_E_mult(Y,Q,kp,xu,n,d,m,eta0,nt); /* Y = EQ */
+    F77_CALL(dgemm)(&trans,&ntrans,&kp,&kp,&n,&alpha,Q,&n,Y,&n,&beta,B,&kp); /* B = Q'EQ */
+    for (i=0;i<kp;i++) for (j=0;j<i;j++) B[i + j * kp] = B[j + i * kp] = (B[i + j * kp] + B[j + i * kp])*.5;
+    mgcv_symeig(B,ev,&kp,&TRUE,&TRUE,&TRUE); /* ev descending */
+    /* select the k largest magnitude eigenvalues, retaining descending order */
+    pi = ni = 0;
+    while (pi + ni < k) if (fabs(ev[pi]) >= fabs(ev[kp-1-ni])) pi++; else ni++; 
+    for (j=0;j<pi;j++) { v[j] = ev[j];for (i=0;i<kp;i++) V[i + j * kp] = B[i + j * kp];}
+    for (j=0;j<ni;j++) { 
+      v[pi+j] = ev[kp-ni+j];
+      for (i=0;i<kp;i++) V[i + (pi+j) * kp] = B[i + (kp-ni+j) * kp];
+    }
+    F77_CALL(dgemm)(&ntrans,&ntrans,&n,&k,&kp,&alpha,Q,&n,V,&kp,&beta,U,&n); /* U = QV */
+    F77_CALL(dgemm)(&ntrans,&ntrans,&n,&k,&kp,&alpha,Y,&n,V,&kp,&beta,R,&n); /* R = EU */
+    /* convergence test on the residuals of the Ritz pairs */
+    max_err = fabs(v[0]);if (fabs(v[k-1]) > max_err) max_err = fabs(v[k-1]);
+    max_err *= tol;
+    for (err=0.0,j=0;j<k;j++) {
+      for (x=0.0,p=R + (ptrdiff_t) j * n,p1=p+n,p2=U + (ptrdiff_t) j * n;p<p1;p++,p2++) {
+        *p -= v[j] * *p2;x += *p * *p;
       }
-      for (i=stop+1;i<Xd->r;i++)
-      { Xd->M[i-stop+start]=Xd->M[i];}
-      Xd->r -= stop-start;
-      for (i=1;i<=stop-start;i++)
-      { Xd->M[Xd->r-1+i]=dum[i];}
-    } 
+      x = sqrt(x);if (x > err) err = x;
+    }
+    if (err <= max_err) break;
+    if (iter >= max_iter) {
+      ErrorMessage(_("randomized eigen decomposition did not converge: use rand.eig=FALSE"),0);
+      break;
+    }
   }
-  R_chk_free(dum); 
-  return(yxindex);
-}
+  R_chk_free(Om);R_chk_free(Y);R_chk_free(B);R_chk_free(ev);R_chk_free(V);R_chk_free(R);
+} /* tps_rand_eigen */
 
 void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,matrix *X,matrix *S,
-                matrix *UZ,matrix *Xu,int n_knots)
+                matrix *UZ,matrix *Xu,int n_knots,int rand_eig,int nt)
 
 /* Takes d covariates x_1,..,x_d and creates the truncated basis for an order m 
    smoothing spline, returning the design matrix and wiggliness penalty matrix 
@@ -369,6 +554,11 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
    n_knot number of knots supplied - 0 for none meaning that the values in x 
           are the knots. n_knots<k equivalent to 0. If n_knot=k then eigen
           decomposition is redundant and is not performed.
+   rand_eig non-zero to obtain the truncated eigen decomposition of E by 
+          randomized subspace iteration (tps_rand_eigen), without forming E,
+          rather than by Lanczos iteration. 
+   nt   number of threads to use for finding unique points and randomized eigen 
+        decomposition.
 
    The outputs are X, S and UZ such that the spline is fitted by minimising:
 
@@ -395,27 +585,25 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
 
 { matrix X1,E,U,v,TU,T,Z,p;
   const char trans='T'; 
-  int l,i,j,M,*yxindex,pure_knot=0,nk,minus=-1,kk,one=1;
-  double w,*xc,*XMi,*Ea,*Ua,tol=DOUBLE_EPS,*b,*a,*uz,alpha=1.0,beta=0.0,*p0,*p1;
+  int l,i,j,M,*yxindex,*ui,pure_knot=0,nk,minus=-1,kk,one=1;
+  double w,*xc,*XMi,*Ea,*Ua,tol=DOUBLE_EPS,*b,*a,*uz,alpha=1.0,beta=0.0,*p0,*p1,**x0;
   tol = pow(tol,.7);
 
-  if (n_knots<k) /* then use the covariate points as knots */
-  { *Xu=initmat(n,d+1);
-    for (i=0;i<n;i++) { for (j=0;j<d;j++) Xu->M[i][j]=x[j][i];Xu->M[i][d]=(double)i;}
-  } else /* knot locations supplied */
-  { *Xu=initmat(n_knots,d+1);
-    for (i=0;i<n_knots;i++) { for (j=0;j<d;j++) Xu->M[i][j]=knt[j][i];Xu->M[i][d]=(double)i;}
-  }
   /* Now the number of unique covariate "points" must be obtained */
   /* and these points stored in Xu, to avoid problems with E */
-  yxindex=Xd_strip(Xu); /*yxindex[i] is the row of Xu corresponding to y[i] */
- 
-  
-  Xu->c--; /* hide indexing column */
+  if (n_knots<k) { nk = n;x0 = x;} /* then use the covariate points as knots */
+  else { nk = n_knots;x0 = knt;} /* knot locations supplied */
+  Ea = (double *)R_chk_calloc((size_t)(nk*d),sizeof(double)); /* the points, column-wise */
+  for (j=0;j<d;j++) for (i=0;i<nk;i++) Ea[i + j * nk] = x0[j][i];
+  yxindex = (int *)R_chk_calloc((size_t)nk,sizeof(int)); /*yxindex[i] is the row of Xu corresponding to y[i] */
+  ui = (int *)R_chk_calloc((size_t)nk,sizeof(int));
+  l = unique_rows(Ea,nk,d,yxindex,ui,nt);
+  *Xu=initmat(l,d);
+  for (i=0;i<l;i++) for (j=0;j<d;j++) Xu->M[i][j] = Ea[ui[i] + j * nk];
+  R_chk_free(Ea);R_chk_free(ui);
   if (Xu->r<k) 
   ErrorMessage(_("A term has fewer unique covariate combinations than specified maximum degrees of freedom"),1);
   if (2*m<=d) { m=0;while (2*m<d+2) m++;} 
-  tpsE(&E,Xu,m,d); /* The important matrix in the full t.p.s. problem */
   tpsT(&T,Xu,m,d); /* The tps constraint matrix */
   M=(int)T.c;       /* dimension of penalty null space */
   /*ek=k-(d+1);*/  /* erroneous code - when I thought that -ve's must not be deleted */
@@ -424,6 +612,8 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
      if (Xu->r<k) ErrorMessage(_("A term has fewer unique covariate combinations than specified maximum degrees of freedom"),1);
   }
   if (Xu->r==k) pure_knot=1; /* basis dimension is number of knots - don't need eigen step */
+  if (pure_knot) rand_eig=0;
+  if (!rand_eig) tpsE(&E,Xu,m,d); /* The important matrix in the full t.p.s. problem */
 
   if (pure_knot) /* don't need the lanczos step, but need to "fake" various matrices to make up for it! */
   { *UZ=initmat(T.r+M-1+constant,T.r);
@@ -437,7 +627,14 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
   } else
   { v=initmat(k,1);    /* eigen-value matrix for E */
 
-  
+    if (rand_eig) { /* E is not formed */
+      nk = Xu->r;
+      Ea = (double *) R_chk_calloc((size_t) (nk*d),sizeof(double)); /* locations, column-wise */
+      Ua = (double *) R_chk_calloc((size_t) (nk*k),sizeof(double));
+      for (i=0;i<nk;i++) for (j=0;j<d;j++) Ea[i + j * nk] = Xu->M[i][j];
+      tps_rand_eigen(Ea,nk,d,m,k,Ua,v.V,tol,nt);
+      U = Rmatrix(Ua,nk,k);R_chk_free(Ea);R_chk_free(Ua);
+    } else {
       nk = E.r;
       Ea = (double *) R_chk_calloc((size_t) (nk*nk),sizeof(double));
       Ua = (double *) R_chk_calloc((size_t) (nk*k),sizeof(double));
@@ -447,7 +644,7 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
       Rlanczos(Ea,Ua,v.M[0],&nk, &kk, &minus,&tol,&one); // final '&one' is for single thread version
 
       U = Rmatrix(Ua,E.r,k);R_chk_free(Ea);R_chk_free(Ua);
-    
+    }
   
     /* Now form the constraint matrix for the truncated problem T'U */
     TU=initmat(M,k);
@@ -464,7 +661,7 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
   }
   UZ->r +=M-1+constant;
   /* Now add the elements required to get UZ to map from whole real parameter vector to whole t.p.s. vector */
-  for (i=0;i<E.r;i++) for (j=k-M;j<UZ->c;j++) UZ->M[i][j]=0.0;
+  for (i=0;i<Xu->r;i++) for (j=k-M;j<UZ->c;j++) UZ->M[i][j]=0.0;
   for (i=0;i<M-1+constant;i++) UZ->M[UZ->r-i-1][UZ->c-i-1]=1.0;
   
   /* Now construct the design matrix X = [Udiag(v)Z,T] .... */
@@ -487,7 +684,23 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
       for (j=0;j<X1.c;j++) X->M[i][j]=X1.M[l][j];
     }
     freemat(X1);
-  } else /* the user supplied a set of knots to generate the original un-truncated basis */
+  } else if (constant) /* the user supplied a set of knots to generate the original un-truncated basis */
+  { /* this is just prediction from the basis, so use the blocked (dgemm based) predict_tprs() */
+    kk = (int) UZ->r; /* = Xu->r + M */
+    nk = (int) Xu->r;
+    uz = (double *) R_chk_calloc((size_t)(kk*k),sizeof(double));
+    RArrayFromMatrix(uz,kk,UZ);
+    Ea = (double *) R_chk_calloc((size_t)(nk*d),sizeof(double));
+    for (i=0;i<nk;i++) for (j=0;j<d;j++) Ea[i + j * nk] = Xu->M[i][j];
+    xc = (double *) R_chk_calloc((size_t)n*d,sizeof(double));
+    for (j=0;j<d;j++) for (i=0;i<n;i++) xc[i + (ptrdiff_t) j * n] = x[j][i];
+    a = (double *) R_chk_calloc((size_t)n*k,sizeof(double));
+    l = 0;
+    predict_tprs(xc,&d,&n,&m,&k,&M,Ea,&nk,uz,NULL,&l,a,&nt);
+    *X=initmat(n,k);
+    for (i=0;i<n;i++) for (XMi=X->M[i],j=0;j<k;j++) XMi[j] = a[i + (ptrdiff_t) j * n];
+    R_chk_free(uz);R_chk_free(Ea);R_chk_free(xc);R_chk_free(a);
+  } else /* knot based, but no intercept: use tps_g() row by row */
   { p.r=0; /* don't want a value from tps_g() */
     xc=(double *)R_chk_calloc((size_t)d,sizeof(double));
     kk = (int) UZ->r;
@@ -536,19 +749,22 @@ void tprs_setup(double **x,double **knt,int m,int d,int n,int k,int constant,mat
     for (j=0;j<S->r;j++) S->M[i][j]/=w;
     for (j=0;j<S->r;j++) S->M[j][i]/=w;
   }  
-  R_chk_free(yxindex);freemat(Z);freemat(TU);freemat(E);freemat(T);
+  R_chk_free(yxindex);freemat(Z);freemat(TU);freemat(T);
+  if (!rand_eig) freemat(E);
   if (!pure_knot) {freemat(U);freemat(v);}
 }
 
 
 void construct_tprs(double *x,int *d,int *n,double *knt,int *nk,int *m,int *k,double *X,double *S,
-                    double *UZ,double *Xu,int *nXu,double *C)
+                    double *UZ,double *Xu,int *nXu,double *C,int *rand_eig,int *nt)
 /* inputs: 
    x contains the n values of each of the d covariates, stored end to end
    knt contains the nk knot locations packed as x
    m is the order of the penalty 
    k is the basis dimension
    max_knots is the maximum number of knots to allow in t.p.r.s. setup.   
+   rand_eig non-zero for randomized eigen decomposition in setup, using nt threads 
+     (see tprs_setup).
 
    outputs:
    X is the n by k model matrix
@@ -567,7 +783,7 @@ void construct_tprs(double *x,int *d,int *n,double *knt,int *nk,int *m,int *k,do
   { kk=(double **)R_chk_calloc((size_t)(*d),sizeof(double*));
     for (i=0;i<*d;i++) kk[i]=knt + i * *nk;
   }
-  tprs_setup(xx,kk,*m,*d,*n,*k,1,&Xm,&Sm,&UZm,&Xum,*nk); /* Do actual setup */
+  tprs_setup(xx,kk,*m,*d,*n,*k,1,&Xm,&Sm,&UZm,&Xum,*nk,*rand_eig,*nt); /* Do actual setup */
   RArrayFromMatrix(X,Xm.r,&Xm);
   RArrayFromMatrix(S,Sm.r,&Sm);
   RArrayFromMatrix(UZ,UZm.r,&UZm);  
@@ -585,7 +801,7 @@ void construct_tprs(double *x,int *d,int *n,double *knt,int *nk,int *m,int *k,do
 }
 
 void predict_tprs(double *x, int *d,int *n,int *m,int *k,int *M,double *Xu,int *nXu,
-                  double *UZ,double *by,int *by_exists,double *X)
+                  double *UZ,double *by,int *by_exists,double *X,int *nt)
 /* inputs are:
    * The n values of the d covariates at which to predict - covariates packed end to end in x
      - any required centering to be done before this call.
@@ -593,70 +809,79 @@ void predict_tprs(double *x, int *d,int *n,int *m,int *k,int *M,double *Xu,int *
    * k is the rank of the basis
    * Xu is the nXu by d matrix of unique covariate values
    * UZ is the basis of the reduced space 
+   * nt is the number of threads to use.
 
    returns the n by k matrix X mapping the parameters to the predicted values.
+
+   The rows of X are produced in blocks of (up to) bs rows. For each block the 
+   bs by nXu + M matrix B of radial basis and null space polynomial values is formed, 
+   and the block of X is then B UZ, formed by a single dgemm call. Blocks are shared 
+   between threads. Rows for which by is zero are simply set to zero, and are 
+   excluded from the blocks.
 */
-{ double *b,by_mult,*xx,*a,*xp,*xxp,*xxp1,*xp1,*Xp,alpha=1.0,beta=0.0,*Xup,*Xup1,r,z,*pb,
-         eta0;
-  int i,j,l,kk,one=1,nobsM,*pin; 
-  const char trans='T'; 
+{ double *B,*A,*xb,*Bp,*Xp,*Xup,*xbp,*Ap,alpha=1.0,beta=0.0,r,z,eta0;
+  int i,j,l,kk,c,nc,bs=128,nb,nr,i0,nobsM,*pin,*ind,nth; 
+  const char trans='N'; 
 
   if (2 * *m <= *d && *d > 0) { *m = 0;while ( 2 * *m < *d+2) (*m)++;} 
   /* get null space polynomial powers */
   pin=(int *)R_chk_calloc((size_t) (*M * *d),sizeof(int)); 
   gen_tps_poly_powers(pin, M, m, d);
   eta0 = eta_const(*m,*d);
-
-  /*Xum=Rmatrix(Xu,*nXu,*d);*/
   nobsM = *nXu + *M;
-  /* UZm=Rmatrix(UZ,nobsM,*k);*/
-  b=(double *)R_chk_calloc((size_t)nobsM,sizeof(double)); /* initmat(UZm.r,1L);*/
-  a=(double *)R_chk_calloc((size_t)*k,sizeof(double));
-  /* Xm=initmat((long)*n,(long)*k);*/
-  xx=(double*)R_chk_calloc((size_t) *d,sizeof(double));
-  for (Xp=X,xp=x,i=0;i< *n;i++,xp++,Xp++) 
-  { if (*by_exists) by_mult=by[i]; else by_mult=1.0;
-    if (by_mult==0.0) {         /* then don't waste flops on calculating stuff that will only be zeroed */
-      /*for (j=0;j< *k ;j++) Xm.M[i][j]=0.0;*/
-      for (xxp=Xp,j=0;j < *k;j++,xxp+= *n) *xxp = 0.0; 
-    } else {                   /* proceed as normal */
-      for (xxp=xx,xxp1=xx + *d,xp1=xp;xxp < xxp1;xxp++,xp1 += *n) *xxp = *xp1; /*xx[j]=x[j * *n + i];*/
-      /* evaluate radial basis */    
-      for (Xup=Xu,Xup1=Xu+*nXu,pb=b;Xup<Xup1;Xup++,pb++) { /* work through unique original locations */
-        r=0.0;
-        for (xxp=xx,xxp1=xx + *d,xp1=Xup;xxp<xxp1;xxp++,xp1+= *nXu) { z = *xp1 - *xxp;r += z*z;}
-        /* r = sqrt(r); */ /* eta set up to expect squared dist */ 
-        *pb = fast_eta(*m,*d,r,eta0);
+
+  /* find the rows to compute, zeroing the rest */
+  ind = (int *)R_chk_calloc((size_t) *n,sizeof(int));
+  for (nr=0,i=0;i < *n;i++) 
+  if (*by_exists && by[i]==0.0) { /* then don't waste flops on calculating stuff that will only be zeroed */
+    for (Xp=X+i,j=0;j < *k;j++,Xp += *n) *Xp = 0.0;
+  } else ind[nr++] = i;
+  nc = nr/bs; if (nc * bs < nr) nc++; /* number of blocks */
+  nth = mgcv_nthreads(*nt);if (nth > nc) nth = nc > 0 ? nc : 1;
+  #ifdef SUPPORT_OPENMP
+  #pragma omp parallel private(B,A,xb,Bp,Xp,Xup,xbp,Ap,r,z,i,j,l,kk,c,nb,i0) num_threads(nth)
+  #endif
+  { /* start of parallel section */
+    if (nc) {
+      xb = (double *)R_chk_calloc((size_t) bs * *d,sizeof(double));
+      B = (double *)R_chk_calloc((size_t) bs * nobsM,sizeof(double));
+      A = (double *)R_chk_calloc((size_t) bs * *k,sizeof(double));
+    } else xb = B = A = NULL;
+    #ifdef SUPPORT_OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for (c=0;c<nc;c++) {
+      i0 = c * bs;nb = nr - i0; if (nb > bs) nb = bs; 
+      /* copy the covariates for this block to xb (nb by d) */
+      for (j=0;j < *d;j++) for (xbp = xb + j * nb,i=0;i<nb;i++) xbp[i] = x[ind[i0+i] + j * *n]; 
+      /* evaluate radial basis, one unique original location (column of B) at a time */
+      for (Bp=B,Xup=Xu,l=0;l < *nXu;l++,Xup++,Bp += nb) {
+        for (i=0;i<nb;i++) Bp[i] = 0.0;
+        for (xbp=xb,j=0;j < *d;j++,xbp += nb) 
+          for (i=0;i<nb;i++) { z = Xup[j * *nXu] - xbp[i];Bp[i] += z*z;}
+        /* eta set up to expect squared dist */ 
+        eta_vec(*m,*d,Bp,nb,eta0);
       } 
       /* now deal with null space */
-      for (l=0;l< *M;l++,pb++) { /* work through null space */
-        r=1.0;
-        for (j=0;j<*d;j++) for (kk=0;kk<pin[l + *M * j];kk++)  r *= xx[j];
-        *pb = r; 
-      } 
-      /*tps_g(&Xum,&p,xx,*d,*m,b,1);*/             
-      /*j=0;
-        mgcv_mmult(a,UZ,b,&one,&j,k,&one,&nobsM);*/ /* get a=(UZ)'b */
-      F77_CALL(dgemv)(&trans,&nobsM,k,&alpha,UZ,&nobsM, b, &one,&beta, a, &one); /* BLAS call for (UZ)'b */
-      if (*by_exists)
-      for (xp1=Xp,xxp=a,xxp1=a + *k;xxp<xxp1;xxp++,xp1+= *n) *xp1 = *xxp * by_mult; 
-      else 
-      for (xp1=Xp,xxp=a,xxp1=a + *k;xxp<xxp1;xxp++,xp1+= *n) *xp1 = *xxp;
-      
-      /* for (j=0;j< *k;j++) 
-      { Xm.M[i][j]=0.0;
-        for (l=0;l<UZm.r;l++) Xm.M[i][j] += b[l]*UZm.M[l][j];  // forming b'UZ 
-        Xm.M[i][j] *= by_mult;
-      }*/
-    }
-  }
-  /* Now clean up and copy X back.*/
-  /* RArrayFromMatrix(X,Xm.r,&Xm); freemat(Xm);*/
-  /*tps_g(&Xum,&p,x,0,0,b,1);*/ /* have tps_g clear up */ 
-  /*freemat(Xum);*/
-  /*freemat(UZm);*/
-  R_chk_free(b);R_chk_free(a);
-  R_chk_free(xx);R_chk_free(pin);
+      for (l=0;l< *M;l++,Bp += nb) { /* work through null space */
+        for (i=0;i<nb;i++) {
+          r=1.0;
+          for (j=0;j<*d;j++) for (z=xb[i + j * nb],kk=0;kk<pin[l + *M * j];kk++)  r *= z;
+          Bp[i] = r;
+        } 
+      }
+      /* A = B UZ, by BLAS */
+      F77_CALL(dgemm)(&trans,&trans,&nb,k,&nobsM,&alpha,B,&nb,UZ,&nobsM,&beta,A,&nb);
+      /* copy into X */
+      for (Ap=A,j=0;j < *k;j++,Ap += nb) {
+        Xp = X + (ptrdiff_t) j * *n;
+        if (*by_exists) for (i=0;i<nb;i++) Xp[ind[i0+i]] = Ap[i] * by[ind[i0+i]];
+        else for (i=0;i<nb;i++) Xp[ind[i0+i]] = Ap[i];
+      }
+    } /* block loop */
+    if (nc) {R_chk_free(xb);R_chk_free(B);R_chk_free(A);}
+  } /* end of parallel section */
+  R_chk_free(ind);R_chk_free(pin);
 }
 
 